@@ -0,0 +1,239 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <zlib.h>
+#include "corpus.h"
+
+#define CHUNK (1024 * 1024)
+#define EDITS 16            /* in-place edits per round */
+#define EDIT_LEN 64
+#define INSERTS 4
+#define INSERT_LEN 128
+#define EXTENT_LEN (64 * 1024)
+#define SPARSE_WRITES 8
+#define SPARSE_WRITE_LEN 4096
+
+static const char *kind_names[CORPUS_KINDS] = {
+    "random", "text", "compressed", "log", "insert", "sparse"
+};
+
+static const char *words[] = {
+    "the", "of", "and", "to", "in", "is", "that", "for", "it", "as", "was", "with", "be", "by",
+    "on", "not", "he", "this", "are", "or", "his", "from", "at", "which", "but", "have", "an",
+    "had", "they", "you", "were", "their", "one", "all", "we", "can", "her", "has", "there",
+    "been", "if", "more", "when", "will", "would", "who", "so", "no", "block", "server",
+    "checksum", "signature", "window", "rolling", "transfer", "delta", "network", "file",
+    "directory", "compression", "latency", "throughput", "buffer", "segment"
+};
+#define NWORDS (sizeof(words) / sizeof(words[0]))
+
+static const char *paths[] = { "/", "/api/sync", "/api/files", "/static/app.js", "/login", "/health" };
+
+/* splitmix64: small, fast and the same on every platform */
+static uint64_t rng_next(uint64_t *s) {
+    uint64_t z = (*s += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+static void fill_random(uint64_t *s, unsigned char *buf, size_t n) {
+    for (size_t i = 0; i < n; i += 8) {
+        uint64_t v = rng_next(s);
+        memcpy(buf + i, &v, n - i < 8 ? n - i : 8);
+    }
+}
+
+static void fill_text(uint64_t *s, unsigned char *buf, size_t n) {
+    size_t pos = 0;
+    while (pos < n) {
+        const char *w = words[rng_next(s) % NWORDS];
+        size_t len = strlen(w);
+        if (len > n - pos) len = n - pos;
+        memcpy(buf + pos, w, len);
+        pos += len;
+        if (pos < n) buf[pos++] = rng_next(s) % 12 == 0 ? '\n' : ' ';
+    }
+}
+
+static void fill_log(uint64_t *s, unsigned char *buf, size_t n) {
+    size_t pos = 0;
+    char line[160];
+    while (pos < n) {
+        uint64_t r = rng_next(s);
+        int len = snprintf(line, sizeof(line),
+                           "2026-03-01 %02u:%02u:%02u.%03u INFO worker-%u GET %s %u %u bytes in %u ms\n",
+                           (unsigned)(r % 24), (unsigned)(r >> 8) % 60, (unsigned)(r >> 16) % 60,
+                           (unsigned)(r >> 24) % 1000, (unsigned)(r >> 34) % 16,
+                           paths[(r >> 38) % (sizeof(paths) / sizeof(paths[0]))],
+                           (r >> 42) % 10 ? 200 : 404, (unsigned)(r >> 44) % 65536,
+                           (unsigned)(r >> 60) + 1);
+        size_t take = (size_t)len < n - pos ? (size_t)len : n - pos;
+        memcpy(buf + pos, line, take);
+        pos += take;
+    }
+}
+
+static int write_all(int fd, const unsigned char *buf, size_t n, off_t off) {
+    while (n > 0) {
+        ssize_t w = pwrite(fd, buf, n, off);
+        if (w <= 0) return -1;
+        buf += w;
+        n -= (size_t)w;
+        off += w;
+    }
+    return 0;
+}
+
+static int write_compressed(int fd, uint64_t *s, size_t size, unsigned char *in, unsigned char *out) {
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    if (deflateInit(&zs, 6) != Z_OK) return -1;
+    size_t done = 0;
+    int rc = 0;
+    while (rc == 0 && done < size) {
+        fill_text(s, in, CHUNK);
+        zs.next_in = in;
+        zs.avail_in = CHUNK;
+        while (rc == 0 && zs.avail_in > 0 && done < size) {
+            zs.next_out = out;
+            zs.avail_out = CHUNK;
+            deflate(&zs, Z_NO_FLUSH);
+            size_t n = CHUNK - zs.avail_out;
+            if (n > size - done) n = size - done;
+            rc = write_all(fd, out, n, (off_t)done);
+            done += n;
+        }
+    }
+    deflateEnd(&zs);
+    return rc;
+}
+
+/* Holes with a 64 KB extent in about every fourth megabyte */
+static int write_sparse(int fd, uint64_t *s, size_t size, unsigned char *buf) {
+    if (ftruncate(fd, (off_t)size) != 0) return -1;
+    for (size_t mb = 0; mb < size; mb += CHUNK) {
+        if (mb > 0 && rng_next(s) % 4 != 0) continue;
+        size_t off = mb + (rng_next(s) % (CHUNK / 4096)) * 4096;
+        if (off >= size) off = mb;
+        size_t len = size - off < EXTENT_LEN ? size - off : EXTENT_LEN;
+        fill_random(s, buf, len);
+        if (write_all(fd, buf, len, (off_t)off) != 0) return -1;
+    }
+    return 0;
+}
+
+int corpus_kind(const char *name) {
+    for (int k = 0; k < CORPUS_KINDS; k++)
+        if (strcmp(name, kind_names[k]) == 0) return k;
+    return -1;
+}
+
+const char *corpus_kind_name(int kind) {
+    return kind >= 0 && kind < CORPUS_KINDS ? kind_names[kind] : "unknown";
+}
+
+int corpus_write_base(const char *path, int kind, size_t size, unsigned seed) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) return -1;
+    unsigned char *buf = malloc(CHUNK), *out = malloc(CHUNK);
+    uint64_t s = (uint64_t)seed * 0x100000001b3ULL + (uint64_t)kind;
+    int rc = buf && out ? 0 : -1;
+    if (rc == 0 && kind == CORPUS_COMPRESSED) {
+        rc = write_compressed(fd, &s, size, buf, out);
+    } else if (rc == 0 && kind == CORPUS_SPARSE) {
+        rc = write_sparse(fd, &s, size, buf);
+    } else {
+        for (size_t off = 0; rc == 0 && off < size; off += CHUNK) {
+            size_t n = size - off < CHUNK ? size - off : CHUNK;
+            if (kind == CORPUS_TEXT) fill_text(&s, buf, n);
+            else if (kind == CORPUS_LOG) fill_log(&s, buf, n);
+            else fill_random(&s, buf, n);
+            rc = write_all(fd, buf, n, (off_t)off);
+        }
+    }
+    free(buf);
+    free(out);
+    if (close(fd) != 0) rc = -1;
+    return rc;
+}
+
+/* Runs of bytes inserted at random offsets; everything after shifts */
+static long long mutate_insert(int fd, uint64_t *s, size_t size) {
+    unsigned char *old = malloc(size ? size : 1);
+    unsigned char *neu = malloc(size + INSERTS * INSERT_LEN);
+    size_t at[INSERTS];
+    long long rc = -1;
+    if (!old || !neu || pread(fd, old, size, 0) != (ssize_t)size) goto out;
+    for (int i = 0; i < INSERTS; i++) at[i] = size ? rng_next(s) % size : 0;
+    for (int i = 1; i < INSERTS; i++) {
+        for (int j = i; j > 0 && at[j] < at[j - 1]; j--) {
+            size_t t = at[j];
+            at[j] = at[j - 1];
+            at[j - 1] = t;
+        }
+    }
+    size_t src = 0, dst = 0;
+    for (int i = 0; i < INSERTS; i++) {
+        memcpy(neu + dst, old + src, at[i] - src);
+        dst += at[i] - src;
+        src = at[i];
+        fill_random(s, neu + dst, INSERT_LEN);
+        dst += INSERT_LEN;
+    }
+    memcpy(neu + dst, old + src, size - src);
+    dst += size - src;
+    if (write_all(fd, neu, dst, 0) == 0) rc = INSERTS * INSERT_LEN;
+out:
+    free(old);
+    free(neu);
+    return rc;
+}
+
+long long corpus_mutate(const char *path, int kind, unsigned seed) {
+    int fd = open(path, O_RDWR);
+    struct stat st;
+    if (fd < 0) return -1;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return -1;
+    }
+    size_t size = (size_t)st.st_size;
+    uint64_t s = (uint64_t)seed * 0xff51afd7ed558ccdULL + (uint64_t)kind + 1;
+    unsigned char buf[SPARSE_WRITE_LEN];
+    long long changed = 0;
+
+    if (kind == CORPUS_LOG) {
+        size_t add = size / 64 > 4096 ? size / 64 : 4096;
+        unsigned char *tail = malloc(add);
+        if (!tail) changed = -1;
+        else {
+            fill_log(&s, tail, add);
+            changed = write_all(fd, tail, add, (off_t)size) == 0 ? (long long)add : -1;
+        }
+        free(tail);
+    } else if (kind == CORPUS_INSERT) {
+        changed = mutate_insert(fd, &s, size);
+    } else if (kind == CORPUS_SPARSE) {
+        for (int i = 0; i < SPARSE_WRITES && changed >= 0 && size >= SPARSE_WRITE_LEN; i++) {
+            size_t off = (rng_next(&s) % (size / SPARSE_WRITE_LEN)) * SPARSE_WRITE_LEN;
+            fill_random(&s, buf, SPARSE_WRITE_LEN);
+            changed = write_all(fd, buf, SPARSE_WRITE_LEN, (off_t)off) == 0 ? changed + SPARSE_WRITE_LEN : -1;
+        }
+    } else {
+        size_t len = size < EDIT_LEN ? size : EDIT_LEN;
+        for (int i = 0; i < EDITS && changed >= 0 && len > 0; i++) {
+            size_t off = rng_next(&s) % (size - len + 1);
+            if (kind == CORPUS_TEXT) fill_text(&s, buf, len);
+            else fill_random(&s, buf, len);
+            changed = write_all(fd, buf, len, (off_t)off) == 0 ? changed + (long long)len : -1;
+        }
+    }
+    if (close(fd) != 0) changed = -1;
+    return changed;
+}
@@ -0,0 +1,24 @@
+#ifndef CORPUS_H
+#define CORPUS_H
+
+#include <stddef.h>
+
+/* Synthetic files for the benchmarks. Each kind has a base version and a
+ * typical edit; the same seed always produces the same bytes. */
+#define CORPUS_RANDOM     0   /* incompressible bytes, edited in place */
+#define CORPUS_TEXT       1   /* prose-like lines, a few words rewritten */
+#define CORPUS_COMPRESSED 2   /* deflate output, edited in place */
+#define CORPUS_LOG        3   /* log lines, new lines appended */
+#define CORPUS_INSERT     4   /* random bytes, short runs inserted mid-file */
+#define CORPUS_SPARSE     5   /* disk image: mostly holes, a few extents written */
+#define CORPUS_KINDS      6
+
+int corpus_kind(const char *name);
+const char *corpus_kind_name(int kind);
+
+/* Writes the base version, size bytes long */
+int corpus_write_base(const char *path, int kind, size_t size, unsigned seed);
+/* Applies one edit in place; returns the bytes changed or -1 */
+long long corpus_mutate(const char *path, int kind, unsigned seed);
+
+#endif
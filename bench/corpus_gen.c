@@ -0,0 +1,72 @@
+/* Writes synthetic corpora: a base version of each kind plus edited
+ * versions, for feeding the client by hand or other tools.
+ *
+ *   gcc -O2 -o bench/corpus_gen bench/corpus_gen.c bench/corpus.c -lz
+ *   ./bench/corpus_gen <kind|all> <MB> <dir> [versions] [seed]
+ *
+ * Produces <dir>/<kind>.v0 .. <kind>.v<versions>, each one edit away from
+ * the previous, and prints the bytes changed by every edit.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include "corpus.h"
+
+static int copy_file(const char *from, const char *to) {
+    int in = open(from, O_RDONLY);
+    int out = open(to, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    char buf[65536];
+    ssize_t n = 0;
+    int rc = in >= 0 && out >= 0 ? 0 : -1;
+    while (rc == 0 && (n = read(in, buf, sizeof(buf))) > 0)
+        if (write(out, buf, (size_t)n) != n) rc = -1;
+    if (n < 0) rc = -1;
+    if (in >= 0) close(in);
+    if (out >= 0 && close(out) != 0) rc = -1;
+    return rc;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 4) {
+        fprintf(stderr, "usage: %s <kind|all> <MB> <dir> [versions] [seed]\nkinds:", argv[0]);
+        for (int k = 0; k < CORPUS_KINDS; k++) fprintf(stderr, " %s", corpus_kind_name(k));
+        fprintf(stderr, "\n");
+        return 1;
+    }
+    int only = strcmp(argv[1], "all") == 0 ? -1 : corpus_kind(argv[1]);
+    size_t size = (size_t)strtoul(argv[2], NULL, 10) << 20;
+    const char *dir = argv[3];
+    int versions = argc > 4 ? atoi(argv[4]) : 1;
+    unsigned seed = argc > 5 ? (unsigned)strtoul(argv[5], NULL, 10) : 1;
+    if (only < 0 && strcmp(argv[1], "all") != 0) {
+        fprintf(stderr, "unknown kind %s\n", argv[1]);
+        return 1;
+    }
+    mkdir(dir, 0755);
+
+    for (int k = 0; k < CORPUS_KINDS; k++) {
+        if (only >= 0 && k != only) continue;
+        char prev[PATH_MAX], cur[PATH_MAX];
+        snprintf(prev, sizeof(prev), "%s/%s.v0", dir, corpus_kind_name(k));
+        if (corpus_write_base(prev, k, size, seed) != 0) {
+            perror(prev);
+            return 1;
+        }
+        printf("%-10s v0 %zu bytes\n", corpus_kind_name(k), size);
+        for (int v = 1; v <= versions; v++) {
+            snprintf(cur, sizeof(cur), "%s/%s.v%d", dir, corpus_kind_name(k), v);
+            long long changed = copy_file(prev, cur) == 0 ? corpus_mutate(cur, k, seed + (unsigned)v) : -1;
+            if (changed < 0) {
+                perror(cur);
+                return 1;
+            }
+            printf("%-10s v%d %lld bytes changed\n", corpus_kind_name(k), v, changed);
+            memcpy(prev, cur, sizeof(prev));
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,94 @@
+/* Wire bytes of a block after a one-line edit, compressed on its own and
+ * against the previous version as a dictionary.
+ *
+ *   gcc -O2 -o bench/dict_bench bench/dict_bench.c common_utils/compressor.c -Icommon_utils -lz
+ *   ./bench/dict_bench
+ *
+ * Exits non-zero if a dictionary block fails to decode or costs more than
+ * max_dict_bytes. Blocks larger than DICT_MAX_LEN are only reported: the
+ * dictionary cannot reach their first part.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "compressor.h"
+
+#define ROUNDS 64
+
+/* zlib framing and the dictionary id take 10 bytes; every 258 bytes of
+ * unchanged input still cost a match of about 3 */
+static size_t max_dict_bytes(size_t len) {
+    return 32 + len / 64;
+}
+
+static const char *words[] = {
+    "the", "of", "and", "to", "in", "is", "that", "for", "it", "as", "was", "with", "be", "by",
+    "block", "server", "checksum", "signature", "window", "rolling", "transfer", "delta", "file",
+};
+#define NWORDS (sizeof(words) / sizeof(words[0]))
+
+/* Lines of prose filling len bytes */
+static void fill_text(unsigned char *buf, size_t len, unsigned *seed) {
+    size_t pos = 0, line = 0;
+    while (pos < len) {
+        const char *w = words[rand_r(seed) % NWORDS];
+        for (const char *p = w; *p && pos < len; p++) buf[pos++] = (unsigned char)*p;
+        line += strlen(w) + 1;
+        if (pos < len) buf[pos++] = line > 72 ? '\n' : ' ';
+        if (line > 72) line = 0;
+    }
+}
+
+/* Rewrites one word in the line containing the middle of the block */
+static void edit_line(unsigned char *buf, size_t len, unsigned *seed) {
+    size_t at = len / 2;
+    while (at > 0 && buf[at - 1] != ' ' && buf[at - 1] != '\n') at--;
+    const char *w = words[rand_r(seed) % NWORDS];
+    for (size_t i = 0; w[i] && at + i < len && buf[at + i] != ' ' && buf[at + i] != '\n'; i++)
+        buf[at + i] = (unsigned char)(w[i] ^ 0x20);
+}
+
+int main(void) {
+    static const size_t sizes[] = { 1024, 2048, 4096, 16384, 65536 };
+    int failed = 0;
+
+    printf("%-8s %10s %10s %10s\n", "block", "plain", "dict", "dict max");
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        size_t len = sizes[s], cap = codec_bound(CODEC_ZLIB, len) + 64;
+        unsigned char *old = malloc(len), *cur = malloc(len), *out = malloc(cap), *dec = malloc(len);
+        dict_ctx_t *dc = dict_ctx_new();
+        if (!old || !cur || !out || !dec || !dc) return 1;
+
+        unsigned seed = 1;
+        size_t plain = 0, dict = 0, worst = 0;
+        for (int r = 0; r < ROUNDS; r++) {
+            fill_text(old, len, &seed);
+            memcpy(cur, old, len);
+            edit_line(cur, len, &seed);
+
+            int p = codec_compress(CODEC_ZLIB, cur, len, out, cap);
+            plain += p > 0 ? (size_t)p : len;
+            int d = dict_compress(dc, cur, len, old, len, out, cap);
+            if (d <= 0 || dict_decompress(dc, out, (size_t)d, old, len, dec, len) != (int)len ||
+                memcmp(dec, cur, len) != 0) {
+                printf("%-8zu dictionary round trip failed\n", len);
+                failed = 1;
+                break;
+            }
+            dict += (size_t)d;
+            if ((size_t)d > worst) worst = (size_t)d;
+        }
+        printf("%-8zu %10.1f %10.1f %10zu\n", len, (double)plain / ROUNDS, (double)dict / ROUNDS, worst);
+        if (len <= DICT_MAX_LEN && worst > max_dict_bytes(len)) {
+            printf("%-8zu dictionary blocks above %zu bytes\n", len, max_dict_bytes(len));
+            failed = 1;
+        }
+
+        dict_ctx_free(dc);
+        free(old);
+        free(cur);
+        free(out);
+        free(dec);
+    }
+    return failed;
+}
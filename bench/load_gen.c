@@ -0,0 +1,451 @@
+/* Drives concurrent simulated clients against a local server and reports
+ * what a sync costs.
+ *
+ *   gcc -O2 -o bench/load_gen bench/load_gen.c bench/corpus.c -lpthread -lz
+ *   ./bench/load_gen [-c clients] [-r rounds] [-s MB] [-k kind|all] [-m plain|delta|cdc]
+ *                    [-C client] [-S server] [-d dir] [-j]
+ *
+ * A fresh server is started in <dir>/srv, so port 9000 must be free. Each
+ * client owns one corpus file and a local proxy that counts the bytes it
+ * exchanges with the server. Round 0 uploads the file; every further round
+ * applies the kind's edit and syncs again. Each sync is checked against
+ * the server's copy. With -j every result is one JSON object per line.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include "corpus.h"
+
+#define SERVER_PORT 9000    /* fixed in server/server.c */
+#define MAX_CLIENTS 256
+
+typedef struct {
+    int id, kind;
+    char dir[PATH_MAX];
+    char name[64];
+    int listen_fd, port;
+    uint64_t wire;          /* bytes relayed in both directions, ever */
+    int first_round, last_round;
+    /* results of the current phase */
+    double *lat;            /* ms per sync */
+    int nlat;
+    int failures;
+    long long changed;
+    uint64_t logical, phase_wire;
+    double cpu;
+} sim_client_t;
+
+typedef struct {
+    int a, b;
+    uint64_t *counter;
+} relay_t;
+
+static char client_bin[PATH_MAX], server_bin[PATH_MAX];
+static const char *workdir = "/tmp/rsync_lite_bench";
+static const char *mode_arg = NULL;
+static const char *mode_name = "plain";
+static size_t file_size = 16u << 20;
+static int nclients = 4, rounds = 3, json = 0;
+static pid_t server_pid = -1;
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int write_all(int fd, const char *buf, size_t n) {
+    while (n > 0) {
+        ssize_t w = write(fd, buf, n);
+        if (w <= 0) return -1;
+        buf += w;
+        n -= (size_t)w;
+    }
+    return 0;
+}
+
+static int connect_local(int port) {
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    struct sockaddr_in sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sin_family = AF_INET;
+    sa.sin_port = htons((uint16_t)port);
+    sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (fd >= 0 && connect(fd, (struct sockaddr *)&sa, sizeof(sa)) == 0) return fd;
+    if (fd >= 0) close(fd);
+    return -1;
+}
+
+/* Bytes are counted before they are forwarded, so a sync's traffic is
+ * complete by the time its client exits */
+static void *relay_main(void *arg) {
+    relay_t *r = arg;
+    struct pollfd p[2] = {{r->a, POLLIN, 0}, {r->b, POLLIN, 0}};
+    char buf[65536];
+    int alive = 1;
+    while (alive) {
+        if (poll(p, 2, -1) < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        for (int i = 0; i < 2 && alive; i++) {
+            if (!p[i].revents) continue;
+            ssize_t n = read(p[i].fd, buf, sizeof(buf));
+            if (n <= 0) {
+                alive = 0;
+                break;
+            }
+            __atomic_add_fetch(r->counter, (uint64_t)n, __ATOMIC_RELAXED);
+            if (write_all(p[1 - i].fd, buf, (size_t)n) != 0) alive = 0;
+        }
+    }
+    close(r->a);
+    close(r->b);
+    free(r);
+    return NULL;
+}
+
+static void *proxy_main(void *arg) {
+    sim_client_t *cl = arg;
+    for (;;) {
+        int fd = accept4(cl->listen_fd, NULL, NULL, SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        int up = connect_local(SERVER_PORT);
+        relay_t *r = up >= 0 ? malloc(sizeof(*r)) : NULL;
+        pthread_t tid;
+        if (!r) {
+            close(fd);
+            if (up >= 0) close(up);
+            continue;
+        }
+        r->a = fd;
+        r->b = up;
+        r->counter = &cl->wire;
+        if (pthread_create(&tid, NULL, relay_main, r) != 0) {
+            close(fd);
+            close(up);
+            free(r);
+            continue;
+        }
+        pthread_detach(tid);
+    }
+    return NULL;
+}
+
+static int proxy_start(sim_client_t *cl) {
+    struct sockaddr_in sa;
+    socklen_t len = sizeof(sa);
+    memset(&sa, 0, sizeof(sa));
+    sa.sin_family = AF_INET;
+    sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    cl->listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (cl->listen_fd < 0 || bind(cl->listen_fd, (struct sockaddr *)&sa, sizeof(sa)) != 0 ||
+        listen(cl->listen_fd, 16) != 0 || getsockname(cl->listen_fd, (struct sockaddr *)&sa, &len) != 0)
+        return -1;
+    cl->port = ntohs(sa.sin_port);
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, proxy_main, cl) != 0) return -1;
+    pthread_detach(tid);
+    return 0;
+}
+
+static int files_equal(const char *a, const char *b) {
+    int fa = open(a, O_RDONLY | O_CLOEXEC), fb = open(b, O_RDONLY | O_CLOEXEC);
+    struct stat sa, sb;
+    int eq = fa >= 0 && fb >= 0 && fstat(fa, &sa) == 0 && fstat(fb, &sb) == 0 && sa.st_size == sb.st_size;
+    if (eq && sa.st_size > 0) {
+        void *ma = mmap(NULL, (size_t)sa.st_size, PROT_READ, MAP_PRIVATE, fa, 0);
+        void *mb = mmap(NULL, (size_t)sb.st_size, PROT_READ, MAP_PRIVATE, fb, 0);
+        eq = ma != MAP_FAILED && mb != MAP_FAILED && memcmp(ma, mb, (size_t)sa.st_size) == 0;
+        if (ma != MAP_FAILED) munmap(ma, (size_t)sa.st_size);
+        if (mb != MAP_FAILED) munmap(mb, (size_t)sb.st_size);
+    }
+    if (fa >= 0) close(fa);
+    if (fb >= 0) close(fb);
+    return eq;
+}
+
+/* One run of the real client; its CPU time comes from wait4 */
+static int run_client(sim_client_t *cl, double *secs, double *cpu) {
+    char port[32], home[PATH_MAX + 8];
+    snprintf(port, sizeof(port), "--port=%d", cl->port);
+    snprintf(home, sizeof(home), "HOME=%s", cl->dir);
+    char *args[5], *env[] = {home, NULL};
+    int n = 0;
+    args[n++] = client_bin;
+    args[n++] = cl->name;
+    if (mode_arg) args[n++] = (char *)mode_arg;
+    args[n++] = port;
+    args[n] = NULL;
+
+    double t0 = now();
+    pid_t pid = fork();
+    if (pid == 0) {
+        if (chdir(cl->dir) != 0) _exit(127);
+        int log = open("client.log", O_WRONLY | O_CREAT | O_APPEND, 0644);
+        if (log >= 0) {
+            dup2(log, 1);
+            dup2(log, 2);
+        }
+        execve(client_bin, args, env);
+        _exit(127);
+    }
+    int status;
+    struct rusage ru;
+    if (pid < 0 || wait4(pid, &status, 0, &ru) != pid) return -1;
+    *secs = now() - t0;
+    *cpu = ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6 + ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0 ? 0 : -1;
+}
+
+static void *client_main(void *arg) {
+    sim_client_t *cl = arg;
+    char path[PATH_MAX + 64], copy[PATH_MAX + 64];
+    snprintf(path, sizeof(path), "%s/%s", cl->dir, cl->name);
+    snprintf(copy, sizeof(copy), "%s/srv/syncedData/%s", workdir, cl->name);
+    for (int r = cl->first_round; r <= cl->last_round; r++) {
+        long long changed = r == 0 ? (long long)file_size
+                                   : corpus_mutate(path, cl->kind, (unsigned)(r * MAX_CLIENTS + cl->id));
+        struct stat st;
+        if (changed < 0 || stat(path, &st) != 0) {
+            cl->failures++;
+            continue;
+        }
+        uint64_t w0 = __atomic_load_n(&cl->wire, __ATOMIC_RELAXED);
+        double secs = 0, cpu = 0;
+        int ok = run_client(cl, &secs, &cpu) == 0 && files_equal(path, copy);
+        cl->phase_wire += __atomic_load_n(&cl->wire, __ATOMIC_RELAXED) - w0;
+        cl->lat[cl->nlat++] = secs * 1000;
+        cl->cpu += cpu;
+        cl->changed += changed;
+        cl->logical += (uint64_t)st.st_size;
+        if (!ok) cl->failures++;
+    }
+    return NULL;
+}
+
+/* utime + stime of the server so far, in seconds */
+static double server_cpu(void) {
+    char path[64], buf[1024];
+    snprintf(path, sizeof(path), "/proc/%d/stat", (int)server_pid);
+    FILE *f = fopen(path, "r");
+    if (!f) return 0;
+    size_t n = fread(buf, 1, sizeof(buf) - 1, f);
+    fclose(f);
+    buf[n] = '\0';
+    char *p = strrchr(buf, ')');
+    unsigned long ut = 0, st = 0;
+    if (!p || sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", &ut, &st) != 2)
+        return 0;
+    return (double)(ut + st) / (double)sysconf(_SC_CLK_TCK);
+}
+
+static int cmp_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+/* Nearest-rank percentile of sorted v */
+static double percentile(const double *v, int n, double q) {
+    if (n == 0) return 0;
+    int k = (int)(q * n);
+    if (k < q * n) k++;
+    return v[k > 0 ? k - 1 : 0];
+}
+
+static int run_phase(sim_client_t *cls, int kind, const char *phase, int first, int last) {
+    double *lat = malloc(sizeof(double) * (size_t)nclients * (size_t)(last - first + 1));
+    pthread_t *tids = malloc(sizeof(pthread_t) * (size_t)nclients);
+    if (!lat || !tids) return -1;
+    for (int i = 0; i < nclients; i++) {
+        sim_client_t *cl = &cls[i];
+        cl->first_round = first;
+        cl->last_round = last;
+        cl->lat = lat + (size_t)i * (size_t)(last - first + 1);
+        cl->nlat = cl->failures = 0;
+        cl->changed = 0;
+        cl->logical = cl->phase_wire = 0;
+        cl->cpu = 0;
+    }
+
+    double cpu0 = server_cpu(), t0 = now();
+    for (int i = 0; i < nclients; i++) pthread_create(&tids[i], NULL, client_main, &cls[i]);
+    for (int i = 0; i < nclients; i++) pthread_join(tids[i], NULL);
+    double wall = now() - t0, srv_cpu = server_cpu() - cpu0;
+
+    int syncs = 0, failures = 0;
+    long long changed = 0;
+    uint64_t logical = 0, wire = 0;
+    double cli_cpu = 0;
+    for (int i = 0; i < nclients; i++) {
+        sim_client_t *cl = &cls[i];
+        /* gather the latencies at the front of lat */
+        memmove(lat + syncs, cl->lat, sizeof(double) * (size_t)cl->nlat);
+        syncs += cl->nlat;
+        failures += cl->failures;
+        changed += cl->changed;
+        logical += cl->logical;
+        wire += cl->phase_wire;
+        cli_cpu += cl->cpu;
+    }
+    qsort(lat, (size_t)syncs, sizeof(double), cmp_double);
+    double mbps = wall > 0 ? logical / wall / 1e6 : 0;
+    double ratio = changed > 0 ? (double)wire / (double)changed : 0;
+    double cpu_gb = logical > 0 ? (cli_cpu + srv_cpu) / (logical / 1e9) : 0;
+    double p50 = percentile(lat, syncs, 0.50), p99 = percentile(lat, syncs, 0.99);
+
+    if (json) {
+        printf("{\"kind\":\"%s\",\"phase\":\"%s\",\"mode\":\"%s\",\"clients\":%d,\"file_bytes\":%zu,"
+               "\"syncs\":%d,\"failures\":%d,\"wall_s\":%.3f,\"mb_per_s\":%.2f,\"changed_bytes\":%lld,"
+               "\"wire_bytes\":%llu,\"wire_per_changed\":%.4f,\"client_cpu_s\":%.3f,\"server_cpu_s\":%.3f,"
+               "\"cpu_s_per_gb\":%.3f,\"p50_ms\":%.2f,\"p99_ms\":%.2f}\n",
+               corpus_kind_name(kind), phase, mode_name, nclients, file_size, syncs, failures, wall, mbps,
+               changed, (unsigned long long)wire, ratio, cli_cpu, srv_cpu, cpu_gb, p50, p99);
+    } else {
+        printf("%-10s %-7s %5d %4d %8.2f %8.1f %10.2f %9.2f %9.3f %9.2f %8.1f %8.1f\n",
+               corpus_kind_name(kind), phase, syncs, failures, wall, mbps, changed / 1e6, wire / 1e6,
+               ratio, cpu_gb, p50, p99);
+    }
+    fflush(stdout);
+    free(lat);
+    free(tids);
+    return failures;
+}
+
+static int remove_entry(const char *path, const struct stat *sb, int flag, struct FTW *ftw) {
+    (void)sb;
+    (void)flag;
+    (void)ftw;
+    remove(path);
+    return 0;
+}
+
+static int start_server(void) {
+    char dir[PATH_MAX + 8];
+    snprintf(dir, sizeof(dir), "%s/srv", workdir);
+    nftw(dir, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+    if (mkdir(dir, 0755) != 0) return -1;
+
+    server_pid = fork();
+    if (server_pid == 0) {
+        if (chdir(dir) != 0) _exit(127);
+        int log = open("server.log", O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (log >= 0) {
+            dup2(log, 1);
+            dup2(log, 2);
+        }
+        execl(server_bin, server_bin, (char *)NULL);
+        _exit(127);
+    }
+    if (server_pid < 0) return -1;
+    for (int i = 0; i < 100; i++) {
+        int fd = connect_local(SERVER_PORT);
+        if (fd >= 0) {
+            close(fd);
+            return 0;
+        }
+        if (waitpid(server_pid, NULL, WNOHANG) == server_pid) break;
+        usleep(50000);
+    }
+    fprintf(stderr, "server did not come up; see %s/server.log\n", dir);
+    return -1;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "usage: %s [-c clients] [-r rounds] [-s MB] [-k kind|all] [-m plain|delta|cdc]\n"
+                    "       [-C client] [-S server] [-d dir] [-j]\nkinds:", prog);
+    for (int k = 0; k < CORPUS_KINDS; k++) fprintf(stderr, " %s", corpus_kind_name(k));
+    fprintf(stderr, "\n");
+}
+
+int main(int argc, char *argv[]) {
+    const char *client = "./client/client", *server = "./server/server", *kinds = "all";
+    int opt;
+    while ((opt = getopt(argc, argv, "c:r:s:k:m:C:S:d:j")) != -1) {
+        switch (opt) {
+        case 'c': nclients = atoi(optarg); break;
+        case 'r': rounds = atoi(optarg); break;
+        case 's': file_size = (size_t)strtoul(optarg, NULL, 10) << 20; break;
+        case 'k': kinds = optarg; break;
+        case 'm': mode_name = optarg; break;
+        case 'C': client = optarg; break;
+        case 'S': server = optarg; break;
+        case 'd': workdir = optarg; break;
+        case 'j': json = 1; break;
+        default: usage(argv[0]); return 1;
+        }
+    }
+    int only = strcmp(kinds, "all") == 0 ? -1 : corpus_kind(kinds);
+    if (strcmp(mode_name, "delta") == 0) mode_arg = "--delta";
+    else if (strcmp(mode_name, "cdc") == 0) mode_arg = "--cdc";
+    else if (strcmp(mode_name, "plain") != 0) only = -2;
+    if (nclients < 1 || nclients > MAX_CLIENTS || rounds < 0 || file_size == 0 || only == -2 ||
+        (only < 0 && strcmp(kinds, "all") != 0)) {
+        usage(argv[0]);
+        return 1;
+    }
+    if (!realpath(client, client_bin) || !realpath(server, server_bin)) {
+        perror("client or server binary");
+        return 1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+    mkdir(workdir, 0755);
+    if (start_server() != 0) return 1;
+
+    sim_client_t *cls = calloc((size_t)nclients, sizeof(sim_client_t));
+    if (!cls) return 1;
+    for (int i = 0; i < nclients; i++) {
+        cls[i].id = i;
+        snprintf(cls[i].dir, sizeof(cls[i].dir), "%s/c%d", workdir, i);
+        nftw(cls[i].dir, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+        if (mkdir(cls[i].dir, 0755) != 0 || proxy_start(&cls[i]) != 0) {
+            perror(cls[i].dir);
+            return 1;
+        }
+    }
+
+    if (!json)
+        printf("%-10s %-7s %5s %4s %8s %8s %10s %9s %9s %9s %8s %8s\n", "kind", "phase", "syncs", "fail",
+               "wall_s", "MB/s", "changed_MB", "wire_MB", "wire/chg", "cpu_s/GB", "p50_ms", "p99_ms");
+    int failures = 0;
+    for (int k = 0; k < CORPUS_KINDS; k++) {
+        if (only >= 0 && k != only) continue;
+        for (int i = 0; i < nclients; i++) {
+            char path[PATH_MAX + 64];
+            cls[i].kind = k;
+            snprintf(cls[i].name, sizeof(cls[i].name), "%s-%d.dat", corpus_kind_name(k), i);
+            snprintf(path, sizeof(path), "%s/%s", cls[i].dir, cls[i].name);
+            if (corpus_write_base(path, k, file_size, (unsigned)i + 1) != 0) {
+                perror(path);
+                return 1;
+            }
+        }
+        failures += run_phase(cls, k, "initial", 0, 0);
+        if (rounds > 0) failures += run_phase(cls, k, "update", 1, rounds);
+    }
+
+    kill(server_pid, SIGTERM);
+    waitpid(server_pid, NULL, 0);
+    return failures ? 2 : 0;
+}
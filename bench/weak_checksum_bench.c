@@ -0,0 +1,110 @@
+/* Throughput of the weak checksum kernels against the original byte loop.
+ *
+ *   gcc -O2 -o bench/weak_checksum_bench bench/weak_checksum_bench.c \
+ *       common_utils/file_hasher.c -Icommon_utils -lpthread -lssl -lcrypto
+ *   ./bench/weak_checksum_bench [MB] [block_size]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "file_hasher.h"
+
+/* The checksum as it was before the kernels, kept as the reference */
+static uint32_t weak_baseline(const unsigned char *buf, size_t len) {
+    uint32_t a = 0, b = 0;
+    for (size_t i = 0; i < len; ++i) {
+        a = (a + buf[i]) & 0xffff;
+        b = (b + a) & 0xffff;
+    }
+    return (b << 16) | a;
+}
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void report(const char *what, const char *kernel, size_t bytes, double secs, uint32_t sink) {
+    printf("%-8s %-8s %8.2f GB/s  (check %08x)\n", what, kernel, bytes / secs / 1e9, sink);
+}
+
+int main(int argc, char *argv[]) {
+    size_t mb = argc > 1 ? strtoul(argv[1], NULL, 10) : 256;
+    size_t bs = argc > 2 ? strtoul(argv[2], NULL, 10) : BLOCK_SIZE;
+    size_t size = mb << 20;
+    if (bs == 0 || size < bs) {
+        fprintf(stderr, "bad size\n");
+        return 1;
+    }
+    unsigned char *data = malloc(size);
+    uint32_t *out = malloc(sizeof(uint32_t) * (size / bs + 1));
+    if (!data || !out) return 1;
+    srand(1);
+    for (size_t i = 0; i < size; i++) data[i] = (unsigned char)rand();
+
+    size_t nblocks = (size + bs - 1) / bs;
+    uint32_t *expect = malloc(sizeof(uint32_t) * nblocks);
+    if (!expect) return 1;
+    double t = now();
+    for (size_t i = 0; i < nblocks; i++) {
+        size_t len = size - i * bs < bs ? size - i * bs : bs;
+        expect[i] = weak_baseline(data + i * bs, len);
+    }
+    report("blocks", "baseline", size, now() - t, expect[nblocks - 1]);
+
+    const char *kernels[] = { "scalar", "ssse3", "avx2" };
+    for (size_t k = 0; k < sizeof(kernels) / sizeof(kernels[0]); k++) {
+        if (rsync_weak_select(kernels[k]) != 0) {
+            printf("blocks   %-8s not supported on this CPU\n", kernels[k]);
+            continue;
+        }
+        t = now();
+        rsync_weak_checksum_blocks(data, size, bs, out);
+        double secs = now() - t;
+        if (memcmp(out, expect, sizeof(uint32_t) * nblocks) != 0) {
+            printf("blocks   %-8s MISMATCH\n", kernels[k]);
+            return 1;
+        }
+        report("blocks", kernels[k], size, secs, out[nblocks - 1]);
+    }
+
+    /* Rolling: one checksum per byte offset, as delta_generate does */
+    size_t windows = size - bs + 1;
+    uint32_t roll[4096];
+    uint32_t w = weak_baseline(data, bs), a = w & 0xffff, b = w >> 16;
+    uint32_t sink = 0;
+    t = now();
+    for (size_t p = 0; p < windows; p++) {
+        sink ^= (b << 16) | a;
+        if (p + 1 < windows) rsync_roll_checksum(&a, &b, data[p], data[p + bs], bs);
+    }
+    report("rolling", "baseline", windows, now() - t, sink);
+
+    for (size_t k = 0; k < sizeof(kernels) / sizeof(kernels[0]); k++) {
+        if (rsync_weak_select(kernels[k]) != 0) continue;
+        a = w & 0xffff;
+        b = w >> 16;
+        uint32_t check = 0;
+        t = now();
+        for (size_t p = 0; p < windows;) {
+            size_t n = windows - p < 4096 ? windows - p : 4096;
+            if (p > 0) rsync_roll_checksum(&a, &b, data[p - 1], data[p - 1 + bs], bs);
+            rsync_roll_checksums(data + p, n, bs, &a, &b, roll);
+            for (size_t i = 0; i < n; i++) check ^= roll[i];
+            p += n;
+        }
+        double secs = now() - t;
+        if (check != sink) {
+            printf("rolling  %-8s MISMATCH\n", kernels[k]);
+            return 1;
+        }
+        report("rolling", kernels[k], windows, secs, check);
+    }
+
+    free(expect);
+    free(out);
+    free(data);
+    return 0;
+}
@@ -6,13 +6,48 @@
 #include <arpa/inet.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <pthread.h>
+#include <errno.h>
+#include <dirent.h>
+#include <limits.h>
 
 #include "../common_utils/protocol.h"
 #include "../common_utils/compressor.h"
 #include "../common_utils/file_hasher.h"
+#include "../common_utils/delta.h"
+#include "../common_utils/chunker.h"
+#include "../common_utils/frame.h"
+#include "../common_utils/sig_engine.h"
+#include "sync_state.h"
+#include "upload_pipeline.h"
+#include "../common_utils/merkle.h"
+#include "../common_utils/buf_pool.h"
 
 #define SERVER_IP "127.0.0.1"
 #define SERVER_PORT 9000
+#define RECV_BUF_SIZE (1024 * 1024)
+#define MAX_GET_STREAMS 16
+#define MAX_LITERAL_LEN (16 * 1024 * 1024)
+
+/* Set with --port=, e.g. to go through a proxy */
+static int server_port = SERVER_PORT;
+/* Codecs offered in HELLO, most preferred first; set with --codec= */
+static const char *codec_prefs = CODEC_DEFAULT_PREFS;
+/* Strong hashes offered in HELLO, most preferred first; set with --hash= */
+static const char *hash_prefs = HASH_DEFAULT_PREFS;
+/* Previous version of the uploaded file, used as compression dictionary */
+static const char *upload_base = NULL;
+/* What was last synced, so unchanged files are skipped; NULL with --no-state */
+static sync_state_t *sync_state = NULL;
+/* Protocol version the server answered HELLO with */
+static int server_proto = PROTO_TEXT;
+/* Bounds of the per-file block size; set with --block-size= */
+static size_t block_size_min = BLOCK_SIZE_MIN;
+static size_t block_size_max = BLOCK_SIZE_MAX;
 
 ssize_t read_n(int fd, void *buf, size_t n)
 {
@@ -44,220 +79,1951 @@ ssize_t write_n(int fd, const void *buf, size_t n)
     return n;
 }
 
-/* Download a file from the server */
-int download_file(const char *fname)
+ssize_t read_line(int fd, char *buf, size_t cap)
+{
+    size_t pos = 0;
+    char ch;
+    while (pos < cap - 1 && read(fd, &ch, 1) == 1)
+    {
+        buf[pos++] = ch;
+        if (ch == '\n')
+            break;
+    }
+    buf[pos] = '\0';
+    return (ssize_t)pos;
+}
+
+int connect_server(void)
 {
     int sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock < 0)
+    {
+        perror("socket");
+        return -1;
+    }
     struct sockaddr_in sa;
+    memset(&sa, 0, sizeof(sa));
     sa.sin_family = AF_INET;
-    sa.sin_port = htons(SERVER_PORT);
+    sa.sin_port = htons((uint16_t)server_port);
     inet_pton(AF_INET, SERVER_IP, &sa.sin_addr);
 
     if (connect(sock, (struct sockaddr *)&sa, sizeof(sa)) < 0)
     {
         perror("connect");
-        return 1;
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+/* Offers the binary framing, our codecs and our strong hashes. Servers
+ * that predate HELLO drop the connection, in which case we reconnect and
+ * stay on text lines; servers that answer without a codec only know zlib,
+ * and without a hash only md5. */
+int negotiate_protocol(int *sock, int *codec, int *hash)
+{
+    char line[512];
+    char name[32] = "zlib", hname[32] = "md5";
+    int version = PROTO_TEXT;
+    *codec = CODEC_ZLIB;
+    *hash = HASH_MD5;
+    snprintf(line, sizeof(line), MSG_HELLO " %d %s %s\n", PROTO_VERSION, codec_prefs, hash_prefs);
+    if (write_n(*sock, line, strlen(line)) > 0 && read_line(*sock, line, sizeof(line)) > 0 &&
+        sscanf(line, MSG_HELLO " %d %31s %31s", &version, name, hname) >= 1)
+    {
+        int c = codec_from_name(name);
+        if (c >= 0 && codec_available(c))
+            *codec = c;
+        *hash = strong_hash_from_name(hname);
+        if (*hash < 0 || !strong_hash_available(*hash))
+        {
+            printf("Server picked unsupported hash %s\n", hname);
+            close(*sock);
+            *sock = -1;
+            return -1;
+        }
+        server_proto = version;
+        return version >= PROTO_BINARY ? PROTO_BINARY : PROTO_TEXT;
+    }
+
+    close(*sock);
+    *sock = connect_server();
+    server_proto = PROTO_TEXT;
+    return *sock < 0 ? -1 : PROTO_TEXT;
+}
+
+ssize_t writev_all(int fd, struct iovec *iov, int cnt)
+{
+    size_t total = 0;
+    for (int i = 0; i < cnt; i++)
+        total += iov[i].iov_len;
+    size_t left = total;
+    while (left > 0)
+    {
+        ssize_t w = writev(fd, iov, cnt);
+        if (w <= 0)
+            return w;
+        left -= w;
+        while (cnt > 0 && (size_t)w >= iov->iov_len)
+        {
+            w -= iov->iov_len;
+            iov++;
+            cnt--;
+        }
+        if (cnt > 0)
+        {
+            iov->iov_base = (char *)iov->iov_base + w;
+            iov->iov_len -= w;
+        }
+    }
+    return total;
+}
+
+int send_frame(int sock, uint8_t type, uint16_t flags, const void *payload, uint32_t len)
+{
+    unsigned char hdr[FRAME_HDR_LEN];
+    frame_encode_hdr(hdr, type, flags, len);
+    struct iovec iov[2] = {{hdr, sizeof(hdr)}, {(void *)payload, len}};
+    return writev_all(sock, iov, len ? 2 : 1) == (ssize_t)(sizeof(hdr) + len) ? 0 : -1;
+}
+
+/* Reads one whole frame; the payload is returned in a malloc'd buffer */
+int read_frame(int sock, frame_hdr_t *h, unsigned char **payload)
+{
+    unsigned char hdr[FRAME_HDR_LEN];
+    *payload = NULL;
+    if (read_n(sock, hdr, sizeof(hdr)) != (ssize_t)sizeof(hdr) || frame_decode_hdr(hdr, h) != 0)
+        return -1;
+    *payload = malloc(h->len ? h->len : 1);
+    if (!*payload)
+        return -1;
+    if (h->len && read_n(sock, *payload, h->len) != (ssize_t)h->len)
+    {
+        free(*payload);
+        *payload = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+static int sink_sigs_text(void *arg, const block_sig_t *sigs, int count)
+{
+    size_t n = sizeof(block_sig_t) * count;
+    return write_n(*(int *)arg, sigs, n) == (ssize_t)n ? 0 : -1;
+}
+
+static int sink_sigs_frame(void *arg, const block_sig_t *sigs, int count)
+{
+    return send_frame(*(int *)arg, FT_SIGS, 0, sigs, (uint32_t)(sizeof(block_sig_t) * count));
+}
+
+/* The signatures of an upload as they are sent, kept to update the sync
+ * state once the server confirms it. The stat fields are taken before
+ * the file is read, so a change made during the upload is seen next time. */
+typedef struct
+{
+    char key[SYNC_KEY_LEN];
+    sync_state_entry_t entry;
+    block_sig_t *sigs;
+    uint64_t *fps; /* only for files large enough to cache signatures of */
+    int have;
+    int sock;
+    sig_sink_fn sink;
+} sig_record_t;
+
+/* What was synced to one server says nothing about another */
+void sync_key(char *key, size_t cap, const char *name, const char *abs_path)
+{
+    snprintf(key, cap, "%s:%d\n%s\n%s", SERVER_IP, server_port, name, abs_path);
+}
+
+/* Sync state of remote file name as last uploaded from abs_path */
+const sync_state_entry_t *synced_entry(const char *name, const char *abs_path)
+{
+    char key[SYNC_KEY_LEN];
+    if (!sync_state)
+        return NULL;
+    sync_key(key, sizeof(key), name, abs_path);
+    return sync_state_find(sync_state, key);
+}
+
+/* Returns NULL when there is no sync state to keep */
+sig_record_t *sig_record_new(const char *name, const char *abs_path, const struct stat *sb,
+                             size_t block_size, int hash)
+{
+    if (!sync_state)
+        return NULL;
+    sig_record_t *rec = calloc(1, sizeof(*rec));
+    int nblocks = (int)((sb->st_size + block_size - 1) / block_size);
+    if (!rec || !(rec->sigs = malloc(sizeof(block_sig_t) * (nblocks ? nblocks : 1))))
+    {
+        free(rec);
+        return NULL;
+    }
+    if (nblocks >= SYNC_STATE_MIN_SIG_BLOCKS && hash != HASH_MURMUR3)
+        rec->fps = malloc(sizeof(uint64_t) * nblocks);
+    sync_key(rec->key, sizeof(rec->key), name, abs_path);
+    sync_state_stat(&rec->entry, sb);
+    rec->entry.key = rec->key;
+    rec->entry.hash_alg = hash;
+    rec->entry.block_size = (uint32_t)block_size;
+    return rec;
+}
+
+void sig_record_free(sig_record_t *rec)
+{
+    if (!rec)
+        return;
+    free(rec->sigs);
+    free(rec->fps);
+    free(rec);
+}
+
+/* The server has the file: remember what it was */
+void sig_record_commit(sig_record_t *rec)
+{
+    if (!rec)
+        return;
+    file_digest(rec->entry.hash_alg, rec->sigs, rec->have, rec->entry.digest);
+    rec->entry.nblocks = rec->fps ? rec->have : 0;
+    rec->entry.sigs = rec->sigs;
+    rec->entry.fps = rec->fps;
+    sync_state_put(sync_state, &rec->entry);
+}
+
+static int sink_record(void *arg, const block_sig_t *sigs, int count)
+{
+    sig_record_t *rec = arg;
+    memcpy(rec->sigs + rec->have, sigs, sizeof(block_sig_t) * count);
+    rec->have += count;
+    return rec->sink(&rec->sock, sigs, count);
+}
+
+/* Streams the signatures of data to the server. With a record, blocks
+ * whose fingerprint matches the cached copy keep their strong hash. */
+int send_sigs(int sock, const unsigned char *data, size_t fsize, size_t block_size, int hash,
+              sig_sink_fn sink, sig_record_t *rec)
+{
+    if (!rec)
+        return sig_engine_run(data, fsize, block_size, hash, 0, sink, &sock);
+
+    rec->sock = sock;
+    rec->sink = sink;
+    rec->have = 0;
+    sig_reuse_t reuse;
+    memset(&reuse, 0, sizeof(reuse));
+    reuse.fps_out = rec->fps;
+    const sync_state_entry_t *prev = sync_state_find(sync_state, rec->key);
+    if (prev && prev->hash_alg == hash && prev->block_size == block_size && prev->nblocks > 0)
+    {
+        reuse.sigs = prev->sigs;
+        reuse.fps = prev->fps;
+        reuse.nblocks = prev->nblocks;
+    }
+    int rc = sig_engine_run_reuse(data, fsize, block_size, hash, 0, rec->fps ? &reuse : NULL,
+                                  sink_record, rec);
+    if (reuse.reused > 0)
+        printf("Reused %d cached block hashes\n", reuse.reused);
+    return rc;
+}
+
+typedef struct
+{
+    block_sig_t *sigs;
+    int have;
+} sig_buf_t;
+
+static int sink_buf(void *arg, const block_sig_t *sigs, int count)
+{
+    sig_buf_t *b = arg;
+    memcpy(b->sigs + b->have, sigs, sizeof(block_sig_t) * count);
+    b->have += count;
+    return 0;
+}
+
+static int sink_none(void *arg, const block_sig_t *sigs, int count)
+{
+    (void)arg;
+    (void)sigs;
+    (void)count;
+    return 0;
+}
+
+/* Blocks of about the square root of the file size, within the bounds,
+ * so that signatures and block headers grow with the square root of the
+ * size instead of the size. Servers that take no block size in FILE_HDR
+ * or DELTA_GET get BLOCK_SIZE. */
+size_t pick_block_size(int proto, size_t fsize)
+{
+    if (proto != PROTO_BINARY || server_proto < PROTO_BLOCK_SIZE)
+        return BLOCK_SIZE;
+    size_t bs = block_size_min;
+    while (bs * 2 <= block_size_max && bs * bs < fsize)
+        bs *= 2;
+    return bs;
+}
+
+/* A file the sync state knows was changed since its last upload will not
+ * match the server's digest, so its signatures are streamed right away.
+ * Any other file is offered by digest first. */
+int offer_digest(const sig_record_t *rec)
+{
+    return server_proto >= PROTO_DIGEST && !(rec && sync_state_find(sync_state, rec->key));
+}
+
+/* Hashes every block before anything is sent, so the FILE_HDR can carry
+ * the digest. The signatures stay in the record if there is one,
+ * otherwise in *owned. */
+const block_sig_t *hash_all_sigs(const unsigned char *data, size_t fsize, int nblocks,
+                                 size_t block_size, int hash, sig_record_t *rec, block_sig_t **owned)
+{
+    *owned = NULL;
+    if (rec)
+        return send_sigs(-1, data, fsize, block_size, hash, sink_none, rec) == 0 ? rec->sigs : NULL;
+    sig_buf_t b = {malloc(sizeof(block_sig_t) * (nblocks ? nblocks : 1)), 0};
+    if (!b.sigs || sig_engine_run(data, fsize, block_size, hash, 0, sink_buf, &b) != 0)
+    {
+        free(b.sigs);
+        return NULL;
+    }
+    *owned = b.sigs;
+    return b.sigs;
+}
+
+/* Decodes the index list of a server request; every index must be below max */
+static int *decode_request(const unsigned char *p, size_t len, size_t max, int *n)
+{
+    int *idx = malloc(sizeof(int) * (max ? max : 1));
+    *n = idx ? ranges_decode(p, len, idx, (int)max) : -1;
+    if (*n < 0 || (*n > 0 && (size_t)idx[*n - 1] >= max))
+    {
+        free(idx);
+        return NULL;
+    }
+    return idx;
+}
+
+/* Sends the signatures of the requested leaf groups back to back, in
+ * frames of at most SIG_BATCH_BLOCKS signatures */
+static int send_groups(int sock, const block_sig_t *sigs, int nblocks, const int *groups, int n)
+{
+    block_sig_t *batch = malloc(sizeof(block_sig_t) * SIG_BATCH_BLOCKS);
+    int have = 0, rc = batch ? 0 : -1;
+    for (int k = 0; rc == 0 && k < n; k++)
+    {
+        int first = groups[k] * MERKLE_FANOUT;
+        int cnt = nblocks - first < MERKLE_FANOUT ? nblocks - first : MERKLE_FANOUT;
+        if (have + cnt > SIG_BATCH_BLOCKS)
+        {
+            rc = sink_sigs_frame(&sock, batch, have);
+            have = 0;
+        }
+        memcpy(batch + have, sigs + first, sizeof(block_sig_t) * cnt);
+        have += cnt;
+    }
+    if (rc == 0 && have > 0)
+        rc = sink_sigs_frame(&sock, batch, have);
+    free(batch);
+    return rc;
+}
+
+/* Answers the server after a FILE_HDR that offered a digest or a Merkle
+ * root: node hashes for every MERKLE_REQ, then the signatures SEND_SIGS
+ * names, or all of them. Sets *up_to_date if the server had the file. */
+int answer_sig_offer(int sock, const block_sig_t *sigs, int nblocks, const unsigned char *tree,
+                     int *up_to_date)
+{
+    size_t nodes_sent = 0;
+    *up_to_date = 0;
+    for (;;)
+    {
+        frame_hdr_t h;
+        unsigned char *p = NULL;
+        if (read_frame(sock, &h, &p) != 0)
+            return -1;
+        if (h.type == FT_FILE_OK && (h.flags & FF_UP_TO_DATE))
+        {
+            free(p);
+            *up_to_date = 1;
+            return 0;
+        }
+
+        uint64_t level = 0;
+        int k = h.type == FT_MERKLE_REQ ? varint_decode(p, h.len, &level) : 0;
+        if (h.type == FT_MERKLE_REQ && tree && k >= 0 && level < (uint64_t)merkle_levels(nblocks))
+        {
+            int n;
+            int *idx = decode_request(p + k, h.len - k, merkle_level_size(nblocks, (int)level), &n);
+            free(p);
+            if (!idx)
+                return -1;
+            const unsigned char *nodes = tree + merkle_level_offset(nblocks, (int)level) * MERKLE_NODE_LEN;
+            unsigned char *out = malloc((size_t)(n ? n : 1) * MERKLE_NODE_LEN);
+            int rc = out ? 0 : -1;
+            for (int i = 0; rc == 0 && i < n; i++)
+                memcpy(out + (size_t)i * MERKLE_NODE_LEN, nodes + (size_t)idx[i] * MERKLE_NODE_LEN,
+                       MERKLE_NODE_LEN);
+            for (int i = 0; rc == 0 && i < n; i += 65536)
+                rc = send_frame(sock, FT_MERKLE_NODES, 0, out + (size_t)i * MERKLE_NODE_LEN,
+                                (uint32_t)((n - i < 65536 ? n - i : 65536) * MERKLE_NODE_LEN));
+            nodes_sent += n;
+            free(out);
+            free(idx);
+            if (rc != 0)
+                return -1;
+            continue;
+        }
+
+        if (h.type == FT_SEND_SIGS && (h.flags & FF_MERKLE) && tree)
+        {
+            int n;
+            size_t groups = merkle_level_size(nblocks, 0);
+            int *idx = decode_request(p, h.len, groups, &n);
+            free(p);
+            if (!idx)
+                return -1;
+            printf("Merkle descent: %zu node hashes, signatures of %d of %zu groups\n", nodes_sent, n,
+                   groups);
+            int rc = send_groups(sock, sigs, nblocks, idx, n);
+            free(idx);
+            return rc;
+        }
+        free(p);
+        if (h.type != FT_SEND_SIGS)
+            return -1;
+        for (int i = 0; i < nblocks; i += SIG_BATCH_BLOCKS)
+            if (sink_sigs_frame(&sock, sigs + i, nblocks - i < SIG_BATCH_BLOCKS ? nblocks - i : SIG_BATCH_BLOCKS) != 0)
+                return -1;
+        return 0;
+    }
+}
+
+/* Moves len bytes from the socket into fd at off. splice() keeps the data
+ * in the kernel; sockets or files that do not support it fall back to
+ * large reads. */
+ssize_t recv_to_file(int sock, int fd, off_t off, size_t len)
+{
+    size_t left = len;
+    int pipefd[2];
+    if (pipe(pipefd) == 0)
+    {
+        fcntl(pipefd[1], F_SETPIPE_SZ, RECV_BUF_SIZE);
+        while (left > 0)
+        {
+            ssize_t in = splice(sock, NULL, pipefd[1], NULL, left, SPLICE_F_MOVE | SPLICE_F_MORE);
+            if (in < 0 && errno == EINTR)
+                continue;
+            if (in <= 0)
+                break;
+            ssize_t moved = 0;
+            while (moved < in)
+            {
+                ssize_t out = splice(pipefd[0], NULL, fd, &off, in - moved, SPLICE_F_MOVE);
+                if (out <= 0)
+                {
+                    close(pipefd[0]);
+                    close(pipefd[1]);
+                    return -1;
+                }
+                moved += out;
+            }
+            left -= in;
+        }
+        close(pipefd[0]);
+        close(pipefd[1]);
+        if (left != len)
+            return left == 0 ? (ssize_t)len : -1;
+    }
+
+    unsigned char *buf = malloc(RECV_BUF_SIZE);
+    if (!buf)
+        return -1;
+    while (left > 0)
+    {
+        ssize_t r = read(sock, buf, left < RECV_BUF_SIZE ? left : RECV_BUF_SIZE);
+        if (r <= 0 || pwrite(fd, buf, r, off) != r)
+            break;
+        off += r;
+        left -= r;
     }
+    free(buf);
+    return left == 0 ? (ssize_t)len : -1;
+}
+
+/* Requests [off, off + len) of fname and writes it at the same offset in
+ * fd. len < 0 asks for everything from off. The file size reported by the
+ * server is stored in *fsize_out. */
+int fetch_range(const char *fname, int fd, size_t off, long long len, size_t *fsize_out,
+                size_t *got_out)
+{
+    int sock = connect_server();
+    if (sock < 0)
+        return 1;
 
-    char header[512];
-    snprintf(header, sizeof(header), "FILE_GET %s\n", fname);
+    char header[2048];
+    if (len < 0)
+        snprintf(header, sizeof(header), MSG_FILE_GET " %s %zu\n", fname, off);
+    else
+        snprintf(header, sizeof(header), MSG_FILE_GET " %s %zu %lld\n", fname, off, len);
     write_n(sock, header, strlen(header));
 
     char line[512];
-    ssize_t r = recv(sock, line, sizeof(line) - 1, 0);
-    if (r <= 0)
+    size_t dlen = 0, fsize = 0;
+    if (read_line(sock, line, sizeof(line)) <= 0)
     {
-        perror("recv");
+        printf("No response from server\n");
         close(sock);
         return 1;
     }
-
-    line[r] = '\0';
     if (strncmp(line, MSG_FILE_ERR, strlen(MSG_FILE_ERR)) == 0)
     {
         printf("Server: file not found on server.\n");
         close(sock);
         return 1;
     }
-
-    if (strncmp(line, MSG_FILE_DATA, strlen(MSG_FILE_DATA)) != 0)
+    int fields = sscanf(line, MSG_FILE_DATA " %zu %zu", &dlen, &fsize);
+    if (fields < 1)
     {
         printf("Invalid response from server: %s\n", line);
         close(sock);
         return 1;
     }
+    if (fields == 1)
+        fsize = off + dlen;
+    if (fsize_out)
+        *fsize_out = fsize;
 
-    size_t fsize = 0;
-    sscanf(line, "FILE_DATA %zu", &fsize);
-    printf("Downloading file (%zu bytes)...\n", fsize);
-
-    char outname[256];
-    snprintf(outname, sizeof(outname), "downloaded_%s", fname);
-    FILE *outf = fopen(outname, "wb");
-    if (!outf)
+    int rc = 0;
+    if (fd >= 0 && dlen > 0 && recv_to_file(sock, fd, (off_t)off, dlen) != (ssize_t)dlen)
     {
-        perror("fopen");
-        close(sock);
-        return 1;
+        printf("Connection lost after partial data\n");
+        rc = 1;
+    }
+    if (rc == 0 && fd >= 0 && (read_line(sock, line, sizeof(line)) <= 0 ||
+                               strncmp(line, MSG_FILE_END, strlen(MSG_FILE_END)) != 0))
+    {
+        printf("Missing %s from server\n", MSG_FILE_END);
+        rc = 1;
     }
+    if (got_out)
+        *got_out = rc == 0 ? dlen : 0;
+    close(sock);
+    return rc;
+}
 
-    size_t total = 0;
-    unsigned char buf[4096];
-    while (1)
+typedef struct
+{
+    const char *fname;
+    int fd;
+    size_t off;
+    size_t len;
+    int rc;
+} range_job_t;
+
+static void *range_worker(void *arg)
+{
+    range_job_t *job = arg;
+    size_t got = 0;
+    job->rc = fetch_range(job->fname, job->fd, job->off, (long long)job->len, NULL, &got);
+    if (job->rc == 0 && got != job->len)
+        job->rc = 1;
+    return NULL;
+}
+
+/* Replays COPY/LITERAL instructions from the server, taking COPY blocks
+ * of block_size from the old local copy. Returns the number of bytes
+ * written or -1. */
+long long apply_delta_stream(int sock, int oldfd, int old_nblocks, size_t block_size, FILE *outf,
+                             size_t *copied_out, size_t *literal_out)
+{
+    unsigned char *blockbuf = buf_get(block_size);
+    long long written = 0;
+    dict_ctx_t *dc = NULL;
+    char cmd[256];
+    while (blockbuf && read_line(sock, cmd, sizeof(cmd)) > 0)
     {
-        ssize_t rr = recv(sock, buf, sizeof(buf), 0);
-        if (rr <= 0)
-            break;
+        if (strncmp(cmd, MSG_DELTA_END, strlen(MSG_DELTA_END)) == 0)
+        {
+            dict_ctx_free(dc);
+            buf_put(blockbuf);
+            return written;
+        }
 
-        if (memcmp(buf, MSG_FILE_END, strlen(MSG_FILE_END)) == 0)
-            break;
+        /* Literal deflated against our own old blocks first..first+count-1 */
+        int c_len = 0, orig_len = 0, first = 0, count = 0;
+        if (sscanf(cmd, MSG_LITERAL_DICT " %d %d %d %d", &c_len, &orig_len, &first, &count) == 4)
+        {
+            if (c_len <= 0 || orig_len <= 0 || orig_len > MAX_LITERAL_LEN || first < 0 ||
+                count <= 0 || (size_t)count > DICT_MAX_LEN / block_size || first > old_nblocks - count)
+            {
+                fprintf(stderr, "Invalid LITERAL_DICT %d %d %d %d\n", c_len, orig_len, first, count);
+                break;
+            }
+            unsigned char dict[DICT_MAX_LEN];
+            ssize_t dict_len = pread(oldfd, dict, (size_t)count * block_size, (off_t)first * block_size);
+            unsigned char *cbuf = buf_get(c_len);
+            unsigned char *dec = buf_get(orig_len);
+            int ok = dict_len > 0 && cbuf && dec && read_n(sock, cbuf, c_len) == c_len &&
+                     (dc || (dc = dict_ctx_new())) &&
+                     dict_decompress(dc, cbuf, c_len, dict, dict_len, dec, orig_len) == orig_len;
+            if (ok)
+            {
+                fwrite(dec, 1, orig_len, outf);
+                written += orig_len;
+                *literal_out += orig_len;
+            }
+            else
+            {
+                fprintf(stderr, "Dictionary decompression failed for literal\n");
+            }
+            buf_put(cbuf);
+            buf_put(dec);
+            if (!ok)
+                break;
+            continue;
+        }
 
-        fwrite(buf, 1, rr, outf);
-        total += rr;
+        int start = 0;
+        if (sscanf(cmd, "COPY %d %d", &start, &count) == 2)
+        {
+            if (start < 0 || count < 0 || start > old_nblocks || count > old_nblocks - start)
+            {
+                fprintf(stderr, "Invalid COPY %d %d\n", start, count);
+                break;
+            }
+            for (int i = 0; i < count; i++)
+            {
+                ssize_t got = pread(oldfd, blockbuf, block_size, (off_t)(start + i) * block_size);
+                if (got <= 0)
+                    goto fail;
+                fwrite(blockbuf, 1, got, outf);
+                written += got;
+                *copied_out += got;
+            }
+            continue;
+        }
 
-        if (total >= fsize)
-            break;
-    }
+        if (sscanf(cmd, "LITERAL %d %d", &c_len, &orig_len) == 2)
+        {
+            if (c_len <= 0 || orig_len <= 0 || c_len > orig_len || orig_len > MAX_LITERAL_LEN)
+            {
+                fprintf(stderr, "Invalid LITERAL %d %d\n", c_len, orig_len);
+                break;
+            }
+            unsigned char *cbuf = buf_get(c_len);
+            if (!cbuf || read_n(sock, cbuf, c_len) != c_len)
+            {
+                buf_put(cbuf);
+                break;
+            }
+            if (c_len == orig_len)
+            {
+                fwrite(cbuf, 1, c_len, outf);
+            }
+            else
+            {
+                unsigned char *dec = buf_get(orig_len);
+                if (!dec || codec_decompress(CODEC_ZLIB, cbuf, c_len, dec, orig_len) < 0)
+                {
+                    fprintf(stderr, "Decompression failed for literal\n");
+                    buf_put(dec);
+                    buf_put(cbuf);
+                    break;
+                }
+                fwrite(dec, 1, orig_len, outf);
+                buf_put(dec);
+            }
+            buf_put(cbuf);
+            written += orig_len;
+            *literal_out += orig_len;
+            continue;
+        }
 
-    fclose(outf);
-    printf("File saved as %s (%zu bytes received)\n", outname, total);
-    close(sock);
-    return 0;
+        fprintf(stderr, "Invalid delta command: %s\n", cmd);
+        break;
+    }
+fail:
+    dict_ctx_free(dc);
+    buf_put(blockbuf);
+    return -1;
 }
 
-int upload_file(const char *fname)
+/* Refreshes an existing downloaded_<name> by sending its signatures and
+ * fetching only what changed. The new copy is assembled next to the old
+ * one and renamed over it once complete. */
+int delta_download_file(const char *fname, const char *outname)
 {
-    FILE *f = fopen(fname, "rb");
-    if (!f)
+    int oldfd = open(outname, O_RDONLY);
+    struct stat st;
+    if (oldfd < 0 || fstat(oldfd, &st) != 0)
     {
-        perror("fopen");
+        perror("open");
+        if (oldfd >= 0)
+            close(oldfd);
+        return 1;
+    }
+    size_t old_size = (size_t)st.st_size;
+    unsigned char *old = mmap(NULL, old_size, PROT_READ, MAP_PRIVATE, oldfd, 0);
+    if (old == MAP_FAILED)
+    {
+        perror("mmap");
+        close(oldfd);
         return 1;
     }
+    madvise(old, old_size, MADV_SEQUENTIAL);
 
-    fseek(f, 0, SEEK_END);
-    size_t fsize = ftell(f);
-    fseek(f, 0, SEEK_SET);
+    int sock = connect_server();
+    int codec, hash = HASH_MD5;
+    int proto = sock < 0 ? -1 : negotiate_protocol(&sock, &codec, &hash);
+    if (proto < 0)
+    {
+        if (sock >= 0)
+            close(sock);
+        munmap(old, old_size);
+        close(oldfd);
+        return 1;
+    }
 
-    int nblocks = (fsize + BLOCK_SIZE - 1) / BLOCK_SIZE;
-    block_sig_t *sigs = malloc(sizeof(block_sig_t) * nblocks);
-    if (!sigs)
+    /* Signatures in the block size an upload of this file would use, so
+     * the server finds our old blocks in its chunk store as dictionaries */
+    size_t block_size = pick_block_size(proto, old_size);
+    int old_nblocks = (int)((old_size + block_size - 1) / block_size);
+    char header[2048];
+    int hlen = block_size == BLOCK_SIZE
+                   ? snprintf(header, sizeof(header), MSG_DELTA_GET " %s %d %zu dict\n", fname,
+                              old_nblocks, old_size)
+                   : snprintf(header, sizeof(header), MSG_DELTA_GET " %s %d %zu dict %zu\n", fname,
+                              old_nblocks, old_size, block_size);
+    write_n(sock, header, hlen);
+    int sent = sig_engine_run(old, old_size, block_size, hash, 0, sink_sigs_text, &sock);
+    munmap(old, old_size);
+    if (sent != 0)
     {
-        perror("malloc");
-        fclose(f);
+        close(sock);
+        close(oldfd);
         return 1;
     }
 
-    unsigned char buf[BLOCK_SIZE];
-    for (int i = 0; i < nblocks; i++)
+    char line[256];
+    size_t fsize = 0;
+    if (read_line(sock, line, sizeof(line)) <= 0 ||
+        sscanf(line, MSG_DELTA_DATA " %zu", &fsize) != 1)
     {
-        size_t r = fread(buf, 1, BLOCK_SIZE, f);
-        sigs[i].weak = rsync_weak_checksum(buf, r);
-        md5_hash(buf, r, sigs[i].strong);
+        if (strncmp(line, MSG_FILE_ERR, strlen(MSG_FILE_ERR)) == 0)
+            printf("Server: file not found on server.\n");
+        else
+            printf("Invalid response from server: %s\n", line);
+        close(sock);
+        close(oldfd);
+        return 1;
     }
-    rewind(f);
 
-    int sock = socket(AF_INET, SOCK_STREAM, 0);
-    struct sockaddr_in sa;
-    sa.sin_family = AF_INET;
-    sa.sin_port = htons(SERVER_PORT);
-    inet_pton(AF_INET, SERVER_IP, &sa.sin_addr);
+    char tmp[MAX_PATH_LEN + 32];
+    snprintf(tmp, sizeof(tmp), "%s.part", outname);
+    FILE *outf = fopen(tmp, "wb");
+    if (!outf)
+    {
+        perror("fopen");
+        close(sock);
+        close(oldfd);
+        return 1;
+    }
 
-    if (connect(sock, (struct sockaddr *)&sa, sizeof(sa)) < 0)
+    size_t copied = 0, literal = 0;
+    long long written = apply_delta_stream(sock, oldfd, old_nblocks, block_size, outf, &copied, &literal);
+    close(sock);
+    close(oldfd);
+    if (fclose(outf) != 0 || written < 0 || (size_t)written != fsize)
     {
-        perror("connect");
-        free(sigs);
-        fclose(f);
+        printf("Delta download of %s failed\n", fname);
+        unlink(tmp);
+        return 1;
+    }
+    if (rename(tmp, outname) != 0)
+    {
+        perror("rename");
+        unlink(tmp);
         return 1;
     }
 
-    printf("Performing file synchronization for %s...\n", fname);
+    printf("File saved as %s (%zu bytes reused locally, %zu bytes received)\n",
+           outname, copied, literal);
+    return 0;
+}
 
-    char header[2048];
-    int hlen = snprintf(header, sizeof(header),
-                        "FILE_HDR %s %zu %d\n", fname, fsize, nblocks);
-    write_n(sock, header, hlen);
-    write_n(sock, sigs, sizeof(block_sig_t) * nblocks);
+/* Download a file from the server. With resume set an existing partial
+ * downloaded_<name> is continued from its current size; streams > 1 splits
+ * the file into that many ranges fetched over parallel connections. */
+int download_file(const char *fname, int resume, int streams)
+{
+    char outname[MAX_PATH_LEN + 16];
+    snprintf(outname, sizeof(outname), "downloaded_%s", fname);
 
-    char resp[8192];
-    ssize_t rlen = recv(sock, resp, sizeof(resp) - 1, 0);
-    if (rlen <= 0)
+    struct stat st;
+    if (!resume && streams <= 1 && stat(outname, &st) == 0 && st.st_size > 0)
+        return delta_download_file(fname, outname);
+
+    int fd = open(outname, O_WRONLY | O_CREAT | (resume ? 0 : O_TRUNC), 0644);
+    if (fd < 0)
     {
-        perror("recv");
-        free(sigs);
-        fclose(f);
-        close(sock);
+        perror("open");
         return 1;
     }
+    size_t start = resume && fstat(fd, &st) == 0 ? (size_t)st.st_size : 0;
 
-    resp[rlen] = '\0';
-    int req_count = 0;
-    int idxs[1024];
-    char *tok = strstr(resp, "\n");
-    if (tok)
+    size_t fsize = 0, got = 0;
+    int rc;
+    if (streams <= 1)
     {
-        tok++;
-        char *p = strtok(tok, " \n");
-        while (p && req_count < 1024)
-        {
-            idxs[req_count++] = atoi(p);
-            p = strtok(NULL, " \n");
-        }
+        rc = fetch_range(fname, fd, start, -1, &fsize, &got);
     }
-    printf("Server requested %d blocks\n", req_count);
-
-    for (int i = 0; i < req_count; i++)
+    else
     {
-        int bi = idxs[i];
-        fseek(f, (long)bi * BLOCK_SIZE, SEEK_SET);
-        size_t got = fread(buf, 1, BLOCK_SIZE, f);
-
-        unsigned char *cbuf = NULL;
-        int clen = compress_block(buf, got, &cbuf);
-        if (clen < 0)
+        /* A zero-length range only reports the size */
+        rc = fetch_range(fname, -1, 0, 0, &fsize, NULL);
+        if (start > fsize)
+            start = fsize;
+        size_t span = fsize - start;
+        if (rc == 0 && span > 0)
         {
-            cbuf = malloc(got);
-            memcpy(cbuf, buf, got);
-            clen = (int)got;
+            if (streams > MAX_GET_STREAMS)
+                streams = MAX_GET_STREAMS;
+            size_t part = (span + streams - 1) / streams;
+            range_job_t jobs[MAX_GET_STREAMS];
+            pthread_t tids[MAX_GET_STREAMS];
+            int started = 0;
+            for (int i = 0; i < streams && (size_t)i * part < span; i++)
+            {
+                jobs[i].fname = fname;
+                jobs[i].fd = fd;
+                jobs[i].off = start + (size_t)i * part;
+                jobs[i].len = span - (size_t)i * part < part ? span - (size_t)i * part : part;
+                jobs[i].rc = 1;
+                if (pthread_create(&tids[i], NULL, range_worker, &jobs[i]) != 0)
+                    break;
+                started++;
+            }
+            for (int i = 0; i < started; i++)
+            {
+                pthread_join(tids[i], NULL);
+                if (jobs[i].rc == 0)
+                    got += jobs[i].len;
+                else
+                    rc = 1;
+            }
+            if ((size_t)started * part < span)
+                rc = 1;
         }
-
-        char bheader[128];
-        int blen = snprintf(bheader, sizeof(bheader),
-                            "BLOCK_DATA %d %d %zu\n", bi, clen, got);
-        write_n(sock, bheader, blen);
-        write_n(sock, cbuf, clen);
-        free(cbuf);
     }
 
-    write_n(sock, "BLOCK_END\n", 10);
-
-    rlen = recv(sock, resp, sizeof(resp) - 1, 0);
-    if (rlen > 0)
+    if (rc == 0 && ftruncate(fd, (off_t)fsize) != 0)
+        perror("ftruncate");
+    int empty = fstat(fd, &st) == 0 && st.st_size == 0;
+    close(fd);
+    if (rc != 0)
     {
-        resp[rlen] = '\0';
-        printf("Server: %s\n", resp);
+        if (empty)
+            unlink(outname);
+        else
+            printf("Download of %s incomplete; rerun with --resume to continue\n", fname);
+        return 1;
     }
-
-    fclose(f);
-    free(sigs);
-    close(sock);
+    if (start > 0)
+        printf("Resumed at byte %zu\n", start);
+    printf("File saved as %s (%zu bytes received, %zu bytes total)\n", outname, got, fsize);
     return 0;
 }
 
-int main(int argc, char *argv[])
+/* Reads the index list that follows a BLOCK_REQ header line */
+int read_index_list(int sock, int *out, int count)
 {
-    if (argc < 2)
+    int n = 0, cur = 0, in_num = 0;
+    char ch;
+    while (read(sock, &ch, 1) == 1)
     {
-        printf("Usage:\n");
-        printf("  %s <filename>           # Upload/sync file\n", argv[0]);
-        printf("  %s <filename> --get     # Download file from server\n", argv[0]);
-        return 1;
+        if (ch >= '0' && ch <= '9')
+        {
+            cur = cur * 10 + (ch - '0');
+            in_num = 1;
+            continue;
+        }
+        if (in_num && n < count)
+            out[n++] = cur;
+        cur = 0;
+        in_num = 0;
+        if (ch == '\n')
+            break;
     }
+    return n;
+}
 
-    const char *fname = argv[1];
+/* State of a tree sync: every regular file below a directory goes over
+ * one connection inside SYNC_START/SYNC_END. The next file's header and
+ * signatures go out before the previous FILE_OK is read, so each file
+ * costs a single round trip. */
+typedef struct
+{
+    int sock;    /* -1 until the first file that needs uploading */
+    int proto;
+    int codec;
+    int hash;
+    int pending; /* BLOCK_END sent, result not read yet */
+    char pending_name[MAX_PATH_LEN];
+    sig_record_t *pending_rec;
+    int files, failed, skipped, unchanged;
+} tree_sync_t;
 
-    if (argc == 3 && strcmp(argv[2], "--get") == 0)
-        return download_file(fname);
+/* Reads the result of the previous upload, if one is outstanding */
+int tree_collect(tree_sync_t *ts)
+{
+    if (!ts || !ts->pending)
+        return 0;
+    ts->pending = 0;
+    int ok;
+    if (ts->proto == PROTO_BINARY)
+    {
+        frame_hdr_t h;
+        unsigned char *payload = NULL;
+        if (read_frame(ts->sock, &h, &payload) != 0)
+            return -1;
+        free(payload);
+        ok = h.type == FT_FILE_OK;
+    }
     else
-        return upload_file(fname);
+    {
+        char line[256];
+        if (read_line(ts->sock, line, sizeof(line)) <= 0)
+            return -1;
+        ok = strncmp(line, MSG_FILE_OK, strlen(MSG_FILE_OK)) == 0;
+    }
+    if (ok)
+    {
+        sig_record_commit(ts->pending_rec);
+        ts->files++;
+    }
+    else
+    {
+        printf("Server rejected %s\n", ts->pending_name);
+        ts->failed++;
+    }
+    sig_record_free(ts->pending_rec);
+    ts->pending_rec = NULL;
+    return 0;
 }
 
+/* Hands the record of a file whose BLOCK_END was just sent to the tree
+ * sync, to be committed with its FILE_OK */
+static void tree_defer(tree_sync_t *ts, const char *fname, sig_record_t **rec)
+{
+    ts->pending = 1;
+    snprintf(ts->pending_name, sizeof(ts->pending_name), "%s", fname);
+    ts->pending_rec = *rec;
+    *rec = NULL;
+}
+
+/* State shared by the pipeline workers encoding one file's requested blocks */
+typedef struct
+{
+    const unsigned char *data;
+    size_t fsize, block_size;
+    const int *idxs;
+    const chunk_sig_t *hints;
+    int basefd, codec, hash;
+    size_t wire;
+    int raw_blocks, dict_blocks;
+} block_job_t;
+
+typedef struct
+{
+    dict_ctx_t *dc;
+    unsigned char *dict;    /* one block of the base file */
+} block_worker_t;
+
+static void *block_worker_new(void *arg)
+{
+    const block_job_t *job = arg;
+    block_worker_t *w = calloc(1, sizeof(block_worker_t));
+    if (w && !(w->dict = buf_get(job->block_size)))
+    {
+        free(w);
+        return NULL;
+    }
+    return w;
+}
+
+static void block_worker_free(void *ctx)
+{
+    block_worker_t *w = ctx;
+    dict_ctx_free(w->dc);
+    buf_put(w->dict);
+    free(w);
+}
+
+static ssize_t encode_block_text(void *arg, void *ctx, int k, unsigned char *out)
+{
+    block_job_t *job = arg;
+    (void)ctx;
+    int bi = job->idxs[k];
+    const unsigned char *buf = job->data + (size_t)bi * BLOCK_SIZE;
+    size_t got = job->fsize - (size_t)bi * BLOCK_SIZE < BLOCK_SIZE ? job->fsize - (size_t)bi * BLOCK_SIZE : BLOCK_SIZE;
+
+    unsigned char cbuf[BLOCK_SIZE + 64];
+    int clen = compress_block(buf, got, cbuf, sizeof(cbuf));
+    const unsigned char *body = clen < 0 ? buf : cbuf;
+    if (clen < 0)
+        clen = (int)got;
+
+    int blen = sprintf((char *)out, "BLOCK_DATA %d %d %zu\n", bi, clen, got);
+    memcpy(out + blen, body, clen);
+    return blen + clen;
+}
+
+/* A block whose old version both sides hold is deflated against it; the
+ * dictionary also helps data that looks random. Otherwise incompressible
+ * blocks skip the codec and go out raw. */
+static ssize_t encode_block_binary(void *arg, void *ctx, int k, unsigned char *out)
+{
+    block_job_t *job = arg;
+    block_worker_t *w = ctx;
+    int bi = job->idxs[k];
+    size_t bs = job->block_size;
+    const unsigned char *buf = job->data + (size_t)bi * bs;
+    size_t got = job->fsize - (size_t)bi * bs < bs ? job->fsize - (size_t)bi * bs : bs;
+
+    unsigned char vh[2 * VARINT_MAX_LEN];
+    size_t vlen = varint_encode((uint64_t)bi, vh);
+    vlen += varint_encode(got, vh + vlen);
+    unsigned char *cbuf = out + FRAME_HDR_LEN + vlen;
+
+    int clen = -1;
+    uint16_t flags = 0;
+    const chunk_sig_t *hint = job->hints ? &job->hints[k] : NULL;
+    if (hint && w && hint->len > 0 && hint->len <= bs &&
+        pread(job->basefd, w->dict, hint->len, (off_t)bi * bs) == (ssize_t)hint->len)
+    {
+        unsigned char strong[16];
+        strong_hash(job->hash, w->dict, hint->len, strong);
+        if (memcmp(strong, hint->strong, 16) == 0 && (w->dc || (w->dc = dict_ctx_new())))
+            clen = dict_compress(w->dc, buf, got, w->dict, hint->len, cbuf, bs * 2);
+        if (clen >= 0)
+        {
+            flags = FF_DICT;
+            __atomic_add_fetch(&job->dict_blocks, 1, __ATOMIC_RELAXED);
+        }
+    }
+    if (clen < 0 && block_is_compressible(buf, got))
+        clen = codec_compress(job->codec, buf, got, cbuf, bs * 2);
+    if (clen < 0)
+    {
+        flags = FF_RAW;
+        memcpy(cbuf, buf, got);
+        clen = (int)got;
+        __atomic_add_fetch(&job->raw_blocks, 1, __ATOMIC_RELAXED);
+    }
+    __atomic_add_fetch(&job->wire, (size_t)clen, __ATOMIC_RELAXED);
+
+    frame_encode_hdr(out, FT_BLOCK_DATA, flags, (uint32_t)(vlen + clen));
+    memcpy(out + FRAME_HDR_LEN, vh, vlen);
+    return (ssize_t)(FRAME_HDR_LEN + vlen + clen);
+}
+
+/* With a tree sync, returns once BLOCK_END is sent and leaves the result
+ * pending; otherwise waits for it. */
+int upload_blocks_text(int sock, const unsigned char *data, const char *fname, size_t fsize,
+                       int nblocks, int hash, tree_sync_t *ts, sig_record_t **rec)
+{
+    char header[2048];
+    int hlen = snprintf(header, sizeof(header),
+                        "FILE_HDR %s %zu %d\n", fname, fsize, nblocks);
+    write_n(sock, header, hlen);
+    if (send_sigs(sock, data, fsize, BLOCK_SIZE, hash, sink_sigs_text, *rec) != 0)
+        return 1;
+    if (tree_collect(ts) != 0)
+        return 1;
+
+    char line[256];
+    int req_count = 0;
+    if (read_line(sock, line, sizeof(line)) <= 0 ||
+        sscanf(line, "BLOCK_REQ %d", &req_count) != 1 || req_count < 0 || req_count > nblocks)
+    {
+        printf("Invalid response from server: %s\n", line);
+        return 1;
+    }
+
+    int *idxs = malloc(sizeof(int) * (req_count ? req_count : 1));
+    if (!idxs || read_index_list(sock, idxs, req_count) != req_count)
+    {
+        printf("Malformed BLOCK_REQ from server\n");
+        free(idxs);
+        return 1;
+    }
+    printf("Server requested %d blocks\n", req_count);
+
+    for (int i = 0; i < req_count; i++)
+    {
+        if (idxs[i] < 0 || idxs[i] >= nblocks)
+        {
+            printf("Server requested invalid block %d\n", idxs[i]);
+            free(idxs);
+            return 1;
+        }
+    }
+
+    block_job_t job = {.data = data, .fsize = fsize, .idxs = idxs};
+    block_encoder_t enc = {encode_block_text, NULL, NULL, &job, 64 + codec_bound(CODEC_ZLIB, BLOCK_SIZE)};
+    int rc = upload_pipeline_run(sock, data, fsize, BLOCK_SIZE, idxs, req_count, &enc, 0);
+    free(idxs);
+    if (rc != 0)
+        return 1;
+
+    write_n(sock, "BLOCK_END\n", 10);
+    if (ts)
+    {
+        tree_defer(ts, fname, rec);
+        return 0;
+    }
+
+    if (read_line(sock, line, sizeof(line)) > 0)
+        printf("Server: %s\n", line);
+    if (strncmp(line, MSG_FILE_OK, strlen(MSG_FILE_OK)) != 0)
+        return 1;
+    sig_record_commit(*rec);
+    return 0;
+}
+
+/* BLOCK_HINTS: per requested block, the length and hash of the server's
+ * current version of it, or length 0 */
+int read_hints_frame(int sock, chunk_sig_t *hints, int count, size_t block_size)
+{
+    frame_hdr_t h;
+    unsigned char *p = NULL;
+    if (read_frame(sock, &h, &p) != 0 || h.type != FT_BLOCK_HINTS)
+    {
+        free(p);
+        return -1;
+    }
+    size_t pos = 0;
+    for (int i = 0; i < count && pos < h.len; i++)
+    {
+        uint64_t len;
+        int k = varint_decode(p + pos, h.len - pos, &len);
+        if (k < 0 || len > block_size || (len && h.len - pos - k < 16))
+        {
+            free(p);
+            return -1;
+        }
+        pos += k;
+        hints[i].len = (uint32_t)len;
+        if (len)
+        {
+            memcpy(hints[i].strong, p + pos, 16);
+            pos += 16;
+        }
+    }
+    free(p);
+    return 0;
+}
+
+/* Same exchange as the text path, but every message is a length-prefixed
+ * frame: no per-block header parsing and the request list is sent as
+ * runs of consecutive indices. */
+int upload_blocks_binary(int sock, const unsigned char *data, const char *fname, size_t fsize,
+                         int nblocks, size_t block_size, int codec, int hash, tree_sync_t *ts,
+                         sig_record_t **rec)
+{
+    unsigned char hdr[4 * VARINT_MAX_LEN + MAX_PATH_LEN + 16];
+    size_t name_len = strlen(fname);
+    if (name_len >= MAX_PATH_LEN)
+    {
+        printf("File name too long\n");
+        return 1;
+    }
+    size_t pos = varint_encode(fsize, hdr);
+    pos += varint_encode((uint64_t)nblocks, hdr + pos);
+    pos += varint_encode(name_len, hdr + pos);
+    memcpy(hdr + pos, fname, name_len);
+    pos += name_len;
+
+    /* Offered by digest or Merkle root, the signatures are only sent as
+     * far as the server asks for them */
+    block_sig_t *owned = NULL;
+    const block_sig_t *all = NULL;
+    unsigned char *tree = NULL;
+    int merkle = server_proto >= PROTO_MERKLE && nblocks >= MERKLE_MIN_BLOCKS;
+    int digest = merkle || offer_digest(*rec);
+    if (digest)
+    {
+        if (!(all = hash_all_sigs(data, fsize, nblocks, block_size, hash, *rec, &owned)))
+            return 1;
+        if (merkle && !(tree = malloc(merkle_nodes(nblocks) * MERKLE_NODE_LEN)))
+        {
+            free(owned);
+            return 1;
+        }
+        if (merkle)
+        {
+            merkle_build(hash, all, nblocks, NULL, tree);
+            memcpy(hdr + pos, merkle_root(tree, nblocks), MERKLE_NODE_LEN);
+        }
+        else
+        {
+            file_digest(hash, all, nblocks, hdr + pos);
+        }
+        pos += 16;
+    }
+
+    uint16_t hflags = merkle ? FF_MERKLE : digest ? FF_DIGEST : 0;
+    if (server_proto >= PROTO_BLOCK_SIZE)
+    {
+        pos += varint_encode(block_size, hdr + pos);
+        hflags |= FF_BLOCK_SIZE;
+    }
+
+    int basefd = upload_base ? open(upload_base, O_RDONLY) : -1;
+    if (upload_base && basefd < 0)
+        perror("open base");
+    if (basefd >= 0)
+        hflags |= FF_WANT_HINTS;
+    int sent = send_frame(sock, FT_FILE_HDR, hflags, hdr, (uint32_t)pos) == 0 ? 0 : -1;
+
+    frame_hdr_t h;
+    unsigned char *payload = NULL;
+    if (sent == 0 && digest)
+    {
+        int up_to_date;
+        sent = tree_collect(ts) == 0 ? answer_sig_offer(sock, all, nblocks, tree, &up_to_date) : -1;
+        if (sent == 0 && up_to_date)
+        {
+            printf("Server already has this version of %s\n", fname);
+            free(owned);
+            free(tree);
+            if (basefd >= 0)
+                close(basefd);
+            sig_record_commit(*rec);
+            if (ts)
+                ts->files++;
+            return 0;
+        }
+    }
+    else if (sent == 0)
+    {
+        /* Signatures go out batch by batch while the rest are still hashed */
+        sent = send_sigs(sock, data, fsize, block_size, hash, sink_sigs_frame, *rec) == 0 &&
+                       tree_collect(ts) == 0
+                   ? 0
+                   : -1;
+    }
+    free(owned);
+    free(tree);
+    if (sent != 0)
+    {
+        if (basefd >= 0)
+            close(basefd);
+        return 1;
+    }
+
+    int *idxs = malloc(sizeof(int) * (nblocks ? nblocks : 1));
+    int req_count = -1;
+    if (idxs && read_frame(sock, &h, &payload) == 0 && h.type == FT_BLOCK_REQ)
+        req_count = ranges_decode(payload, h.len, idxs, nblocks);
+    free(payload);
+    chunk_sig_t *hints = NULL;
+    if (req_count >= 0 && basefd >= 0)
+    {
+        hints = calloc(req_count ? req_count : 1, sizeof(chunk_sig_t));
+        if (!hints || read_hints_frame(sock, hints, req_count, block_size) != 0)
+            req_count = -1;
+    }
+    if (req_count < 0)
+    {
+        printf("Invalid BLOCK_REQ from server\n");
+        free(idxs);
+        free(hints);
+        if (basefd >= 0)
+            close(basefd);
+        return 1;
+    }
+    printf("Server requested %d blocks\n", req_count);
+
+    int rc = 0;
+    for (int i = 0; i < req_count; i++)
+        if (idxs[i] < 0 || idxs[i] >= nblocks)
+            rc = 1;
+    if (codec_bound(codec, block_size) > block_size * 2)
+        codec = CODEC_NONE;
+    block_job_t job = {.data = data, .fsize = fsize, .block_size = block_size, .idxs = idxs,
+                       .hints = hints, .basefd = basefd, .codec = codec, .hash = hash};
+    block_encoder_t enc = {encode_block_binary, block_worker_new, block_worker_free, &job,
+                           FRAME_HDR_LEN + 2 * VARINT_MAX_LEN + block_size * 2};
+    if (rc == 0 && upload_pipeline_run(sock, data, fsize, block_size, idxs, req_count, &enc, 0) != 0)
+        rc = 1;
+    free(idxs);
+    free(hints);
+    if (basefd >= 0)
+        close(basefd);
+    printf("Sent %zu payload bytes with %s (%d blocks raw, %d against the base)\n",
+           job.wire, codec_name(codec), job.raw_blocks, job.dict_blocks);
+    if (rc != 0 || send_frame(sock, FT_BLOCK_END, 0, NULL, 0) != 0)
+        return 1;
+    if (ts)
+    {
+        tree_defer(ts, fname, rec);
+        return 0;
+    }
+
+    if (read_frame(sock, &h, &payload) != 0)
+        return 1;
+    free(payload);
+    printf("Server: %s\n", h.type == FT_FILE_OK ? MSG_FILE_OK : MSG_FILE_ERR);
+    if (h.type != FT_FILE_OK)
+        return 1;
+    sig_record_commit(*rec);
+    return 0;
+}
+
+/* Maps a whole file for reading; empty files map to NULL */
+int map_file(const char *fname, unsigned char **data, size_t *fsize, struct stat *sb)
+{
+    int fd = open(fname, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0)
+    {
+        perror("open");
+        if (fd >= 0)
+            close(fd);
+        return -1;
+    }
+    *fsize = (size_t)st.st_size;
+    *data = NULL;
+    if (*fsize > 0)
+    {
+        *data = mmap(NULL, *fsize, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (*data == MAP_FAILED)
+        {
+            perror("mmap");
+            *data = NULL;
+            close(fd);
+            return -1;
+        }
+        madvise(*data, *fsize, MADV_SEQUENTIAL);
+    }
+    close(fd);
+    if (sb)
+        *sb = st;
+    return 0;
+}
+
+int upload_file(const char *fname)
+{
+    /* The server keeps the base name; the state also tells copies of it
+     * in other directories apart */
+    const char *base = strrchr(fname, '/');
+    const char *remote = base ? base + 1 : fname;
+    char abs_path[PATH_MAX];
+    struct stat sb;
+    int have_abs = realpath(fname, abs_path) != NULL;
+    if (have_abs && stat(fname, &sb) == 0)
+    {
+        const sync_state_entry_t *prev = synced_entry(remote, abs_path);
+        if (prev && sync_state_unchanged(prev, &sb))
+        {
+            printf("%s is unchanged since the last sync\n", fname);
+            return 0;
+        }
+    }
+
+    unsigned char *data;
+    size_t fsize;
+    if (map_file(fname, &data, &fsize, &sb) != 0)
+        return 1;
+
+    int sock = connect_server();
+    int codec = CODEC_ZLIB, hash = HASH_MD5;
+    int proto = sock < 0 ? -1 : negotiate_protocol(&sock, &codec, &hash);
+    if (proto < 0)
+    {
+        if (data)
+            munmap(data, fsize);
+        return 1;
+    }
+
+    printf("Performing file synchronization for %s...\n", fname);
+
+    size_t block_size = pick_block_size(proto, fsize);
+    int nblocks = (int)((fsize + block_size - 1) / block_size);
+    printf("Using %s block hashes over %zu byte blocks\n", strong_hash_name(hash), block_size);
+    sig_record_t *rec = have_abs ? sig_record_new(remote, abs_path, &sb, block_size, hash) : NULL;
+    int rc = proto == PROTO_BINARY
+                 ? upload_blocks_binary(sock, data, fname, fsize, nblocks, block_size, codec, hash, NULL, &rec)
+                 : upload_blocks_text(sock, data, fname, fsize, nblocks, hash, NULL, &rec);
+    sig_record_free(rec);
+
+    if (data)
+        munmap(data, fsize);
+    close(sock);
+    return rc;
+}
+
+/* Opens the sync session; files found unchanged never get this far */
+int tree_connect(tree_sync_t *ts)
+{
+    char line[256];
+    ts->sock = connect_server();
+    ts->proto = ts->sock < 0 ? -1 : negotiate_protocol(&ts->sock, &ts->codec, &ts->hash);
+    if (ts->proto < 0)
+        return -1;
+    if (write_n(ts->sock, MSG_SYNC_START "\n", strlen(MSG_SYNC_START) + 1) <= 0 ||
+        read_line(ts->sock, line, sizeof(line)) <= 0 ||
+        strncmp(line, MSG_SYNC_START, strlen(MSG_SYNC_START)) != 0)
+    {
+        printf("Server does not support tree sync\n");
+        close(ts->sock);
+        ts->sock = -1;
+        return -1;
+    }
+    printf("Using %s block hashes\n", strong_hash_name(ts->hash));
+    return 0;
+}
+
+/* Walks dir depth first; rel is its path as the server names it. Returns
+ * -1 once the connection is no longer usable. */
+int tree_walk(tree_sync_t *ts, const char *dir, const char *rel)
+{
+    DIR *d = opendir(dir);
+    if (!d)
+    {
+        perror(dir);
+        ts->skipped++;
+        return 0;
+    }
+    int rc = 0;
+    struct dirent *de;
+    while (rc == 0 && (de = readdir(d)) != NULL)
+    {
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+            continue;
+        char path[PATH_MAX], name[MAX_PATH_LEN];
+        struct stat st;
+        int plen = snprintf(path, sizeof(path), "%s/%s", dir, de->d_name);
+        int nlen = rel[0] ? snprintf(name, sizeof(name), "%s/%s", rel, de->d_name)
+                          : snprintf(name, sizeof(name), "%s", de->d_name);
+        if (plen >= (int)sizeof(path) || nlen >= (int)sizeof(name) || lstat(path, &st) != 0 ||
+            strpbrk(name, " \n"))
+        {
+            printf("Skipping %s\n", path);
+            ts->skipped++;
+            continue;
+        }
+        if (S_ISDIR(st.st_mode))
+        {
+            rc = tree_walk(ts, path, name);
+            continue;
+        }
+        if (!S_ISREG(st.st_mode))
+            continue;
+        const sync_state_entry_t *prev = synced_entry(name, path);
+        if (prev && sync_state_unchanged(prev, &st))
+        {
+            ts->unchanged++;
+            continue;
+        }
+
+        if (ts->sock < 0 && tree_connect(ts) != 0)
+        {
+            rc = -1;
+            break;
+        }
+
+        unsigned char *data;
+        size_t fsize;
+        if (map_file(path, &data, &fsize, &st) != 0)
+        {
+            ts->skipped++;
+            continue;
+        }
+        size_t block_size = pick_block_size(ts->proto, fsize);
+        int nblocks = (int)((fsize + block_size - 1) / block_size);
+        printf("Syncing %s\n", name);
+        sig_record_t *rec = sig_record_new(name, path, &st, block_size, ts->hash);
+        int up = ts->proto == PROTO_BINARY
+                     ? upload_blocks_binary(ts->sock, data, name, fsize, nblocks, block_size, ts->codec,
+                                            ts->hash, ts, &rec)
+                     : upload_blocks_text(ts->sock, data, name, fsize, nblocks, ts->hash, ts, &rec);
+        sig_record_free(rec);
+        if (data)
+            munmap(data, fsize);
+        if (up != 0)
+            rc = -1;
+    }
+    closedir(d);
+    return rc;
+}
+
+/* Files keep their path relative to the directory's parent, so syncing
+ * ~/src/proj lands in syncedData/proj/... */
+int tree_upload(const char *dir)
+{
+    char real[PATH_MAX];
+    struct stat st;
+    if (!realpath(dir, real) || stat(real, &st) != 0 || !S_ISDIR(st.st_mode))
+    {
+        printf("%s is not a directory\n", dir);
+        return 1;
+    }
+    const char *slash = strrchr(real, '/');
+    const char *root = slash ? slash + 1 : real;
+    upload_base = NULL;
+
+    tree_sync_t ts;
+    memset(&ts, 0, sizeof(ts));
+    ts.sock = -1;
+    printf("Syncing tree %s\n", real);
+
+    char line[256];
+    int rc = tree_walk(&ts, real, root);
+    int committed = ts.sock < 0 && rc == 0 ? 0 : -1;
+    if (ts.sock >= 0)
+    {
+        if (rc == 0 && tree_collect(&ts) == 0 &&
+            write_n(ts.sock, MSG_SYNC_END "\n", strlen(MSG_SYNC_END) + 1) > 0 &&
+            read_line(ts.sock, line, sizeof(line)) > 0)
+            sscanf(line, MSG_SYNC_END " %d", &committed);
+        close(ts.sock);
+    }
+    sig_record_free(ts.pending_rec);
+
+    if (committed < 0)
+    {
+        printf("Tree sync aborted after %d files\n", ts.files);
+        return 1;
+    }
+    printf("Tree synced: %d files committed, %d unchanged, %d rejected, %d skipped\n", committed,
+           ts.unchanged, ts.failed, ts.skipped);
+    return ts.failed > 0 ? 1 : 0;
+}
+
+typedef struct
+{
+    int sock;
+    size_t copied_blocks;
+    size_t literal_bytes;
+    size_t wire_bytes;
+} delta_send_ctx_t;
+
+static int send_copy(void *arg, int start_block, int count)
+{
+    delta_send_ctx_t *ctx = arg;
+    char line[64];
+    int len = snprintf(line, sizeof(line), MSG_COPY " %d %d\n", start_block, count);
+    if (write_n(ctx->sock, line, len) != len)
+        return -1;
+    ctx->copied_blocks += count;
+    ctx->wire_bytes += len;
+    return 0;
+}
+
+static int send_literal(void *arg, const unsigned char *data, size_t len)
+{
+    delta_send_ctx_t *ctx = arg;
+    size_t cap = codec_bound(CODEC_ZLIB, len);
+    unsigned char *cbuf = buf_get(cap);
+    int clen = cbuf && block_is_compressible(data, len) ? codec_compress(CODEC_ZLIB, data, len, cbuf, cap) : -1;
+    const unsigned char *payload = cbuf;
+    if (clen < 0 || (size_t)clen >= len)
+    {
+        /* clen == len tells the server the payload is stored raw */
+        payload = data;
+        clen = (int)len;
+    }
+
+    char line[64];
+    int hlen = snprintf(line, sizeof(line), MSG_LITERAL " %d %zu\n", clen, len);
+    int rc = 0;
+    if (write_n(ctx->sock, line, hlen) != hlen ||
+        write_n(ctx->sock, payload, clen) != clen)
+        rc = -1;
+    buf_put(cbuf);
+
+    ctx->literal_bytes += len;
+    ctx->wire_bytes += hlen + clen;
+    return rc;
+}
+
+/* Upload using rolling-checksum matching against the server's copy */
+int delta_upload_file(const char *fname)
+{
+    int fd = open(fname, O_RDONLY);
+    if (fd < 0)
+    {
+        perror("open");
+        return 1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0)
+    {
+        perror("fstat");
+        close(fd);
+        return 1;
+    }
+    size_t fsize = (size_t)st.st_size;
+    unsigned char *data = NULL;
+    if (fsize > 0)
+    {
+        data = mmap(NULL, fsize, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED)
+        {
+            perror("mmap");
+            close(fd);
+            return 1;
+        }
+        madvise(data, fsize, MADV_SEQUENTIAL);
+    }
+    close(fd);
+
+    int sock = connect_server();
+    int codec, hash = HASH_MD5;
+    if (sock < 0 || negotiate_protocol(&sock, &codec, &hash) < 0)
+    {
+        if (sock >= 0)
+            close(sock);
+        if (data)
+            munmap(data, fsize);
+        return 1;
+    }
+
+    printf("Performing delta synchronization for %s...\n", fname);
+
+    char header[2048];
+    int hlen = snprintf(header, sizeof(header), MSG_DELTA_HDR " %s %zu\n", fname, fsize);
+    write_n(sock, header, hlen);
+
+    char line[256];
+    int old_nblocks = 0;
+    size_t old_size = 0;
+    if (read_line(sock, line, sizeof(line)) <= 0 ||
+        sscanf(line, "SIGS %d %zu", &old_nblocks, &old_size) != 2 || old_nblocks < 0)
+    {
+        printf("Invalid response from server: %s\n", line);
+        close(sock);
+        if (data)
+            munmap(data, fsize);
+        return 1;
+    }
+
+    block_sig_t *old_sigs = malloc(sizeof(block_sig_t) * (old_nblocks ? old_nblocks : 1));
+    if (!old_sigs ||
+        read_n(sock, old_sigs, sizeof(block_sig_t) * old_nblocks) != (ssize_t)(sizeof(block_sig_t) * old_nblocks))
+    {
+        fprintf(stderr, "Failed to read server signatures\n");
+        free(old_sigs);
+        close(sock);
+        if (data)
+            munmap(data, fsize);
+        return 1;
+    }
+
+    delta_send_ctx_t ctx = {sock, 0, 0, 0};
+    delta_ops_t ops = {send_copy, send_literal};
+    delta_index_t *di = delta_index_build(old_sigs, old_nblocks, BLOCK_SIZE, old_size, hash);
+    int rc = di ? delta_generate(di, data, fsize, &ops, &ctx) : -1;
+    delta_index_free(di);
+    free(old_sigs);
+    if (data)
+        munmap(data, fsize);
+
+    if (rc != 0)
+    {
+        fprintf(stderr, "Delta generation failed\n");
+        close(sock);
+        return 1;
+    }
+    write_n(sock, MSG_DELTA_END "\n", strlen(MSG_DELTA_END) + 1);
+
+    printf("Reused %zu blocks, sent %zu literal bytes (%zu bytes on the wire)\n",
+           ctx.copied_blocks, ctx.literal_bytes, ctx.wire_bytes);
+
+    if (read_line(sock, line, sizeof(line)) > 0)
+        printf("Server: %s", line);
+
+    close(sock);
+    return strncmp(line, MSG_FILE_OK, strlen(MSG_FILE_OK)) == 0 ? 0 : 1;
+}
+
+/* Upload using content-defined chunk boundaries */
+int cdc_upload_file(const char *fname, size_t avg_size)
+{
+    int fd = open(fname, O_RDONLY);
+    if (fd < 0)
+    {
+        perror("open");
+        return 1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0)
+    {
+        perror("fstat");
+        close(fd);
+        return 1;
+    }
+    size_t fsize = (size_t)st.st_size;
+    unsigned char *data = NULL;
+    if (fsize > 0)
+    {
+        data = mmap(NULL, fsize, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED)
+        {
+            perror("mmap");
+            close(fd);
+            return 1;
+        }
+        madvise(data, fsize, MADV_SEQUENTIAL);
+    }
+    close(fd);
+
+    /* The chunk hashes depend on the algorithm the server agrees to */
+    int rc = 1;
+    int *idxs = NULL;
+    int codec, hash = HASH_MD5;
+    int sock = connect_server();
+    if (sock < 0 || negotiate_protocol(&sock, &codec, &hash) < 0)
+    {
+        if (sock >= 0)
+            close(sock);
+        if (data)
+            munmap(data, fsize);
+        return 1;
+    }
+
+    cdc_params_t params;
+    cdc_init(&params, avg_size);
+
+    int cap = 64, nchunks = 0;
+    chunk_sig_t *csigs = malloc(sizeof(chunk_sig_t) * cap);
+    size_t *offs = malloc(sizeof(size_t) * cap);
+    for (size_t off = 0; csigs && offs && off < fsize;)
+    {
+        size_t len = cdc_next_cut(&params, data + off, fsize - off);
+        if (nchunks == cap)
+        {
+            cap *= 2;
+            chunk_sig_t *ncs = realloc(csigs, sizeof(chunk_sig_t) * cap);
+            size_t *no = realloc(offs, sizeof(size_t) * cap);
+            if (ncs)
+                csigs = ncs;
+            if (no)
+                offs = no;
+            if (!ncs || !no)
+                break;
+        }
+        csigs[nchunks].len = (uint32_t)len;
+        csigs[nchunks].weak = rsync_weak_checksum(data + off, len);
+        strong_hash(hash, data + off, len, csigs[nchunks].strong);
+        offs[nchunks++] = off;
+        off += len;
+    }
+    if (!csigs || !offs || (nchunks > 0 && offs[nchunks - 1] + csigs[nchunks - 1].len != fsize))
+    {
+        fprintf(stderr, "Failed to chunk %s\n", fname);
+        goto out;
+    }
+
+    printf("Performing chunked synchronization for %s (%d chunks, avg %zu bytes)...\n",
+           fname, nchunks, params.avg_size);
+
+    char header[2048];
+    int hlen = snprintf(header, sizeof(header), MSG_CHUNK_HDR " %s %zu %d %zu\n",
+                        fname, fsize, nchunks, params.avg_size);
+    write_n(sock, header, hlen);
+    write_n(sock, csigs, sizeof(chunk_sig_t) * nchunks);
+
+    char line[256];
+    int req_count = 0;
+    if (read_line(sock, line, sizeof(line)) <= 0 ||
+        sscanf(line, "BLOCK_REQ %d", &req_count) != 1 || req_count < 0 || req_count > nchunks)
+    {
+        printf("Invalid response from server: %s\n", line);
+        goto out;
+    }
+    idxs = malloc(sizeof(int) * (req_count ? req_count : 1));
+    if (!idxs || read_index_list(sock, idxs, req_count) != req_count)
+    {
+        fprintf(stderr, "Failed to read requested chunk list\n");
+        goto out;
+    }
+    printf("Server requested %d of %d chunks\n", req_count, nchunks);
+
+    size_t wire = 0;
+    for (int i = 0; i < req_count; i++)
+    {
+        int ci = idxs[i];
+        if (ci < 0 || ci >= nchunks)
+            goto out;
+        const unsigned char *chunk = data + offs[ci];
+        size_t len = csigs[ci].len;
+
+        unsigned char *cbuf = buf_get(codec_bound(CODEC_ZLIB, len));
+        int clen = -1;
+        if (cbuf && block_is_compressible(chunk, len))
+            clen = codec_compress(CODEC_ZLIB, chunk, len, cbuf, codec_bound(CODEC_ZLIB, len));
+        const unsigned char *payload = cbuf;
+        if (clen < 0 || (size_t)clen >= len)
+        {
+            payload = chunk;
+            clen = (int)len;
+        }
+
+        char bheader[128];
+        int blen = snprintf(bheader, sizeof(bheader), "BLOCK_DATA %d %d %zu\n", ci, clen, len);
+        write_n(sock, bheader, blen);
+        write_n(sock, payload, clen);
+        buf_put(cbuf);
+        wire += blen + clen;
+    }
+    write_n(sock, "BLOCK_END\n", 10);
+    printf("Sent %zu bytes of chunk data\n", wire);
+
+    if (read_line(sock, line, sizeof(line)) > 0)
+    {
+        printf("Server: %s", line);
+        if (strncmp(line, MSG_FILE_OK, strlen(MSG_FILE_OK)) == 0)
+            rc = 0;
+    }
+
+out:
+    if (sock >= 0)
+        close(sock);
+    free(idxs);
+    free(csigs);
+    free(offs);
+    if (data)
+        munmap(data, fsize);
+    return rc;
+}
+
+/* --block-size=N fixes the block size, --block-size=MIN:MAX bounds it */
+int parse_block_size(const char *arg)
+{
+    char *end;
+    unsigned long lo = strtoul(arg, &end, 10), hi = lo;
+    if (*end == ':')
+        hi = strtoul(end + 1, &end, 10);
+    if (*end != '\0' || lo < BLOCK_SIZE_MIN || hi > BLOCK_SIZE_MAX || lo > hi)
+    {
+        printf("Block sizes must lie within %d..%d\n", BLOCK_SIZE_MIN, BLOCK_SIZE_MAX);
+        return -1;
+    }
+    block_size_min = lo;
+    block_size_max = hi;
+    return 0;
+}
+
+/* Prints the server's STATS report */
+int print_stats(int prometheus)
+{
+    int sock = connect_server();
+    if (sock < 0)
+        return 1;
+    const char *req = prometheus ? MSG_STATS " prometheus\n" : MSG_STATS "\n";
+    if (write_n(sock, req, strlen(req)) != (ssize_t)strlen(req))
+    {
+        close(sock);
+        return 1;
+    }
+    char buf[4096];
+    ssize_t n;
+    while ((n = read(sock, buf, sizeof(buf))) > 0)
+        fwrite(buf, 1, (size_t)n, stdout);
+    close(sock);
+    return n < 0 ? 1 : 0;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 2)
+    {
+        printf("Usage: %s <filename> [mode] [options]\n", argv[0]);
+        printf("       %s --stats[=prometheus] [--port=N]  Print the server's metrics\n", argv[0]);
+        printf("Modes (default: upload/sync file):\n");
+        printf("  --get      Download file from server\n");
+        printf("  --get=N    Download over N parallel range requests\n");
+        printf("  --resume   Continue an interrupted download\n");
+        printf("  --delta    Upload only bytes not found in the server copy\n");
+        printf("  --cdc[=N]  Upload using content-defined chunks (avg N bytes)\n");
+        printf("  --tree     Sync every file below directory <filename> over one connection\n");
+        printf("Options:\n");
+        printf("  --codec=C  Prefer block codecs C (%s)\n", CODEC_DEFAULT_PREFS ",none");
+        printf("  --base=F   Compress changed blocks against old copy F\n");
+        printf("  --hash=H   Prefer strong hashes H (%s,xxh3,murmur3); murmur3 and\n"
+               "             xxh3 are fast but only safe on trusted networks\n", HASH_DEFAULT_PREFS);
+        printf("  --block-size=N[:M]  Use N byte blocks, or sizes from N to M scaled with\n"
+               "             the file (default %d:%d)\n", BLOCK_SIZE_MIN, BLOCK_SIZE_MAX);
+        printf("  --state=F  Keep the sync state in F (default ~/%s)\n", SYNC_STATE_FILE);
+        printf("  --no-state Upload and hash every file, even if unchanged\n");
+        printf("  --port=N   Connect to port N instead of %d\n", SERVER_PORT);
+        return 1;
+    }
+
+    const char *fname = argv[1];
+    const char *mode = NULL;
+    const char *state_path = NULL;
+    int use_state = 1;
+    for (int i = 2; i < argc; i++)
+    {
+        if (strncmp(argv[i], "--codec=", 8) == 0)
+            codec_prefs = argv[i] + 8;
+        else if (strncmp(argv[i], "--base=", 7) == 0)
+            upload_base = argv[i] + 7;
+        else if (strncmp(argv[i], "--hash=", 7) == 0)
+            hash_prefs = argv[i] + 7;
+        else if (strncmp(argv[i], "--block-size=", 13) == 0)
+        {
+            if (parse_block_size(argv[i] + 13) != 0)
+                return 1;
+        }
+        else if (strncmp(argv[i], "--state=", 8) == 0)
+            state_path = argv[i] + 8;
+        else if (strcmp(argv[i], "--no-state") == 0)
+            use_state = 0;
+        else if (strncmp(argv[i], "--port=", 7) == 0)
+            server_port = atoi(argv[i] + 7);
+        else
+            mode = argv[i];
+    }
+
+    if (strcmp(fname, "--stats") == 0 || strcmp(fname, "--stats=prometheus") == 0)
+        return print_stats(fname[7] == '=');
+
+    /* Plain and tree uploads skip files that have not changed since they
+     * were last synced */
+    if (use_state && (!mode || strcmp(mode, "--tree") == 0))
+    {
+        char def[PATH_MAX];
+        const char *home = getenv("HOME");
+        if (!state_path)
+        {
+            snprintf(def, sizeof(def), "%s/%s", home ? home : ".", SYNC_STATE_FILE);
+            state_path = def;
+        }
+        sync_state = sync_state_open(state_path);
+        int rc = mode ? tree_upload(fname) : upload_file(fname);
+        if (sync_state)
+        {
+            sync_state_save(sync_state);
+            sync_state_close(sync_state);
+        }
+        return rc;
+    }
+
+    if (mode && strncmp(mode, "--get", 5) == 0)
+        return download_file(fname, 0, mode[5] == '=' ? atoi(mode + 6) : 1);
+    else if (mode && strcmp(mode, "--resume") == 0)
+        return download_file(fname, 1, 1);
+    else if (mode && strcmp(mode, "--delta") == 0)
+        return delta_upload_file(fname);
+    else if (mode && strcmp(mode, "--tree") == 0)
+        return tree_upload(fname);
+    else if (mode && strncmp(mode, "--cdc", 5) == 0)
+        return cdc_upload_file(fname, mode[5] == '=' ? strtoul(mode + 6, NULL, 10) : CDC_DEFAULT_AVG);
+    else
+        return upload_file(fname);
+}
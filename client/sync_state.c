@@ -0,0 +1,316 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include "sync_state.h"
+
+/* File layout: a header, then per entry a state_rec_t followed by the key,
+ * the fingerprints and the signatures, each padded to 8 bytes so the
+ * mapped file is used in place. */
+typedef struct
+{
+    uint32_t magic;
+    uint32_t version;
+    uint64_t count;
+} state_hdr_t;
+
+typedef struct
+{
+    uint64_t size;
+    int64_t mtime_ns;
+    int64_t ctime_ns;
+    uint64_t ino;
+    uint64_t dev;
+    uint32_t key_len;
+    uint32_t nblocks;
+    uint32_t hash_alg;
+    uint32_t block_size;        /* 0 in files from before it varied: BLOCK_SIZE */
+    unsigned char digest[16];
+} state_rec_t;
+
+typedef struct
+{
+    sync_state_entry_t e;
+    void *owned;                /* key, fps and sigs of entries put since open */
+} state_slot_t;
+
+struct sync_state
+{
+    char *path;
+    unsigned char *map;
+    size_t map_size;
+    state_slot_t *entries;
+    int count, cap;
+    int *slots;                 /* open addressing over entries, -1 = empty */
+    size_t mask;
+    int dirty;
+};
+
+#define PAD8(n) (((n) + 7) & ~(size_t)7)
+
+static uint32_t key_hash(const char *s)
+{
+    uint32_t h = 2166136261u;
+    while (*s)
+    {
+        h ^= (unsigned char)*s++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static int find_slot(const sync_state_t *st, const char *key)
+{
+    for (size_t s = key_hash(key) & st->mask; st->slots[s] >= 0; s = (s + 1) & st->mask)
+        if (strcmp(st->entries[st->slots[s]].e.key, key) == 0)
+            return st->slots[s];
+    return -1;
+}
+
+static void insert_slot(sync_state_t *st, int idx)
+{
+    size_t s = key_hash(st->entries[idx].e.key) & st->mask;
+    while (st->slots[s] >= 0)
+        s = (s + 1) & st->mask;
+    st->slots[s] = idx;
+}
+
+static int grow(sync_state_t *st)
+{
+    if (st->count == st->cap)
+    {
+        int ncap = st->cap ? st->cap * 2 : 256;
+        state_slot_t *n = realloc(st->entries, sizeof(state_slot_t) * (size_t)ncap);
+        if (!n)
+            return -1;
+        st->entries = n;
+        st->cap = ncap;
+    }
+    if ((size_t)(st->count + 1) * 2 > st->mask + 1)
+    {
+        size_t nsize = (st->mask + 1) * 2;
+        int *n = malloc(sizeof(int) * nsize);
+        if (!n)
+            return -1;
+        free(st->slots);
+        st->slots = n;
+        st->mask = nsize - 1;
+        for (size_t i = 0; i < nsize; i++)
+            st->slots[i] = -1;
+        for (int i = 0; i < st->count; i++)
+            insert_slot(st, i);
+    }
+    return 0;
+}
+
+static void load(sync_state_t *st)
+{
+    int fd = open(st->path, O_RDONLY);
+    struct stat sb;
+    if (fd < 0)
+        return;
+    if (fstat(fd, &sb) != 0 || (size_t)sb.st_size < sizeof(state_hdr_t))
+    {
+        close(fd);
+        return;
+    }
+    st->map_size = (size_t)sb.st_size;
+    st->map = mmap(NULL, st->map_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (st->map == MAP_FAILED)
+    {
+        st->map = NULL;
+        return;
+    }
+
+    const state_hdr_t *h = (const state_hdr_t *)st->map;
+    if (h->magic != SYNC_STATE_MAGIC || h->version != SYNC_STATE_VERSION)
+    {
+        printf("Ignoring sync state %s from another version\n", st->path);
+        return;
+    }
+    size_t off = sizeof(state_hdr_t);
+    for (uint64_t i = 0; i < h->count; i++)
+    {
+        if (st->map_size - off < sizeof(state_rec_t))
+            break;
+        const state_rec_t *r = (const state_rec_t *)(st->map + off);
+        size_t key_off = off + sizeof(state_rec_t);
+        size_t fps_off = key_off + PAD8((size_t)r->key_len + 1);
+        size_t sigs_off = fps_off + sizeof(uint64_t) * r->nblocks;
+        size_t end = sigs_off + PAD8(sizeof(block_sig_t) * r->nblocks);
+        if (end > st->map_size || end < off || st->map[key_off + r->key_len] != '\0' || grow(st) != 0)
+            break;
+
+        state_slot_t *s = &st->entries[st->count];
+        memset(s, 0, sizeof(*s));
+        s->e.key = (const char *)st->map + key_off;
+        s->e.size = r->size;
+        s->e.mtime_ns = r->mtime_ns;
+        s->e.ctime_ns = r->ctime_ns;
+        s->e.ino = r->ino;
+        s->e.dev = r->dev;
+        s->e.hash_alg = (int)r->hash_alg;
+        s->e.block_size = r->block_size ? r->block_size : BLOCK_SIZE;
+        memcpy(s->e.digest, r->digest, 16);
+        s->e.nblocks = (int)r->nblocks;
+        s->e.fps = r->nblocks ? (const uint64_t *)(st->map + fps_off) : NULL;
+        s->e.sigs = r->nblocks ? (const block_sig_t *)(st->map + sigs_off) : NULL;
+        insert_slot(st, st->count++);
+        off = end;
+    }
+}
+
+sync_state_t *sync_state_open(const char *path)
+{
+    sync_state_t *st = calloc(1, sizeof(*st));
+    if (!st || !(st->path = strdup(path)))
+    {
+        free(st);
+        return NULL;
+    }
+    st->mask = 255;
+    st->slots = malloc(sizeof(int) * (st->mask + 1));
+    if (!st->slots)
+    {
+        sync_state_close(st);
+        return NULL;
+    }
+    for (size_t i = 0; i <= st->mask; i++)
+        st->slots[i] = -1;
+    load(st);
+    return st;
+}
+
+void sync_state_close(sync_state_t *st)
+{
+    if (!st)
+        return;
+    for (int i = 0; i < st->count; i++)
+        free(st->entries[i].owned);
+    if (st->map)
+        munmap(st->map, st->map_size);
+    free(st->entries);
+    free(st->slots);
+    free(st->path);
+    free(st);
+}
+
+const sync_state_entry_t *sync_state_find(sync_state_t *st, const char *key)
+{
+    int i = find_slot(st, key);
+    return i >= 0 ? &st->entries[i].e : NULL;
+}
+
+int sync_state_put(sync_state_t *st, const sync_state_entry_t *e)
+{
+    size_t key_len = strlen(e->key);
+    size_t fps_len = sizeof(uint64_t) * (size_t)e->nblocks;
+    size_t sigs_len = sizeof(block_sig_t) * (size_t)e->nblocks;
+    unsigned char *mem = malloc(PAD8(key_len + 1) + fps_len + sigs_len);
+    if (!mem)
+        return -1;
+    memcpy(mem, e->key, key_len + 1);
+    if (e->nblocks)
+    {
+        memcpy(mem + PAD8(key_len + 1), e->fps, fps_len);
+        memcpy(mem + PAD8(key_len + 1) + fps_len, e->sigs, sigs_len);
+    }
+
+    int i = find_slot(st, e->key), fresh = i < 0;
+    if (fresh)
+    {
+        if (grow(st) != 0)
+        {
+            free(mem);
+            return -1;
+        }
+        i = st->count++;
+        st->entries[i].owned = NULL;
+    }
+    state_slot_t *s = &st->entries[i];
+    free(s->owned);
+    s->owned = mem;
+    s->e = *e;
+    s->e.key = (const char *)mem;
+    s->e.fps = e->nblocks ? (const uint64_t *)(mem + PAD8(key_len + 1)) : NULL;
+    s->e.sigs = e->nblocks ? (const block_sig_t *)(mem + PAD8(key_len + 1) + fps_len) : NULL;
+    if (fresh)
+        insert_slot(st, i);
+    st->dirty = 1;
+    return 0;
+}
+
+/* Writes every entry to a new file and renames it over the old one; the
+ * map stays valid for the entries that still point into it. */
+int sync_state_save(sync_state_t *st)
+{
+    if (!st->dirty)
+        return 0;
+    char tmp[4096];
+    snprintf(tmp, sizeof(tmp), "%s.%d.tmp", st->path, (int)getpid());
+    FILE *f = fopen(tmp, "wb");
+    if (!f)
+    {
+        perror("fopen sync state");
+        return -1;
+    }
+
+    static const unsigned char zeros[8];
+    state_hdr_t h = { SYNC_STATE_MAGIC, SYNC_STATE_VERSION, (uint64_t)st->count };
+    int ok = fwrite(&h, sizeof(h), 1, f) == 1;
+    for (int i = 0; ok && i < st->count; i++)
+    {
+        const sync_state_entry_t *e = &st->entries[i].e;
+        state_rec_t r;
+        memset(&r, 0, sizeof(r));
+        r.size = e->size;
+        r.mtime_ns = e->mtime_ns;
+        r.ctime_ns = e->ctime_ns;
+        r.ino = e->ino;
+        r.dev = e->dev;
+        r.key_len = (uint32_t)strlen(e->key);
+        r.nblocks = (uint32_t)e->nblocks;
+        r.hash_alg = (uint32_t)e->hash_alg;
+        r.block_size = e->block_size;
+        memcpy(r.digest, e->digest, 16);
+        size_t sigs_len = sizeof(block_sig_t) * (size_t)e->nblocks;
+        ok = fwrite(&r, sizeof(r), 1, f) == 1 &&
+             fwrite(e->key, 1, r.key_len + 1, f) == r.key_len + 1 &&
+             fwrite(zeros, 1, PAD8(r.key_len + 1) - (r.key_len + 1), f) ==
+                 PAD8(r.key_len + 1) - (r.key_len + 1) &&
+             fwrite(e->fps, sizeof(uint64_t), (size_t)e->nblocks, f) == (size_t)e->nblocks &&
+             fwrite(e->sigs, 1, sigs_len, f) == sigs_len &&
+             fwrite(zeros, 1, PAD8(sigs_len) - sigs_len, f) == PAD8(sigs_len) - sigs_len;
+    }
+    if (fclose(f) != 0)
+        ok = 0;
+    if (!ok || rename(tmp, st->path) != 0)
+    {
+        perror("save sync state");
+        unlink(tmp);
+        return -1;
+    }
+    st->dirty = 0;
+    return 0;
+}
+
+void sync_state_stat(sync_state_entry_t *e, const struct stat *sb)
+{
+    e->size = (uint64_t)sb->st_size;
+    e->mtime_ns = (int64_t)sb->st_mtim.tv_sec * 1000000000 + sb->st_mtim.tv_nsec;
+    e->ctime_ns = (int64_t)sb->st_ctim.tv_sec * 1000000000 + sb->st_ctim.tv_nsec;
+    e->ino = (uint64_t)sb->st_ino;
+    e->dev = (uint64_t)sb->st_dev;
+}
+
+int sync_state_unchanged(const sync_state_entry_t *e, const struct stat *sb)
+{
+    sync_state_entry_t now;
+    sync_state_stat(&now, sb);
+    return e->size == now.size && e->mtime_ns == now.mtime_ns && e->ctime_ns == now.ctime_ns &&
+           e->ino == now.ino && e->dev == now.dev;
+}
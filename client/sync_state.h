@@ -0,0 +1,53 @@
+#ifndef SYNC_STATE_H
+#define SYNC_STATE_H
+
+#include <limits.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include "../common_utils/protocol.h"
+
+#define SYNC_STATE_MAGIC 0x54534c52   /* "RLST" */
+#define SYNC_STATE_VERSION 1
+#define SYNC_STATE_FILE ".rsync_lite_state"
+#define SYNC_KEY_LEN (MAX_PATH_LEN + PATH_MAX + 64)
+
+/* Files with fewer blocks are cheap to rehash; only their stat fields
+ * and digest are kept. */
+#define SYNC_STATE_MIN_SIG_BLOCKS 256
+
+/* What the client knew about a file when it was last synced successfully */
+typedef struct
+{
+    const char *key;            /* server address, remote name and absolute local path, '\n' apart */
+    uint64_t size;
+    int64_t mtime_ns;
+    int64_t ctime_ns;
+    uint64_t ino;
+    uint64_t dev;
+    int hash_alg;
+    unsigned char digest[16];   /* file_digest of the signatures */
+    uint32_t block_size;        /* of the blocks the signatures cover */
+    int nblocks;                /* signatures kept below, 0 if none */
+    const block_sig_t *sigs;
+    const uint64_t *fps;        /* block_fingerprint of each block */
+} sync_state_entry_t;
+
+/* Client-side sync state, keyed by server, remote name and local path.
+ * The file is mapped and entries point into it; changes are kept in
+ * memory and written back as a new file by sync_state_save. Entries
+ * returned by find are valid until the next put. */
+typedef struct sync_state sync_state_t;
+
+sync_state_t *sync_state_open(const char *path);
+void sync_state_close(sync_state_t *st);
+
+const sync_state_entry_t *sync_state_find(sync_state_t *st, const char *key);
+int sync_state_put(sync_state_t *st, const sync_state_entry_t *e);
+int sync_state_save(sync_state_t *st);
+
+/* Fills the stat fields of e from sb */
+void sync_state_stat(sync_state_entry_t *e, const struct stat *sb);
+/* True if the file behind sb still looks like the one e was taken from */
+int sync_state_unchanged(const sync_state_entry_t *e, const struct stat *sb);
+
+#endif
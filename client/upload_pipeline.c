@@ -0,0 +1,270 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include "upload_pipeline.h"
+
+#define PIPE_MAX_THREADS 64
+#define PIPE_MAX_IOV 64
+
+/* Jobs move through a ring of slots: the reader may fault in job j once
+ * job j - nslots is on the wire, a worker may encode it once it is read,
+ * and the sender takes the slots back in job order. */
+typedef struct
+{
+    const unsigned char *data;
+    size_t fsize, block_size;
+    const int *idxs;
+    int n, njobs, nslots;
+    int job_blocks;
+    const block_encoder_t *enc;
+    unsigned char *bufs;
+    size_t buf_size;
+    ssize_t *slot_len;  /* wire bytes of the job in each slot, -1 if encoding failed */
+    int *slot_job;      /* job encoded into each slot, -1 while in progress */
+    int next_read;      /* jobs whose blocks are faulted in */
+    int next_job;       /* next job to hand to a worker */
+    int sent;           /* jobs written to the socket */
+    int stop;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} pipeline_t;
+
+static int write_iov(int fd, struct iovec *iov, int cnt)
+{
+    while (cnt > 0)
+    {
+        ssize_t w = writev(fd, iov, cnt);
+        if (w <= 0)
+            return -1;
+        while (cnt > 0 && (size_t)w >= iov->iov_len)
+        {
+            w -= (ssize_t)iov->iov_len;
+            iov++;
+            cnt--;
+        }
+        if (cnt > 0)
+        {
+            iov->iov_base = (char *)iov->iov_base + w;
+            iov->iov_len -= (size_t)w;
+        }
+    }
+    return 0;
+}
+
+/* Pulls the pages of job j into memory, one run of adjacent blocks at a
+ * time, so workers never stall on a page fault */
+static void read_job(const pipeline_t *p, int j)
+{
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    int last = (j + 1) * p->job_blocks < p->n ? (j + 1) * p->job_blocks : p->n;
+    unsigned char touch = 0;
+    for (int k = j * p->job_blocks; k < last;)
+    {
+        int run = k + 1;
+        while (run < last && p->idxs[run] == p->idxs[run - 1] + 1)
+            run++;
+        size_t start = (size_t)p->idxs[k] * p->block_size & ~(page - 1);
+        size_t end = (size_t)(p->idxs[run - 1] + 1) * p->block_size;
+        if (end > p->fsize)
+            end = p->fsize;
+        if (start < end)
+        {
+            madvise((void *)(p->data + start), end - start, MADV_WILLNEED);
+            for (size_t off = start; off < end; off += page)
+                touch ^= ((const volatile unsigned char *)p->data)[off];
+        }
+        k = run;
+    }
+    (void)touch;
+}
+
+static ssize_t encode_job(const pipeline_t *p, void *ctx, int j, unsigned char *out)
+{
+    int last = (j + 1) * p->job_blocks < p->n ? (j + 1) * p->job_blocks : p->n;
+    size_t len = 0;
+    for (int k = j * p->job_blocks; k < last; k++)
+    {
+        ssize_t w = p->enc->encode(p->enc->arg, ctx, k, out + len);
+        if (w < 0 || (size_t)w > p->enc->max_wire)
+            return -1;
+        len += (size_t)w;
+    }
+    return (ssize_t)len;
+}
+
+static void *reader_main(void *arg)
+{
+    pipeline_t *p = arg;
+    pthread_mutex_lock(&p->lock);
+    while (!p->stop && p->next_read < p->njobs)
+    {
+        if (p->next_read >= p->sent + p->nslots)
+        {
+            pthread_cond_wait(&p->cond, &p->lock);
+            continue;
+        }
+        int j = p->next_read;
+        pthread_mutex_unlock(&p->lock);
+
+        read_job(p, j);
+
+        pthread_mutex_lock(&p->lock);
+        p->next_read = j + 1;
+        pthread_cond_broadcast(&p->cond);
+    }
+    pthread_mutex_unlock(&p->lock);
+    return NULL;
+}
+
+static void *worker_main(void *arg)
+{
+    pipeline_t *p = arg;
+    void *ctx = p->enc->ctx_new ? p->enc->ctx_new(p->enc->arg) : NULL;
+
+    pthread_mutex_lock(&p->lock);
+    while (!p->stop && p->next_job < p->njobs)
+    {
+        if (p->next_job >= p->next_read)
+        {
+            pthread_cond_wait(&p->cond, &p->lock);
+            continue;
+        }
+        int j = p->next_job++;
+        int slot = j % p->nslots;
+        pthread_mutex_unlock(&p->lock);
+
+        ssize_t len = encode_job(p, ctx, j, p->bufs + (size_t)slot * p->buf_size);
+
+        pthread_mutex_lock(&p->lock);
+        p->slot_len[slot] = len;
+        p->slot_job[slot] = j;
+        pthread_cond_broadcast(&p->cond);
+    }
+    pthread_mutex_unlock(&p->lock);
+    if (ctx && p->enc->ctx_free)
+        p->enc->ctx_free(ctx);
+    return NULL;
+}
+
+/* A single job is encoded and sent on the calling thread */
+static int run_inline(int sock, pipeline_t *p)
+{
+    void *ctx = p->enc->ctx_new ? p->enc->ctx_new(p->enc->arg) : NULL;
+    unsigned char *buf = malloc(p->buf_size);
+    ssize_t len = buf ? encode_job(p, ctx, 0, buf) : -1;
+    struct iovec iov = {buf, len > 0 ? (size_t)len : 0};
+    int rc = len < 0 ? -1 : write_iov(sock, &iov, 1);
+    free(buf);
+    if (ctx && p->enc->ctx_free)
+        p->enc->ctx_free(ctx);
+    return rc;
+}
+
+int upload_pipeline_run(int sock, const unsigned char *data, size_t fsize, size_t block_size,
+                        const int *idxs, int n, const block_encoder_t *enc, int nthreads)
+{
+    pipeline_t p;
+    memset(&p, 0, sizeof(p));
+    p.data = data;
+    p.fsize = fsize;
+    p.block_size = block_size;
+    p.idxs = idxs;
+    p.n = n;
+    p.enc = enc;
+    p.job_blocks = (int)(PIPE_JOB_BYTES / block_size);
+    if (p.job_blocks > PIPE_JOB_BLOCKS)
+        p.job_blocks = PIPE_JOB_BLOCKS;
+    if (p.job_blocks < 1)
+        p.job_blocks = 1;
+    p.njobs = (n + p.job_blocks - 1) / p.job_blocks;
+    p.buf_size = enc->max_wire * (size_t)p.job_blocks;
+    if (p.njobs == 0)
+        return 0;
+    if (p.njobs == 1)
+        return run_inline(sock, &p);
+
+    if (nthreads <= 0)
+        nthreads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (nthreads > PIPE_MAX_THREADS)
+        nthreads = PIPE_MAX_THREADS;
+    if (nthreads > p.njobs)
+        nthreads = p.njobs;
+    if (nthreads < 1)
+        nthreads = 1;
+
+    p.nslots = nthreads * 2 + 2;
+    p.bufs = malloc(p.buf_size * (size_t)p.nslots);
+    p.slot_len = malloc(sizeof(ssize_t) * (size_t)p.nslots);
+    p.slot_job = malloc(sizeof(int) * (size_t)p.nslots);
+    if (!p.bufs || !p.slot_len || !p.slot_job)
+    {
+        free(p.bufs);
+        free(p.slot_len);
+        free(p.slot_job);
+        return -1;
+    }
+    for (int i = 0; i < p.nslots; i++)
+        p.slot_job[i] = -1;
+    pthread_mutex_init(&p.lock, NULL);
+    pthread_cond_init(&p.cond, NULL);
+
+    pthread_t reader, tids[PIPE_MAX_THREADS];
+    int have_reader = pthread_create(&reader, NULL, reader_main, &p) == 0;
+    int started = 0;
+    for (; have_reader && started < nthreads; started++)
+        if (pthread_create(&tids[started], NULL, worker_main, &p) != 0)
+            break;
+
+    int rc = started > 0 ? 0 : -1;
+    for (int j = 0; rc == 0 && j < p.njobs;)
+    {
+        /* Every finished job in order goes out in one writev */
+        pthread_mutex_lock(&p.lock);
+        while (p.slot_job[j % p.nslots] != j)
+            pthread_cond_wait(&p.cond, &p.lock);
+        int cnt = 1;
+        while (cnt < PIPE_MAX_IOV && j + cnt < p.njobs && p.slot_job[(j + cnt) % p.nslots] == j + cnt)
+            cnt++;
+        pthread_mutex_unlock(&p.lock);
+
+        struct iovec iov[PIPE_MAX_IOV];
+        for (int i = 0; i < cnt; i++)
+        {
+            int slot = (j + i) % p.nslots;
+            if (p.slot_len[slot] < 0)
+                rc = -1;
+            iov[i].iov_base = p.bufs + (size_t)slot * p.buf_size;
+            iov[i].iov_len = p.slot_len[slot] > 0 ? (size_t)p.slot_len[slot] : 0;
+        }
+        if (rc == 0)
+            rc = write_iov(sock, iov, cnt);
+
+        pthread_mutex_lock(&p.lock);
+        for (int i = 0; i < cnt; i++)
+            p.slot_job[(j + i) % p.nslots] = -1;
+        p.sent = j + cnt;
+        pthread_cond_broadcast(&p.cond);
+        pthread_mutex_unlock(&p.lock);
+        j += cnt;
+    }
+
+    pthread_mutex_lock(&p.lock);
+    p.stop = 1;
+    pthread_cond_broadcast(&p.cond);
+    pthread_mutex_unlock(&p.lock);
+    if (have_reader)
+        pthread_join(reader, NULL);
+    for (int i = 0; i < started; i++)
+        pthread_join(tids[i], NULL);
+
+    pthread_mutex_destroy(&p.lock);
+    pthread_cond_destroy(&p.cond);
+    free(p.bufs);
+    free(p.slot_len);
+    free(p.slot_job);
+    return rc;
+}
@@ -0,0 +1,34 @@
+#ifndef UPLOAD_PIPELINE_H
+#define UPLOAD_PIPELINE_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+/* Requested blocks handled per job, fewer for large blocks so a job covers
+ * PIPE_JOB_BYTES at most; a job is the unit each stage passes on */
+#define PIPE_JOB_BLOCKS 64
+#define PIPE_JOB_BYTES (64 * 1024)
+
+/* Writes the complete wire form of the k-th requested block (header and
+ * payload) to out, which holds max_wire bytes. Returns its length or -1.
+ * ctx belongs to the calling worker. */
+typedef ssize_t (*block_encode_fn)(void *arg, void *ctx, int k, unsigned char *out);
+
+typedef struct
+{
+    block_encode_fn encode;
+    void *(*ctx_new)(void *arg);    /* per-worker state, may be NULL */
+    void (*ctx_free)(void *ctx);
+    void *arg;
+    size_t max_wire;
+} block_encoder_t;
+
+/* Sends blocks idxs[0..n) of the mapped file in request order. A reader
+ * thread faults in coalesced runs of requested blocks ahead of nthreads
+ * compression workers (0 = one per CPU); the calling thread writes the
+ * finished jobs to sock with one writev per batch. A ring of job buffers
+ * bounds how far the reader and workers run ahead of the socket. */
+int upload_pipeline_run(int sock, const unsigned char *data, size_t fsize, size_t block_size,
+                        const int *idxs, int n, const block_encoder_t *enc, int nthreads);
+
+#endif
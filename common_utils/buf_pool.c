@@ -0,0 +1,84 @@
+#include <stdlib.h>
+#include <pthread.h>
+#include "buf_pool.h"
+
+#define POOL_MIN_SHIFT 12
+#define POOL_MAX_SHIFT 20
+#define POOL_CLASSES (POOL_MAX_SHIFT - POOL_MIN_SHIFT + 1)
+#define POOL_KEEP 8                     /* buffers cached per size ... */
+#define POOL_KEEP_BYTES (2 << 20)       /* ... up to this many bytes */
+#define POOL_UNPOOLED -1
+
+/* Precedes every buffer; 16 bytes keep the caller's data malloc-aligned */
+typedef union {
+    int cls;
+    long double align;
+} buf_hdr_t;
+
+typedef struct {
+    buf_hdr_t *free[POOL_CLASSES][POOL_KEEP];
+    int nfree[POOL_CLASSES];
+} buf_cache_t;
+
+static __thread buf_cache_t *cache;
+static pthread_key_t cache_key;
+static pthread_once_t cache_once = PTHREAD_ONCE_INIT;
+
+static void cache_free(void *arg) {
+    buf_cache_t *c = arg;
+    for (int i = 0; i < POOL_CLASSES; i++)
+        for (int k = 0; k < c->nfree[i]; k++) free(c->free[i][k]);
+    free(c);
+    cache = NULL;
+}
+
+static void cache_key_init(void) {
+    pthread_key_create(&cache_key, cache_free);
+}
+
+/* The calling thread's cache, freed with the thread */
+static buf_cache_t *my_cache(void) {
+    if (cache) return cache;
+    pthread_once(&cache_once, cache_key_init);
+    cache = calloc(1, sizeof(*cache));
+    if (cache) pthread_setspecific(cache_key, cache);
+    return cache;
+}
+
+static int keep_limit(int cls) {
+    int n = POOL_KEEP_BYTES >> (cls + POOL_MIN_SHIFT);
+    return n < 1 ? 1 : n > POOL_KEEP ? POOL_KEEP : n;
+}
+
+void *buf_get(size_t len) {
+    int cls = 0;
+    while (cls < POOL_CLASSES && ((size_t)1 << (cls + POOL_MIN_SHIFT)) < len) cls++;
+
+    buf_hdr_t *h;
+    if (cls == POOL_CLASSES) {
+        h = malloc(sizeof(*h) + len);
+        if (!h) return NULL;
+        h->cls = POOL_UNPOOLED;
+        return h + 1;
+    }
+    buf_cache_t *c = my_cache();
+    if (c && c->nfree[cls] > 0) {
+        h = c->free[cls][--c->nfree[cls]];
+    } else {
+        h = malloc(sizeof(*h) + ((size_t)1 << (cls + POOL_MIN_SHIFT)));
+        if (!h) return NULL;
+        h->cls = cls;
+    }
+    return h + 1;
+}
+
+void buf_put(void *buf) {
+    if (!buf) return;
+    buf_hdr_t *h = (buf_hdr_t *)buf - 1;
+    buf_cache_t *c = h->cls == POOL_UNPOOLED ? NULL : my_cache();
+    if (c && c->nfree[h->cls] < keep_limit(h->cls)) {
+        c->free[h->cls][c->nfree[h->cls]++] = h;
+        return;
+    }
+    free(h);
+}
@@ -0,0 +1,14 @@
+#ifndef BUF_POOL_H
+#define BUF_POOL_H
+
+#include <stddef.h>
+
+/* Scratch buffers for blocks, compressed payloads and batches, recycled
+ * through a per-thread cache instead of the allocator. Sizes are rounded
+ * up to a power of two from 4 KB to 1 MB and each thread keeps a few
+ * buffers of every size; larger requests go straight to malloc. A buffer
+ * may be returned on another thread than the one that took it. */
+void *buf_get(size_t len);
+void buf_put(void *buf);
+
+#endif
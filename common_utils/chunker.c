@@ -0,0 +1,53 @@
+#include "chunker.h"
+
+static uint64_t splitmix64(uint64_t *state) {
+    uint64_t z = (*state += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+static uint64_t top_bits(int n) {
+    if (n <= 0) return 0;
+    if (n >= 64) return ~0ULL;
+    return ((1ULL << n) - 1) << (64 - n);
+}
+
+void cdc_init(cdc_params_t *p, size_t avg_size) {
+    if (avg_size < CDC_MIN_AVG) avg_size = CDC_MIN_AVG;
+    if (avg_size > CDC_MAX_AVG) avg_size = CDC_MAX_AVG;
+
+    int bits = 0;
+    while (((size_t)1 << (bits + 1)) <= avg_size) bits++;
+
+    p->avg_size = (size_t)1 << bits;
+    p->min_size = p->avg_size / 4;
+    p->max_size = p->avg_size * 4;
+    p->mask_s = top_bits(bits + 2);
+    p->mask_l = top_bits(bits - 2);
+
+    /* The gear table must be identical on every host, so it is derived
+     * from a fixed seed rather than from rand(). */
+    uint64_t seed = 0x5a17c0de5eedULL;
+    for (int i = 0; i < 256; i++)
+        p->gear[i] = splitmix64(&seed);
+}
+
+size_t cdc_next_cut(const cdc_params_t *p, const unsigned char *data, size_t len) {
+    if (len <= p->min_size) return len;
+
+    size_t max = len < p->max_size ? len : p->max_size;
+    size_t normal = p->avg_size < max ? p->avg_size : max;
+    uint64_t fp = 0;
+    size_t i = p->min_size;
+
+    for (; i < normal; i++) {
+        fp = (fp << 1) + p->gear[data[i]];
+        if (!(fp & p->mask_s)) return i + 1;
+    }
+    for (; i < max; i++) {
+        fp = (fp << 1) + p->gear[data[i]];
+        if (!(fp & p->mask_l)) return i + 1;
+    }
+    return i;
+}
@@ -0,0 +1,23 @@
+#ifndef CHUNKER_H
+#define CHUNKER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define CDC_DEFAULT_AVG (16 * 1024)
+#define CDC_MIN_AVG 256
+#define CDC_MAX_AVG (1024 * 1024)
+
+typedef struct {
+    size_t min_size;
+    size_t avg_size;
+    size_t max_size;
+    uint64_t mask_s;     /* stricter mask used before avg_size */
+    uint64_t mask_l;     /* looser mask used after avg_size */
+    uint64_t gear[256];
+} cdc_params_t;
+
+void cdc_init(cdc_params_t *p, size_t avg_size);
+size_t cdc_next_cut(const cdc_params_t *p, const unsigned char *data, size_t len);
+
+#endif
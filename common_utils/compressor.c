@@ -3,37 +3,231 @@
 #include <stdlib.h>
 #include <string.h>
 #include<stdio.h>
+#ifdef HAVE_LZ4
+#include <lz4.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
 
-int compress_block(const unsigned char *in, size_t in_len, unsigned char **outptr) {
-    if (!in || !outptr) return -1;
-    
-    uLong bound = compressBound((uLong)in_len);
-    unsigned char *out = malloc(bound);
-    if (!out) return -1;
-    uLongf destLen = bound;
-    int rc = compress2(out, &destLen, in, (uLong)in_len, Z_BEST_SPEED);
-    if (rc != Z_OK) {
-        free(out);
+#define SAMPLE_BYTES 256
+#define MIN_SAMPLED_LEN 512
+/* Level 1 barely searches the dictionary. Blocks are small, so the
+ * longest hash chains are affordable and keep a one-line edit to a few
+ * dozen bytes even in 16 KB blocks. */
+#define DICT_LEVEL 9
+
+/* A zlib stream of in, even when it comes out larger; out_cap must be at
+ * least codec_bound(CODEC_ZLIB, in_len). */
+int compress_block(const unsigned char *in, size_t in_len, unsigned char *out, size_t out_cap) {
+    if (!in || !out) return -1;
+    uLongf destLen = (uLongf)out_cap;
+    if (compress2(out, &destLen, in, (uLong)in_len, Z_BEST_SPEED) != Z_OK) return -1;
+    return (int)destLen;
+}
+
+static const char *codec_names[CODEC_MAX] = { "none", "zlib", "lz4", "zstd" };
+
+const char *codec_name(int codec) {
+    return codec >= 0 && codec < CODEC_MAX ? codec_names[codec] : "?";
+}
+
+int codec_from_name(const char *name) {
+    for (int i = 0; i < CODEC_MAX; i++)
+        if (strcmp(name, codec_names[i]) == 0) return i;
+    return -1;
+}
+
+int codec_available(int codec) {
+    switch (codec) {
+    case CODEC_NONE:
+    case CODEC_ZLIB:
+        return 1;
+#ifdef HAVE_LZ4
+    case CODEC_LZ4:
+        return 1;
+#endif
+#ifdef HAVE_ZSTD
+    case CODEC_ZSTD:
+        return 1;
+#endif
+    default:
+        return 0;
+    }
+}
+
+/* First codec in a comma separated preference list that this build has;
+ * zlib is the fallback every peer understands. */
+int codec_pick(const char *prefs) {
+    char name[16];
+    while (prefs && *prefs) {
+        size_t n = strcspn(prefs, ",");
+        if (n < sizeof(name)) {
+            memcpy(name, prefs, n);
+            name[n] = '\0';
+            int c = codec_from_name(name);
+            if (c >= 0 && codec_available(c)) return c;
+        }
+        prefs += n;
+        if (*prefs == ',') prefs++;
+    }
+    return CODEC_ZLIB;
+}
+
+size_t codec_bound(int codec, size_t in_len) {
+    switch (codec) {
+#ifdef HAVE_LZ4
+    case CODEC_LZ4:
+        return (size_t)LZ4_compressBound((int)in_len);
+#endif
+#ifdef HAVE_ZSTD
+    case CODEC_ZSTD:
+        return ZSTD_compressBound(in_len);
+#endif
+    case CODEC_ZLIB:
+        return compressBound((uLong)in_len);
+    default:
+        return in_len;
+    }
+}
+
+/* Compresses into a caller buffer of at least codec_bound() bytes. Returns
+ * the compressed length, or -1 when the block should be sent raw. */
+int codec_compress(int codec, const unsigned char *in, size_t in_len, unsigned char *out, size_t out_cap) {
+    size_t n = 0;
+    switch (codec) {
+    case CODEC_ZLIB: {
+        uLongf dest = (uLongf)out_cap;
+        if (compress2(out, &dest, in, (uLong)in_len, Z_BEST_SPEED) != Z_OK) return -1;
+        n = dest;
+        break;
+    }
+#ifdef HAVE_LZ4
+    case CODEC_LZ4: {
+        int r = LZ4_compress_default((const char *)in, (char *)out, (int)in_len, (int)out_cap);
+        if (r <= 0) return -1;
+        n = (size_t)r;
+        break;
+    }
+#endif
+#ifdef HAVE_ZSTD
+    case CODEC_ZSTD:
+        n = ZSTD_compress(out, out_cap, in, in_len, 1);
+        if (ZSTD_isError(n)) return -1;
+        break;
+#endif
+    default:
         return -1;
     }
-    
-    unsigned char *shrink = realloc(out, destLen);
-    if (shrink) out = shrink;
-    *outptr = out;
-    printf("Compressed %zu -> %lu bytes\n", in_len, destLen);
-    return (int)destLen;
+    return n < in_len ? (int)n : -1;
+}
+
+int codec_decompress(int codec, const unsigned char *in, size_t in_len, unsigned char *out, size_t out_len) {
+    switch (codec) {
+    case CODEC_ZLIB: {
+        uLongf dest = (uLongf)out_len;
+        if (uncompress(out, &dest, in, (uLong)in_len) != Z_OK || dest != out_len) return -1;
+        return (int)dest;
+    }
+#ifdef HAVE_LZ4
+    case CODEC_LZ4: {
+        int r = LZ4_decompress_safe((const char *)in, (char *)out, (int)in_len, (int)out_len);
+        return r == (int)out_len ? r : -1;
+    }
+#endif
+#ifdef HAVE_ZSTD
+    case CODEC_ZSTD: {
+        size_t r = ZSTD_decompress(out, out_len, in, in_len);
+        return !ZSTD_isError(r) && r == out_len ? (int)r : -1;
+    }
+#endif
+    default:
+        return -1;
+    }
+}
+
+/* Cheap guess at whether a block is worth compressing. Bytes are sampled
+ * across the block and the chance of two samples being equal is compared
+ * with that of uniformly random data (1/256); jpeg, gzip or video payloads
+ * sit right at that floor while text and binaries are far above it. */
+int block_is_compressible(const unsigned char *in, size_t len) {
+    if (len < MIN_SAMPLED_LEN) return 1;
+
+    unsigned counts[256] = { 0 };
+    size_t step = len / SAMPLE_BYTES;
+    for (size_t i = 0; i < SAMPLE_BYTES; i++) counts[in[i * step]]++;
+
+    unsigned long long pairs = 0;
+    for (int i = 0; i < 256; i++) pairs += (unsigned long long)counts[i] * counts[i];
+
+    /* sum(c^2) is about n + n^2/256 for random input; demand 25% more */
+    unsigned long long random_pairs = SAMPLE_BYTES + (unsigned long long)SAMPLE_BYTES * SAMPLE_BYTES / 256;
+    return pairs * 4 > random_pairs * 5;
+}
+
+struct dict_ctx {
+    z_stream def, inf;
+    int def_ready, inf_ready;
+};
+
+dict_ctx_t *dict_ctx_new(void) {
+    return calloc(1, sizeof(dict_ctx_t));
 }
 
-int decompress_block(const unsigned char *in, size_t in_len, unsigned char **outptr, size_t expected_out_len) {
-    if (!in || !outptr) return -1;
-    unsigned char *out = malloc(expected_out_len);
-    if (!out) return -1;
-    uLongf destLen = (uLongf)expected_out_len;
-    int rc = uncompress(out, &destLen, in, (uLong)in_len);
-    if (rc != Z_OK || destLen != expected_out_len) {
-        free(out);
+void dict_ctx_free(dict_ctx_t *dc) {
+    if (!dc) return;
+    if (dc->def_ready) deflateEnd(&dc->def);
+    if (dc->inf_ready) inflateEnd(&dc->inf);
+    free(dc);
+}
+
+/* Streams are set up once and reset per block; deflateInit alone costs
+ * more than compressing a 1 KB block. */
+int dict_compress(dict_ctx_t *dc, const unsigned char *in, size_t in_len,
+                  const unsigned char *dict, size_t dict_len, unsigned char *out, size_t out_cap) {
+    if (!dc->def_ready) {
+        if (deflateInit(&dc->def, DICT_LEVEL) != Z_OK) return -1;
+        dc->def_ready = 1;
+    } else if (deflateReset(&dc->def) != Z_OK) {
         return -1;
     }
-    *outptr = out;
-    return (int)destLen;
+    if (dict_len > DICT_MAX_LEN) {
+        dict += dict_len - DICT_MAX_LEN;
+        dict_len = DICT_MAX_LEN;
+    }
+    if (deflateSetDictionary(&dc->def, dict, (uInt)dict_len) != Z_OK) return -1;
+
+    dc->def.next_in = (unsigned char *)in;
+    dc->def.avail_in = (uInt)in_len;
+    dc->def.next_out = out;
+    dc->def.avail_out = (uInt)out_cap;
+    if (deflate(&dc->def, Z_FINISH) != Z_STREAM_END) return -1;
+    size_t n = out_cap - dc->def.avail_out;
+    return n < in_len ? (int)n : -1;
+}
+
+int dict_decompress(dict_ctx_t *dc, const unsigned char *in, size_t in_len,
+                    const unsigned char *dict, size_t dict_len, unsigned char *out, size_t out_len) {
+    if (!dc->inf_ready) {
+        if (inflateInit(&dc->inf) != Z_OK) return -1;
+        dc->inf_ready = 1;
+    } else if (inflateReset(&dc->inf) != Z_OK) {
+        return -1;
+    }
+    if (dict_len > DICT_MAX_LEN) {
+        dict += dict_len - DICT_MAX_LEN;
+        dict_len = DICT_MAX_LEN;
+    }
+
+    dc->inf.next_in = (unsigned char *)in;
+    dc->inf.avail_in = (uInt)in_len;
+    dc->inf.next_out = out;
+    dc->inf.avail_out = (uInt)out_len;
+    int rc = inflate(&dc->inf, Z_FINISH);
+    if (rc == Z_NEED_DICT) {
+        if (inflateSetDictionary(&dc->inf, dict, (uInt)dict_len) != Z_OK) return -1;
+        rc = inflate(&dc->inf, Z_FINISH);
+    }
+    if (rc != Z_STREAM_END || dc->inf.avail_out != 0) return -1;
+    return (int)out_len;
 }
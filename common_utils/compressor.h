@@ -3,8 +3,42 @@
 
 #include <stddef.h>
 
-int compress_block(const unsigned char *in, size_t in_len, unsigned char **outptr);
+/* Block codecs. zlib is always built; lz4 and zstd are compiled in with
+ * -DHAVE_LZ4 -llz4 / -DHAVE_ZSTD -lzstd. */
+#define CODEC_NONE 0
+#define CODEC_ZLIB 1
+#define CODEC_LZ4  2
+#define CODEC_ZSTD 3
+#define CODEC_MAX  4
 
-int decompress_block(const unsigned char *in, size_t in_len, unsigned char **outptr, size_t expected_out_len);
+/* Preference order offered in HELLO when the user does not pick one */
+#define CODEC_DEFAULT_PREFS "lz4,zstd,zlib"
+
+int compress_block(const unsigned char *in, size_t in_len, unsigned char *out, size_t out_cap);
+
+const char *codec_name(int codec);
+int codec_from_name(const char *name);
+int codec_available(int codec);
+int codec_pick(const char *prefs);
+
+size_t codec_bound(int codec, size_t in_len);
+int codec_compress(int codec, const unsigned char *in, size_t in_len, unsigned char *out, size_t out_cap);
+int codec_decompress(int codec, const unsigned char *in, size_t in_len, unsigned char *out, size_t out_len);
+
+int block_is_compressible(const unsigned char *in, size_t len);
+
+/* zlib streams primed with the previous version of the data. Only the last
+ * DICT_MAX_LEN bytes of a dictionary are used; the stream carries the
+ * dictionary's adler32 so a mismatched dictionary fails to decode. */
+#define DICT_MAX_LEN (32 * 1024)
+
+typedef struct dict_ctx dict_ctx_t;
+
+dict_ctx_t *dict_ctx_new(void);
+void dict_ctx_free(dict_ctx_t *dc);
+int dict_compress(dict_ctx_t *dc, const unsigned char *in, size_t in_len,
+                  const unsigned char *dict, size_t dict_len, unsigned char *out, size_t out_cap);
+int dict_decompress(dict_ctx_t *dc, const unsigned char *in, size_t in_len,
+                    const unsigned char *dict, size_t dict_len, unsigned char *out, size_t out_len);
 
 #endif
@@ -0,0 +1,179 @@
+#include "delta.h"
+#include "file_hasher.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define DELTA_LITERAL_MAX (64 * 1024)
+#define DELTA_ROLL_BATCH 256
+#define EMPTY_SLOT -1
+
+struct delta_index {
+    const block_sig_t *sigs;
+    int nblocks;
+    size_t block_size;
+    int hash_alg;
+    size_t tail_len;      /* length of the last block if it is short, else 0 */
+    int *slots;
+    size_t mask;
+};
+
+static size_t slot_of(uint32_t weak, size_t mask) {
+    return (size_t)((weak * 2654435761u) >> 8) & mask;
+}
+
+delta_index_t *delta_index_build(const block_sig_t *sigs, int nblocks,
+                                 size_t block_size, size_t old_size, int hash_alg) {
+    delta_index_t *di = calloc(1, sizeof(*di));
+    if (!di) return NULL;
+
+    size_t cap = 16;
+    while (cap < (size_t)nblocks * 2) cap <<= 1;
+    di->slots = malloc(sizeof(int) * cap);
+    if (!di->slots) { free(di); return NULL; }
+    for (size_t i = 0; i < cap; i++) di->slots[i] = EMPTY_SLOT;
+
+    di->sigs = sigs;
+    di->nblocks = nblocks;
+    di->block_size = block_size;
+    di->hash_alg = hash_alg;
+    di->mask = cap - 1;
+    if (nblocks > 0 && old_size % block_size != 0)
+        di->tail_len = old_size % block_size;
+
+    /* Only full-size blocks take part in the sliding search; the short
+     * tail block is tried once at the end of the new data. */
+    int full = di->tail_len ? nblocks - 1 : nblocks;
+    for (int i = 0; i < full; i++) {
+        size_t s = slot_of(sigs[i].weak, di->mask);
+        while (di->slots[s] != EMPTY_SLOT) s = (s + 1) & di->mask;
+        di->slots[s] = i;
+    }
+    return di;
+}
+
+void delta_index_free(delta_index_t *di) {
+    if (!di) return;
+    free(di->slots);
+    free(di);
+}
+
+int delta_index_find(const delta_index_t *di, uint32_t weak,
+                     const unsigned char *buf, size_t len) {
+    unsigned char strong[16];
+    int have_strong = 0;
+
+    for (size_t s = slot_of(weak, di->mask); di->slots[s] != EMPTY_SLOT; s = (s + 1) & di->mask) {
+        int i = di->slots[s];
+        if (di->sigs[i].weak != weak) continue;
+        if (!have_strong) {
+            strong_hash(di->hash_alg, buf, len, strong);
+            have_strong = 1;
+        }
+        if (memcmp(di->sigs[i].strong, strong, 16) == 0) return i;
+    }
+    return -1;
+}
+
+typedef struct {
+    const delta_ops_t *ops;
+    void *ctx;
+    int copy_start;
+    int copy_count;
+} emitter_t;
+
+static int flush_copy(emitter_t *em) {
+    if (em->copy_count == 0) return 0;
+    int rc = em->ops->copy(em->ctx, em->copy_start, em->copy_count);
+    em->copy_count = 0;
+    return rc;
+}
+
+static int emit_copy(emitter_t *em, int idx) {
+    if (em->copy_count > 0 && em->copy_start + em->copy_count == idx) {
+        em->copy_count++;
+        return 0;
+    }
+    if (flush_copy(em) != 0) return -1;
+    em->copy_start = idx;
+    em->copy_count = 1;
+    return 0;
+}
+
+static int emit_literal(emitter_t *em, const unsigned char *data, size_t len) {
+    if (len == 0) return 0;
+    if (flush_copy(em) != 0) return -1;
+    return em->ops->literal(em->ctx, data, len);
+}
+
+int delta_generate(const delta_index_t *di, const unsigned char *data, size_t len,
+                   const delta_ops_t *ops, void *ctx) {
+    emitter_t em = { ops, ctx, 0, 0 };
+    size_t bs = di->block_size;
+    size_t p = 0, lit = 0;
+    int have_window = 0;
+    uint32_t a = 0, b = 0;
+    /* Weak sums of the windows at p.. are rolled in batches; a fresh
+     * window starts with a batch of one, so runs of matching blocks never
+     * roll ahead for nothing. */
+    uint32_t weak[DELTA_ROLL_BATCH];
+    size_t nweak = 0, wi = 0;
+
+    while (di->nblocks > 0 && p + bs <= len) {
+        if (wi == nweak) {
+            size_t n = 1;
+            if (!have_window) {
+                uint32_t w = rsync_weak_checksum(data + p, bs);
+                a = w & 0xffff;
+                b = w >> 16;
+                have_window = 1;
+            } else {
+                rsync_roll_checksum(&a, &b, data[p - 1], data[p - 1 + bs], bs);
+                n = len - bs - p + 1 < DELTA_ROLL_BATCH ? len - bs - p + 1 : DELTA_ROLL_BATCH;
+            }
+            rsync_roll_checksums(data + p, n, bs, &a, &b, weak);
+            nweak = n;
+            wi = 0;
+        }
+
+        int idx = delta_index_find(di, weak[wi], data + p, bs);
+        if (idx >= 0) {
+            if (emit_literal(&em, data + lit, p - lit) != 0) return -1;
+            if (emit_copy(&em, idx) != 0) return -1;
+            p += bs;
+            lit = p;
+            have_window = 0;
+            nweak = wi = 0;
+            continue;
+        }
+
+        wi++;
+        p++;
+
+        if (p - lit >= DELTA_LITERAL_MAX) {
+            if (emit_literal(&em, data + lit, p - lit) != 0) return -1;
+            lit = p;
+        }
+    }
+
+    if (di->tail_len && len >= di->tail_len && len - di->tail_len >= lit) {
+        const unsigned char *t = data + len - di->tail_len;
+        const block_sig_t *ts = &di->sigs[di->nblocks - 1];
+        unsigned char strong[16];
+        if (rsync_weak_checksum(t, di->tail_len) == ts->weak) {
+            strong_hash(di->hash_alg, t, di->tail_len, strong);
+            if (memcmp(strong, ts->strong, 16) == 0) {
+                if (emit_literal(&em, data + lit, (size_t)(t - data) - lit) != 0) return -1;
+                if (emit_copy(&em, di->nblocks - 1) != 0) return -1;
+                lit = len;
+            }
+        }
+    }
+
+    while (lit < len) {
+        size_t n = len - lit;
+        if (n > DELTA_LITERAL_MAX) n = DELTA_LITERAL_MAX;
+        if (emit_literal(&em, data + lit, n) != 0) return -1;
+        lit += n;
+    }
+    return flush_copy(&em);
+}
@@ -0,0 +1,26 @@
+#ifndef DELTA_H
+#define DELTA_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "protocol.h"
+
+typedef struct delta_index delta_index_t;
+
+/* Called by delta_generate for every matched run of old blocks and every
+ * run of unmatched bytes. Returning non-zero aborts the generation. */
+typedef struct {
+    int (*copy)(void *ctx, int start_block, int count);
+    int (*literal)(void *ctx, const unsigned char *data, size_t len);
+} delta_ops_t;
+
+delta_index_t *delta_index_build(const block_sig_t *sigs, int nblocks,
+                                 size_t block_size, size_t old_size, int hash_alg);
+void delta_index_free(delta_index_t *di);
+int delta_index_find(const delta_index_t *di, uint32_t weak,
+                     const unsigned char *buf, size_t len);
+
+int delta_generate(const delta_index_t *di, const unsigned char *data, size_t len,
+                   const delta_ops_t *ops, void *ctx);
+
+#endif
@@ -1,59 +1,442 @@
 #include "file_hasher.h"
+#include "buf_pool.h"
 #include <string.h>
 #include <openssl/evp.h>
 #include <stdint.h>
+#include <pthread.h>
+#ifdef HAVE_XXHASH
+#include <xxhash.h>
+#endif
+#ifdef HAVE_BLAKE3
+#include <blake3.h>
+#endif
 
-uint32_t rsync_weak_checksum(const unsigned char *buf, size_t len) {
+/* Both sums are only kept modulo 2^16, so they can run in 32 bits with
+ * wraparound and be masked once at the end: a is the byte sum and b the
+ * sum of every byte weighted by its distance from the end of the block. */
+static uint32_t weak_scalar(const unsigned char *buf, size_t len) {
     uint32_t a = 0, b = 0;
     for (size_t i = 0; i < len; ++i) {
-        a = (a + buf[i]) & 0xffff;
-        b = (b + a) & 0xffff;
+        a += buf[i];
+        b += a;
     }
-    return (b << 16) | a;
+    return ((b & 0xffff) << 16) | (a & 0xffff);
 }
 
-void rsync_roll_checksum(uint32_t *a_out, uint32_t *b_out,
-                         const unsigned char *old_block,
-                         const unsigned char *new_block,
-                         size_t block_size, size_t offset) {
-    (void)old_block;
-    (void)offset;
-    uint32_t a = 0, b = 0;
-    for (size_t i = 0; i < block_size; ++i) {
-        a = (a + new_block[i]) & 0xffff;
-        b = (b + a) & 0xffff;
+static void roll_scalar(const unsigned char *data, size_t n, size_t block_size,
+                        uint32_t *a, uint32_t *b, uint32_t *out) {
+    uint32_t ra = *a, rb = *b;
+    uint32_t bs = (uint32_t)block_size;
+    if (n == 0) return;
+    out[0] = (rb << 16) | ra;
+    for (size_t k = 1; k < n; k++) {
+        ra = (ra - data[k - 1] + data[k - 1 + block_size]) & 0xffff;
+        rb = (rb - bs * data[k - 1] + ra) & 0xffff;
+        out[k] = (rb << 16) | ra;
+    }
+    *a = ra;
+    *b = rb;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+
+/* Per 16 byte chunk: a += sum(x), b += 16 * a_before + sum((16 - j) * x[j]).
+ * pmaddubsw pairs stay below 2 * 16 * 255, far from saturating. */
+__attribute__((target("ssse3")))
+static uint32_t weak_ssse3(const unsigned char *buf, size_t len) {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i ones = _mm_set1_epi16(1);
+    const __m128i weights = _mm_setr_epi8(16, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1);
+    __m128i va = zero, vb = zero, vprev = zero;
+    size_t i = 0;
+
+    for (; i + 16 <= len; i += 16) {
+        __m128i x = _mm_loadu_si128((const __m128i *)(buf + i));
+        vprev = _mm_add_epi32(vprev, va);
+        va = _mm_add_epi32(va, _mm_sad_epu8(x, zero));
+        vb = _mm_add_epi32(vb, _mm_madd_epi16(_mm_maddubs_epi16(x, weights), ones));
+    }
+    vprev = _mm_slli_epi32(vprev, 4);
+    vb = _mm_add_epi32(vb, vprev);
+    va = _mm_add_epi32(va, _mm_shuffle_epi32(va, _MM_SHUFFLE(1, 0, 3, 2)));
+    vb = _mm_add_epi32(vb, _mm_shuffle_epi32(vb, _MM_SHUFFLE(1, 0, 3, 2)));
+    vb = _mm_add_epi32(vb, _mm_shuffle_epi32(vb, _MM_SHUFFLE(2, 3, 0, 1)));
+    uint32_t a = (uint32_t)_mm_cvtsi128_si32(va);
+    uint32_t b = (uint32_t)_mm_cvtsi128_si32(vb);
+
+    for (; i < len; i++) {
+        a += buf[i];
+        b += a;
+    }
+    return ((b & 0xffff) << 16) | (a & 0xffff);
+}
+
+/* Same as the SSSE3 kernel over 32 byte chunks */
+__attribute__((target("avx2")))
+static uint32_t weak_avx2(const unsigned char *buf, size_t len) {
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i ones = _mm256_set1_epi16(1);
+    const __m256i weights = _mm256_setr_epi8(32, 31, 30, 29, 28, 27, 26, 25, 24, 23, 22, 21, 20, 19, 18, 17,
+                                             16, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1);
+    __m256i va = zero, vb = zero, vprev = zero;
+    size_t i = 0;
+
+    for (; i + 32 <= len; i += 32) {
+        __m256i x = _mm256_loadu_si256((const __m256i *)(buf + i));
+        vprev = _mm256_add_epi32(vprev, va);
+        va = _mm256_add_epi32(va, _mm256_sad_epu8(x, zero));
+        vb = _mm256_add_epi32(vb, _mm256_madd_epi16(_mm256_maddubs_epi16(x, weights), ones));
+    }
+    vb = _mm256_add_epi32(vb, _mm256_slli_epi32(vprev, 5));
+    __m128i a4 = _mm_add_epi32(_mm256_castsi256_si128(va), _mm256_extracti128_si256(va, 1));
+    __m128i b4 = _mm_add_epi32(_mm256_castsi256_si128(vb), _mm256_extracti128_si256(vb, 1));
+    a4 = _mm_add_epi32(a4, _mm_shuffle_epi32(a4, _MM_SHUFFLE(1, 0, 3, 2)));
+    b4 = _mm_add_epi32(b4, _mm_shuffle_epi32(b4, _MM_SHUFFLE(1, 0, 3, 2)));
+    b4 = _mm_add_epi32(b4, _mm_shuffle_epi32(b4, _MM_SHUFFLE(2, 3, 0, 1)));
+    uint32_t a = (uint32_t)_mm_cvtsi128_si32(a4);
+    uint32_t b = (uint32_t)_mm_cvtsi128_si32(b4);
+
+    for (; i < len; i++) {
+        a += buf[i];
+        b += a;
+    }
+    return ((b & 0xffff) << 16) | (a & 0xffff);
+}
+
+static inline __m128i prefix_sum_epi16(__m128i v) {
+    v = _mm_add_epi16(v, _mm_slli_si128(v, 2));
+    v = _mm_add_epi16(v, _mm_slli_si128(v, 4));
+    return _mm_add_epi16(v, _mm_slli_si128(v, 8));
+}
+
+/* Eight rolls at a time in 16-bit lanes (the sums are mod 2^16 anyway):
+ * the a values are a prefix sum of x[k + bs] - x[k], and the b values a
+ * prefix sum of a[k + 1] - bs * x[k]. SSE2 is always there on x86-64. */
+static void roll_sse2(const unsigned char *data, size_t n, size_t block_size,
+                      uint32_t *a, uint32_t *b, uint32_t *out) {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i vbs = _mm_set1_epi16((short)block_size);
+    __m128i ca = _mm_set1_epi16((short)*a), cb = _mm_set1_epi16((short)*b);
+    size_t k = 1;
+    if (n == 0) return;
+    out[0] = (*b << 16) | *a;
+
+    for (; k + 8 <= n; k += 8) {
+        __m128i xo = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(data + k - 1)), zero);
+        __m128i xi = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(data + k - 1 + block_size)), zero);
+        __m128i va = _mm_add_epi16(prefix_sum_epi16(_mm_sub_epi16(xi, xo)), ca);
+        __m128i e = _mm_sub_epi16(va, _mm_mullo_epi16(xo, vbs));
+        __m128i vb = _mm_add_epi16(prefix_sum_epi16(e), cb);
+        _mm_storeu_si128((__m128i *)(out + k), _mm_unpacklo_epi16(va, vb));
+        _mm_storeu_si128((__m128i *)(out + k + 4), _mm_unpackhi_epi16(va, vb));
+        /* carry the last lane into every lane for the next eight */
+        ca = _mm_shuffle_epi32(_mm_shufflehi_epi16(va, 0xff), 0xff);
+        cb = _mm_shuffle_epi32(_mm_shufflehi_epi16(vb, 0xff), 0xff);
+    }
+    *a = (uint32_t)_mm_extract_epi16(ca, 0);
+    *b = (uint32_t)_mm_extract_epi16(cb, 0);
+    if (k < n) roll_scalar(data + k - 1, n - k + 1, block_size, a, b, out + k - 1);
+}
+#endif
+
+typedef struct {
+    const char *name;
+    uint32_t (*block)(const unsigned char *buf, size_t len);
+    void (*roll)(const unsigned char *data, size_t n, size_t block_size,
+                 uint32_t *a, uint32_t *b, uint32_t *out);
+} weak_kernel_t;
+
+static const weak_kernel_t weak_kernels[] = {
+#if defined(__x86_64__) || defined(__i386__)
+    { "avx2", weak_avx2, roll_sse2 },
+    { "ssse3", weak_ssse3, roll_sse2 },
+#endif
+    { "scalar", weak_scalar, roll_scalar },
+};
+#define NUM_WEAK_KERNELS (sizeof(weak_kernels) / sizeof(weak_kernels[0]))
+
+static const weak_kernel_t *weak_kernel;
+static pthread_once_t weak_once = PTHREAD_ONCE_INIT;
+
+static int weak_kernel_supported(const weak_kernel_t *k) {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (strcmp(k->name, "avx2") == 0) return __builtin_cpu_supports("avx2");
+    if (strcmp(k->name, "ssse3") == 0) return __builtin_cpu_supports("ssse3");
+#endif
+    return 1;
+}
+
+static void weak_kernel_init(void) {
+    for (size_t i = 0; i < NUM_WEAK_KERNELS; i++) {
+        if (weak_kernel_supported(&weak_kernels[i])) {
+            weak_kernel = &weak_kernels[i];
+            return;
+        }
+    }
+}
+
+static const weak_kernel_t *get_weak_kernel(void) {
+    pthread_once(&weak_once, weak_kernel_init);
+    return weak_kernel;
+}
+
+const char *rsync_weak_kernel(void) {
+    return get_weak_kernel()->name;
+}
+
+int rsync_weak_select(const char *name) {
+    get_weak_kernel();
+    for (size_t i = 0; i < NUM_WEAK_KERNELS; i++) {
+        if (strcmp(weak_kernels[i].name, name) == 0 && weak_kernel_supported(&weak_kernels[i])) {
+            weak_kernel = &weak_kernels[i];
+            return 0;
+        }
+    }
+    return -1;
+}
+
+uint32_t rsync_weak_checksum(const unsigned char *buf, size_t len) {
+    return get_weak_kernel()->block(buf, len);
+}
+
+void rsync_weak_checksum_blocks(const unsigned char *data, size_t size, size_t block_size,
+                                uint32_t *out) {
+    const weak_kernel_t *k = get_weak_kernel();
+    for (size_t off = 0; off < size; off += block_size) {
+        size_t len = size - off < block_size ? size - off : block_size;
+        *out++ = k->block(data + off, len);
+    }
+}
+
+void rsync_roll_checksums(const unsigned char *data, size_t n, size_t block_size,
+                          uint32_t *a, uint32_t *b, uint32_t *out) {
+    get_weak_kernel()->roll(data, n, block_size, a, b, out);
+}
+
+void rsync_roll_checksum(uint32_t *a, uint32_t *b,
+                         unsigned char out_byte, unsigned char in_byte,
+                         size_t block_size) {
+    *a = (*a - out_byte + in_byte) & 0xffff;
+    *b = (*b - (uint32_t)(block_size * out_byte) + *a) & 0xffff;
+}
+
+/* One digest context per thread, created on first use and released when
+ * the thread exits */
+static pthread_key_t md_key;
+static pthread_once_t md_once = PTHREAD_ONCE_INIT;
+
+static void md_ctx_free(void *ctx) {
+    EVP_MD_CTX_free(ctx);
+}
+
+static void md_key_init(void) {
+    pthread_key_create(&md_key, md_ctx_free);
+}
+
+static EVP_MD_CTX *thread_md_ctx(void) {
+    pthread_once(&md_once, md_key_init);
+    EVP_MD_CTX *ctx = pthread_getspecific(md_key);
+    if (!ctx) {
+        ctx = EVP_MD_CTX_new();
+        if (ctx) pthread_setspecific(md_key, ctx);
     }
-    *a_out = a;
-    *b_out = b;
+    return ctx;
 }
 
 void md5_hash(const unsigned char *buf, size_t len, unsigned char out16[16]) {
-    EVP_MD_CTX *ctx = EVP_MD_CTX_new();
+    EVP_MD_CTX *ctx = thread_md_ctx();
     if (!ctx) return;
 
     EVP_DigestInit_ex(ctx, EVP_md5(), NULL);
     EVP_DigestUpdate(ctx, buf, len);
     EVP_DigestFinal_ex(ctx, out16, NULL);
-    EVP_MD_CTX_free(ctx);
 }
 
-void compute_sigs_for_file(FILE *f, block_sig_t *sigs, int nblocks, size_t file_size) {
+static void blake2b_hash(const unsigned char *buf, size_t len, unsigned char out16[16]) {
+    unsigned char full[EVP_MAX_MD_SIZE];
+    EVP_MD_CTX *ctx = thread_md_ctx();
+    if (!ctx) return;
+
+    EVP_DigestInit_ex(ctx, EVP_blake2b512(), NULL);
+    EVP_DigestUpdate(ctx, buf, len);
+    EVP_DigestFinal_ex(ctx, full, NULL);
+    memcpy(out16, full, 16);
+}
+
+static inline uint64_t rotl64(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t load_le64(const unsigned char *p) {
+    uint64_t v;
+    memcpy(&v, p, 8);
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    v = __builtin_bswap64(v);
+#endif
+    return v;
+}
+
+static inline uint64_t fmix64(uint64_t k) {
+    k ^= k >> 33;
+    k *= 0xff51afd7ed558ccdULL;
+    k ^= k >> 33;
+    k *= 0xc4ceb9fe1a85ec53ULL;
+    k ^= k >> 33;
+    return k;
+}
+
+/* MurmurHash3_x64_128 (Austin Appleby, public domain), seed 0. The result
+ * is written as two little-endian 64-bit words on every platform. */
+static void murmur3_hash(const unsigned char *buf, size_t len, unsigned char out16[16]) {
+    const uint64_t c1 = 0x87c37b91114253d5ULL, c2 = 0x4cf5ad432745937fULL;
+    uint64_t h1 = 0, h2 = 0, k1, k2;
+    size_t nblocks = len / 16;
+
+    for (size_t i = 0; i < nblocks; i++) {
+        k1 = load_le64(buf + i * 16);
+        k2 = load_le64(buf + i * 16 + 8);
+        k1 *= c1; k1 = rotl64(k1, 31); k1 *= c2; h1 ^= k1;
+        h1 = rotl64(h1, 27); h1 += h2; h1 = h1 * 5 + 0x52dce729;
+        k2 *= c2; k2 = rotl64(k2, 33); k2 *= c1; h2 ^= k2;
+        h2 = rotl64(h2, 31); h2 += h1; h2 = h2 * 5 + 0x38495ab5;
+    }
+
+    const unsigned char *tail = buf + nblocks * 16;
+    size_t rem = len & 15;
+    k1 = k2 = 0;
+    for (size_t b = rem; b > 8; b--) k2 = (k2 << 8) | tail[b - 1];
+    if (rem > 8) {
+        k2 *= c2; k2 = rotl64(k2, 33); k2 *= c1; h2 ^= k2;
+    }
+    for (size_t b = rem < 8 ? rem : 8; b > 0; b--) k1 = (k1 << 8) | tail[b - 1];
+    if (rem > 0) {
+        k1 *= c1; k1 = rotl64(k1, 31); k1 *= c2; h1 ^= k1;
+    }
+
+    h1 ^= (uint64_t)len;
+    h2 ^= (uint64_t)len;
+    h1 += h2;
+    h2 += h1;
+    h1 = fmix64(h1);
+    h2 = fmix64(h2);
+    h1 += h2;
+    h2 += h1;
+    for (int b = 0; b < 8; b++) {
+        out16[b] = (unsigned char)(h1 >> (8 * b));
+        out16[8 + b] = (unsigned char)(h2 >> (8 * b));
+    }
+}
+
+static const char *hash_names[HASH_MAX] = { "md5", "murmur3", "blake2b", "xxh3", "blake3" };
+
+const char *strong_hash_name(int alg) {
+    return alg >= 0 && alg < HASH_MAX ? hash_names[alg] : "?";
+}
+
+int strong_hash_from_name(const char *name) {
+    for (int i = 0; i < HASH_MAX; i++)
+        if (strcmp(name, hash_names[i]) == 0) return i;
+    return -1;
+}
+
+int strong_hash_available(int alg) {
+    switch (alg) {
+    case HASH_MD5:
+    case HASH_MURMUR3:
+    case HASH_BLAKE2B:
+        return 1;
+#ifdef HAVE_XXHASH
+    case HASH_XXH3:
+        return 1;
+#endif
+#ifdef HAVE_BLAKE3
+    case HASH_BLAKE3:
+        return 1;
+#endif
+    default:
+        return 0;
+    }
+}
+
+/* First algorithm of a comma separated preference list that this build
+ * has; md5 is what every peer understands. */
+int strong_hash_pick(const char *prefs) {
+    char name[16];
+    while (prefs && *prefs) {
+        size_t n = strcspn(prefs, ",");
+        if (n < sizeof(name)) {
+            memcpy(name, prefs, n);
+            name[n] = '\0';
+            int alg = strong_hash_from_name(name);
+            if (alg >= 0 && strong_hash_available(alg)) return alg;
+        }
+        prefs += n;
+        if (*prefs == ',') prefs++;
+    }
+    return HASH_MD5;
+}
+
+void strong_hash(int alg, const unsigned char *buf, size_t len, unsigned char out16[16]) {
+    switch (alg) {
+    case HASH_MURMUR3:
+        murmur3_hash(buf, len, out16);
+        return;
+    case HASH_BLAKE2B:
+        blake2b_hash(buf, len, out16);
+        return;
+#ifdef HAVE_XXHASH
+    case HASH_XXH3: {
+        XXH128_canonical_t c;
+        XXH128_canonicalFromHash(&c, XXH3_128bits(buf, len));
+        memcpy(out16, c.digest, 16);
+        return;
+    }
+#endif
+#ifdef HAVE_BLAKE3
+    case HASH_BLAKE3: {
+        blake3_hasher h;
+        blake3_hasher_init(&h);
+        blake3_hasher_update(&h, buf, len);
+        blake3_hasher_finalize(&h, out16, 16);
+        return;
+    }
+#endif
+    default:
+        md5_hash(buf, len, out16);
+        return;
+    }
+}
+
+void file_digest(int alg, const block_sig_t *sigs, int nblocks, unsigned char out16[16]) {
+    strong_hash(alg, (const unsigned char *)sigs, sizeof(block_sig_t) * (size_t)nblocks, out16);
+}
+
+uint64_t block_fingerprint(const unsigned char *buf, size_t len) {
+    unsigned char h[16];
+    murmur3_hash(buf, len, h);
+    return load_le64(h);
+}
+
+/* Returns -1 if no buffer could be had for a block */
+int compute_sigs_for_file(FILE *f, block_sig_t *sigs, int nblocks, size_t block_size,
+                          size_t file_size, int alg) {
+    unsigned char *buf = buf_get(block_size);
+    if (!buf) return -1;
+    fseek(f, 0, SEEK_SET);
     for (int i = 0; i < nblocks; ++i) {
-        size_t offset = (size_t)i * BLOCK_SIZE;
-        size_t toread = BLOCK_SIZE;
+        size_t offset = (size_t)i * block_size;
+        size_t toread = block_size;
         if (offset + toread > file_size)
             toread = file_size - offset;
 
-        unsigned char *buf = malloc(toread ? toread : 1);
-        if (!buf) { perror("malloc"); exit(1); }
-
-        fseek(f, offset, SEEK_SET);
         size_t r = fread(buf, 1, toread, f);
-        (void)r;
+        if (r < toread) memset(buf + r, 0, toread - r);
 
         sigs[i].weak = rsync_weak_checksum(buf, toread);
-        md5_hash(buf, toread, sigs[i].strong);
-
-        free(buf);
+        strong_hash(alg, buf, toread, sigs[i].strong);
     }
+    buf_put(buf);
+    return 0;
 }
\ No newline at end of file
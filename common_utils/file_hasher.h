@@ -7,13 +7,55 @@
 #include "protocol.h"
 
 uint32_t rsync_weak_checksum(const unsigned char *buf, size_t len);
-void compute_sigs_for_file(FILE *f, block_sig_t *sigs, int nblocks, size_t file_size);
-void rsync_roll_checksum(uint32_t *a_out, uint32_t *b_out,
-                         const unsigned char *old_block,
-                         const unsigned char *new_block,
-                         size_t block_size, size_t offset);
+int compute_sigs_for_file(FILE *f, block_sig_t *sigs, int nblocks, size_t block_size,
+                          size_t file_size, int alg);
+void rsync_roll_checksum(uint32_t *a, uint32_t *b,
+                         unsigned char out_byte, unsigned char in_byte,
+                         size_t block_size);
+
+/* Weak checksums of the consecutive block_size blocks covering size bytes
+ * of data; the last one may be short. */
+void rsync_weak_checksum_blocks(const unsigned char *data, size_t size, size_t block_size,
+                                uint32_t *out);
+/* Weak checksums of the n windows starting at data[0..n-1]. *a and *b hold
+ * the sums of the window at data[0] and are left at the window at
+ * data[n-1], so data must hold n - 1 + block_size bytes. */
+void rsync_roll_checksums(const unsigned char *data, size_t n, size_t block_size,
+                          uint32_t *a, uint32_t *b, uint32_t *out);
+
+/* The weak checksum kernels ("scalar", "ssse3", "avx2") are picked from
+ * the CPU on first use. rsync_weak_select forces one, for benchmarks, and
+ * fails if this CPU cannot run it. */
+const char *rsync_weak_kernel(void);
+int rsync_weak_select(const char *name);
 
 void md5_hash(const unsigned char *buf, size_t len, unsigned char out16[16]);
 
+/* Algorithms for block_sig_t.strong. The ids are stored in index.db and
+ * must not be renumbered. md5, murmur3 and blake2b are always built;
+ * xxh3 and blake3 need -DHAVE_XXHASH -lxxhash / -DHAVE_BLAKE3 -lblake3. */
+#define HASH_MD5      0
+#define HASH_MURMUR3  1   /* MurmurHash3 x64 128: fast, not collision resistant */
+#define HASH_BLAKE2B  2   /* BLAKE2b-512 truncated to 128 bits */
+#define HASH_XXH3     3
+#define HASH_BLAKE3   4
+#define HASH_MAX      5
+
+#define HASH_DEFAULT_PREFS "blake3,blake2b,md5"
+
+const char *strong_hash_name(int alg);
+int strong_hash_from_name(const char *name);
+int strong_hash_available(int alg);
+int strong_hash_pick(const char *prefs);
+void strong_hash(int alg, const unsigned char *buf, size_t len, unsigned char out16[16]);
+
+/* Digest of a whole file: the strong hash of its block signature array,
+ * so either side can derive it from signatures without rereading data. */
+void file_digest(int alg, const block_sig_t *sigs, int nblocks, unsigned char out16[16]);
+
+/* 64-bit murmur3 of a block, cheap enough to tell whether a block still
+ * matches a cached signature before paying for its strong hash. */
+uint64_t block_fingerprint(const unsigned char *buf, size_t len);
+
 #endif
 
@@ -0,0 +1,96 @@
+#include "frame.h"
+
+void frame_encode_hdr(unsigned char out[FRAME_HDR_LEN], uint8_t type, uint16_t flags, uint32_t len) {
+    out[0] = FRAME_MAGIC;
+    out[1] = type;
+    out[2] = (unsigned char)(flags >> 8);
+    out[3] = (unsigned char)flags;
+    out[4] = (unsigned char)(len >> 24);
+    out[5] = (unsigned char)(len >> 16);
+    out[6] = (unsigned char)(len >> 8);
+    out[7] = (unsigned char)len;
+}
+
+int frame_decode_hdr(const unsigned char in[FRAME_HDR_LEN], frame_hdr_t *h) {
+    if (in[0] != FRAME_MAGIC) return -1;
+    h->type = in[1];
+    h->flags = (uint16_t)((in[2] << 8) | in[3]);
+    h->len = ((uint32_t)in[4] << 24) | ((uint32_t)in[5] << 16) | ((uint32_t)in[6] << 8) | in[7];
+    return h->len <= FRAME_MAX_LEN ? 0 : -1;
+}
+
+size_t varint_encode(uint64_t v, unsigned char *out) {
+    size_t n = 0;
+    while (v >= 0x80) {
+        out[n++] = (unsigned char)(v | 0x80);
+        v >>= 7;
+    }
+    out[n++] = (unsigned char)v;
+    return n;
+}
+
+/* Returns the number of bytes consumed, or -1 if the input is truncated */
+int varint_decode(const unsigned char *in, size_t len, uint64_t *v) {
+    uint64_t r = 0;
+    for (size_t i = 0; i < len && i < VARINT_MAX_LEN; i++) {
+        r |= (uint64_t)(in[i] & 0x7f) << (7 * i);
+        if (!(in[i] & 0x80)) {
+            *v = r;
+            return (int)i + 1;
+        }
+    }
+    return -1;
+}
+
+/* Index lists are sent as: count, number of runs, then (gap, length)
+ * pairs where gap is the distance from the end of the previous run. A
+ * fully changed file therefore costs a handful of bytes. */
+size_t ranges_encode_bound(int n) {
+    return (size_t)(2 + 2 * n) * VARINT_MAX_LEN;
+}
+
+size_t ranges_encode(const int *idx, int n, unsigned char *out) {
+    int runs = 0;
+    for (int i = 0; i < n; i++)
+        if (i == 0 || idx[i] != idx[i - 1] + 1) runs++;
+
+    size_t pos = varint_encode((uint64_t)n, out);
+    pos += varint_encode((uint64_t)runs, out + pos);
+
+    int next = 0;
+    for (int i = 0; i < n;) {
+        int start = idx[i], len = 1;
+        while (i + len < n && idx[i + len] == start + len) len++;
+        pos += varint_encode((uint64_t)(start - next), out + pos);
+        pos += varint_encode((uint64_t)len, out + pos);
+        next = start + len;
+        i += len;
+    }
+    return pos;
+}
+
+int ranges_decode(const unsigned char *in, size_t len, int *out, int max_out) {
+    uint64_t count, runs, gap, rlen;
+    size_t pos = 0;
+    int k;
+
+    if ((k = varint_decode(in, len, &count)) < 0) return -1;
+    pos += (size_t)k;
+    if ((k = varint_decode(in + pos, len - pos, &runs)) < 0) return -1;
+    pos += (size_t)k;
+    if (count > (uint64_t)max_out) return -1;
+
+    uint64_t next = 0;
+    int n = 0;
+    for (uint64_t r = 0; r < runs; r++) {
+        if ((k = varint_decode(in + pos, len - pos, &gap)) < 0) return -1;
+        pos += (size_t)k;
+        if ((k = varint_decode(in + pos, len - pos, &rlen)) < 0) return -1;
+        pos += (size_t)k;
+        if (rlen > (uint64_t)(max_out - n)) return -1;
+        uint64_t start = next + gap;
+        for (uint64_t j = 0; j < rlen; j++) out[n++] = (int)(start + j);
+        next = start + rlen;
+    }
+    return (uint64_t)n == count ? n : -1;
+}
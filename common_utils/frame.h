@@ -0,0 +1,62 @@
+#ifndef FRAME_H
+#define FRAME_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Binary framing negotiated with "HELLO <version>". Every frame starts
+ * with an 8-byte header; the magic byte can never begin a text command,
+ * so text and binary messages can share one connection. */
+#define PROTO_TEXT       1
+#define PROTO_BINARY     2
+#define PROTO_DIGEST     3   /* binary, and FILE_HDR may carry a whole-file digest */
+#define PROTO_MERKLE     4   /* ... or the root of a Merkle tree over the signatures */
+#define PROTO_BLOCK_SIZE 5   /* ... and may choose its own block size */
+#define PROTO_VERSION    PROTO_BLOCK_SIZE
+#define MSG_HELLO        "HELLO"
+
+#define FRAME_MAGIC      0xB5
+#define FRAME_HDR_LEN    8
+#define FRAME_MAX_LEN    (64u * 1024 * 1024)
+
+#define FT_FILE_HDR      1
+#define FT_SIGS          2
+#define FT_BLOCK_REQ     3
+#define FT_BLOCK_DATA    4
+#define FT_BLOCK_END     5
+#define FT_FILE_OK       6
+#define FT_FILE_ERR      7
+#define FT_BLOCK_HINTS   8
+#define FT_SEND_SIGS     9   /* FILE_HDR digest did not match: send the signatures */
+#define FT_MERKLE_REQ    10  /* level, then ranges of the nodes wanted from that level */
+#define FT_MERKLE_NODES  11  /* the requested node hashes, in request order */
+
+#define FF_RAW           0x0001   /* BLOCK_DATA payload is stored uncompressed */
+#define FF_DICT          0x0002   /* BLOCK_DATA deflated against the hinted old block */
+#define FF_WANT_HINTS    0x0004   /* FILE_HDR: answer BLOCK_REQ with BLOCK_HINTS */
+#define FF_DIGEST        0x0008   /* FILE_HDR: ends with the 16-byte file_digest of the sigs */
+#define FF_UP_TO_DATE    0x0010   /* FILE_OK: the server already had that digest */
+#define FF_MERKLE        0x0020   /* FILE_HDR: ends with the Merkle root instead;
+                                     SEND_SIGS: payload lists the leaf groups wanted */
+#define FF_BLOCK_SIZE    0x0040   /* FILE_HDR: a varint block size follows the name,
+                                     digest or root; BLOCK_SIZE without it */
+
+#define VARINT_MAX_LEN   10
+
+typedef struct {
+    uint8_t type;
+    uint16_t flags;
+    uint32_t len;
+} frame_hdr_t;
+
+void frame_encode_hdr(unsigned char out[FRAME_HDR_LEN], uint8_t type, uint16_t flags, uint32_t len);
+int frame_decode_hdr(const unsigned char in[FRAME_HDR_LEN], frame_hdr_t *h);
+
+size_t varint_encode(uint64_t v, unsigned char *out);
+int varint_decode(const unsigned char *in, size_t len, uint64_t *v);
+
+size_t ranges_encode_bound(int n);
+size_t ranges_encode(const int *idx, int n, unsigned char *out);
+int ranges_decode(const unsigned char *in, size_t len, int *out, int max_out);
+
+#endif
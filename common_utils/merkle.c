@@ -0,0 +1,67 @@
+#include <string.h>
+
+#include "merkle.h"
+#include "file_hasher.h"
+
+static size_t up(size_t n) {
+    return (n + MERKLE_FANOUT - 1) / MERKLE_FANOUT;
+}
+
+int merkle_levels(int nblocks) {
+    if (nblocks <= 0) return 0;
+    int levels = 1;
+    for (size_t n = up((size_t)nblocks); n > 1; n = up(n)) levels++;
+    return levels;
+}
+
+size_t merkle_level_size(int nblocks, int level) {
+    if (level < 0 || level >= merkle_levels(nblocks)) return 0;
+    size_t n = up((size_t)nblocks);
+    while (level-- > 0) n = up(n);
+    return n;
+}
+
+size_t merkle_level_offset(int nblocks, int level) {
+    size_t off = 0;
+    for (int k = 0; k < level; k++) off += merkle_level_size(nblocks, k);
+    return off;
+}
+
+size_t merkle_nodes(int nblocks) {
+    return merkle_level_offset(nblocks, merkle_levels(nblocks));
+}
+
+void merkle_leaf(int alg, const block_sig_t *sigs, int nblocks, size_t i, unsigned char *out) {
+    size_t first = i * MERKLE_FANOUT;
+    size_t cnt = (size_t)nblocks - first < MERKLE_FANOUT ? (size_t)nblocks - first : MERKLE_FANOUT;
+    strong_hash(alg, (const unsigned char *)(sigs + first), cnt * sizeof(block_sig_t), out);
+}
+
+void merkle_build(int alg, const block_sig_t *sigs, int nblocks, const unsigned char *leaves,
+                  unsigned char *tree) {
+    size_t n = merkle_level_size(nblocks, 0);
+    if (leaves) {
+        memcpy(tree, leaves, n * MERKLE_NODE_LEN);
+    } else {
+        for (size_t i = 0; i < n; i++) merkle_leaf(alg, sigs, nblocks, i, tree + i * MERKLE_NODE_LEN);
+    }
+
+    unsigned char *below = tree;
+    while (n > 1) {
+        unsigned char *level = below + n * MERKLE_NODE_LEN;
+        size_t parents = up(n);
+        for (size_t i = 0; i < parents; i++) {
+            size_t first = i * MERKLE_FANOUT;
+            size_t cnt = n - first < MERKLE_FANOUT ? n - first : MERKLE_FANOUT;
+            strong_hash(alg, below + first * MERKLE_NODE_LEN, cnt * MERKLE_NODE_LEN,
+                        level + i * MERKLE_NODE_LEN);
+        }
+        below = level;
+        n = parents;
+    }
+}
+
+const unsigned char *merkle_root(const unsigned char *tree, int nblocks) {
+    size_t n = merkle_nodes(nblocks);
+    return n ? tree + (n - 1) * MERKLE_NODE_LEN : NULL;
+}
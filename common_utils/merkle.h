@@ -0,0 +1,31 @@
+#ifndef MERKLE_H
+#define MERKLE_H
+
+#include <stddef.h>
+#include "protocol.h"
+
+#define MERKLE_FANOUT 64     /* signatures per leaf, children per inner node */
+#define MERKLE_NODE_LEN 16
+/* Below this many blocks sending every signature is cheaper than the
+ * round trips of a descent */
+#define MERKLE_MIN_BLOCKS 4096
+
+/* Hash tree over a file's block signatures. Leaf i hashes signatures
+ * i*MERKLE_FANOUT onwards, each inner node hashes up to MERKLE_FANOUT
+ * nodes of the level below, up to a single root. Node i of level k covers
+ * the same blocks in every file, so two trees are compared node by node.
+ * Trees are stored level by level, leaves first. */
+int merkle_levels(int nblocks);
+size_t merkle_level_size(int nblocks, int level);
+size_t merkle_level_offset(int nblocks, int level);   /* in nodes */
+size_t merkle_nodes(int nblocks);
+
+/* Leaf i: the hash of the signatures it covers */
+void merkle_leaf(int alg, const block_sig_t *sigs, int nblocks, size_t i, unsigned char *out);
+/* Fills tree with merkle_nodes(nblocks) nodes. With leaves set, level 0 is
+ * copied from it instead of hashed. */
+void merkle_build(int alg, const block_sig_t *sigs, int nblocks, const unsigned char *leaves,
+                  unsigned char *tree);
+const unsigned char *merkle_root(const unsigned char *tree, int nblocks);
+
+#endif
@@ -0,0 +1,137 @@
+#include "netbuf.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+int nb_init(netbuf_t *nb, int fd) {
+    memset(nb, 0, sizeof(*nb));
+    nb->fd = fd;
+    nb->buf = malloc(NETBUF_INITIAL_CAP);
+    if (!nb->buf) return -1;
+    nb->cap = NETBUF_INITIAL_CAP;
+    return 0;
+}
+
+void nb_free(netbuf_t *nb) {
+    free(nb->buf);
+    nb->buf = NULL;
+    nb->cap = nb->start = nb->end = 0;
+}
+
+size_t nb_avail(const netbuf_t *nb) {
+    return nb->end - nb->start;
+}
+
+const char *nb_data(const netbuf_t *nb) {
+    return nb->buf + nb->start;
+}
+
+void nb_consume(netbuf_t *nb, size_t n) {
+    nb->start += n;
+    if (nb->start >= nb->end) nb->start = nb->end = 0;
+}
+
+/* Ensures there is free space after end and that `want` bytes of unread
+ * data fit in the buffer, compacting before growing. */
+static int make_room(netbuf_t *nb, size_t want) {
+    size_t avail = nb_avail(nb);
+    size_t need = want > avail ? want : avail;
+
+    if (nb->start > 0 && (nb->cap - nb->end < 4096 || nb->start + need > nb->cap)) {
+        memmove(nb->buf, nb->buf + nb->start, avail);
+        nb->start = 0;
+        nb->end = avail;
+    }
+
+    size_t cap = nb->cap;
+    while (cap < nb->start + need || cap - nb->end < 4096) cap *= 2;
+    if (cap == nb->cap) return 0;
+    char *n = realloc(nb->buf, cap);
+    if (!n) return -1;
+    nb->buf = n;
+    nb->cap = cap;
+    return 0;
+}
+
+/* Reads whatever the socket has without blocking, growing the buffer so
+ * that at least `want` bytes fit. Returns bytes read, 0 on EOF, or -1
+ * with errno set (EAGAIN when nothing is pending). */
+ssize_t nb_fill(netbuf_t *nb, size_t want) {
+    if (make_room(nb, want) != 0) {
+        errno = ENOMEM;
+        return -1;
+    }
+    ssize_t r;
+    do {
+        r = recv(nb->fd, nb->buf + nb->end, nb->cap - nb->end, MSG_DONTWAIT);
+    } while (r < 0 && errno == EINTR);
+    if (r == 0) nb->eof = 1;
+    if (r > 0) nb->end += (size_t)r;
+    return r;
+}
+
+size_t nb_take(netbuf_t *nb, void *dst, size_t n) {
+    size_t avail = nb_avail(nb);
+    if (n > avail) n = avail;
+    memcpy(dst, nb->buf + nb->start, n);
+    nb_consume(nb, n);
+    return n;
+}
+
+/* Copies one complete buffered line (including '\n') into dst and
+ * NUL-terminates it. Returns 0 if no full line is buffered yet, -1 if the
+ * line does not fit in dst. */
+ssize_t nb_take_line(netbuf_t *nb, char *dst, size_t cap) {
+    const char *p = nb->buf + nb->start;
+    const char *nl = memchr(p, '\n', nb_avail(nb));
+    if (!nl) return nb_avail(nb) >= cap ? -1 : 0;
+    size_t len = (size_t)(nl - p) + 1;
+    if (len >= cap) return -1;
+    memcpy(dst, p, len);
+    dst[len] = '\0';
+    nb_consume(nb, len);
+    return (ssize_t)len;
+}
+
+static int wait_readable(netbuf_t *nb) {
+    struct pollfd pfd = { nb->fd, POLLIN, 0 };
+    int rc;
+    do {
+        rc = poll(&pfd, 1, NETBUF_IO_TIMEOUT_MS);
+    } while (rc < 0 && errno == EINTR);
+    return rc > 0 ? 0 : -1;
+}
+
+static int fill_wait(netbuf_t *nb, size_t want) {
+    for (;;) {
+        ssize_t r = nb_fill(nb, want);
+        if (r > 0) return 0;
+        if (r == 0) return -1;
+        if (errno != EAGAIN && errno != EWOULDBLOCK) return -1;
+        if (wait_readable(nb) != 0) return -1;
+    }
+}
+
+ssize_t nb_read_n(netbuf_t *nb, void *dst, size_t n) {
+    char *p = dst;
+    size_t got = nb_take(nb, p, n);
+    while (got < n) {
+        if (fill_wait(nb, 1) != 0) return (ssize_t)got;
+        got += nb_take(nb, p + got, n - got);
+    }
+    return (ssize_t)n;
+}
+
+ssize_t nb_read_line(netbuf_t *nb, char *dst, size_t cap) {
+    for (;;) {
+        ssize_t n = nb_take_line(nb, dst, cap);
+        if (n != 0) return n;
+        if (fill_wait(nb, nb_avail(nb) + 1) != 0) {
+            dst[0] = '\0';
+            return 0;
+        }
+    }
+}
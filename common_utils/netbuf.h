@@ -0,0 +1,33 @@
+#ifndef NETBUF_H
+#define NETBUF_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#define NETBUF_INITIAL_CAP (64 * 1024)
+#define NETBUF_IO_TIMEOUT_MS 60000
+
+/* Buffered reader over a socket. The fill/take calls never block and are
+ * used by the event loop; nb_read_n/nb_read_line wait for data (with a
+ * timeout) and work on blocking and non-blocking sockets alike. */
+typedef struct {
+    int fd;
+    char *buf;
+    size_t start, end, cap;
+    int eof;
+} netbuf_t;
+
+int nb_init(netbuf_t *nb, int fd);
+void nb_free(netbuf_t *nb);
+
+ssize_t nb_fill(netbuf_t *nb, size_t want);
+size_t nb_avail(const netbuf_t *nb);
+const char *nb_data(const netbuf_t *nb);
+void nb_consume(netbuf_t *nb, size_t n);
+size_t nb_take(netbuf_t *nb, void *dst, size_t n);
+ssize_t nb_take_line(netbuf_t *nb, char *dst, size_t cap);
+
+ssize_t nb_read_n(netbuf_t *nb, void *dst, size_t n);
+ssize_t nb_read_line(netbuf_t *nb, char *dst, size_t cap);
+
+#endif
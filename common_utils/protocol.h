@@ -5,6 +5,10 @@
 #include <stdint.h>
 
 #define BLOCK_SIZE 1024
+/* Bounds of the per-file block size carried in a binary FILE_HDR; the
+ * text protocol and the delta paths always use BLOCK_SIZE */
+#define BLOCK_SIZE_MIN 256
+#define BLOCK_SIZE_MAX (64 * 1024)
 #define MAX_PATH_LEN 1024
 
 #define MSG_SYNC_START "SYNC_START"
@@ -19,10 +23,32 @@
 #define MSG_FILE_END  "FILE_END"
 #define MSG_FILE_ERR  "FILE_ERR"
 
+/* STATS [prometheus]: the server's counters and phase latencies */
+#define MSG_STATS     "STATS"
+
+#define MSG_DELTA_HDR "DELTA_HDR"
+#define MSG_SIGS      "SIGS"
+#define MSG_COPY      "COPY"
+#define MSG_LITERAL   "LITERAL"
+#define MSG_LITERAL_DICT "LITERAL_DICT"
+#define MSG_DELTA_END "DELTA_END"
+#define MSG_FILE_OK   "FILE_OK"
+#define MSG_DELTA_GET  "DELTA_GET"
+#define MSG_DELTA_DATA "DELTA_DATA"
+
+#define MSG_CHUNK_HDR "CHUNK_HDR"
+
 
 typedef struct {
     uint32_t weak;       
     unsigned char strong[16]; 
 } block_sig_t;
 
+/* Signature of a variable-length content-defined chunk */
+typedef struct {
+    uint32_t len;
+    uint32_t weak;
+    unsigned char strong[16];
+} chunk_sig_t;
+
 #endif
@@ -0,0 +1,159 @@
+#include "sig_engine.h"
+#include "file_hasher.h"
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#define SIG_MAX_THREADS 64
+
+/* Batches are computed into a ring of slots; a worker may only run ahead
+ * of the sink by the size of the ring, which bounds memory for any file
+ * size. */
+typedef struct {
+    const unsigned char *data;
+    size_t size, block_size;
+    int hash_alg;
+    sig_reuse_t *reuse;
+    int nblocks, nbatches, nslots;
+    block_sig_t *slots;
+    int *slot_batch;        /* batch held by each slot, -1 while in progress */
+    int next_batch;         /* next batch to hand to a worker */
+    int emitted;            /* batches already passed to the sink */
+    int stop;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} sig_engine_t;
+
+static void hash_batch(sig_engine_t *e, int batch, block_sig_t *out) {
+    int first = batch * SIG_BATCH_BLOCKS;
+    int last = first + SIG_BATCH_BLOCKS < e->nblocks ? first + SIG_BATCH_BLOCKS : e->nblocks;
+    uint32_t weak[SIG_BATCH_BLOCKS];
+    size_t start = (size_t)first * e->block_size;
+    size_t end = (size_t)last * e->block_size < e->size ? (size_t)last * e->block_size : e->size;
+    rsync_weak_checksum_blocks(e->data + start, end - start, e->block_size, weak);
+    sig_reuse_t *r = e->reuse;
+    int reused = 0;
+    for (int i = first; i < last; i++) {
+        size_t off = (size_t)i * e->block_size;
+        size_t len = e->size - off < e->block_size ? e->size - off : e->block_size;
+        out[i - first].weak = weak[i - first];
+        if (r) {
+            r->fps_out[i] = block_fingerprint(e->data + off, len);
+            if (i < r->nblocks && r->fps[i] == r->fps_out[i] && r->sigs[i].weak == weak[i - first]) {
+                memcpy(out[i - first].strong, r->sigs[i].strong, 16);
+                reused++;
+                continue;
+            }
+        }
+        strong_hash(e->hash_alg, e->data + off, len, out[i - first].strong);
+    }
+    if (reused) __atomic_add_fetch(&r->reused, reused, __ATOMIC_RELAXED);
+}
+
+static void *sig_worker(void *arg) {
+    sig_engine_t *e = arg;
+
+    pthread_mutex_lock(&e->lock);
+    while (!e->stop && e->next_batch < e->nbatches) {
+        if (e->next_batch >= e->emitted + e->nslots) {
+            pthread_cond_wait(&e->cond, &e->lock);
+            continue;
+        }
+        int b = e->next_batch++;
+        int slot = b % e->nslots;
+        e->slot_batch[slot] = -1;
+        pthread_mutex_unlock(&e->lock);
+
+        hash_batch(e, b, e->slots + (size_t)slot * SIG_BATCH_BLOCKS);
+
+        pthread_mutex_lock(&e->lock);
+        e->slot_batch[slot] = b;
+        pthread_cond_broadcast(&e->cond);
+    }
+    pthread_mutex_unlock(&e->lock);
+    return NULL;
+}
+
+int sig_engine_run(const unsigned char *data, size_t size, size_t block_size, int hash_alg,
+                   int nthreads, sig_sink_fn sink, void *arg) {
+    return sig_engine_run_reuse(data, size, block_size, hash_alg, nthreads, NULL, sink, arg);
+}
+
+int sig_engine_run_reuse(const unsigned char *data, size_t size, size_t block_size, int hash_alg,
+                         int nthreads, sig_reuse_t *reuse, sig_sink_fn sink, void *arg) {
+    sig_engine_t e;
+    memset(&e, 0, sizeof(e));
+    e.data = data;
+    e.size = size;
+    e.block_size = block_size;
+    e.hash_alg = hash_alg;
+    e.reuse = reuse;
+    if (reuse) reuse->reused = 0;
+    e.nblocks = (int)((size + block_size - 1) / block_size);
+    e.nbatches = (e.nblocks + SIG_BATCH_BLOCKS - 1) / SIG_BATCH_BLOCKS;
+    if (e.nbatches == 0) return 0;
+
+    if (nthreads <= 0) nthreads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (nthreads > SIG_MAX_THREADS) nthreads = SIG_MAX_THREADS;
+    if (nthreads > e.nbatches) nthreads = e.nbatches;
+    if (nthreads < 1) nthreads = 1;
+
+    /* A single batch is not worth a thread */
+    if (nthreads == 1) {
+        block_sig_t *out = malloc(sizeof(block_sig_t) * SIG_BATCH_BLOCKS);
+        int rc = out ? 0 : -1;
+        for (int b = 0; rc == 0 && b < e.nbatches; b++) {
+            hash_batch(&e, b, out);
+            int count = b == e.nbatches - 1 ? e.nblocks - b * SIG_BATCH_BLOCKS : SIG_BATCH_BLOCKS;
+            rc = sink(arg, out, count);
+        }
+        free(out);
+        return rc;
+    }
+
+    e.nslots = nthreads * 2;
+    e.slots = malloc(sizeof(block_sig_t) * SIG_BATCH_BLOCKS * (size_t)e.nslots);
+    e.slot_batch = malloc(sizeof(int) * (size_t)e.nslots);
+    if (!e.slots || !e.slot_batch) {
+        free(e.slots);
+        free(e.slot_batch);
+        return -1;
+    }
+    for (int i = 0; i < e.nslots; i++) e.slot_batch[i] = -1;
+    pthread_mutex_init(&e.lock, NULL);
+    pthread_cond_init(&e.cond, NULL);
+
+    pthread_t tids[SIG_MAX_THREADS];
+    int started = 0;
+    for (; started < nthreads; started++)
+        if (pthread_create(&tids[started], NULL, sig_worker, &e) != 0) break;
+
+    int rc = started > 0 ? 0 : -1;
+    for (int b = 0; rc == 0 && b < e.nbatches; b++) {
+        int slot = b % e.nslots;
+        pthread_mutex_lock(&e.lock);
+        while (e.slot_batch[slot] != b) pthread_cond_wait(&e.cond, &e.lock);
+        pthread_mutex_unlock(&e.lock);
+
+        int count = b == e.nbatches - 1 ? e.nblocks - b * SIG_BATCH_BLOCKS : SIG_BATCH_BLOCKS;
+        rc = sink(arg, e.slots + (size_t)slot * SIG_BATCH_BLOCKS, count);
+
+        pthread_mutex_lock(&e.lock);
+        e.emitted = b + 1;
+        pthread_cond_broadcast(&e.cond);
+        pthread_mutex_unlock(&e.lock);
+    }
+
+    pthread_mutex_lock(&e.lock);
+    e.stop = 1;
+    pthread_cond_broadcast(&e.cond);
+    pthread_mutex_unlock(&e.lock);
+    for (int i = 0; i < started; i++) pthread_join(tids[i], NULL);
+
+    pthread_mutex_destroy(&e.lock);
+    pthread_cond_destroy(&e.cond);
+    free(e.slots);
+    free(e.slot_batch);
+    return rc;
+}
@@ -0,0 +1,34 @@
+#ifndef SIG_ENGINE_H
+#define SIG_ENGINE_H
+
+#include <stddef.h>
+#include "protocol.h"
+
+#define SIG_BATCH_BLOCKS 4096
+
+/* Receives consecutive signatures in file order. Returning non-zero stops
+ * the engine. */
+typedef int (*sig_sink_fn)(void *arg, const block_sig_t *sigs, int count);
+
+/* Hashes data in block_size blocks with strong hash hash_alg (HASH_*) on
+ * nthreads workers (0 = one per CPU) and hands finished batches to sink
+ * from the calling thread, so the sink can write to a socket while later
+ * batches are still being hashed. */
+int sig_engine_run(const unsigned char *data, size_t size, size_t block_size, int hash_alg,
+                   int nthreads, sig_sink_fn sink, void *arg);
+
+/* Signatures of an earlier version of the same data in the same hash, with
+ * a block_fingerprint per block. A block whose weak sum and fingerprint
+ * are unchanged keeps its strong hash instead of being rehashed. */
+typedef struct {
+    const block_sig_t *sigs;    /* may be NULL with nblocks 0 */
+    const uint64_t *fps;
+    int nblocks;
+    uint64_t *fps_out;          /* receives the fingerprints of data, one per block */
+    int reused;                 /* set to the number of strong hashes kept */
+} sig_reuse_t;
+
+int sig_engine_run_reuse(const unsigned char *data, size_t size, size_t block_size, int hash_alg,
+                         int nthreads, sig_reuse_t *reuse, sig_sink_fn sink, void *arg);
+
+#endif
@@ -0,0 +1,498 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include "chunk_store.h"
+#include "log.h"
+#include "../common_utils/file_hasher.h"
+
+#define CHUNK_STORE_MAGIC 0x53434c52   /* "RLCS" */
+#define CHUNK_PACK_MAGIC 0x50434c52    /* "RLCP" */
+#define CHUNK_STORE_VERSION 3
+#define CHUNK_GC_MIN_DEAD (64ULL * 1024 * 1024)
+#define CHUNK_SAVE_BATCH 256
+
+/* Both files start with this header. gc writes a new generation of both;
+ * an index whose generation differs from the pack's describes another
+ * pack and is discarded. */
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t gen;
+} cs_hdr_t;
+
+/* chunks.idx is the header followed by one record per chunk, appended as
+ * chunks are stored; only gc rewrites it */
+typedef struct {
+    unsigned char strong[16];
+    uint32_t len;
+    uint32_t hash_alg;
+    uint64_t off;
+} cs_rec_t;
+
+/* Chunks are only shared between files hashed with the same algorithm, so
+ * a collision in a weak one cannot stand in for data keyed by another */
+typedef struct {
+    unsigned char strong[16];
+    uint32_t len;
+    uint32_t refs;      /* rebuilt from the manifests at startup, never persisted */
+    uint64_t off;
+    uint32_t hash_alg;
+    uint32_t pad;
+} cs_entry_t;
+
+struct chunk_store {
+    pthread_mutex_t lock;
+    int pack_fd;
+    int idx_fd;
+    char pack_path[512];
+    char idx_path[512];
+    uint64_t gen;
+    uint64_t pack_size;
+    uint64_t idx_size;
+    cs_entry_t *entries;
+    size_t count, cap;
+    size_t saved;       /* entries already recorded in chunks.idx */
+    int *slots;
+    size_t mask;
+    uint64_t saved_uploads, saved_bytes;
+};
+
+static size_t slot_for(const unsigned char strong[16], size_t mask) {
+    uint64_t h;
+    memcpy(&h, strong, sizeof(h));
+    return (size_t)h & mask;
+}
+
+static int find_entry(const chunk_store_t *cs, int hash_alg, const unsigned char strong[16],
+                      uint32_t len) {
+    for (size_t s = slot_for(strong, cs->mask); cs->slots[s] >= 0; s = (s + 1) & cs->mask) {
+        const cs_entry_t *e = &cs->entries[cs->slots[s]];
+        if (memcmp(e->strong, strong, 16) == 0 && e->len == len && e->hash_alg == (uint32_t)hash_alg)
+            return cs->slots[s];
+    }
+    return -1;
+}
+
+static int rebuild_slots(chunk_store_t *cs, size_t want) {
+    size_t cap = 1024;
+    while (cap < want * 2) cap <<= 1;
+    int *slots = malloc(sizeof(int) * cap);
+    if (!slots) return -1;
+    for (size_t i = 0; i < cap; i++) slots[i] = -1;
+    free(cs->slots);
+    cs->slots = slots;
+    cs->mask = cap - 1;
+    for (size_t i = 0; i < cs->count; i++) {
+        size_t s = slot_for(cs->entries[i].strong, cs->mask);
+        while (cs->slots[s] >= 0) s = (s + 1) & cs->mask;
+        cs->slots[s] = (int)i;
+    }
+    return 0;
+}
+
+static int insert_entry(chunk_store_t *cs, int hash_alg, const unsigned char strong[16], uint32_t len,
+                        uint64_t off) {
+    if (cs->count == cs->cap) {
+        size_t ncap = cs->cap ? cs->cap * 2 : 1024;
+        cs_entry_t *n = realloc(cs->entries, sizeof(cs_entry_t) * ncap);
+        if (!n) return -1;
+        cs->entries = n;
+        cs->cap = ncap;
+    }
+    if ((cs->count + 1) * 2 > cs->mask + 1 && rebuild_slots(cs, cs->count + 1) != 0)
+        return -1;
+
+    cs_entry_t *e = &cs->entries[cs->count];
+    memcpy(e->strong, strong, 16);
+    e->len = len;
+    e->refs = 0;
+    e->off = off;
+    e->hash_alg = (uint32_t)hash_alg;
+    e->pad = 0;
+
+    size_t s = slot_for(strong, cs->mask);
+    while (cs->slots[s] >= 0) s = (s + 1) & cs->mask;
+    cs->slots[s] = (int)cs->count;
+    return (int)cs->count++;
+}
+
+static int read_hdr(int fd, uint32_t magic, cs_hdr_t *h) {
+    return pread(fd, h, sizeof(*h), 0) == (ssize_t)sizeof(*h) && h->magic == magic &&
+           h->version == CHUNK_STORE_VERSION;
+}
+
+/* Loads the records of a matching pack and index. Returns -1 if they
+ * belong to different generations or an older format. */
+static int load_index(chunk_store_t *cs) {
+    struct stat pst, ist;
+    cs_hdr_t ph, ih;
+    if (fstat(cs->pack_fd, &pst) != 0 || fstat(cs->idx_fd, &ist) != 0 ||
+        !read_hdr(cs->pack_fd, CHUNK_PACK_MAGIC, &ph) || !read_hdr(cs->idx_fd, CHUNK_STORE_MAGIC, &ih) ||
+        ih.gen != ph.gen)
+        return -1;
+    cs->gen = ph.gen;
+    cs->pack_size = (uint64_t)pst.st_size;
+
+    uint64_t nrec = ((uint64_t)ist.st_size - sizeof(ih)) / sizeof(cs_rec_t);
+    cs_rec_t recs[CHUNK_SAVE_BATCH];
+    for (uint64_t i = 0; i < nrec; i += CHUNK_SAVE_BATCH) {
+        size_t n = nrec - i < CHUNK_SAVE_BATCH ? (size_t)(nrec - i) : CHUNK_SAVE_BATCH;
+        off_t at = (off_t)(sizeof(ih) + i * sizeof(cs_rec_t));
+        if (pread(cs->idx_fd, recs, n * sizeof(cs_rec_t), at) != (ssize_t)(n * sizeof(cs_rec_t)))
+            return -1;
+        for (size_t k = 0; k < n; k++) {
+            const cs_rec_t *r = &recs[k];
+            /* Records past the end of the pack were never fully written */
+            if (r->off < sizeof(ph) || r->off + r->len > cs->pack_size) continue;
+            int alg = (int)r->hash_alg;
+            if (find_entry(cs, alg, r->strong, r->len) < 0 &&
+                insert_entry(cs, alg, r->strong, r->len, r->off) < 0)
+                return -1;
+        }
+    }
+    cs->idx_size = sizeof(ih) + nrec * sizeof(cs_rec_t);
+    if (cs->idx_size < (uint64_t)ist.st_size) {
+        log_warn("Chunk index %s: dropping a torn record", cs->idx_path);
+        if (ftruncate(cs->idx_fd, (off_t)cs->idx_size) != 0)
+            log_error("ftruncate chunk index: %s", strerror(errno));
+    }
+    cs->saved = cs->count;
+    return 0;
+}
+
+/* Empties both files and starts them over at generation gen */
+static int reset_files(chunk_store_t *cs, uint64_t gen) {
+    cs_hdr_t ph = { CHUNK_PACK_MAGIC, CHUNK_STORE_VERSION, gen };
+    cs_hdr_t ih = { CHUNK_STORE_MAGIC, CHUNK_STORE_VERSION, gen };
+    if (ftruncate(cs->pack_fd, 0) != 0 || pwrite(cs->pack_fd, &ph, sizeof(ph), 0) != (ssize_t)sizeof(ph) ||
+        ftruncate(cs->idx_fd, 0) != 0 || pwrite(cs->idx_fd, &ih, sizeof(ih), 0) != (ssize_t)sizeof(ih))
+        return -1;
+    cs->count = cs->saved = 0;
+    cs->gen = gen;
+    cs->pack_size = sizeof(ph);
+    cs->idx_size = sizeof(ih);
+    return rebuild_slots(cs, 0);
+}
+
+chunk_store_t *chunk_store_open(const char *pack_path, const char *idx_path) {
+    chunk_store_t *cs = calloc(1, sizeof(*cs));
+    if (!cs) return NULL;
+    pthread_mutex_init(&cs->lock, NULL);
+    snprintf(cs->pack_path, sizeof(cs->pack_path), "%s", pack_path);
+    snprintf(cs->idx_path, sizeof(cs->idx_path), "%s", idx_path);
+
+    cs->pack_fd = open(pack_path, O_RDWR | O_CREAT, 0644);
+    cs->idx_fd = open(idx_path, O_RDWR | O_CREAT, 0644);
+    if (cs->pack_fd < 0 || cs->idx_fd < 0) {
+        log_error("open chunk store: %s", strerror(errno));
+        chunk_store_close(cs);
+        return NULL;
+    }
+    if (rebuild_slots(cs, 0) != 0) {
+        chunk_store_close(cs);
+        return NULL;
+    }
+
+    if (load_index(cs) != 0) {
+        /* The manifests re-add every chunk at startup, so a store that
+         * cannot be trusted is simply started over */
+        struct stat st;
+        cs_hdr_t ph;
+        uint64_t gen = read_hdr(cs->pack_fd, CHUNK_PACK_MAGIC, &ph) ? ph.gen + 1 : 1;
+        if (fstat(cs->pack_fd, &st) == 0 && st.st_size > 0)
+            log_warn("Chunk store %s does not match %s or is outdated, starting it over",
+                     idx_path, pack_path);
+        if (reset_files(cs, gen) != 0) {
+            log_error("reset chunk store: %s", strerror(errno));
+            chunk_store_close(cs);
+            return NULL;
+        }
+    }
+    return cs;
+}
+
+void chunk_store_close(chunk_store_t *cs) {
+    if (!cs) return;
+    if (cs->pack_fd >= 0) close(cs->pack_fd);
+    if (cs->idx_fd >= 0) close(cs->idx_fd);
+    free(cs->entries);
+    free(cs->slots);
+    pthread_mutex_destroy(&cs->lock);
+    free(cs);
+}
+
+int chunk_store_has(chunk_store_t *cs, int hash_alg, const unsigned char strong[16], uint32_t len) {
+    pthread_mutex_lock(&cs->lock);
+    int has = find_entry(cs, hash_alg, strong, len) >= 0;
+    pthread_mutex_unlock(&cs->lock);
+    return has;
+}
+
+/* The pack is not synced as it grows, so what a crash left behind is
+ * rehashed on every read rather than trusted */
+static int read_chunk(chunk_store_t *cs, int hash_alg, const unsigned char strong[16], uint32_t len,
+                      unsigned char *out, int count_saved) {
+    pthread_mutex_lock(&cs->lock);
+    int i = find_entry(cs, hash_alg, strong, len);
+    uint64_t off = i >= 0 ? cs->entries[i].off : 0;
+    int ok = i >= 0 && pread(cs->pack_fd, out, len, (off_t)off) == (ssize_t)len;
+    pthread_mutex_unlock(&cs->lock);
+    if (!ok) return -1;
+
+    unsigned char check[16];
+    strong_hash(hash_alg, out, len, check);
+    if (memcmp(check, strong, 16) != 0) {
+        log_warn("Chunk store: chunk at offset %llu does not match its hash", (unsigned long long)off);
+        return -1;
+    }
+    if (count_saved) {
+        pthread_mutex_lock(&cs->lock);
+        cs->saved_uploads++;
+        cs->saved_bytes += len;
+        pthread_mutex_unlock(&cs->lock);
+    }
+    return 0;
+}
+
+/* Reads a chunk that stands in for an upload */
+int chunk_store_read(chunk_store_t *cs, int hash_alg, const unsigned char strong[16], uint32_t len,
+                     unsigned char *out) {
+    return read_chunk(cs, hash_alg, strong, len, out, 1);
+}
+
+/* Reads a chunk for any other purpose, e.g. as a compression dictionary */
+int chunk_store_fetch(chunk_store_t *cs, int hash_alg, const unsigned char strong[16], uint32_t len,
+                      unsigned char *out) {
+    return read_chunk(cs, hash_alg, strong, len, out, 0);
+}
+
+static uint32_t entry_len(const uint32_t *lens, uint32_t block_size, int i, size_t off,
+                          size_t filesize) {
+    if (lens) return lens[i];
+    return (uint32_t)(filesize - off < block_size ? filesize - off : block_size);
+}
+
+/* References every chunk of a committed file, copying chunks the store
+ * has not seen yet out of the file. Data is checked against the manifest
+ * (hashed with the manifest's hash_alg) so a file that drifted from its
+ * index never poisons the store. */
+int chunk_store_add_file(chunk_store_t *cs, const char *path, const block_sig_t *sigs,
+                         const uint32_t *lens, uint32_t block_size, int n, size_t filesize,
+                         int hash_alg) {
+    int fd = open(path, O_RDONLY);
+    unsigned char *buf = NULL;
+    size_t buf_cap = 0;
+    size_t off = 0;
+    int rc = 0;
+
+    pthread_mutex_lock(&cs->lock);
+    for (int i = 0; i < n; i++) {
+        uint32_t len = entry_len(lens, block_size, i, off, filesize);
+        int e = find_entry(cs, hash_alg, sigs[i].strong, len);
+
+        if (e < 0 && fd >= 0) {
+            if (len > buf_cap) {
+                unsigned char *nb = realloc(buf, len);
+                if (!nb) { rc = -1; break; }
+                buf = nb;
+                buf_cap = len;
+            }
+            /* Reading and verifying the chunk does not hold up other
+             * files; someone else may have stored it in the meantime. */
+            pthread_mutex_unlock(&cs->lock);
+            unsigned char strong[16];
+            int ok = pread(fd, buf, len, (off_t)off) == (ssize_t)len;
+            if (ok) {
+                strong_hash(hash_alg, buf, len, strong);
+                ok = memcmp(strong, sigs[i].strong, 16) == 0;
+            }
+            pthread_mutex_lock(&cs->lock);
+            e = find_entry(cs, hash_alg, sigs[i].strong, len);
+            if (e < 0 && ok &&
+                pwrite(cs->pack_fd, buf, len, (off_t)cs->pack_size) == (ssize_t)len) {
+                e = insert_entry(cs, hash_alg, sigs[i].strong, len, cs->pack_size);
+                cs->pack_size += len;
+            }
+        }
+        if (e >= 0) cs->entries[e].refs++;
+        off += len;
+    }
+    pthread_mutex_unlock(&cs->lock);
+
+    free(buf);
+    if (fd >= 0) close(fd);
+    return rc;
+}
+
+void chunk_store_release(chunk_store_t *cs, const block_sig_t *sigs, const uint32_t *lens,
+                         uint32_t block_size, int n, size_t filesize, int hash_alg) {
+    size_t off = 0;
+    pthread_mutex_lock(&cs->lock);
+    for (int i = 0; i < n; i++) {
+        uint32_t len = entry_len(lens, block_size, i, off, filesize);
+        int e = find_entry(cs, hash_alg, sigs[i].strong, len);
+        if (e >= 0 && cs->entries[e].refs > 0) cs->entries[e].refs--;
+        off += len;
+    }
+    pthread_mutex_unlock(&cs->lock);
+}
+
+/* Writes the records of entries from..count-1 at *pos in fd */
+static int write_recs(int fd, const cs_entry_t *entries, size_t from, size_t count, uint64_t *pos) {
+    cs_rec_t recs[CHUNK_SAVE_BATCH];
+    while (from < count) {
+        size_t n = count - from < CHUNK_SAVE_BATCH ? count - from : CHUNK_SAVE_BATCH;
+        memset(recs, 0, sizeof(cs_rec_t) * n);
+        for (size_t k = 0; k < n; k++) {
+            memcpy(recs[k].strong, entries[from + k].strong, 16);
+            recs[k].len = entries[from + k].len;
+            recs[k].hash_alg = entries[from + k].hash_alg;
+            recs[k].off = entries[from + k].off;
+        }
+        size_t bytes = sizeof(cs_rec_t) * n;
+        if (pwrite(fd, recs, bytes, (off_t)*pos) != (ssize_t)bytes) return -1;
+        *pos += bytes;
+        from += n;
+    }
+    return 0;
+}
+
+/* Appends the chunks stored since the last save to chunks.idx */
+static int save_locked(chunk_store_t *cs) {
+    uint64_t pos = cs->idx_size;
+    if (write_recs(cs->idx_fd, cs->entries, cs->saved, cs->count, &pos) != 0) {
+        log_error("write chunk index: %s", strerror(errno));
+        if (ftruncate(cs->idx_fd, (off_t)cs->idx_size) != 0)
+            log_error("ftruncate chunk index: %s", strerror(errno));
+        return -1;
+    }
+    cs->idx_size = pos;
+    cs->saved = cs->count;
+    return 0;
+}
+
+int chunk_store_save(chunk_store_t *cs) {
+    pthread_mutex_lock(&cs->lock);
+    int rc = save_locked(cs);
+    pthread_mutex_unlock(&cs->lock);
+    return rc;
+}
+
+int chunk_store_should_gc(chunk_store_t *cs) {
+    chunk_store_stats_t st;
+    chunk_store_stats(cs, &st);
+    return st.dead_bytes > CHUNK_GC_MIN_DEAD && st.dead_bytes > st.stored_bytes;
+}
+
+/* Rewrites the pack with only referenced chunks, as the next generation
+ * of both files. Each is durable before either replaces the old one, and
+ * a crash between the two renames leaves generations that do not match. */
+int chunk_store_gc(chunk_store_t *cs) {
+    char tmp[600], idx_tmp[600];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", cs->pack_path);
+    snprintf(idx_tmp, sizeof(idx_tmp), "%s.tmp", cs->idx_path);
+
+    pthread_mutex_lock(&cs->lock);
+    int out = open(tmp, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    int idx_out = open(idx_tmp, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (out < 0 || idx_out < 0) {
+        log_error("open chunk store tmp: %s", strerror(errno));
+        if (out >= 0) close(out);
+        if (idx_out >= 0) close(idx_out);
+        unlink(tmp);
+        unlink(idx_tmp);
+        pthread_mutex_unlock(&cs->lock);
+        return -1;
+    }
+
+    unsigned char *buf = NULL;
+    size_t buf_cap = 0, kept = 0;
+    cs_hdr_t ph = { CHUNK_PACK_MAGIC, CHUNK_STORE_VERSION, cs->gen + 1 };
+    cs_hdr_t ih = { CHUNK_STORE_MAGIC, CHUNK_STORE_VERSION, cs->gen + 1 };
+    uint64_t new_size = sizeof(ph), idx_size = sizeof(ih);
+    cs_entry_t *live = malloc(sizeof(cs_entry_t) * (cs->count ? cs->count : 1));
+    int rc = live && pwrite(out, &ph, sizeof(ph), 0) == (ssize_t)sizeof(ph) &&
+                     pwrite(idx_out, &ih, sizeof(ih), 0) == (ssize_t)sizeof(ih)
+                 ? 0
+                 : -1;
+    for (size_t i = 0; rc == 0 && i < cs->count; i++) {
+        cs_entry_t e = cs->entries[i];
+        if (e.refs == 0) continue;
+        if (e.len > buf_cap) {
+            unsigned char *nb = realloc(buf, e.len);
+            if (!nb) { rc = -1; break; }
+            buf = nb;
+            buf_cap = e.len;
+        }
+        if (pread(cs->pack_fd, buf, e.len, (off_t)e.off) != (ssize_t)e.len ||
+            pwrite(out, buf, e.len, (off_t)new_size) != (ssize_t)e.len) {
+            rc = -1;
+            break;
+        }
+        e.off = new_size;
+        new_size += e.len;
+        live[kept++] = e;
+    }
+    free(buf);
+    if (rc == 0 && (write_recs(idx_out, live, 0, kept, &idx_size) != 0 || fsync(out) != 0 ||
+                    fsync(idx_out) != 0))
+        rc = -1;
+
+    if (rc != 0 || rename(tmp, cs->pack_path) != 0) {
+        close(out);
+        close(idx_out);
+        unlink(tmp);
+        unlink(idx_tmp);
+        free(live);
+        pthread_mutex_unlock(&cs->lock);
+        log_error("Chunk store gc failed");
+        return -1;
+    }
+    /* The new pack is in place; an index left behind is caught by its
+     * generation at the next start */
+    if (rename(idx_tmp, cs->idx_path) != 0)
+        log_error("rename chunk index: %s", strerror(errno));
+
+    size_t dropped = cs->count - kept;
+    close(cs->pack_fd);
+    close(cs->idx_fd);
+    cs->pack_fd = out;
+    cs->idx_fd = idx_out;
+    cs->gen++;
+    cs->pack_size = new_size;
+    cs->idx_size = idx_size;
+    free(cs->entries);
+    cs->entries = live;
+    cs->cap = cs->count ? cs->count : 1;
+    cs->count = cs->saved = kept;
+    rebuild_slots(cs, kept);
+    pthread_mutex_unlock(&cs->lock);
+
+    log_info("Chunk store gc: dropped %zu chunks, pack is now %llu bytes",
+             dropped, (unsigned long long)new_size);
+    return 0;
+}
+
+void chunk_store_stats(chunk_store_t *cs, chunk_store_stats_t *st) {
+    memset(st, 0, sizeof(*st));
+    pthread_mutex_lock(&cs->lock);
+    for (size_t i = 0; i < cs->count; i++) {
+        const cs_entry_t *e = &cs->entries[i];
+        if (e->refs == 0) {
+            st->dead_bytes += e->len;
+            continue;
+        }
+        st->chunks++;
+        st->stored_bytes += e->len;
+        st->logical_bytes += (uint64_t)e->len * e->refs;
+    }
+    st->saved_uploads = cs->saved_uploads;
+    st->saved_bytes = cs->saved_bytes;
+    pthread_mutex_unlock(&cs->lock);
+}
@@ -0,0 +1,46 @@
+#ifndef CHUNK_STORE_H
+#define CHUNK_STORE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "../common_utils/protocol.h"
+
+/* Content-addressable store shared by every file on the server. Chunk
+ * payloads live once in an append-only pack keyed by hash algorithm,
+ * strong hash and length; the per-file index entries act as manifests and
+ * hold the references. */
+typedef struct chunk_store chunk_store_t;
+
+typedef struct {
+    uint64_t chunks;          /* live unique chunks */
+    uint64_t stored_bytes;    /* payload bytes of live chunks */
+    uint64_t logical_bytes;   /* bytes referenced by all manifests */
+    uint64_t dead_bytes;      /* unreferenced bytes waiting for gc */
+    uint64_t saved_uploads;   /* chunks served from the store instead of the wire */
+    uint64_t saved_bytes;
+} chunk_store_stats_t;
+
+chunk_store_t *chunk_store_open(const char *pack_path, const char *idx_path);
+void chunk_store_close(chunk_store_t *cs);
+
+int chunk_store_has(chunk_store_t *cs, int hash_alg, const unsigned char strong[16], uint32_t len);
+/* Both fail unless the bytes read hash to strong under hash_alg */
+int chunk_store_read(chunk_store_t *cs, int hash_alg, const unsigned char strong[16], uint32_t len,
+                     unsigned char *out);
+int chunk_store_fetch(chunk_store_t *cs, int hash_alg, const unsigned char strong[16], uint32_t len,
+                      unsigned char *out);
+
+/* lens gives the length of every chunk; without it the file is in fixed
+ * blocks of block_size */
+int chunk_store_add_file(chunk_store_t *cs, const char *path, const block_sig_t *sigs,
+                         const uint32_t *lens, uint32_t block_size, int n, size_t filesize,
+                         int hash_alg);
+void chunk_store_release(chunk_store_t *cs, const block_sig_t *sigs, const uint32_t *lens,
+                         uint32_t block_size, int n, size_t filesize, int hash_alg);
+
+int chunk_store_save(chunk_store_t *cs);
+int chunk_store_gc(chunk_store_t *cs);
+int chunk_store_should_gc(chunk_store_t *cs);
+void chunk_store_stats(chunk_store_t *cs, chunk_store_stats_t *st);
+
+#endif
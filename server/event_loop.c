@@ -0,0 +1,156 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include "event_loop.h"
+#include "log.h"
+
+#define MAX_EVENTS 256
+#define FILL_SOFT_CAP (1024 * 1024)
+
+typedef struct {
+    int epfd;
+    conn_handler_fn handler;
+    conn_cleanup_fn cleanup;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    conn_t *head, *tail;
+} loop_t;
+
+static void push_ready(loop_t *lp, conn_t *c) {
+    pthread_mutex_lock(&lp->lock);
+    c->next = NULL;
+    if (lp->tail) lp->tail->next = c;
+    else lp->head = c;
+    lp->tail = c;
+    pthread_cond_signal(&lp->cond);
+    pthread_mutex_unlock(&lp->lock);
+}
+
+static conn_t *pop_ready(loop_t *lp) {
+    pthread_mutex_lock(&lp->lock);
+    while (!lp->head) pthread_cond_wait(&lp->cond, &lp->lock);
+    conn_t *c = lp->head;
+    lp->head = c->next;
+    if (!lp->head) lp->tail = NULL;
+    pthread_mutex_unlock(&lp->lock);
+    return c;
+}
+
+static void close_conn(loop_t *lp, conn_t *c) {
+    epoll_ctl(lp->epfd, EPOLL_CTL_DEL, c->fd, NULL);
+    if (lp->cleanup) lp->cleanup(c);
+    close(c->fd);
+    nb_free(&c->in);
+    free(c);
+}
+
+/* Connections are armed with EPOLLONESHOT, so exactly one worker owns a
+ * connection between a readiness event and the re-arm below. */
+static void *worker_main(void *arg) {
+    loop_t *lp = arg;
+    for (;;) {
+        conn_t *c = pop_ready(lp);
+
+        int failed = 0;
+        do {
+            size_t want = c->want > FILL_SOFT_CAP ? c->want : FILL_SOFT_CAP;
+            ssize_t r = nb_fill(&c->in, want);
+            if (r == 0) break;
+            if (r < 0) {
+                if (errno != EAGAIN && errno != EWOULDBLOCK) failed = 1;
+                break;
+            }
+        } while (nb_avail(&c->in) < FILL_SOFT_CAP || nb_avail(&c->in) < c->want);
+
+        int rc = failed ? CONN_CLOSE : lp->handler(c);
+        if (rc == CONN_WANT_READ && c->in.eof) rc = CONN_CLOSE;
+        if (rc == CONN_CLOSE) {
+            close_conn(lp, c);
+            continue;
+        }
+
+        struct epoll_event ev;
+        ev.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+        ev.data.ptr = c;
+        if (epoll_ctl(lp->epfd, EPOLL_CTL_MOD, c->fd, &ev) != 0)
+            close_conn(lp, c);
+    }
+    return NULL;
+}
+
+int event_loop_run(int listen_fd, int nworkers, conn_handler_fn handler, conn_cleanup_fn cleanup) {
+    loop_t lp;
+    memset(&lp, 0, sizeof(lp));
+    lp.handler = handler;
+    lp.cleanup = cleanup;
+    pthread_mutex_init(&lp.lock, NULL);
+    pthread_cond_init(&lp.cond, NULL);
+
+    lp.epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (lp.epfd < 0) { log_error("epoll_create1: %s", strerror(errno)); return -1; }
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;   /* NULL marks the listening socket */
+    if (epoll_ctl(lp.epfd, EPOLL_CTL_ADD, listen_fd, &ev) != 0) {
+        log_error("epoll_ctl listen: %s", strerror(errno));
+        close(lp.epfd);
+        return -1;
+    }
+
+    for (int i = 0; i < nworkers; i++) {
+        pthread_t tid;
+        if (pthread_create(&tid, NULL, worker_main, &lp) != 0) {
+            log_error("pthread_create: %s", strerror(errno));
+            return -1;
+        }
+        pthread_detach(tid);
+    }
+
+    struct epoll_event events[MAX_EVENTS];
+    for (;;) {
+        int n = epoll_wait(lp.epfd, events, MAX_EVENTS, -1);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            log_error("epoll_wait: %s", strerror(errno));
+            return -1;
+        }
+        for (int i = 0; i < n; i++) {
+            conn_t *c = events[i].data.ptr;
+            if (c) {
+                push_ready(&lp, c);
+                continue;
+            }
+
+            for (;;) {
+                int fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+                if (fd < 0) {
+                    if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                        log_error("accept: %s", strerror(errno));
+                    break;
+                }
+                conn_t *nc = calloc(1, sizeof(*nc));
+                if (!nc || nb_init(&nc->in, fd) != 0) {
+                    free(nc);
+                    close(fd);
+                    continue;
+                }
+                nc->fd = fd;
+                struct epoll_event cev;
+                cev.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+                cev.data.ptr = nc;
+                if (epoll_ctl(lp.epfd, EPOLL_CTL_ADD, fd, &cev) != 0) {
+                    nb_free(&nc->in);
+                    free(nc);
+                    close(fd);
+                }
+            }
+        }
+    }
+}
@@ -0,0 +1,31 @@
+#ifndef EVENT_LOOP_H
+#define EVENT_LOOP_H
+
+#include <stddef.h>
+#include "../common_utils/netbuf.h"
+
+#define CONN_WANT_READ 0
+#define CONN_CLOSE     1
+
+typedef struct conn {
+    int fd;
+    netbuf_t in;
+    int state;
+    int proto;          /* PROTO_TEXT until the client negotiates HELLO */
+    int codec;          /* block codec agreed in HELLO */
+    int hash_alg;       /* strong hash agreed in HELLO, md5 by default */
+    int in_sync;        /* inside SYNC_START: keep relative paths and the connection */
+    int sync_files;     /* files committed in this sync session */
+    size_t want;        /* bytes the handler needs buffered before it can progress */
+    void *session;      /* protocol state owned by the handler */
+    struct conn *next;  /* work queue link */
+} conn_t;
+
+/* Runs on a worker thread after new input was buffered. Must consume as
+ * much as it can and return CONN_WANT_READ or CONN_CLOSE. */
+typedef int (*conn_handler_fn)(conn_t *c);
+typedef void (*conn_cleanup_fn)(conn_t *c);
+
+int event_loop_run(int listen_fd, int nworkers, conn_handler_fn handler, conn_cleanup_fn cleanup);
+
+#endif
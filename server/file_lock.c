@@ -0,0 +1,101 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "file_lock.h"
+
+#define FILE_LOCK_SHARDS 64
+
+typedef struct lock_shard lock_shard_t;
+
+struct file_lock {
+    struct file_lock *next;
+    lock_shard_t *shard;
+    pthread_cond_t cond;
+    int users;            /* holders plus waiters; the entry is freed at zero */
+    int readers;
+    int writer;
+    int writers_waiting;
+    char name[];
+};
+
+struct lock_shard {
+    pthread_mutex_t mu;
+    struct file_lock *head;
+};
+
+static lock_shard_t shards[FILE_LOCK_SHARDS];
+static pthread_once_t shards_once = PTHREAD_ONCE_INIT;
+
+static void shards_init(void) {
+    for (int i = 0; i < FILE_LOCK_SHARDS; i++) {
+        pthread_mutex_init(&shards[i].mu, NULL);
+        shards[i].head = NULL;
+    }
+}
+
+static uint32_t name_hash(const char *s) {
+    uint32_t h = 2166136261u;
+    while (*s) {
+        h ^= (unsigned char)*s++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+file_lock_t *file_lock_acquire(const char *name, int exclusive) {
+    pthread_once(&shards_once, shards_init);
+    lock_shard_t *sh = &shards[name_hash(name) % FILE_LOCK_SHARDS];
+
+    pthread_mutex_lock(&sh->mu);
+    file_lock_t *l = sh->head;
+    while (l && strcmp(l->name, name) != 0) l = l->next;
+    if (!l) {
+        size_t n = strlen(name) + 1;
+        l = calloc(1, sizeof(*l) + n);
+        if (!l) {
+            pthread_mutex_unlock(&sh->mu);
+            return NULL;
+        }
+        memcpy(l->name, name, n);
+        pthread_cond_init(&l->cond, NULL);
+        l->shard = sh;
+        l->next = sh->head;
+        sh->head = l;
+    }
+    l->users++;
+
+    if (exclusive) {
+        l->writers_waiting++;
+        while (l->writer || l->readers > 0) pthread_cond_wait(&l->cond, &sh->mu);
+        l->writers_waiting--;
+        l->writer = 1;
+    } else {
+        while (l->writer || l->writers_waiting > 0) pthread_cond_wait(&l->cond, &sh->mu);
+        l->readers++;
+    }
+    pthread_mutex_unlock(&sh->mu);
+    return l;
+}
+
+void file_lock_release(file_lock_t *l) {
+    if (!l) return;
+    lock_shard_t *sh = l->shard;
+
+    pthread_mutex_lock(&sh->mu);
+    if (l->writer) l->writer = 0;
+    else l->readers--;
+
+    if (--l->users == 0) {
+        file_lock_t **pp = &sh->head;
+        while (*pp != l) pp = &(*pp)->next;
+        *pp = l->next;
+        pthread_mutex_unlock(&sh->mu);
+        pthread_cond_destroy(&l->cond);
+        free(l);
+        return;
+    }
+    pthread_cond_broadcast(&l->cond);
+    pthread_mutex_unlock(&sh->mu);
+}
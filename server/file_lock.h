@@ -0,0 +1,16 @@
+#ifndef FILE_LOCK_H
+#define FILE_LOCK_H
+
+/* Reader/writer locks keyed by file name, created on first use and freed
+ * when the last holder lets go. The table is sharded so that unrelated
+ * names never contend on the same mutex.
+ *
+ * Locks are not owned by a thread: one taken while handling a connection
+ * may be released by whichever worker handles it next. Writers are
+ * preferred, so a stream of readers cannot starve a commit. */
+typedef struct file_lock file_lock_t;
+
+file_lock_t *file_lock_acquire(const char *name, int exclusive);
+void file_lock_release(file_lock_t *l);
+
+#endif
@@ -1,95 +1,703 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <zlib.h>
 #include "index_store.h"
+#include "log.h"
 
-int save_all_indices(const char *path, const file_index_t *indices, int count) {
-    char tmp[512];
-    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
-    FILE *f = fopen(tmp, "wb");
-    if (!f) { perror("fopen tmp"); return -1; }
+#define INDEX_WAL_MAGIC 0x37574c52      /* "RLW7" */
+#define INDEX_WAL_MAGIC_V6 0x36574c52   /* "RLW6", records without a block size */
+#define INDEX_WAL_MAGIC_V5 0x35574c52   /* "RLW5", records without a tree */
+#define INDEX_WAL_MAGIC_V4 0x57494c52   /* "RLIW", records without a digest */
+#define INDEX_COMPACT_MIN (8ULL * 1024 * 1024)
 
-    fwrite(&count, sizeof(int), 1, f);
-    for (int i = 0; i < count; i++) {
-        fwrite(indices[i].filename, sizeof(indices[i].filename), 1, f);
-        fwrite(&indices[i].filesize, sizeof(indices[i].filesize), 1, f);
-        fwrite(&indices[i].nblocks, sizeof(indices[i].nblocks), 1, f);
-        fwrite(indices[i].sigs, sizeof(block_sig_t), indices[i].nblocks, f);
+/* Snapshot layout (version 7): a header, one index_rec_t per file, then
+ * the names, signature arrays and Merkle trees the records point at.
+ * Offsets are from the start of the file and arrays are 8-byte aligned,
+ * so the mapped file is used in place. */
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t count;
+} index_hdr_t;
+
+typedef struct {
+    uint64_t filesize;
+    uint64_t name_off;
+    uint64_t sigs_off;
+    uint64_t lens_off;      /* 0 without per-chunk lengths */
+    uint32_t name_len;
+    uint32_t nblocks;
+    uint32_t chunk_avg;
+    uint32_t hash_alg;
+    unsigned char digest[16];   /* not in version 4 records */
+    uint64_t tree_off;          /* 0 without a tree; not before version 6 */
+    uint32_t block_size;        /* not before version 7 */
+    uint32_t pad;
+} index_rec_t;
+
+#define INDEX_REC_V4_SIZE offsetof(index_rec_t, digest)
+#define INDEX_REC_V5_SIZE offsetof(index_rec_t, tree_off)
+#define INDEX_REC_V6_SIZE offsetof(index_rec_t, block_size)
+
+/* Log record: header, then wal_put_t, the name, sigs, lens and tree.
+ * Records written by older versions have their own magic and lack the
+ * block size (version 6), also the tree (version 5) or also the digest
+ * (version 4). */
+typedef struct {
+    uint32_t magic;
+    uint32_t len;           /* payload bytes after this header */
+    uint32_t crc;           /* crc32 of the payload; a torn tail fails it */
+    uint32_t pad;
+} wal_hdr_t;
+
+typedef struct {
+    uint64_t filesize;
+    uint32_t nblocks;
+    uint32_t chunk_avg;
+    uint32_t hash_alg;
+    uint32_t name_len;
+    unsigned char digest[16];
+    uint32_t block_size;    /* not before version 7 */
+    uint32_t pad;
+} wal_put_t;
+
+#define WAL_PUT_V4_SIZE offsetof(wal_put_t, digest)
+#define WAL_PUT_V6_SIZE offsetof(wal_put_t, block_size)
+
+typedef struct {
+    file_index_t idx;
+    int owned;              /* name/sigs/lens are heap copies, not views of the map */
+} db_entry_t;
+
+struct index_db {
+    char path[512];
+    char wal_path[520];
+    int wal_fd;
+    uint64_t wal_size;
+    unsigned char *map;
+    size_t map_size;
+    db_entry_t *entries;
+    size_t count, cap;
+    int *slots;
+    size_t mask;
+};
+
+static size_t name_slot(const char *name, size_t mask) {
+    uint64_t h = 1469598103934665603ULL;
+    for (const unsigned char *p = (const unsigned char *)name; *p; p++) {
+        h ^= *p;
+        h *= 1099511628211ULL;
     }
+    return (size_t)h & mask;
+}
 
-    fclose(f);
-    rename(tmp, path);
+static int find_entry(const index_db_t *db, const char *name) {
+    for (size_t s = name_slot(name, db->mask); db->slots[s] >= 0; s = (s + 1) & db->mask) {
+        if (strcmp(db->entries[db->slots[s]].idx.filename, name) == 0)
+            return db->slots[s];
+    }
+    return -1;
+}
+
+static int rebuild_slots(index_db_t *db, size_t want) {
+    size_t cap = 1024;
+    while (cap < want * 2) cap <<= 1;
+    int *slots = malloc(sizeof(int) * cap);
+    if (!slots) return -1;
+    for (size_t i = 0; i < cap; i++) slots[i] = -1;
+    free(db->slots);
+    db->slots = slots;
+    db->mask = cap - 1;
+    for (size_t i = 0; i < db->count; i++) {
+        size_t s = name_slot(db->entries[i].idx.filename, db->mask);
+        while (db->slots[s] >= 0) s = (s + 1) & db->mask;
+        db->slots[s] = (int)i;
+    }
     return 0;
 }
 
-file_index_t *load_all_indices(const char *path, int *out_count) {
-    FILE *f = fopen(path, "rb");
-    if (!f) { *out_count = 0; return NULL; }
+static void free_entry_data(db_entry_t *d) {
+    if (!d->owned) return;
+    free((char *)d->idx.filename);
+    free((block_sig_t *)d->idx.sigs);
+    free((uint32_t *)d->idx.lens);
+    free((unsigned char *)d->idx.tree);
+}
 
-    int count = 0;
-    if (fread(&count, sizeof(int), 1, f) != 1) {
-        fclose(f);
-        *out_count = 0;
-        return NULL;
+static size_t tree_bytes(const file_index_t *e) {
+    return e->tree ? merkle_nodes(e->nblocks) * MERKLE_NODE_LEN : 0;
+}
+
+/* Entries from versions that stored no tree get one built on load */
+static unsigned char *build_tree(const file_index_t *e) {
+    if (e->chunk_avg != 0 || e->nblocks == 0) return NULL;
+    unsigned char *tree = malloc(merkle_nodes(e->nblocks) * MERKLE_NODE_LEN);
+    if (tree) merkle_build(e->hash_alg, e->sigs, e->nblocks, NULL, tree);
+    return tree;
+}
+
+/* How set_entry stores the arrays of an entry */
+enum {
+    ENTRY_MAPPED,   /* pointing into the snapshot map */
+    ENTRY_COPY,     /* duplicated onto the heap */
+    ENTRY_ADOPT     /* taking over malloc'ed arrays, freed even on failure */
+};
+
+/* Inserts or replaces the entry for e->filename */
+static int set_entry(index_db_t *db, const file_index_t *e, int mode) {
+    db_entry_t d;
+    memset(&d, 0, sizeof(d));
+    d.idx = *e;
+    if (e->chunk_avg == 0) d.idx.lens = NULL;
+    else d.idx.block_size = 0;
+    if (mode == ENTRY_ADOPT) {
+        d.idx.filename = strdup(e->filename);
+        d.owned = 1;
+        if (!d.idx.filename) {
+            free_entry_data(&d);
+            return -1;
+        }
+    } else if (mode == ENTRY_COPY) {
+        size_t n = (size_t)e->nblocks;
+        char *name = strdup(e->filename);
+        block_sig_t *sigs = malloc(sizeof(block_sig_t) * (n ? n : 1));
+        uint32_t *lens = d.idx.lens ? malloc(sizeof(uint32_t) * (n ? n : 1)) : NULL;
+        unsigned char *tree = e->tree ? malloc(tree_bytes(e)) : NULL;
+        if (!name || !sigs || (d.idx.lens && !lens) || (e->tree && !tree)) {
+            free(name);
+            free(sigs);
+            free(lens);
+            free(tree);
+            return -1;
+        }
+        memcpy(sigs, e->sigs, sizeof(block_sig_t) * n);
+        if (lens) memcpy(lens, e->lens, sizeof(uint32_t) * n);
+        if (tree) memcpy(tree, e->tree, tree_bytes(e));
+        d.idx.filename = name;
+        d.idx.sigs = sigs;
+        d.idx.lens = lens;
+        d.idx.tree = tree;
+        d.owned = 1;
     }
 
-    file_index_t *arr = calloc(count, sizeof(file_index_t));
-    if (!arr) { fclose(f); *out_count = 0; return NULL; }
+    int i = find_entry(db, e->filename);
+    if (i >= 0) {
+        free_entry_data(&db->entries[i]);
+        db->entries[i] = d;
+        return 0;
+    }
 
-    for (int i = 0; i < count; i++) {
-        fread(arr[i].filename, sizeof(arr[i].filename), 1, f);
-        fread(&arr[i].filesize, sizeof(arr[i].filesize), 1, f);
-        fread(&arr[i].nblocks, sizeof(arr[i].nblocks), 1, f);
-        arr[i].sigs = malloc(sizeof(block_sig_t) * arr[i].nblocks);
-        fread(arr[i].sigs, sizeof(block_sig_t), arr[i].nblocks, f);
+    if (db->count == db->cap) {
+        size_t ncap = db->cap ? db->cap * 2 : 1024;
+        db_entry_t *n = realloc(db->entries, sizeof(db_entry_t) * ncap);
+        if (!n) {
+            free_entry_data(&d);
+            return -1;
+        }
+        db->entries = n;
+        db->cap = ncap;
+    }
+    if ((db->count + 1) * 2 > db->mask + 1 && rebuild_slots(db, db->count + 1) != 0) {
+        free_entry_data(&d);
+        return -1;
     }
+    db->entries[db->count] = d;
+    size_t s = name_slot(d.idx.filename, db->mask);
+    while (db->slots[s] >= 0) s = (s + 1) & db->mask;
+    db->slots[s] = (int)db->count++;
+    return 0;
+}
 
-    fclose(f);
-    *out_count = count;
-    return arr;
+/* Entries from before version 7 all used BLOCK_SIZE blocks */
+static uint32_t stored_block_size(int version, uint32_t block_size, uint32_t chunk_avg) {
+    if (chunk_avg != 0) return 0;
+    return version >= 7 ? block_size : BLOCK_SIZE;
 }
 
-void free_indices(file_index_t *indices, int count) {
-    if (!indices) return;
-    for (int i = 0; i < count; i++)
-        if (indices[i].sigs) free(indices[i].sigs);
-    free(indices);
+static int block_size_ok(uint32_t block_size, uint32_t chunk_avg) {
+    return chunk_avg != 0 || (block_size >= BLOCK_SIZE_MIN && block_size <= BLOCK_SIZE_MAX);
 }
 
-file_index_t *find_index_by_name(file_index_t *indices, int count, const char *filename) {
-    for (int i = 0; i < count; i++) {
-        if (strcmp(indices[i].filename, filename) == 0)
-            return &indices[i];
+static int range_ok(uint64_t off, uint64_t len, size_t size) {
+    return off <= size && len <= size - off;
+}
+
+/* Maps a version 4 to 7 snapshot and indexes its records in place.
+ * Records from older versions get their digest and tree computed here. */
+static int load_snapshot(index_db_t *db, int fd, size_t size, uint32_t version) {
+    unsigned char *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) return -1;
+    db->map = map;
+    db->map_size = size;
+
+    size_t rec_size = version == INDEX_VERSION ? sizeof(index_rec_t)
+                      : version == 6          ? INDEX_REC_V6_SIZE
+                      : version == 5          ? INDEX_REC_V5_SIZE
+                                              : INDEX_REC_V4_SIZE;
+    index_hdr_t hdr;
+    memcpy(&hdr, map, sizeof(hdr));
+    if (hdr.count > size / rec_size || !range_ok(sizeof(hdr), hdr.count * rec_size, size))
+        return -1;
+    if (rebuild_slots(db, (size_t)hdr.count) != 0) return -1;
+
+    for (uint64_t i = 0; i < hdr.count; i++) {
+        index_rec_t rec;
+        memset(&rec, 0, sizeof(rec));
+        memcpy(&rec, map + sizeof(hdr) + i * rec_size, rec_size);
+        const index_rec_t *r = &rec;
+        uint64_t lens_bytes = r->chunk_avg ? (uint64_t)r->nblocks * sizeof(uint32_t) : 0;
+        uint64_t tree_len = r->tree_off ? merkle_nodes((int)r->nblocks) * MERKLE_NODE_LEN : 0;
+        uint32_t block_size = stored_block_size((int)version, r->block_size, r->chunk_avg);
+        if (r->name_len == 0 || r->name_len >= MAX_PATH_LEN ||
+            !range_ok(r->name_off, r->name_len + 1, size) || map[r->name_off + r->name_len] != '\0' ||
+            r->nblocks > INT32_MAX || r->sigs_off % 4 != 0 || r->lens_off % 4 != 0 ||
+            !range_ok(r->sigs_off, (uint64_t)r->nblocks * sizeof(block_sig_t), size) ||
+            (lens_bytes && !range_ok(r->lens_off, lens_bytes, size)) ||
+            (tree_len && !range_ok(r->tree_off, tree_len, size)) ||
+            !block_size_ok(block_size, r->chunk_avg)) {
+            log_warn("Index record %llu is corrupt, skipping", (unsigned long long)i);
+            continue;
+        }
+        file_index_t e;
+        e.filename = (const char *)map + r->name_off;
+        e.filesize = (size_t)r->filesize;
+        e.nblocks = (int)r->nblocks;
+        e.sigs = (const block_sig_t *)(map + r->sigs_off);
+        e.chunk_avg = r->chunk_avg;
+        e.lens = lens_bytes ? (const uint32_t *)(map + r->lens_off) : NULL;
+        e.hash_alg = (int)r->hash_alg;
+        e.tree = tree_len ? map + r->tree_off : NULL;
+        e.block_size = block_size;
+        if (version >= 5) memcpy(e.digest, r->digest, sizeof(e.digest));
+        else file_digest(e.hash_alg, e.sigs, e.nblocks, e.digest);
+        if (version < 6) {
+            unsigned char *tree = build_tree(&e);
+            e.tree = tree;
+            int rc = set_entry(db, &e, ENTRY_COPY);
+            free(tree);
+            if (rc != 0) return -1;
+        } else if (set_entry(db, &e, ENTRY_MAPPED) != 0) {
+            return -1;
+        }
     }
-    return NULL;
+    return 0;
 }
 
-int replace_or_add_index(file_index_t **indices_ptr, int *count_ptr, const file_index_t *newidx) {
-    file_index_t *indices = *indices_ptr;
-    int count = *count_ptr;
+/* Versions 1-3 were a flat dump of every entry; they are read into memory
+ * once and rewritten as a snapshot. */
+static int load_legacy(index_db_t *db, FILE *f) {
+    int count = 0, version = 1;
+    if (fread(&count, sizeof(int), 1, f) != 1) return 0;
+    /* Files written before the header existed start directly with the count */
+    if (count == INDEX_MAGIC) {
+        if (fread(&version, sizeof(int), 1, f) != 1 || fread(&count, sizeof(int), 1, f) != 1)
+            return -1;
+    }
 
+    char filename[MAX_PATH_LEN];
     for (int i = 0; i < count; i++) {
-        if (strcmp(indices[i].filename, newidx->filename) == 0) {
-            if (indices[i].sigs) free(indices[i].sigs);
-            indices[i].sigs = malloc(sizeof(block_sig_t) * newidx->nblocks);
-            memcpy(indices[i].sigs, newidx->sigs, sizeof(block_sig_t) * newidx->nblocks);
-            indices[i].filesize = newidx->filesize;
-            indices[i].nblocks = newidx->nblocks;
-            return 0;
+        file_index_t e;
+        memset(&e, 0, sizeof(e));
+        if (fread(filename, sizeof(filename), 1, f) != 1 ||
+            fread(&e.filesize, sizeof(e.filesize), 1, f) != 1 ||
+            fread(&e.nblocks, sizeof(e.nblocks), 1, f) != 1 ||
+            (version >= 2 && fread(&e.chunk_avg, sizeof(e.chunk_avg), 1, f) != 1) ||
+            (version >= 3 && fread(&e.hash_alg, sizeof(e.hash_alg), 1, f) != 1) ||
+            e.nblocks < 0)
+            return -1;
+        filename[MAX_PATH_LEN - 1] = '\0';
+        e.filename = filename;
+        e.block_size = stored_block_size(version, 0, e.chunk_avg);
+
+        size_t n = (size_t)e.nblocks;
+        block_sig_t *sigs = malloc(sizeof(block_sig_t) * (n ? n : 1));
+        uint32_t *lens = e.chunk_avg ? malloc(sizeof(uint32_t) * (n ? n : 1)) : NULL;
+        int ok = sigs && (!e.chunk_avg || lens) &&
+                 fread(sigs, sizeof(block_sig_t), n, f) == n &&
+                 (!lens || fread(lens, sizeof(uint32_t), n, f) == n);
+        e.sigs = sigs;
+        e.lens = lens;
+        if (!ok) {
+            free(sigs);
+            free(lens);
+            return -1;
+        }
+        file_digest(e.hash_alg, sigs, e.nblocks, e.digest);
+        e.tree = build_tree(&e);
+        if (set_entry(db, &e, ENTRY_ADOPT) != 0) return -1;
+    }
+    return count;
+}
+
+/* Applies every complete record of the log and cuts off a torn tail */
+static int replay_wal(index_db_t *db) {
+    struct stat st;
+    if (fstat(db->wal_fd, &st) != 0) return -1;
+    size_t size = (size_t)st.st_size;
+    if (size == 0) return 0;
+
+    unsigned char *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, db->wal_fd, 0);
+    if (map == MAP_FAILED) return -1;
+
+    size_t pos = 0;
+    int applied = 0;
+    while (pos + sizeof(wal_hdr_t) <= size) {
+        wal_hdr_t h;
+        memcpy(&h, map + pos, sizeof(h));
+        const unsigned char *p = map + pos + sizeof(h);
+        int version = h.magic == INDEX_WAL_MAGIC      ? INDEX_VERSION
+                      : h.magic == INDEX_WAL_MAGIC_V6 ? 6
+                      : h.magic == INDEX_WAL_MAGIC_V5 ? 5
+                      : h.magic == INDEX_WAL_MAGIC_V4 ? 4
+                                                      : 0;
+        size_t put_size = version >= 7   ? sizeof(wal_put_t)
+                          : version >= 5 ? WAL_PUT_V6_SIZE
+                                         : WAL_PUT_V4_SIZE;
+        if (version == 0 || h.len < put_size || h.len > size - pos - sizeof(h) ||
+            crc32(0L, p, h.len) != h.crc)
+            break;
+
+        wal_put_t w;
+        memset(&w, 0, sizeof(w));
+        memcpy(&w, p, put_size);
+        uint64_t tree_len = version >= 6 && w.chunk_avg == 0 && w.nblocks <= INT32_MAX
+                                ? merkle_nodes((int)w.nblocks) * MERKLE_NODE_LEN
+                                : 0;
+        uint64_t want = put_size + (uint64_t)w.name_len + (uint64_t)w.nblocks * sizeof(block_sig_t) +
+                        (w.chunk_avg ? (uint64_t)w.nblocks * sizeof(uint32_t) : 0) + tree_len;
+        uint32_t block_size = stored_block_size(version, w.block_size, w.chunk_avg);
+        if (want != h.len || w.name_len == 0 || w.name_len >= MAX_PATH_LEN || w.nblocks > INT32_MAX ||
+            !block_size_ok(block_size, w.chunk_avg))
+            break;
+
+        char name[MAX_PATH_LEN];
+        memcpy(name, p + put_size, w.name_len);
+        name[w.name_len] = '\0';
+        const unsigned char *sp = p + put_size + w.name_len;
+        size_t sig_bytes = (size_t)w.nblocks * sizeof(block_sig_t);
+
+        /* Records are packed, so copy the arrays out to aligned memory */
+        file_index_t e;
+        e.filename = name;
+        e.filesize = (size_t)w.filesize;
+        e.nblocks = (int)w.nblocks;
+        e.chunk_avg = w.chunk_avg;
+        e.hash_alg = (int)w.hash_alg;
+        e.block_size = block_size;
+        block_sig_t *sigs = malloc(sig_bytes ? sig_bytes : 1);
+        uint32_t *lens = w.chunk_avg ? malloc(sizeof(uint32_t) * (w.nblocks ? w.nblocks : 1)) : NULL;
+        unsigned char *tree = NULL;
+        int ok = sigs && (!w.chunk_avg || lens);
+        if (ok) {
+            memcpy(sigs, sp, sig_bytes);
+            if (lens) memcpy(lens, sp + sig_bytes, sizeof(uint32_t) * w.nblocks);
+            e.sigs = sigs;
+            e.lens = lens;
+            e.tree = NULL;
+            if (version >= 5) memcpy(e.digest, w.digest, sizeof(e.digest));
+            else file_digest(e.hash_alg, sigs, e.nblocks, e.digest);
+            if (tree_len) e.tree = sp + sig_bytes;
+            else if (version < 6) e.tree = tree = build_tree(&e);
+            ok = set_entry(db, &e, ENTRY_COPY) == 0;
         }
+        free(sigs);
+        free(lens);
+        free(tree);
+        if (!ok) break;
+
+        pos += sizeof(h) + h.len;
+        applied++;
     }
+    munmap(map, size);
 
-    file_index_t *tmp = realloc(indices, sizeof(file_index_t) * (count + 1));
-    if (!tmp) return -1;
+    if (pos < size) {
+        log_warn("Index log %s: dropping %zu bytes of incomplete records",
+                 db->wal_path, size - pos);
+        if (ftruncate(db->wal_fd, (off_t)pos) != 0) log_error("ftruncate index log: %s", strerror(errno));
+    }
+    db->wal_size = pos;
+    return applied;
+}
+
+static void drop_state(index_db_t *db) {
+    for (size_t i = 0; i < db->count; i++) free_entry_data(&db->entries[i]);
+    free(db->entries);
+    free(db->slots);
+    if (db->map) munmap(db->map, db->map_size);
+    db->entries = NULL;
+    db->slots = NULL;
+    db->map = NULL;
+    db->count = db->cap = 0;
+    db->map_size = 0;
+}
 
-    indices = tmp;
-    indices[count].sigs = malloc(sizeof(block_sig_t) * newidx->nblocks);
-    memcpy(indices[count].sigs, newidx->sigs, sizeof(block_sig_t) * newidx->nblocks);
-    strncpy(indices[count].filename, newidx->filename, MAX_PATH_LEN - 1);
-    indices[count].filesize = newidx->filesize;
-    indices[count].nblocks = newidx->nblocks;
+/* Opens the snapshot at db->path into an empty db. Returns 1 if it was in
+ * an older format and should be rewritten. */
+static int open_snapshot(index_db_t *db) {
+    if (rebuild_slots(db, 0) != 0) return -1;
+    int fd = open(db->path, O_RDONLY);
+    if (fd < 0) return 0;
+
+    struct stat st;
+    index_hdr_t hdr;
+    int rc = 0;
+    if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(hdr) &&
+        pread(fd, &hdr, sizeof(hdr), 0) == (ssize_t)sizeof(hdr) && hdr.magic == INDEX_MAGIC &&
+        hdr.version >= 4) {
+        if (hdr.version > INDEX_VERSION) rc = -1;
+        else rc = load_snapshot(db, fd, (size_t)st.st_size, hdr.version);
+        if (rc == 0 && hdr.version < INDEX_VERSION) rc = 1;
+    } else {
+        FILE *f = fdopen(dup(fd), "rb");
+        rc = f ? load_legacy(db, f) : -1;
+        if (f) fclose(f);
+        if (rc > 0) rc = 1;
+    }
+    close(fd);
+    return rc;
+}
+
+index_db_t *index_db_open(const char *path) {
+    index_db_t *db = calloc(1, sizeof(*db));
+    if (!db) return NULL;
+    snprintf(db->path, sizeof(db->path), "%s", path);
+    snprintf(db->wal_path, sizeof(db->wal_path), "%s.wal", path);
+    db->wal_fd = -1;
+
+    int legacy = open_snapshot(db);
+    if (legacy < 0) {
+        log_error("Failed to load index %s", path);
+        index_db_close(db);
+        return NULL;
+    }
+    db->wal_fd = open(db->wal_path, O_RDWR | O_CREAT | O_APPEND, 0644);
+    if (db->wal_fd < 0 || replay_wal(db) < 0) {
+        log_error("open index log: %s", strerror(errno));
+        index_db_close(db);
+        return NULL;
+    }
+    if (legacy && index_db_compact(db) == 0)
+        log_info("Converted %s to index version %d", path, INDEX_VERSION);
+    return db;
+}
+
+void index_db_close(index_db_t *db) {
+    if (!db) return;
+    drop_state(db);
+    if (db->wal_fd >= 0) close(db->wal_fd);
+    free(db);
+}
+
+const file_index_t *index_db_find(index_db_t *db, const char *filename) {
+    int i = find_entry(db, filename);
+    return i >= 0 ? &db->entries[i].idx : NULL;
+}
+
+int index_db_count(index_db_t *db) {
+    return (int)db->count;
+}
+
+const file_index_t *index_db_entry(index_db_t *db, int i) {
+    return i >= 0 && (size_t)i < db->count ? &db->entries[i].idx : NULL;
+}
+
+static int write_all(int fd, struct iovec *iov, int cnt) {
+    while (cnt > 0) {
+        ssize_t w = writev(fd, iov, cnt);
+        if (w <= 0) return -1;
+        while (cnt > 0 && (size_t)w >= iov->iov_len) {
+            w -= (ssize_t)iov->iov_len;
+            iov++;
+            cnt--;
+        }
+        if (cnt > 0) {
+            iov->iov_base = (char *)iov->iov_base + w;
+            iov->iov_len -= (size_t)w;
+        }
+    }
+    return 0;
+}
+
+static void free_arrays(const file_index_t *e) {
+    free((block_sig_t *)e->sigs);
+    free((uint32_t *)e->lens);
+    free((unsigned char *)e->tree);
+}
+
+/* Appends the new version of a file to the log, then updates the table.
+ * The whole snapshot is only rewritten once the log has grown as large as
+ * the snapshot itself, so a sync costs the size of its own signatures. */
+static int put_entry(index_db_t *db, const file_index_t *e, int mode) {
+    wal_put_t w;
+    memset(&w, 0, sizeof(w));
+    w.filesize = e->filesize;
+    w.nblocks = (uint32_t)e->nblocks;
+    w.chunk_avg = e->chunk_avg;
+    w.hash_alg = (uint32_t)e->hash_alg;
+    w.name_len = (uint32_t)strlen(e->filename);
+    memcpy(w.digest, e->digest, sizeof(w.digest));
+    w.block_size = e->chunk_avg ? 0 : e->block_size;
+    /* Replay expects a tree with every fixed-size entry */
+    if (w.name_len == 0 || w.name_len >= MAX_PATH_LEN || e->nblocks < 0 ||
+        (e->chunk_avg == 0 && e->nblocks > 0) != (e->tree != NULL) ||
+        !block_size_ok(w.block_size, e->chunk_avg)) {
+        if (mode == ENTRY_ADOPT) free_arrays(e);
+        return -1;
+    }
+
+    size_t sig_bytes = sizeof(block_sig_t) * (size_t)e->nblocks;
+    size_t lens_bytes = e->chunk_avg ? sizeof(uint32_t) * (size_t)e->nblocks : 0;
+    struct iovec iov[6] = {
+        { NULL, sizeof(wal_hdr_t) },
+        { &w, sizeof(w) },
+        { (void *)e->filename, w.name_len },
+        { (void *)e->sigs, sig_bytes },
+        { (void *)e->lens, lens_bytes },
+        { (void *)e->tree, tree_bytes(e) },
+    };
+    wal_hdr_t h;
+    h.magic = INDEX_WAL_MAGIC;
+    h.len = 0;
+    h.crc = crc32(0L, Z_NULL, 0);
+    h.pad = 0;
+    for (int i = 1; i < 6; i++) {
+        if (iov[i].iov_len == 0) continue;
+        h.crc = crc32(h.crc, iov[i].iov_base, (uInt)iov[i].iov_len);
+        h.len += (uint32_t)iov[i].iov_len;
+    }
+    iov[0].iov_base = &h;
+
+    if (write_all(db->wal_fd, iov, 6) != 0) {
+        log_error("write index log: %s", strerror(errno));
+        if (ftruncate(db->wal_fd, (off_t)db->wal_size) != 0) log_error("ftruncate index log: %s", strerror(errno));
+        if (mode == ENTRY_ADOPT) free_arrays(e);
+        return -1;
+    }
+    db->wal_size += sizeof(h) + h.len;
+
+    if (set_entry(db, e, mode) != 0) return -1;
+    if (db->wal_size >= INDEX_COMPACT_MIN && db->wal_size >= db->map_size)
+        return index_db_compact(db);
+    return 0;
+}
+
+int index_db_put(index_db_t *db, const file_index_t *e) {
+    return put_entry(db, e, ENTRY_COPY);
+}
+
+int index_db_put_owned(index_db_t *db, const file_index_t *e) {
+    return put_entry(db, e, ENTRY_ADOPT);
+}
+
+static uint64_t align8(uint64_t off) {
+    return (off + 7) & ~(uint64_t)7;
+}
+
+static int pad_to(FILE *f, uint64_t *pos, uint64_t off) {
+    static const char zeros[8];
+    if (off > *pos && fwrite(zeros, 1, off - *pos, f) != off - *pos) return -1;
+    *pos = off;
+    return 0;
+}
+
+/* Writes every entry to a new snapshot, swaps it in and empties the log */
+int index_db_compact(index_db_t *db) {
+    char tmp[530];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", db->path);
+    FILE *f = fopen(tmp, "wb");
+    if (!f) {
+        log_error("fopen index tmp: %s", strerror(errno));
+        return -1;
+    }
+
+    index_hdr_t hdr = { INDEX_MAGIC, INDEX_VERSION, db->count };
+    int ok = fwrite(&hdr, sizeof(hdr), 1, f) == 1;
+    uint64_t off = sizeof(hdr) + db->count * sizeof(index_rec_t);
+    for (size_t i = 0; ok && i < db->count; i++) {
+        const file_index_t *e = &db->entries[i].idx;
+        index_rec_t r;
+        memset(&r, 0, sizeof(r));
+        r.filesize = e->filesize;
+        r.name_len = (uint32_t)strlen(e->filename);
+        r.nblocks = (uint32_t)e->nblocks;
+        r.chunk_avg = e->chunk_avg;
+        r.hash_alg = (uint32_t)e->hash_alg;
+        r.block_size = e->block_size;
+        memcpy(r.digest, e->digest, sizeof(r.digest));
+        r.name_off = off;
+        r.sigs_off = align8(off + r.name_len + 1);
+        off = r.sigs_off + (uint64_t)r.nblocks * sizeof(block_sig_t);
+        if (e->lens) {
+            r.lens_off = align8(off);
+            off = r.lens_off + (uint64_t)r.nblocks * sizeof(uint32_t);
+        }
+        if (e->tree) {
+            r.tree_off = align8(off);
+            off = r.tree_off + tree_bytes(e);
+        }
+        off = align8(off);
+        ok = fwrite(&r, sizeof(r), 1, f) == 1;
+    }
+
+    uint64_t pos = sizeof(hdr) + db->count * sizeof(index_rec_t);
+    for (size_t i = 0; ok && i < db->count; i++) {
+        const file_index_t *e = &db->entries[i].idx;
+        size_t name_len = strlen(e->filename) + 1;
+        size_t n = (size_t)e->nblocks;
+        ok = fwrite(e->filename, 1, name_len, f) == name_len;
+        pos += name_len;
+        ok = ok && pad_to(f, &pos, align8(pos)) == 0 &&
+             fwrite(e->sigs, sizeof(block_sig_t), n, f) == n;
+        pos += n * sizeof(block_sig_t);
+        if (ok && e->lens) {
+            ok = pad_to(f, &pos, align8(pos)) == 0 && fwrite(e->lens, sizeof(uint32_t), n, f) == n;
+            pos += n * sizeof(uint32_t);
+        }
+        if (ok && e->tree) {
+            size_t tlen = tree_bytes(e);
+            ok = pad_to(f, &pos, align8(pos)) == 0 && fwrite(e->tree, 1, tlen, f) == tlen;
+            pos += tlen;
+        }
+        ok = ok && pad_to(f, &pos, align8(pos)) == 0;
+    }
+
+    /* The log is emptied below, so the snapshot must be durable first */
+    ok = ok && fflush(f) == 0 && fsync(fileno(f)) == 0;
+    if (fclose(f) != 0) ok = 0;
+    if (!ok || rename(tmp, db->path) != 0) {
+        log_error("write index snapshot: %s", strerror(errno));
+        unlink(tmp);
+        return -1;
+    }
+
+    index_db_t fresh;
+    memset(&fresh, 0, sizeof(fresh));
+    memcpy(fresh.path, db->path, sizeof(fresh.path));
+    if (open_snapshot(&fresh) != 0) {
+        /* Keep serving from memory; the log still holds every update */
+        log_error("Failed to reopen index snapshot %s", db->path);
+        drop_state(&fresh);
+        return -1;
+    }
+    if (ftruncate(db->wal_fd, 0) != 0) log_error("ftruncate index log: %s", strerror(errno));
+    db->wal_size = 0;
 
-    *indices_ptr = indices;
-    *count_ptr = count + 1;
+    drop_state(db);
+    db->entries = fresh.entries;
+    db->count = fresh.count;
+    db->cap = fresh.cap;
+    db->slots = fresh.slots;
+    db->mask = fresh.mask;
+    db->map = fresh.map;
+    db->map_size = fresh.map_size;
     return 0;
 }
@@ -2,20 +2,44 @@
 #define INDEX_STORE_H
 
 #include <stddef.h>
-#include "../common_utils/protocol.h"   
+#include "../common_utils/protocol.h"
 #include "../common_utils/file_hasher.h"
+#include "../common_utils/merkle.h"
+
+#define INDEX_MAGIC 0x58494c52   /* "RLIX" */
+#define INDEX_VERSION 7
 
 typedef struct {
-    char filename[MAX_PATH_LEN];
+    const char *filename;
     size_t filesize;
     int nblocks;
-    block_sig_t *sigs;
+    const block_sig_t *sigs;
+    uint32_t chunk_avg;   /* 0 for fixed-size blocks, else CDC average size */
+    const uint32_t *lens; /* per-chunk lengths, only set when chunk_avg != 0 */
+    int hash_alg;         /* HASH_* used for sigs[].strong; md5 before version 3 */
+    unsigned char digest[16]; /* file_digest of sigs; filled in by the caller */
+    const unsigned char *tree; /* merkle_build of sigs for fixed-size blocks, else NULL */
+    uint32_t block_size;  /* of fixed-size blocks, 0 with chunk_avg; BLOCK_SIZE before version 7 */
 } file_index_t;
 
-int save_all_indices(const char *path, const file_index_t *indices, int count);
-file_index_t *load_all_indices(const char *path, int *out_count);
-void free_indices(file_index_t *indices, int count);
-file_index_t *find_index_by_name(file_index_t *indices, int count, const char *filename);
-int replace_or_add_index(file_index_t **indices_ptr, int *count_ptr, const file_index_t *newidx);
+/* Index of every synced file, keyed by name. The snapshot file is mapped
+ * rather than read, updates are appended to a write-ahead log next to it
+ * (<path>.wal) and folded into a new snapshot once the log outgrows it.
+ *
+ * Not thread safe: callers serialise access, and entries returned by
+ * index_db_find / index_db_entry are only valid until the next put. */
+typedef struct index_db index_db_t;
+
+index_db_t *index_db_open(const char *path);
+void index_db_close(index_db_t *db);
+
+const file_index_t *index_db_find(index_db_t *db, const char *filename);
+int index_db_put(index_db_t *db, const file_index_t *e);
+/* Like index_db_put, but the index takes over e's malloc'ed sigs, lens and
+ * tree instead of copying them, and frees them if the put fails */
+int index_db_put_owned(index_db_t *db, const file_index_t *e);
+int index_db_count(index_db_t *db);
+const file_index_t *index_db_entry(index_db_t *db, int i);
+int index_db_compact(index_db_t *db);
 
 #endif
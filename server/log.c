@@ -0,0 +1,142 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <strings.h>
+#include <pthread.h>
+#include <time.h>
+#include "log.h"
+
+#define LOG_RING_SLOTS 256
+#define LOG_LINE_MAX 512
+
+typedef struct {
+    int level;
+    int len;
+    char text[LOG_LINE_MAX];
+} log_line_t;
+
+/* Single producer (the owning thread), single consumer (whoever holds
+ * drain_lock). head and tail only ever grow. */
+typedef struct log_ring {
+    unsigned head, tail;
+    unsigned long long dropped;
+    struct log_ring *next;
+    log_line_t lines[LOG_RING_SLOTS];
+} log_ring_t;
+
+int log_level = LOG_LEVEL_INFO;
+
+static log_ring_t *rings;
+static __thread log_ring_t *my_ring;
+static pthread_mutex_t drain_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t wake_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wake = PTHREAD_COND_INITIALIZER;
+static int started;
+
+static const char *level_names[] = { "debug", "info", "warn", "error" };
+
+int log_level_from_name(const char *name) {
+    for (int i = 0; i < (int)(sizeof(level_names) / sizeof(level_names[0])); i++)
+        if (strcasecmp(name, level_names[i]) == 0) return i;
+    return -1;
+}
+
+static log_ring_t *ring_register(void) {
+    log_ring_t *r = calloc(1, sizeof(*r));
+    if (!r) return NULL;
+    r->next = __atomic_load_n(&rings, __ATOMIC_ACQUIRE);
+    while (!__atomic_compare_exchange_n(&rings, &r->next, r, 1, __ATOMIC_RELEASE, __ATOMIC_ACQUIRE))
+        ;
+    return my_ring = r;
+}
+
+void log_write(int level, const char *fmt, ...) {
+    va_list ap;
+    log_ring_t *r = NULL;
+    if (__atomic_load_n(&started, __ATOMIC_ACQUIRE)) r = my_ring ? my_ring : ring_register();
+    if (!r) {
+        /* No writer yet (or no memory for a ring): write it ourselves */
+        FILE *out = level >= LOG_LEVEL_WARN ? stderr : stdout;
+        va_start(ap, fmt);
+        vfprintf(out, fmt, ap);
+        va_end(ap);
+        fputc('\n', out);
+        return;
+    }
+
+    unsigned head = r->head;
+    unsigned tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+    if (head - tail == LOG_RING_SLOTS) {
+        __atomic_add_fetch(&r->dropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    log_line_t *l = &r->lines[head % LOG_RING_SLOTS];
+    va_start(ap, fmt);
+    int n = vsnprintf(l->text, LOG_LINE_MAX, fmt, ap);
+    va_end(ap);
+    l->len = n < 0 ? 0 : n < LOG_LINE_MAX ? n : LOG_LINE_MAX - 1;
+    l->level = level;
+    __atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+
+    /* Only the first line into an empty ring needs to wake the writer */
+    if (head == tail) pthread_cond_signal(&wake);
+}
+
+/* Returns the number of lines written */
+static int drain(void) {
+    int lines = 0;
+    pthread_mutex_lock(&drain_lock);
+    for (log_ring_t *r = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); r; r = r->next) {
+        unsigned tail = r->tail;
+        unsigned head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+        for (; tail != head; tail++, lines++) {
+            const log_line_t *l = &r->lines[tail % LOG_RING_SLOTS];
+            FILE *out = l->level >= LOG_LEVEL_WARN ? stderr : stdout;
+            fwrite(l->text, 1, (size_t)l->len, out);
+            fputc('\n', out);
+        }
+        __atomic_store_n(&r->tail, tail, __ATOMIC_RELEASE);
+        unsigned long long dropped = __atomic_exchange_n(&r->dropped, 0, __ATOMIC_RELAXED);
+        if (dropped) fprintf(stderr, "log: %llu lines dropped\n", dropped);
+    }
+    if (lines) {
+        fflush(stdout);
+        fflush(stderr);
+    }
+    pthread_mutex_unlock(&drain_lock);
+    return lines;
+}
+
+void log_flush(void) {
+    drain();
+}
+
+static void *writer_main(void *arg) {
+    (void)arg;
+    for (;;) {
+        if (drain()) continue;
+        /* A wakeup racing with the check above is only late, not lost */
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_nsec += 100 * 1000000L;
+        if (ts.tv_nsec >= 1000000000L) {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000L;
+        }
+        pthread_mutex_lock(&wake_lock);
+        pthread_cond_timedwait(&wake, &wake_lock, &ts);
+        pthread_mutex_unlock(&wake_lock);
+    }
+    return NULL;
+}
+
+void log_start(void) {
+    pthread_t t;
+    if (__atomic_load_n(&started, __ATOMIC_ACQUIRE)) return;
+    if (pthread_create(&t, NULL, writer_main, NULL) != 0) return;
+    pthread_detach(t);
+    __atomic_store_n(&started, 1, __ATOMIC_RELEASE);
+    atexit(log_flush);
+}
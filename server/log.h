@@ -0,0 +1,31 @@
+#ifndef LOG_H
+#define LOG_H
+
+/* Leveled logging off the calling thread. Every thread formats into its
+ * own ring of lines, with no lock on the way; a background writer drains
+ * the rings to stdout (debug, info) and stderr (warn, error). A thread
+ * whose ring is full drops the line and the writer reports how many were
+ * lost. Lines below the current level are not even formatted. */
+enum {
+    LOG_LEVEL_DEBUG,
+    LOG_LEVEL_INFO,
+    LOG_LEVEL_WARN,
+    LOG_LEVEL_ERROR
+};
+
+extern int log_level;
+
+int log_level_from_name(const char *name);   /* -1 if unknown */
+void log_start(void);
+/* Writes out everything logged so far */
+void log_flush(void);
+void log_write(int level, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+#define log_at(level, ...) \
+    do { if ((level) >= log_level) log_write((level), __VA_ARGS__); } while (0)
+#define log_debug(...) log_at(LOG_LEVEL_DEBUG, __VA_ARGS__)
+#define log_info(...)  log_at(LOG_LEVEL_INFO, __VA_ARGS__)
+#define log_warn(...)  log_at(LOG_LEVEL_WARN, __VA_ARGS__)
+#define log_error(...) log_at(LOG_LEVEL_ERROR, __VA_ARGS__)
+
+#endif
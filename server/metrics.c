@@ -0,0 +1,132 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "metrics.h"
+
+#define MET_SHARDS 32
+/* Bucket i counts durations below 2^i microseconds; the last one is +Inf */
+#define MET_BUCKETS 28
+
+typedef struct {
+    uint64_t count, sum_ns;
+    uint64_t buckets[MET_BUCKETS];
+} histogram_t;
+
+typedef struct {
+    uint64_t counters[MET_COUNTERS];
+    histogram_t phases[MET_PHASES];
+} __attribute__((aligned(64))) shard_t;
+
+static shard_t shards[MET_SHARDS];
+static int next_shard;
+static __thread int my_shard = -1;
+
+static const char *phase_names[MET_PHASES] = {
+    "sig_recv", "diff", "block_recv", "decode", "disk_write", "index_save", "commit",
+    "file_get", "delta_get", "delta_upload", "chunk_upload"
+};
+
+static const char *counter_names[MET_COUNTERS] = {
+    "uploads", "uploads_failed", "up_to_date", "blocks_requested", "blocks_received",
+    "bytes_received", "bytes_sent"
+};
+
+static shard_t *shard(void) {
+    if (my_shard < 0) my_shard = __atomic_fetch_add(&next_shard, 1, __ATOMIC_RELAXED) % MET_SHARDS;
+    return &shards[my_shard];
+}
+
+double metrics_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+void metrics_add(int counter, uint64_t n) {
+    __atomic_add_fetch(&shard()->counters[counter], n, __ATOMIC_RELAXED);
+}
+
+void metrics_observe(int phase, double sec) {
+    uint64_t ns = sec > 0 ? (uint64_t)(sec * 1e9) : 0;
+    uint64_t us = ns / 1000;
+    int b = us ? 64 - __builtin_clzll(us) : 0;
+    if (b >= MET_BUCKETS) b = MET_BUCKETS - 1;
+    histogram_t *h = &shard()->phases[phase];
+    __atomic_add_fetch(&h->count, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&h->sum_ns, ns, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&h->buckets[b], 1, __ATOMIC_RELAXED);
+}
+
+static void sum_shards(uint64_t *counters, histogram_t *phases) {
+    memset(counters, 0, sizeof(uint64_t) * MET_COUNTERS);
+    memset(phases, 0, sizeof(histogram_t) * MET_PHASES);
+    for (int s = 0; s < MET_SHARDS; s++) {
+        for (int i = 0; i < MET_COUNTERS; i++)
+            counters[i] += __atomic_load_n(&shards[s].counters[i], __ATOMIC_RELAXED);
+        for (int p = 0; p < MET_PHASES; p++) {
+            const histogram_t *h = &shards[s].phases[p];
+            phases[p].count += __atomic_load_n(&h->count, __ATOMIC_RELAXED);
+            phases[p].sum_ns += __atomic_load_n(&h->sum_ns, __ATOMIC_RELAXED);
+            for (int b = 0; b < MET_BUCKETS; b++)
+                phases[p].buckets[b] += __atomic_load_n(&h->buckets[b], __ATOMIC_RELAXED);
+        }
+    }
+}
+
+/* Upper bound of the bucket holding the q-th observation, in ms */
+static double quantile_ms(const histogram_t *h, double q) {
+    uint64_t rank = (uint64_t)(q * (double)h->count), seen = 0;
+    if ((double)rank < q * (double)h->count || rank == 0) rank++;
+    for (int b = 0; b < MET_BUCKETS - 1; b++) {
+        seen += h->buckets[b];
+        if (seen >= rank) return (double)(1ULL << b) / 1000;
+    }
+    return (double)(1ULL << (MET_BUCKETS - 1)) / 1000;
+}
+
+char *metrics_render(int prometheus, size_t *len) {
+    uint64_t counters[MET_COUNTERS];
+    histogram_t phases[MET_PHASES];
+    sum_shards(counters, phases);
+
+    char *out = NULL;
+    FILE *f = open_memstream(&out, len);
+    if (!f) return NULL;
+    if (prometheus) {
+        for (int i = 0; i < MET_COUNTERS; i++)
+            fprintf(f, "# TYPE rsync_lite_%s_total counter\nrsync_lite_%s_total %llu\n",
+                    counter_names[i], counter_names[i], (unsigned long long)counters[i]);
+        fprintf(f, "# TYPE rsync_lite_phase_seconds histogram\n");
+        for (int p = 0; p < MET_PHASES; p++) {
+            uint64_t cum = 0;
+            for (int b = 0; b < MET_BUCKETS - 1; b++) {
+                cum += phases[p].buckets[b];
+                fprintf(f, "rsync_lite_phase_seconds_bucket{phase=\"%s\",le=\"%g\"} %llu\n",
+                        phase_names[p], (double)(1ULL << b) / 1e6, (unsigned long long)cum);
+            }
+            fprintf(f, "rsync_lite_phase_seconds_bucket{phase=\"%s\",le=\"+Inf\"} %llu\n",
+                    phase_names[p], (unsigned long long)phases[p].count);
+            fprintf(f, "rsync_lite_phase_seconds_sum{phase=\"%s\"} %.9f\n", phase_names[p],
+                    (double)phases[p].sum_ns / 1e9);
+            fprintf(f, "rsync_lite_phase_seconds_count{phase=\"%s\"} %llu\n", phase_names[p],
+                    (unsigned long long)phases[p].count);
+        }
+    } else {
+        for (int i = 0; i < MET_COUNTERS; i++)
+            fprintf(f, "%-16s %llu\n", counter_names[i], (unsigned long long)counters[i]);
+        fprintf(f, "\n%-16s %8s %10s %10s %10s\n", "phase", "count", "total_s", "p50_ms", "p99_ms");
+        for (int p = 0; p < MET_PHASES; p++) {
+            const histogram_t *h = &phases[p];
+            fprintf(f, "%-16s %8llu %10.3f %10.3f %10.3f\n", phase_names[p], (unsigned long long)h->count,
+                    (double)h->sum_ns / 1e9, h->count ? quantile_ms(h, 0.5) : 0,
+                    h->count ? quantile_ms(h, 0.99) : 0);
+        }
+    }
+    if (fclose(f) != 0) {
+        free(out);
+        return NULL;
+    }
+    return out;
+}
@@ -0,0 +1,43 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Counters and latency histograms, sharded per thread so that recording
+ * is a relaxed atomic add on a cache line the thread rarely shares.
+ * Shards are only summed when a STATS request renders them. */
+enum {
+    MET_SIG_RECV,       /* FILE_HDR until every signature is in */
+    MET_DIFF,           /* matching signatures and sending BLOCK_REQ */
+    MET_BLOCK_RECV,     /* BLOCK_REQ until BLOCK_END */
+    MET_DECODE,         /* decompression of an upload's blocks */
+    MET_DISK_WRITE,     /* writing them into the staging file */
+    MET_INDEX_SAVE,     /* recording the index entry */
+    MET_COMMIT,         /* chunk store, rename and index, under the file lock */
+    MET_FILE_GET,
+    MET_DELTA_GET,
+    MET_DELTA_UPLOAD,
+    MET_CHUNK_UPLOAD,
+    MET_PHASES
+};
+
+enum {
+    MET_UPLOADS,          /* FILE_HDR uploads answered FILE_OK */
+    MET_UPLOADS_FAILED,
+    MET_UP_TO_DATE,
+    MET_BLOCKS_REQUESTED,
+    MET_BLOCKS_RECEIVED,
+    MET_BYTES_RECEIVED,   /* block payloads as sent by clients */
+    MET_BYTES_SENT,       /* FILE_GET payloads */
+    MET_COUNTERS
+};
+
+double metrics_now(void);
+void metrics_add(int counter, uint64_t n);
+void metrics_observe(int phase, double sec);
+
+/* A malloc'ed report: a plain table, or the Prometheus text format */
+char *metrics_render(int prometheus, size_t *len);
+
+#endif
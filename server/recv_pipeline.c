@@ -0,0 +1,296 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/uio.h>
+#include "recv_pipeline.h"
+#include "../common_utils/buf_pool.h"
+#include "log.h"
+
+#define RECV_PART_BLOCKS 32     /* blocks a decoder takes at a time */
+
+typedef struct recv_job {
+    recv_pipe_t *rp;
+    recv_block_t blocks[RECV_BATCH_BLOCKS];
+    int ok[RECV_BATCH_BLOCKS];
+    int n;
+    unsigned char *in;          /* compressed payloads */
+    size_t in_len, in_cap;
+    unsigned char *out;         /* block k decodes to out + k * block_size */
+    int nparts, next_part, parts_done;
+    int busy;                   /* queued or being written */
+    int failed;
+    struct recv_job *next;      /* pool queue link */
+} recv_job_t;
+
+struct recv_pipe {
+    int fd;
+    size_t block_size;
+    int batch_blocks;           /* blocks per batch, at most RECV_BATCH_BLOCKS */
+    recv_decode_fn decode;
+    void *arg;
+    recv_job_t jobs[2];
+    int cur;
+    int failed;
+    dict_ctx_t *dict;           /* for batches decoded inline */
+    double started;
+    recv_stats_t stats;         /* updated under pool_lock */
+};
+
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t done_cond = PTHREAD_COND_INITIALIZER;
+static recv_job_t *queue_head, *queue_tail;
+static int pool_threads;
+
+static double now_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static void decode_part(recv_job_t *j, int part, dict_ctx_t **dict) {
+    recv_pipe_t *rp = j->rp;
+    double t0 = now_sec();
+    int bad = 0;
+    int last = (part + 1) * RECV_PART_BLOCKS < j->n ? (part + 1) * RECV_PART_BLOCKS : j->n;
+    for (int k = part * RECV_PART_BLOCKS; k < last; k++) {
+        const recv_block_t *b = &j->blocks[k];
+        j->ok[k] = rp->decode(rp->arg, dict, b, j->in + b->off, j->out + (size_t)k * rp->block_size) == 0;
+        bad += !j->ok[k];
+    }
+    double t = now_sec() - t0;
+
+    pthread_mutex_lock(&pool_lock);
+    rp->stats.decode_sec += t;
+    rp->stats.bad_blocks += bad;
+    pthread_mutex_unlock(&pool_lock);
+}
+
+static int cmp_block(const void *a, const void *b, void *arg) {
+    const recv_block_t *blocks = arg;
+    int x = *(const int *)a, y = *(const int *)b;
+    if (blocks[x].idx != blocks[y].idx) return blocks[x].idx < blocks[y].idx ? -1 : 1;
+    return x < y ? -1 : x > y;
+}
+
+static int pwritev_all(int fd, struct iovec *iov, int cnt, off_t off) {
+    while (cnt > 0) {
+        ssize_t w = pwritev(fd, iov, cnt, off);
+        if (w <= 0) return -1;
+        off += w;
+        while (cnt > 0 && (size_t)w >= iov->iov_len) {
+            w -= (ssize_t)iov->iov_len;
+            iov++;
+            cnt--;
+        }
+        if (cnt > 0) {
+            iov->iov_base = (char *)iov->iov_base + w;
+            iov->iov_len -= (size_t)w;
+        }
+    }
+    return 0;
+}
+
+/* Blocks are written in index order; a run stops after a short block.
+ * A block sent twice is written twice, the later copy last. */
+static void write_job(recv_job_t *j) {
+    recv_pipe_t *rp = j->rp;
+    double t0 = now_sec();
+    int order[RECV_BATCH_BLOCKS];
+    struct iovec iov[RECV_BATCH_BLOCKS];
+    for (int k = 0; k < j->n; k++) order[k] = k;
+    qsort_r(order, (size_t)j->n, sizeof(int), cmp_block, j->blocks);
+
+    int writes = 0;
+    size_t out_bytes = 0;
+    for (int i = 0; i < j->n && !j->failed;) {
+        if (!j->ok[order[i]]) {
+            j->failed = 1;
+            break;
+        }
+        int cnt = 0;
+        const recv_block_t *prev = NULL;
+        while (i < j->n && j->ok[order[i]]) {
+            const recv_block_t *b = &j->blocks[order[i]];
+            if (prev && (b->idx != prev->idx + 1 || prev->orig_len != rp->block_size)) break;
+            iov[cnt].iov_base = j->out + (size_t)order[i] * rp->block_size;
+            iov[cnt].iov_len = b->orig_len;
+            out_bytes += b->orig_len;
+            cnt++;
+            prev = b;
+            i++;
+        }
+        off_t off = (off_t)j->blocks[order[i - cnt]].idx * (off_t)rp->block_size;
+        if (pwritev_all(rp->fd, iov, cnt, off) != 0) {
+            log_error("pwritev: %s", strerror(errno));
+            j->failed = 1;
+        }
+        writes++;
+    }
+    double t = now_sec() - t0;
+
+    pthread_mutex_lock(&pool_lock);
+    rp->stats.write_sec += t;
+    rp->stats.writes += writes;
+    rp->stats.out_bytes += out_bytes;
+    pthread_mutex_unlock(&pool_lock);
+}
+
+static void *pool_main(void *arg) {
+    (void)arg;
+    dict_ctx_t *dict = NULL;
+    pthread_mutex_lock(&pool_lock);
+    for (;;) {
+        while (!queue_head) pthread_cond_wait(&pool_cond, &pool_lock);
+        recv_job_t *j = queue_head;
+        int part = j->next_part++;
+        if (j->next_part == j->nparts) {
+            queue_head = j->next;
+            if (!queue_head) queue_tail = NULL;
+        }
+        pthread_mutex_unlock(&pool_lock);
+
+        decode_part(j, part, &dict);
+
+        pthread_mutex_lock(&pool_lock);
+        if (++j->parts_done == j->nparts) {
+            pthread_mutex_unlock(&pool_lock);
+            write_job(j);
+            pthread_mutex_lock(&pool_lock);
+            j->busy = 0;
+            pthread_cond_broadcast(&done_cond);
+        }
+    }
+    return NULL;
+}
+
+void recv_pool_start(int nthreads) {
+    for (int i = 0; i < nthreads; i++) {
+        pthread_t tid;
+        if (pthread_create(&tid, NULL, pool_main, NULL) != 0) break;
+        pthread_detach(tid);
+        pool_threads++;
+    }
+}
+
+recv_pipe_t *recv_pipe_new(int fd, size_t block_size, recv_decode_fn decode, void *arg) {
+    recv_pipe_t *rp = calloc(1, sizeof(*rp));
+    if (!rp) return NULL;
+    rp->fd = fd;
+    rp->block_size = block_size;
+    rp->batch_blocks = RECV_BATCH_BYTES / block_size;
+    if (rp->batch_blocks > RECV_BATCH_BLOCKS) rp->batch_blocks = RECV_BATCH_BLOCKS;
+    if (rp->batch_blocks < 1) rp->batch_blocks = 1;
+    rp->decode = decode;
+    rp->arg = arg;
+    for (int i = 0; i < 2; i++) {
+        recv_job_t *j = &rp->jobs[i];
+        j->rp = rp;
+        j->in_cap = (size_t)rp->batch_blocks * 2 * block_size;
+        j->in = buf_get(j->in_cap);
+        j->out = buf_get((size_t)rp->batch_blocks * block_size);
+        if (!j->in || !j->out) {
+            recv_pipe_free(rp);
+            return NULL;
+        }
+    }
+    rp->started = now_sec();
+    return rp;
+}
+
+static void submit(recv_pipe_t *rp, recv_job_t *j) {
+    if (j->n == 0) return;
+    j->nparts = (j->n + RECV_PART_BLOCKS - 1) / RECV_PART_BLOCKS;
+    j->next_part = j->parts_done = 0;
+    j->failed = 0;
+    if (pool_threads == 0) {
+        for (int p = 0; p < j->nparts; p++) decode_part(j, p, &rp->dict);
+        write_job(j);
+        return;
+    }
+
+    pthread_mutex_lock(&pool_lock);
+    j->busy = 1;
+    j->next = NULL;
+    if (queue_tail) queue_tail->next = j;
+    else queue_head = j;
+    queue_tail = j;
+    pthread_cond_broadcast(&pool_cond);
+    pthread_mutex_unlock(&pool_lock);
+}
+
+/* Waits until j is on disk and empties it for the next batch */
+static void reclaim(recv_pipe_t *rp, recv_job_t *j) {
+    pthread_mutex_lock(&pool_lock);
+    while (j->busy) pthread_cond_wait(&done_cond, &pool_lock);
+    pthread_mutex_unlock(&pool_lock);
+    if (j->n > 0 && j->failed) rp->failed = 1;
+    j->n = 0;
+    j->in_len = 0;
+}
+
+int recv_pipe_add(recv_pipe_t *rp, int idx, int flags, const unsigned char *data, size_t c_len,
+                  size_t orig_len) {
+    if (orig_len == 0 || orig_len > rp->block_size) return -1;
+    recv_job_t *j = &rp->jobs[rp->cur];
+    if (j->n == rp->batch_blocks || (j->n > 0 && j->in_len + c_len > j->in_cap)) {
+        submit(rp, j);
+        rp->cur ^= 1;
+        j = &rp->jobs[rp->cur];
+        reclaim(rp, j);
+    }
+    if (rp->failed) return -1;
+    if (c_len > j->in_cap) {
+        /* Only ever an empty batch, so nothing needs copying */
+        unsigned char *in = buf_get(c_len);
+        if (!in) return -1;
+        buf_put(j->in);
+        j->in = in;
+        j->in_cap = c_len;
+    }
+
+    recv_block_t *b = &j->blocks[j->n++];
+    b->idx = idx;
+    b->flags = flags;
+    b->c_len = (uint32_t)c_len;
+    b->orig_len = (uint32_t)orig_len;
+    b->off = j->in_len;
+    memcpy(j->in + j->in_len, data, c_len);
+    j->in_len += c_len;
+    rp->stats.blocks++;
+    rp->stats.in_bytes += c_len;
+    return 0;
+}
+
+int recv_pipe_finish(recv_pipe_t *rp, recv_stats_t *stats) {
+    submit(rp, &rp->jobs[rp->cur]);
+    reclaim(rp, &rp->jobs[rp->cur]);
+    reclaim(rp, &rp->jobs[rp->cur ^ 1]);
+
+    if (stats) {
+        pthread_mutex_lock(&pool_lock);
+        *stats = rp->stats;
+        pthread_mutex_unlock(&pool_lock);
+        stats->recv_sec = now_sec() - rp->started;
+    }
+    return rp->failed ? -1 : 0;
+}
+
+void recv_pipe_free(recv_pipe_t *rp) {
+    if (!rp) return;
+    for (int i = 0; i < 2; i++) {
+        recv_job_t *j = &rp->jobs[i];
+        pthread_mutex_lock(&pool_lock);
+        while (j->busy) pthread_cond_wait(&done_cond, &pool_lock);
+        pthread_mutex_unlock(&pool_lock);
+        buf_put(j->in);
+        buf_put(j->out);
+    }
+    dict_ctx_free(rp->dict);
+    free(rp);
+}
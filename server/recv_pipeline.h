@@ -0,0 +1,50 @@
+#ifndef RECV_PIPELINE_H
+#define RECV_PIPELINE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "../common_utils/compressor.h"
+
+/* Blocks of one upload are collected into batches of RECV_BATCH_BLOCKS,
+ * fewer for large blocks so that a batch decodes to RECV_BATCH_BYTES at
+ * most. A full batch goes to a shared pool of decoder threads while the
+ * connection keeps receiving into the other one; the thread finishing
+ * the last part of a batch writes its runs of consecutive blocks to the
+ * staging file with one pwritev each. */
+#define RECV_BATCH_BLOCKS 256
+#define RECV_BATCH_BYTES (256 * 1024)
+
+typedef struct {
+    int idx;
+    int flags;          /* frame flags of the block (FF_RAW, FF_DICT) */
+    uint32_t c_len, orig_len;
+    size_t off;         /* payload offset in the batch */
+} recv_block_t;
+
+/* Decodes b's payload in into orig_len bytes at out. dict is the calling
+ * thread's dictionary context, created on first use. Returns 0 or -1. */
+typedef int (*recv_decode_fn)(void *arg, dict_ctx_t **dict, const recv_block_t *b,
+                              const unsigned char *in, unsigned char *out);
+
+typedef struct {
+    int blocks, writes;
+    int bad_blocks;     /* blocks the decode callback rejected */
+    size_t in_bytes, out_bytes;
+    double recv_sec, decode_sec, write_sec;   /* time spent in each stage */
+} recv_stats_t;
+
+typedef struct recv_pipe recv_pipe_t;
+
+/* Starts the decoder pool; with 0 threads batches are handled inline */
+void recv_pool_start(int nthreads);
+
+recv_pipe_t *recv_pipe_new(int fd, size_t block_size, recv_decode_fn decode, void *arg);
+/* Copies one payload into the current batch. Returns -1 once any earlier
+ * block of the upload failed to decode or write. */
+int recv_pipe_add(recv_pipe_t *rp, int idx, int flags, const unsigned char *data, size_t c_len,
+                  size_t orig_len);
+/* Writes everything still buffered and waits for it */
+int recv_pipe_finish(recv_pipe_t *rp, recv_stats_t *stats);
+void recv_pipe_free(recv_pipe_t *rp);
+
+#endif
@@ -9,45 +9,88 @@
 #include <netinet/in.h>
 #include <sys/stat.h>
 #include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <netinet/tcp.h>
+#include <sys/sendfile.h>
+#include <sys/mman.h>
+#include <dirent.h>
 
 #include "../common_utils/protocol.h"
 #include "../common_utils/compressor.h"
 #include "../common_utils/file_hasher.h"
+#include "../common_utils/frame.h"
+#include "../common_utils/delta.h"
+#include "../common_utils/merkle.h"
+#include "../common_utils/buf_pool.h"
 #include "index_store.h"
+#include "chunk_store.h"
+#include "file_lock.h"
+#include "event_loop.h"
+#include "recv_pipeline.h"
+#include "metrics.h"
+#include "log.h"
 
 #define PORT 9000
-#define BACKLOG 10
+#define BACKLOG 128
 #define INDEX_FILE "index.db"
 #define SYNC_FOLDER "syncedData"
+#define STAGING_FOLDER SYNC_FOLDER "/.partial"
+#define MAX_LITERAL_LEN (16 * 1024 * 1024)
+#define CHUNK_PACK "chunks.pack"
+#define CHUNK_INDEX "chunks.idx"
 
-file_index_t *indices = NULL;
-int indices_count = 0;
+index_db_t *index_db = NULL;
 pthread_mutex_t index_lock = PTHREAD_MUTEX_INITIALIZER;
+chunk_store_t *chunks = NULL;
 
-ssize_t read_n(int fd, void *buf, size_t n) {
-    char *p = buf;
+/* Client sockets are non-blocking; replies wait for buffer space rather
+ * than spinning. */
+ssize_t write_n(int fd, const void *buf, size_t n) {
+    const char *p = buf;
     size_t left = n;
     while (left > 0) {
-        ssize_t r = read(fd, p, left);
-        if (r <= 0) return r;
-        left -= r;
-        p += r;
+        ssize_t w = write(fd, p, left);
+        if (w < 0 && errno == EINTR) continue;
+        if (w < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            struct pollfd pfd = { fd, POLLOUT, 0 };
+            if (poll(&pfd, 1, NETBUF_IO_TIMEOUT_MS) <= 0) return -1;
+            continue;
+        }
+        if (w <= 0) return w;
+        left -= w;
+        p += w;
     }
     return (ssize_t)n;
 }
 
-ssize_t write_n(int fd, const void *buf, size_t n) {
-    const char *p = buf;
+/* Streams a file range straight from the page cache to the socket */
+ssize_t sendfile_n(int out_fd, int in_fd, off_t off, size_t n) {
     size_t left = n;
     while (left > 0) {
-        ssize_t w = write(fd, p, left);
+        ssize_t w = sendfile(out_fd, in_fd, &off, left);
+        if (w < 0 && errno == EINTR) continue;
+        if (w < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            struct pollfd pfd = { out_fd, POLLOUT, 0 };
+            if (poll(&pfd, 1, NETBUF_IO_TIMEOUT_MS) <= 0) return -1;
+            continue;
+        }
         if (w <= 0) return w;
-        left -= w;
-        p += w;
+        left -= (size_t)w;
     }
     return (ssize_t)n;
 }
 
+void set_cork(int fd, int on) {
+    setsockopt(fd, IPPROTO_TCP, TCP_CORK, &on, sizeof(on));
+}
+
+static uint32_t fixed_block_len(size_t fsize, size_t block_size, int i) {
+    size_t off = (size_t)i * block_size;
+    return (uint32_t)(fsize - off < block_size ? fsize - off : block_size);
+}
+
 void ensure_folder(const char *folder) {
     struct stat st;
     if (stat(folder, &st) == -1) {
@@ -55,268 +98,1812 @@ void ensure_folder(const char *folder) {
     }
 }
 
-void handle_client(int client_fd) {
-    FILE *outf = NULL;
-    char line[4096];
+void print_chunk_stats(void) {
+    chunk_store_stats_t st;
+    chunk_store_stats(chunks, &st);
+    double ratio = st.stored_bytes ? (double)st.logical_bytes / (double)st.stored_bytes : 1.0;
+    log_info("Chunk store: %llu chunks, %llu bytes stored for %llu logical bytes (dedup %.2fx), "
+             "%llu chunks / %llu bytes reused instead of uploaded",
+             (unsigned long long)st.chunks, (unsigned long long)st.stored_bytes,
+             (unsigned long long)st.logical_bytes, ratio,
+             (unsigned long long)st.saved_uploads, (unsigned long long)st.saved_bytes);
+}
 
-    ssize_t rr = recv(client_fd, line, sizeof(line) - 1, 0);
-    if (rr <= 0) { close(client_fd); return; }
+/* Uploads are assembled in a private staging file under STAGING_FOLDER,
+ * on the same filesystem as SYNC_FOLDER so that publishing is a rename. */
+void staging_path(char *out, size_t n, const char *name) {
+    static unsigned long seq;
+    const char *base = strrchr(name, '/');
+    ensure_folder(SYNC_FOLDER);
+    ensure_folder(STAGING_FOLDER);
+    snprintf(out, n, "%s/%lu.%s", STAGING_FOLDER,
+             __atomic_add_fetch(&seq, 1, __ATOMIC_RELAXED), base ? base + 1 : name);
+}
 
-    line[rr] = '\0';
+/* Creates the directories leading up to path, for files synced as part
+ * of a tree */
+void ensure_parent_dirs(const char *path) {
+    char dir[MAX_PATH_LEN + 64];
+    snprintf(dir, sizeof(dir), "%s", path);
+    for (char *p = strchr(dir + strlen(SYNC_FOLDER) + 1, '/'); p; p = strchr(p + 1, '/')) {
+        *p = '\0';
+        mkdir(dir, 0755);
+        *p = '/';
+    }
+}
 
-    if (strncmp(line, MSG_FILE_GET, strlen(MSG_FILE_GET)) == 0) {
-        char req_fname[MAX_PATH_LEN];
-        if (sscanf(line, "FILE_GET %s", req_fname) != 1) {
-            const char *err = MSG_FILE_ERR "\n";
-            write_n(client_fd, err, strlen(err));
-            close(client_fd);
-            return;
-        }
-
-        const char *base = strrchr(req_fname, '/');
-        const char *basename = base ? base + 1 : req_fname;
-
-        ensure_folder(SYNC_FOLDER);
-        char path[512];
-        snprintf(path, sizeof(path), "%s/%s", SYNC_FOLDER, basename);
-
-        FILE *f = fopen(path, "rb");
-        if (!f) {
-            const char *err = MSG_FILE_ERR "\n";
-            write_n(client_fd, err, strlen(err));
-            fprintf(stderr, "Client requested missing file: %s\n", path);
-            close(client_fd);
-            return;
-        }
-
-        if (fseek(f, 0, SEEK_END) != 0) {
-            perror("fseek");
-            fclose(f);
-            const char *err = MSG_FILE_ERR "\n";
-            write_n(client_fd, err, strlen(err));
-            close(client_fd);
-            return;
-        }
-        long fsize_long = ftell(f);
-        if (fsize_long < 0) fsize_long = 0;
-        size_t fsize = (size_t)fsize_long;
-        rewind(f);
-
-        char hdr[128];
-        int hdrlen = snprintf(hdr, sizeof(hdr), MSG_FILE_DATA " %zu\n", fsize);
-        write_n(client_fd, hdr, (size_t)hdrlen);
-
-        unsigned char buf[4096];
-        size_t n;
-        while ((n = fread(buf, 1, sizeof(buf), f)) > 0) {
-            if (write_n(client_fd, buf, n) <= 0) {
-                fprintf(stderr, "Error sending file to client (write)\n");
-                break;
-            }
+/* Names inside a sync session are paths relative to SYNC_FOLDER; they
+ * may not leave it or reach into the staging folder. */
+int valid_tree_path(const char *name) {
+    if (name[0] == '/') return 0;
+    for (const char *p = name;;) {
+        const char *end = strchr(p, '/');
+        size_t len = end ? (size_t)(end - p) : strlen(p);
+        if (len == 0 || (len == 1 && p[0] == '.') || (len == 2 && p[0] == '.' && p[1] == '.'))
+            return 0;
+        if (p == name && len == 8 && strncmp(p, ".partial", 8) == 0) return 0;
+        if (!end) return 1;
+        p = end + 1;
+    }
+}
+
+/* Staging files left behind by a crash are never committed */
+void remove_stale_staging(void) {
+    DIR *d = opendir(STAGING_FOLDER);
+    if (!d) return;
+    struct dirent *de;
+    char path[MAX_PATH_LEN + 64];
+    while ((de = readdir(d)) != NULL) {
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) continue;
+        snprintf(path, sizeof(path), "%s/%s", STAGING_FOLDER, de->d_name);
+        unlink(path);
+    }
+    closedir(d);
+}
+
+/* Copies len bytes between descriptors inside the kernel where possible,
+ * which shares extents outright on filesystems that support reflinks. */
+int copy_range(int in_fd, off_t in_off, int out_fd, off_t out_off, size_t len) {
+    while (len > 0) {
+        ssize_t n = copy_file_range(in_fd, &in_off, out_fd, &out_off, len, 0);
+        if (n <= 0) break;
+        len -= (size_t)n;
+    }
+    unsigned char buf[64 * 1024];
+    while (len > 0) {
+        size_t want = len < sizeof(buf) ? len : sizeof(buf);
+        ssize_t n = pread(in_fd, buf, want, in_off);
+        if (n <= 0 || pwrite(out_fd, buf, (size_t)n, out_off) != n) return -1;
+        in_off += n;
+        out_off += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+/* The stored version of a file: an open descriptor and a private copy of
+ * its index entry, taken together under the file's read lock so that no
+ * commit lands in between. The descriptor keeps this version readable
+ * after a later commit renames a new one over it. */
+typedef struct {
+    int fd;             /* -1 if the file does not exist */
+    int indexed;        /* the fields below describe fd */
+    size_t filesize;
+    int nblocks;
+    block_sig_t *sigs;
+    uint32_t block_size;
+    uint32_t chunk_avg;
+    uint32_t *lens;
+    int hash_alg;
+} stored_version_t;
+
+void stored_version_open(stored_version_t *v, const char *basename, const char *path) {
+    memset(v, 0, sizeof(*v));
+    file_lock_t *fl = file_lock_acquire(basename, 0);
+    v->fd = open(path, O_RDONLY);
+
+    pthread_mutex_lock(&index_lock);
+    const file_index_t *e = v->fd >= 0 ? index_db_find(index_db, basename) : NULL;
+    if (e) {
+        size_t n = (size_t)(e->nblocks ? e->nblocks : 1);
+        v->sigs = malloc(sizeof(block_sig_t) * n);
+        v->lens = e->chunk_avg ? malloc(sizeof(uint32_t) * n) : NULL;
+        if (v->sigs && (!e->chunk_avg || v->lens)) {
+            memcpy(v->sigs, e->sigs, sizeof(block_sig_t) * (size_t)e->nblocks);
+            if (e->chunk_avg) memcpy(v->lens, e->lens, sizeof(uint32_t) * (size_t)e->nblocks);
+            v->indexed = 1;
+            v->filesize = e->filesize;
+            v->nblocks = e->nblocks;
+            v->block_size = e->block_size;
+            v->chunk_avg = e->chunk_avg;
+            v->hash_alg = e->hash_alg;
+        } else {
+            free(v->sigs);
+            free(v->lens);
+            v->sigs = NULL;
+            v->lens = NULL;
         }
-        fclose(f);
+    }
+    pthread_mutex_unlock(&index_lock);
+    file_lock_release(fl);
+}
 
-        write_n(client_fd, MSG_FILE_END "\n", strlen(MSG_FILE_END) + 1);
+void stored_version_close(stored_version_t *v) {
+    if (v->fd >= 0) close(v->fd);
+    free(v->sigs);
+    free(v->lens);
+    v->fd = -1;
+    v->sigs = NULL;
+    v->lens = NULL;
+}
 
-        printf("Sent file %s (%zu bytes) to client\n", basename, fsize);
-        close(client_fd);
-        return;
+/* Publishes an upload: the staging file is renamed over path and the new
+ * manifest recorded under the file's write lock, so readers always find a
+ * file together with the index entry describing it. The chunk store takes
+ * references on the new chunks before the old version's references are
+ * dropped, so shared chunks never hit zero in between.
+ *
+ * Without a staging file only the manifest changes, and only if path is
+ * still the version at base; if another upload replaced it meanwhile,
+ * this one is ordered before it and has nothing left to do.
+ *
+ * sigs and lens must come from malloc: the index keeps them as the new
+ * entry, and they are freed on every other path. */
+int commit_file(const char *basename, const char *path, const char *staging,
+                const struct stat *base, size_t fsize, int nblocks, block_sig_t *sigs,
+                uint32_t block_size, uint32_t chunk_avg, uint32_t *lens, int hash_alg,
+                const unsigned char *leaves) {
+    double t0 = metrics_now();
+    /* Fixed-size entries carry a Merkle tree; a descent already knows its
+     * leaf level */
+    unsigned char *tree = NULL;
+    if (chunk_avg == 0 && nblocks > 0) {
+        tree = malloc(merkle_nodes(nblocks) * MERKLE_NODE_LEN);
+        if (!tree) {
+            if (staging) unlink(staging);
+            free(sigs);
+            free(lens);
+            return -1;
+        }
+        merkle_build(hash_alg, sigs, nblocks, leaves, tree);
     }
 
-    if (strncmp(line, MSG_FILE_HDR, strlen(MSG_FILE_HDR)) != 0) {
-        close(client_fd);
-        return;
+    file_index_t newidx;
+    memset(&newidx, 0, sizeof(newidx));
+    newidx.filename = basename;
+    newidx.filesize = fsize;
+    newidx.nblocks = nblocks;
+    newidx.sigs = sigs;
+    newidx.block_size = chunk_avg ? 0 : block_size;
+    newidx.chunk_avg = chunk_avg;
+    newidx.lens = lens;
+    newidx.hash_alg = hash_alg;
+    file_digest(hash_alg, sigs, nblocks, newidx.digest);
+    newidx.tree = tree;
+
+    /* The staging file is private, so its chunks are stored unlocked */
+    const uint32_t *chunk_lens = chunk_avg ? lens : NULL;
+    if (staging)
+        chunk_store_add_file(chunks, staging, sigs, chunk_lens, newidx.block_size, nblocks, fsize, hash_alg);
+
+    int rc = 0;
+    file_lock_t *fl = file_lock_acquire(basename, 1);
+    if (staging) {
+        ensure_parent_dirs(path);
+        if (rename(staging, path) != 0) {
+            log_error("rename: %s", strerror(errno));
+            unlink(staging);
+            chunk_store_release(chunks, sigs, chunk_lens, newidx.block_size, nblocks, fsize, hash_alg);
+            file_lock_release(fl);
+            free(tree);
+            free(sigs);
+            free(lens);
+            return -1;
+        }
+    } else {
+        struct stat st;
+        if (base && (stat(path, &st) != 0 || st.st_ino != base->st_ino || st.st_dev != base->st_dev)) {
+            log_info("%s was replaced by a concurrent upload; nothing to commit", basename);
+            file_lock_release(fl);
+            free(tree);
+            free(sigs);
+            free(lens);
+            return 0;
+        }
+        chunk_store_add_file(chunks, path, sigs, chunk_lens, newidx.block_size, nblocks, fsize, hash_alg);
     }
 
+    pthread_mutex_lock(&index_lock);
+    const file_index_t *old = index_db_find(index_db, basename);
+    if (old)
+        chunk_store_release(chunks, old->sigs, old->chunk_avg ? old->lens : NULL, old->block_size,
+                            old->nblocks, old->filesize, old->hash_alg);
+
+    double t_put = metrics_now();
+    int put = index_db_put_owned(index_db, &newidx);
+    metrics_observe(MET_INDEX_SAVE, metrics_now() - t_put);
+    if (put != 0) {
+        log_error("Failed to save index to %s", INDEX_FILE);
+        rc = -1;
+    } else {
+        log_debug("Index saved to %s", INDEX_FILE);
+    }
+    pthread_mutex_unlock(&index_lock);
+    file_lock_release(fl);
+    metrics_observe(MET_COMMIT, metrics_now() - t0);
+
+    if (chunk_store_should_gc(chunks))
+        chunk_store_gc(chunks);
+    chunk_store_save(chunks);
+
+    print_chunk_stats();
+    return rc;
+}
+
+/* Applies one COPY/LITERAL stream from the client on top of the stored
+ * version of the file. The old version's signatures go out first so the
+ * client can find matching blocks at any byte offset. */
+void handle_delta_upload(conn_t *c, const char *line) {
     char fname[MAX_PATH_LEN];
     size_t fsize;
-    int nblocks;
-    if (sscanf(line, "FILE_HDR %s %zu %d", fname, &fsize, &nblocks) != 3) {
-        fprintf(stderr, "Bad FILE_HDR from client\n");
-        close(client_fd);
+    if (sscanf(line, "DELTA_HDR %1023s %zu", fname, &fsize) != 2) {
+        log_warn("Bad DELTA_HDR from client");
         return;
     }
 
     const char *base = strrchr(fname, '/');
     const char *basename = base ? base + 1 : fname;
 
-    char *p = strstr(line, "\n");
-    int header_bytes = (p ? (p - line + 1) : rr);
-    int remaining = rr - header_bytes;
-    block_sig_t *sigs = malloc(sizeof(block_sig_t) * (size_t)nblocks);
-    if (!sigs) {
-        fprintf(stderr, "malloc sigs failed\n");
-        close(client_fd);
+    char path[MAX_PATH_LEN + 64], tmp[MAX_PATH_LEN + 96];
+    snprintf(path, sizeof(path), "%s/%s", SYNC_FOLDER, basename);
+    staging_path(tmp, sizeof(tmp), basename);
+
+    stored_version_t v;
+    stored_version_open(&v, basename, path);
+    FILE *oldf = v.fd >= 0 ? fdopen(v.fd, "rb") : NULL;
+    if (oldf) v.fd = -1;
+    int old_nblocks = 0;
+    size_t old_size = 0;
+    block_sig_t *old_sigs = NULL;
+
+    int rehash = 0;
+    if (v.indexed && oldf && v.nblocks > 0) {
+        old_size = v.filesize;
+        if (v.chunk_avg || v.block_size != BLOCK_SIZE || v.hash_alg != c->hash_alg) {
+            rehash = 1;
+        } else {
+            old_sigs = v.sigs;
+            old_nblocks = v.nblocks;
+            v.sigs = NULL;
+        }
+    }
+    stored_version_close(&v);
+
+    /* A file last synced in chunked mode, in other blocks or with another
+     * strong hash has no BLOCK_SIZE signatures the client can use */
+    if (rehash) {
+        int n = (int)((old_size + BLOCK_SIZE - 1) / BLOCK_SIZE);
+        old_sigs = malloc(sizeof(block_sig_t) * (size_t)n);
+        if (old_sigs && compute_sigs_for_file(oldf, old_sigs, n, BLOCK_SIZE, old_size, c->hash_alg) == 0) {
+            old_nblocks = n;
+        } else {
+            free(old_sigs);
+            old_sigs = NULL;
+        }
+    }
+
+    char hdr[128];
+    int hlen = snprintf(hdr, sizeof(hdr), MSG_SIGS " %d %zu\n", old_nblocks, old_size);
+    write_n(c->fd, hdr, (size_t)hlen);
+    if (old_nblocks > 0)
+        write_n(c->fd, old_sigs, sizeof(block_sig_t) * (size_t)old_nblocks);
+    free(old_sigs);
+
+    log_debug("Server: delta hdr: %s size=%zu (old blocks=%d)", basename, fsize, old_nblocks);
+
+    FILE *outf = fopen(tmp, "wb");
+    if (!outf) {
+        log_error("fopen delta output: %s", strerror(errno));
+        if (oldf) fclose(oldf);
         return;
     }
-    if (remaining > 0) memcpy(sigs, line + header_bytes, (size_t)remaining);
-    if ((int)remaining < (int)(sizeof(block_sig_t) * nblocks)) {
-        ssize_t need = (ssize_t)(sizeof(block_sig_t) * nblocks - remaining);
-        if (read_n(client_fd, ((char *)sigs) + remaining, (size_t)need) != need) {
-            fprintf(stderr, "Failed to read full signatures\n");
-            free(sigs);
-            close(client_fd);
-            return;
+
+    unsigned char blockbuf[BLOCK_SIZE];
+    size_t copied = 0, literal = 0;
+    int ok = 0;
+    while (1) {
+        char cmd[256];
+        if (nb_read_line(&c->in, cmd, sizeof(cmd)) <= 0) break;
+
+        if (strncmp(cmd, MSG_DELTA_END, strlen(MSG_DELTA_END)) == 0) {
+            ok = 1;
+            break;
+        }
+
+        int start = 0, count = 0;
+        if (sscanf(cmd, "COPY %d %d", &start, &count) == 2) {
+            if (!oldf || start < 0 || count < 0 || start > old_nblocks || count > old_nblocks - start) {
+                log_warn("Invalid COPY %d %d", start, count);
+                break;
+            }
+            fseek(oldf, (long)start * BLOCK_SIZE, SEEK_SET);
+            for (int i = 0; i < count; i++) {
+                size_t got = fread(blockbuf, 1, BLOCK_SIZE, oldf);
+                if (got == 0) break;
+                fwrite(blockbuf, 1, got, outf);
+                copied += got;
+            }
+            continue;
         }
+
+        int c_len = 0, orig_len = 0;
+        if (sscanf(cmd, "LITERAL %d %d", &c_len, &orig_len) == 2) {
+            if (c_len <= 0 || orig_len <= 0 || c_len > orig_len || orig_len > MAX_LITERAL_LEN) {
+                log_warn("Invalid LITERAL %d %d", c_len, orig_len);
+                break;
+            }
+            unsigned char *cbuf = buf_get((size_t)c_len);
+            if (!cbuf) break;
+            if (nb_read_n(&c->in, cbuf, (size_t)c_len) != (ssize_t)c_len) {
+                buf_put(cbuf);
+                break;
+            }
+            if (c_len == orig_len) {
+                fwrite(cbuf, 1, (size_t)c_len, outf);
+            } else {
+                unsigned char *dec = buf_get((size_t)orig_len);
+                if (!dec || codec_decompress(CODEC_ZLIB, cbuf, (size_t)c_len, dec, (size_t)orig_len) < 0) {
+                    log_warn("Decompression failed for literal");
+                    buf_put(dec);
+                    buf_put(cbuf);
+                    break;
+                }
+                fwrite(dec, 1, (size_t)orig_len, outf);
+                buf_put(dec);
+            }
+            buf_put(cbuf);
+            literal += (size_t)orig_len;
+            continue;
+        }
+
+        log_warn("Invalid delta command: %s", cmd);
+        break;
     }
 
-    printf("Server: file hdr: %s size=%zu nblocks=%d\n", basename, fsize, nblocks);
+    if (oldf) fclose(oldf);
+    fflush(outf);
+    long written = ftell(outf);
+    fclose(outf);
 
-    pthread_mutex_lock(&index_lock);
-    file_index_t *existing = find_index_by_name(indices, indices_count, basename);
-    pthread_mutex_unlock(&index_lock);
+    if (!ok || written < 0 || (size_t)written != fsize) {
+        log_error("Delta upload for %s failed", basename);
+        unlink(tmp);
+        write_n(c->fd, MSG_FILE_ERR "\n", strlen(MSG_FILE_ERR) + 1);
+        return;
+    }
 
-    int *req = malloc(sizeof(int) * (size_t)nblocks);
-    if (!req) {
+    int nblocks = (int)((fsize + BLOCK_SIZE - 1) / BLOCK_SIZE);
+    block_sig_t *sigs = malloc(sizeof(block_sig_t) * (size_t)(nblocks ? nblocks : 1));
+    FILE *nf = fopen(tmp, "rb");
+    if (!sigs || !nf || compute_sigs_for_file(nf, sigs, nblocks, BLOCK_SIZE, fsize, c->hash_alg) != 0) {
+        if (nf) fclose(nf);
         free(sigs);
-        close(client_fd);
+        unlink(tmp);
+        write_n(c->fd, MSG_FILE_ERR "\n", strlen(MSG_FILE_ERR) + 1);
         return;
     }
-    int req_count = 0;
-    for (int i = 0; i < nblocks; i++) {
-        int match = 0;
-        if (existing && existing->nblocks == nblocks) {
-            if (existing->sigs[i].weak == sigs[i].weak &&
-                memcmp(existing->sigs[i].strong, sigs[i].strong, 16) == 0) {
-                match = 1;
+    fclose(nf);
+
+    log_info("Delta applied to %s: %zu bytes copied, %zu literal bytes", basename, copied, literal);
+    int rc = commit_file(basename, path, tmp, NULL, fsize, nblocks, sigs, BLOCK_SIZE, 0, NULL,
+                         c->hash_alg, NULL);
+
+    if (rc == 0)
+        write_n(c->fd, MSG_FILE_OK "\n", strlen(MSG_FILE_OK) + 1);
+    else
+        write_n(c->fd, MSG_FILE_ERR "\n", strlen(MSG_FILE_ERR) + 1);
+}
+
+typedef struct {
+    size_t off;
+    uint32_t len;
+    uint32_t weak;
+    unsigned char strong[16];
+} old_chunk_t;
+
+#define FROM_STORE -2
+
+/* Byte ranges of every entry in the stored index, fixed blocks or chunks,
+ * with strong hashes in hash_alg. Entries stored under another hash are
+ * rehashed from the file on disk. *fd_out is left open on the version the
+ * ranges describe (-1 if there is none). */
+old_chunk_t *snapshot_old_chunks(const char *basename, const char *path, int hash_alg,
+                                 int *count_out, int *fd_out) {
+    old_chunk_t *old = NULL;
+    int count = 0;
+
+    stored_version_t v;
+    stored_version_open(&v, basename, path);
+    if (v.indexed && v.nblocks > 0) {
+        old = malloc(sizeof(old_chunk_t) * (size_t)v.nblocks);
+        if (old) {
+            size_t off = 0;
+            for (int i = 0; i < v.nblocks; i++) {
+                size_t len = v.chunk_avg ? v.lens[i] : v.block_size;
+                if (off + len > v.filesize) len = v.filesize - off;
+                old[i].off = off;
+                old[i].len = (uint32_t)len;
+                old[i].weak = v.sigs[i].weak;
+                memcpy(old[i].strong, v.sigs[i].strong, 16);
+                off += len;
             }
+            count = v.nblocks;
         }
-        if (!match) req[req_count++] = i;
     }
 
-    char outbuf[8192];
-    int pos = snprintf(outbuf, sizeof(outbuf), "BLOCK_REQ %d\n", req_count);
-    for (int i = 0; i < req_count; i++) {
-        pos += snprintf(outbuf + pos, sizeof(outbuf) - pos, "%d ", req[i]);
+    if (count > 0 && v.hash_alg != hash_alg) {
+        uint32_t max_len = 1;
+        for (int i = 0; i < count; i++)
+            if (old[i].len > max_len) max_len = old[i].len;
+        unsigned char *buf = malloc(max_len);
+        int i = 0;
+        for (; buf && i < count; i++) {
+            if (pread(v.fd, buf, old[i].len, (off_t)old[i].off) != (ssize_t)old[i].len) break;
+            strong_hash(hash_alg, buf, old[i].len, old[i].strong);
+        }
+        if (i < count) count = 0;
+        free(buf);
+    }
+
+    *fd_out = v.fd;
+    v.fd = -1;
+    stored_version_close(&v);
+    *count_out = count;
+    return old;
+}
+
+int find_old_chunk(const old_chunk_t *old, const int *slots, size_t mask, const chunk_sig_t *cs) {
+    for (size_t s = cs->weak & mask; slots[s] >= 0; s = (s + 1) & mask) {
+        const old_chunk_t *o = &old[slots[s]];
+        if (o->weak == cs->weak && o->len == cs->len && memcmp(o->strong, cs->strong, 16) == 0)
+            return slots[s];
+    }
+    return -1;
+}
+
+int send_block_req(int client_fd, const int *req, int req_count) {
+    size_t cap = 32 + (size_t)req_count * 12;
+    char *outbuf = malloc(cap);
+    if (!outbuf) return -1;
+    size_t pos = (size_t)snprintf(outbuf, cap, MSG_BLOCK_REQ " %d\n", req_count);
+    for (int i = 0; i < req_count; i++)
+        pos += (size_t)snprintf(outbuf + pos, cap - pos, "%d ", req[i]);
+    pos += (size_t)snprintf(outbuf + pos, cap - pos, "\n");
+    ssize_t w = write_n(client_fd, outbuf, pos);
+    free(outbuf);
+    return w == (ssize_t)pos ? 0 : -1;
+}
+
+/* Content-defined chunking upload. Chunks may have moved anywhere in the
+ * file, so they are matched against the stored version by hash rather
+ * than by position, and the new file is assembled into a staging file. */
+void handle_chunk_upload(conn_t *c, const char *line) {
+    char fname[MAX_PATH_LEN];
+    size_t fsize;
+    int nchunks;
+    unsigned int chunk_avg;
+    if (sscanf(line, "CHUNK_HDR %1023s %zu %d %u", fname, &fsize, &nchunks, &chunk_avg) != 4 ||
+        nchunks < 0 || chunk_avg == 0 || (size_t)nchunks > fsize + 1) {
+        log_warn("Bad CHUNK_HDR from client");
+        return;
     }
-    pos += snprintf(outbuf + pos, sizeof(outbuf) - pos, "\n");
-    write_n(client_fd, outbuf, (size_t)pos);
+
+    const char *base = strrchr(fname, '/');
+    const char *basename = base ? base + 1 : fname;
+
+    size_t sig_bytes = sizeof(chunk_sig_t) * (size_t)nchunks;
+    chunk_sig_t *csigs = malloc(sig_bytes ? sig_bytes : 1);
+    if (!csigs) {
+        return;
+    }
+    if (nb_read_n(&c->in, csigs, sig_bytes) != (ssize_t)sig_bytes) {
+        log_warn("Failed to read full chunk signatures");
+        free(csigs);
+        return;
+    }
+
+    size_t total = 0, max_len = 0;
+    for (int i = 0; i < nchunks; i++) {
+        total += csigs[i].len;
+        if (csigs[i].len > max_len) max_len = csigs[i].len;
+    }
+    if (total != fsize || max_len > MAX_LITERAL_LEN) {
+        log_warn("Chunk list does not cover %zu bytes", fsize);
+        free(csigs);
+        return;
+    }
+
+    log_debug("Server: chunk hdr: %s size=%zu nchunks=%d avg=%u", basename, fsize, nchunks, chunk_avg);
+
+    char path[MAX_PATH_LEN + 64], tmp[MAX_PATH_LEN + 96];
+    snprintf(path, sizeof(path), "%s/%s", SYNC_FOLDER, basename);
+    staging_path(tmp, sizeof(tmp), basename);
+
+    int old_count = 0, old_fd = -1;
+    old_chunk_t *old = snapshot_old_chunks(basename, path, c->hash_alg, &old_count, &old_fd);
+    size_t cap = 16;
+    while (cap < (size_t)old_count * 2) cap <<= 1;
+    int *slots = malloc(sizeof(int) * cap);
+    int *match = malloc(sizeof(int) * (size_t)(nchunks ? nchunks : 1));
+    int *req = malloc(sizeof(int) * (size_t)(nchunks ? nchunks : 1));
+    unsigned char *buf = malloc(max_len ? max_len : 1);
+    if (!slots || !match || !req || !buf) {
+        free(old); free(slots); free(match); free(req); free(buf); free(csigs);
+        if (old_fd >= 0) close(old_fd);
+        return;
+    }
+    for (size_t i = 0; i < cap; i++) slots[i] = -1;
+    for (int i = 0; i < old_count; i++) {
+        size_t sl = old[i].weak & (cap - 1);
+        while (slots[sl] >= 0) sl = (sl + 1) & (cap - 1);
+        slots[sl] = i;
+    }
+
+    /* match[i]: index into the old version, FROM_STORE, or -1 to request.
+     * Chunks from the store are written before BLOCK_REQ goes out, since
+     * a gc while the client streams could drop them; any that cannot be
+     * read are requested instead. */
+    FILE *outf = fopen(tmp, "wb");
+    int req_count = 0;
+    size_t reused = 0, off = 0;
+    for (int i = 0; i < nchunks; i++) {
+        match[i] = find_old_chunk(old, slots, cap - 1, &csigs[i]);
+        if (match[i] < 0 && outf && chunk_store_read(chunks, c->hash_alg, csigs[i].strong, csigs[i].len, buf) == 0 &&
+            fseek(outf, (long)off, SEEK_SET) == 0 && fwrite(buf, 1, csigs[i].len, outf) == csigs[i].len) {
+            match[i] = FROM_STORE;
+            reused += csigs[i].len;
+        }
+        if (match[i] == -1) req[req_count++] = i;
+        off += csigs[i].len;
+    }
+    send_block_req(c->fd, req, req_count);
     free(req);
+    free(slots);
+
+    FILE *oldf = old_fd >= 0 ? fdopen(old_fd, "rb") : NULL;
+    if (!oldf && old_fd >= 0) close(old_fd);
+    int ok = outf != NULL && fseek(outf, 0, SEEK_SET) == 0;
 
-    if (req_count > 0) {
-        ensure_folder(SYNC_FOLDER);
-        char path[512];
-        snprintf(path, sizeof(path), "%s/%s", SYNC_FOLDER, basename);
-
-        outf = fopen(path, "r+b");
-        if (!outf) {
-            outf = fopen(path, "wb");
-            if (!outf) {
-                perror("fopen server output");
-                free(sigs);
-                close(client_fd);
-                return;
+    for (int i = 0; ok && i < nchunks; i++) {
+        if (match[i] == FROM_STORE) {
+            if (fseek(outf, (long)csigs[i].len, SEEK_CUR) != 0) {
+                ok = 0;
+                break;
             }
+            continue;
         }
-        if (ftruncate(fileno(outf), (off_t)fsize) != 0) {
-            /* Not fatal; continue */
+        if (match[i] >= 0 && oldf) {
+            const old_chunk_t *o = &old[match[i]];
+            if (fseek(oldf, (long)o->off, SEEK_SET) != 0 || fread(buf, 1, o->len, oldf) != o->len) {
+                ok = 0;
+                break;
+            }
+            fwrite(buf, 1, o->len, outf);
+            reused += o->len;
+            continue;
         }
-    } else {
-        outf = NULL;
-        printf("No blocks requested; file up-to-date.\n");
-    }
 
-    while (1) {
         char hdr[256];
-        int hpos = 0;
-        char ch;
-        while (read(client_fd, &ch, 1) == 1) {
-            hdr[hpos++] = ch;
-            if (ch == '\n' || hpos >= (int)sizeof(hdr) - 1) break;
+        int idx = -1, c_len = 0, orig_len = 0;
+        if (nb_read_line(&c->in, hdr, sizeof(hdr)) <= 0 ||
+            sscanf(hdr, "BLOCK_DATA %d %d %d", &idx, &c_len, &orig_len) != 3 ||
+            idx != i || orig_len != (int)csigs[i].len || c_len <= 0 || c_len > orig_len) {
+            log_warn("Unexpected chunk data for chunk %d: %s", i, hdr);
+            ok = 0;
+            break;
         }
-        if (hpos <= 0) break;
-        hdr[hpos] = '\0';
-
-        if (strncmp(hdr, "BLOCK_END", 9) == 0) {
-            printf("All blocks received for %s\n", basename);
+        unsigned char *cbuf = buf_get((size_t)c_len);
+        if (!cbuf || nb_read_n(&c->in, cbuf, (size_t)c_len) != (ssize_t)c_len) {
+            buf_put(cbuf);
+            ok = 0;
             break;
         }
+        if (c_len == orig_len) {
+            fwrite(cbuf, 1, (size_t)c_len, outf);
+        } else {
+            unsigned char *dec = buf_get((size_t)orig_len);
+            if (!dec || codec_decompress(CODEC_ZLIB, cbuf, (size_t)c_len, dec, (size_t)orig_len) < 0) {
+                log_warn("Decompression failed for chunk %d", i);
+                buf_put(dec);
+                buf_put(cbuf);
+                ok = 0;
+                break;
+            }
+            fwrite(dec, 1, (size_t)orig_len, outf);
+            buf_put(dec);
+        }
+        buf_put(cbuf);
+    }
 
-        int idx = -1, c_len = 0, orig_len = 0;
-        if (sscanf(hdr, "BLOCK_DATA %d %d %d", &idx, &c_len, &orig_len) != 3) {
-            fprintf(stderr, "Invalid block header: %s\n", hdr);
-            continue;
+    if (ok) {
+        char end[64];
+        if (nb_read_line(&c->in, end, sizeof(end)) <= 0 || strncmp(end, "BLOCK_END", 9) != 0)
+            ok = 0;
+    }
+    if (oldf) fclose(oldf);
+    if (outf) fclose(outf);
+    free(old);
+    free(match);
+    free(buf);
+
+    if (!ok) {
+        log_error("Chunked upload for %s failed", basename);
+        unlink(tmp);
+        write_n(c->fd, MSG_FILE_ERR "\n", strlen(MSG_FILE_ERR) + 1);
+        free(csigs);
+        return;
+    }
+
+    log_info("Chunked upload of %s: %d/%d chunks sent, %zu bytes reused",
+             basename, req_count, nchunks, reused);
+
+    block_sig_t *sigs = malloc(sizeof(block_sig_t) * (size_t)(nchunks ? nchunks : 1));
+    uint32_t *lens = malloc(sizeof(uint32_t) * (size_t)(nchunks ? nchunks : 1));
+    int rc = -1;
+    if (sigs && lens) {
+        for (int i = 0; i < nchunks; i++) {
+            sigs[i].weak = csigs[i].weak;
+            memcpy(sigs[i].strong, csigs[i].strong, 16);
+            lens[i] = csigs[i].len;
         }
+        rc = commit_file(basename, path, tmp, NULL, fsize, nchunks, sigs, 0, chunk_avg, lens,
+                         c->hash_alg, NULL);
+    } else {
+        unlink(tmp);
+        free(sigs);
+        free(lens);
+    }
+    free(csigs);
+
+    if (rc == 0)
+        write_n(c->fd, MSG_FILE_OK "\n", strlen(MSG_FILE_OK) + 1);
+    else
+        write_n(c->fd, MSG_FILE_ERR "\n", strlen(MSG_FILE_ERR) + 1);
+}
+
+/* FILE_GET <name> [offset [length]]. The reply is FILE_DATA <length> <size>
+ * followed by exactly <length> bytes, so ranges can resume or split a
+ * download; a zero length just reports the size. */
+void handle_file_get(conn_t *c, const char *line) {
+    char req_fname[MAX_PATH_LEN];
+    unsigned long long off = 0, len = ~0ULL;
+    if (sscanf(line, "FILE_GET %1023s %llu %llu", req_fname, &off, &len) < 1) {
+        const char *err = MSG_FILE_ERR "\n";
+        write_n(c->fd, err, strlen(err));
+        return;
+    }
+
+    const char *base = strrchr(req_fname, '/');
+    const char *basename = base ? base + 1 : req_fname;
+
+    ensure_folder(SYNC_FOLDER);
+    char path[MAX_PATH_LEN + 64];
+    snprintf(path, sizeof(path), "%s/%s", SYNC_FOLDER, basename);
+
+    /* Commits replace the file by rename, so the open descriptor is a
+     * consistent snapshot for as long as the transfer takes */
+    file_lock_t *fl = file_lock_acquire(basename, 0);
+    int fd = open(path, O_RDONLY);
+    file_lock_release(fl);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        const char *err = MSG_FILE_ERR "\n";
+        write_n(c->fd, err, strlen(err));
+        log_warn("Client requested missing file: %s", path);
+        if (fd >= 0) close(fd);
+        return;
+    }
+
+    size_t fsize = (size_t)st.st_size;
+    if (off > fsize) off = fsize;
+    if (len > fsize - off) len = fsize - off;
+    posix_fadvise(fd, (off_t)off, (off_t)len, POSIX_FADV_SEQUENTIAL);
+
+    /* Header, payload and trailer leave in full segments */
+    set_cork(c->fd, 1);
+    char hdr[128];
+    int hdrlen = snprintf(hdr, sizeof(hdr), MSG_FILE_DATA " %llu %zu\n", len, fsize);
+    int ok = write_n(c->fd, hdr, (size_t)hdrlen) == hdrlen;
+    if (ok && len > 0 && sendfile_n(c->fd, fd, (off_t)off, (size_t)len) != (ssize_t)len) {
+        log_error("Error sending file to client (sendfile)");
+        ok = 0;
+    }
+    close(fd);
+    if (ok) write_n(c->fd, MSG_FILE_END "\n", strlen(MSG_FILE_END) + 1);
+    set_cork(c->fd, 0);
+
+    if (ok) metrics_add(MET_BYTES_SENT, len);
+    log_info("Sent file %s (%llu of %zu bytes from offset %llu) to client", basename, len, fsize, off);
+}
+
+typedef struct {
+    int fd;
+    size_t copied_blocks, literal_bytes, wire_bytes, dict_literals;
+    /* Dictionary state for DELTA_GET: the receiver's old blocks are found
+     * in the chunk store by hash. shift maps new offsets to old ones and is
+     * realigned after every COPY. */
+    const unsigned char *base;
+    const block_sig_t *old_sigs;
+    int old_nblocks;
+    size_t old_size;
+    size_t block_size;      /* of the receiver's signatures */
+    int hash_alg;
+    size_t new_pos;
+    long long shift;
+    dict_ctx_t *dict;
+} delta_send_ctx_t;
 
-        unsigned char *cbuf = malloc((size_t)c_len);
-        if (!cbuf) {
-            fprintf(stderr, "alloc cbuf failed\n");
+static int send_copy(void *arg, int start_block, int count) {
+    delta_send_ctx_t *ctx = arg;
+    char line[64];
+    int len = snprintf(line, sizeof(line), MSG_COPY " %d %d\n", start_block, count);
+    if (write_n(ctx->fd, line, (size_t)len) != len) return -1;
+    ctx->copied_blocks += (size_t)count;
+    ctx->wire_bytes += (size_t)len;
+
+    size_t old_off = (size_t)start_block * ctx->block_size;
+    size_t old_end = old_off + (size_t)count * ctx->block_size;
+    if (old_end > ctx->old_size) old_end = ctx->old_size;
+    ctx->shift = (long long)old_off - (long long)ctx->new_pos;
+    ctx->new_pos += old_end - old_off;
+    return 0;
+}
+
+/* Old blocks lining up with [off, off + len) of the new data, as long as
+ * the server still holds them. Returns the number of blocks loaded. */
+static int load_literal_dict(delta_send_ctx_t *ctx, size_t off, size_t len,
+                             unsigned char *dict, size_t *dict_len, int *first_out) {
+    long long old_off = (long long)off + ctx->shift;
+    if (old_off < 0) old_off = 0;
+    size_t bs = ctx->block_size;
+    int first = (int)((size_t)old_off / bs);
+    int count = 0;
+    *dict_len = 0;
+    while (first + count < ctx->old_nblocks && (size_t)count * bs < len + bs && *dict_len + bs <= DICT_MAX_LEN) {
+        int b = first + count;
+        uint32_t blen = fixed_block_len(ctx->old_size, bs, b);
+        if (chunk_store_fetch(chunks, ctx->hash_alg, ctx->old_sigs[b].strong, blen, dict + *dict_len) != 0)
             break;
+        *dict_len += blen;
+        count++;
+    }
+    *first_out = first;
+    return count;
+}
+
+static int send_literal(void *arg, const unsigned char *data, size_t len) {
+    delta_send_ctx_t *ctx = arg;
+    size_t cap = codec_bound(CODEC_ZLIB, len);
+    unsigned char *cbuf = buf_get(cap);
+    const unsigned char *payload = NULL;
+    char line[96];
+    int hlen = 0, clen = -1;
+    size_t off = ctx->base ? (size_t)(data - ctx->base) : 0;
+
+    if (ctx->dict && ctx->old_nblocks > 0 && cbuf) {
+        unsigned char dict[DICT_MAX_LEN];
+        size_t dict_len;
+        int first;
+        int count = load_literal_dict(ctx, off, len, dict, &dict_len, &first);
+        if (count > 0) {
+            clen = dict_compress(ctx->dict, data, len, dict, dict_len, cbuf, len);
+            if (clen > 0) {
+                payload = cbuf;
+                hlen = snprintf(line, sizeof(line), MSG_LITERAL_DICT " %d %zu %d %d\n",
+                                clen, len, first, count);
+                ctx->dict_literals++;
+            }
         }
-        if (read_n(client_fd, cbuf, (size_t)c_len) != (ssize_t)c_len) {
-            fprintf(stderr, "Failed to read full block payload (%d bytes)\n", c_len);
-            free(cbuf);
-            break;
+    }
+
+    if (!payload) {
+        clen = -1;
+        if (cbuf && block_is_compressible(data, len))
+            clen = codec_compress(CODEC_ZLIB, data, len, cbuf, cap);
+        payload = cbuf;
+        if (clen < 0 || (size_t)clen >= len) {
+            payload = data;
+            clen = (int)len;
         }
+        hlen = snprintf(line, sizeof(line), MSG_LITERAL " %d %zu\n", clen, len);
+    }
+
+    int rc = 0;
+    if (write_n(ctx->fd, line, (size_t)hlen) != hlen ||
+        write_n(ctx->fd, payload, (size_t)clen) != clen)
+        rc = -1;
+    buf_put(cbuf);
+
+    ctx->literal_bytes += len;
+    ctx->wire_bytes += (size_t)(hlen + clen);
+    ctx->new_pos = off + len;
+    return rc;
+}
+
+/* Mirror of the delta upload: the client sends the signatures of the copy
+ * it already holds and gets back COPY/LITERAL instructions that rebuild the
+ * stored file from it. Signatures are over BLOCK_SIZE blocks unless a block
+ * size follows "dict"; clients pick the size they would upload in, so
+ * their old blocks are found in the chunk store. */
+void handle_delta_get(conn_t *c, const char *line) {
+    char fname[MAX_PATH_LEN];
+    char opt[16] = "";
+    int old_nblocks;
+    size_t old_size, bs = BLOCK_SIZE;
+    int n = sscanf(line, "DELTA_GET %1023s %d %zu %15s %zu", fname, &old_nblocks, &old_size, opt, &bs);
+    if (n < 3 || bs < BLOCK_SIZE_MIN || bs > BLOCK_SIZE_MAX || old_nblocks < 0 ||
+        (size_t)old_nblocks != (old_size + bs - 1) / bs) {
+        log_warn("Bad DELTA_GET from client");
+        return;
+    }
+
+    block_sig_t *old_sigs = malloc(sizeof(block_sig_t) * (size_t)(old_nblocks ? old_nblocks : 1));
+    size_t sig_bytes = sizeof(block_sig_t) * (size_t)old_nblocks;
+    if (!old_sigs || nb_read_n(&c->in, old_sigs, sig_bytes) != (ssize_t)sig_bytes) {
+        free(old_sigs);
+        return;
+    }
 
-        unsigned char *blockbuf = NULL;
-        int dec_len = decompress_block(cbuf, c_len, &blockbuf, (size_t)orig_len);
-        free(cbuf);
-        if (dec_len < 0) {
-            fprintf(stderr, "Decompression failed for block %d\n", idx);
+    const char *base = strrchr(fname, '/');
+    const char *basename = base ? base + 1 : fname;
+    char path[MAX_PATH_LEN + 64];
+    snprintf(path, sizeof(path), "%s/%s", SYNC_FOLDER, basename);
+
+    file_lock_t *fl = file_lock_acquire(basename, 0);
+    int fd = open(path, O_RDONLY);
+    file_lock_release(fl);
+    struct stat st;
+    unsigned char *data = NULL;
+    if (fd >= 0 && fstat(fd, &st) == 0 && st.st_size > 0) {
+        data = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED) data = NULL;
+        else madvise(data, (size_t)st.st_size, MADV_SEQUENTIAL);
+    }
+    if (fd < 0 || (st.st_size > 0 && !data)) {
+        write_n(c->fd, MSG_FILE_ERR "\n", strlen(MSG_FILE_ERR) + 1);
+        log_warn("Client requested missing file: %s", path);
+        if (fd >= 0) close(fd);
+        free(old_sigs);
+        return;
+    }
+    close(fd);
+    size_t fsize = (size_t)st.st_size;
+
+    /* Many short COPY lines: let the kernel pack them into full segments */
+    set_cork(c->fd, 1);
+    char hdr[128];
+    int hlen = snprintf(hdr, sizeof(hdr), MSG_DELTA_DATA " %zu\n", fsize);
+    write_n(c->fd, hdr, (size_t)hlen);
+
+    delta_send_ctx_t ctx = { 0 };
+    ctx.fd = c->fd;
+    ctx.base = data;
+    ctx.old_sigs = old_sigs;
+    ctx.old_nblocks = old_nblocks;
+    ctx.old_size = old_size;
+    ctx.block_size = bs;
+    ctx.hash_alg = c->hash_alg;
+    /* Clients that can rebuild dictionaries ask with a trailing "dict" */
+    if (strcmp(opt, "dict") == 0) ctx.dict = dict_ctx_new();
+
+    delta_ops_t ops = { send_copy, send_literal };
+    delta_index_t *di = delta_index_build(old_sigs, old_nblocks, bs, old_size, c->hash_alg);
+    int rc = di ? delta_generate(di, data, fsize, &ops, &ctx) : -1;
+    delta_index_free(di);
+    dict_ctx_free(ctx.dict);
+    free(old_sigs);
+    if (data) munmap(data, fsize);
+
+    if (rc == 0)
+        write_n(c->fd, MSG_DELTA_END "\n", strlen(MSG_DELTA_END) + 1);
+    set_cork(c->fd, 0);
+
+    log_info("Delta sent for %s: %zu blocks reused, %zu literal bytes (%zu bytes on the wire, "
+             "%zu literals against old blocks)",
+             basename, ctx.copied_blocks, ctx.literal_bytes, ctx.wire_bytes, ctx.dict_literals);
+}
+
+/* Per-connection states of the FILE_HDR -> BLOCK_REQ -> BLOCK_DATA ->
+ * FILE_OK upload, driven by the event loop as input arrives. */
+enum {
+    ST_CMD,
+    ST_SIGS,
+    ST_BLOCK_HDR,
+    ST_BLOCK_PAYLOAD
+};
+
+/* Step results: made progress, needs more input, or close the connection */
+#define STEP_OK    1
+#define STEP_WAIT  0
+#define STEP_CLOSE -1
+
+typedef struct {
+    char basename[MAX_PATH_LEN]; /* index key; the relative path inside a sync session */
+    char path[MAX_PATH_LEN + 64];
+    size_t fsize;
+    size_t block_size;  /* chosen by the client, BLOCK_SIZE over text */
+    int nblocks;
+    block_sig_t *sigs;
+    size_t sig_have;
+    int out_fd;         /* staging file, -1 when the stored version is kept */
+    char staging[MAX_PATH_LEN + 96];
+    struct stat base;   /* stored version the upload matched, if kept */
+    int failed;
+    int binary;         /* negotiated over frames rather than text lines */
+    int codec;          /* codec of compressed BLOCK_DATA payloads */
+    int hash_alg;       /* strong hash of sigs */
+    int negotiated;
+    chunk_sig_t *hints; /* old block offered as dictionary, per block index */
+    recv_pipe_t *recv;  /* decodes and writes received blocks */
+    unsigned char *tree;   /* stored Merkle tree, while descending into it */
+    int tree_nblocks;      /* blocks the stored tree covers */
+    int level;             /* level of want[]; -1 once they are leaf groups */
+    int *want;             /* nodes, then leaf groups, asked from the client */
+    int nwant;
+    unsigned char *nodes;  /* node hashes received for want[] */
+    size_t nodes_have;
+    size_t sig_want;       /* signature bytes of the wanted leaf groups */
+    unsigned char *leaves; /* leaf level of the new tree, known from the descent */
+    double started;        /* FILE_HDR, then BLOCK_REQ, for the phase metrics */
+    int ignored;           /* blocks received for no staging file or block */
+    int idx, c_len, orig_len;
+} upload_t;
+
+int upload_init(conn_t *c, const char *fname, size_t fsize, int nblocks, size_t block_size,
+                int binary) {
+    if (c->session || block_size < BLOCK_SIZE_MIN || block_size > BLOCK_SIZE_MAX || nblocks < 0 ||
+        (size_t)nblocks != (fsize + block_size - 1) / block_size) {
+        log_warn("Bad FILE_HDR from client");
+        return STEP_CLOSE;
+    }
+
+    upload_t *u = calloc(1, sizeof(*u));
+    if (!u) return STEP_CLOSE;
+    u->sigs = malloc(sizeof(block_sig_t) * (size_t)(nblocks ? nblocks : 1));
+    if (!u->sigs) {
+        log_error("malloc sigs failed");
+        free(u);
+        return STEP_CLOSE;
+    }
+
+    const char *base = strrchr(fname, '/');
+    if (c->in_sync) {
+        if (!valid_tree_path(fname)) {
+            log_warn("Bad path in FILE_HDR: %s", fname);
+            free(u->sigs);
+            free(u);
+            return STEP_CLOSE;
+        }
+        base = NULL;
+    }
+    snprintf(u->basename, sizeof(u->basename), "%s", base ? base + 1 : fname);
+    snprintf(u->path, sizeof(u->path), "%s/%s", SYNC_FOLDER, u->basename);
+    u->fsize = fsize;
+    u->block_size = block_size;
+    u->nblocks = nblocks;
+    u->binary = binary;
+    u->codec = binary ? c->codec : CODEC_ZLIB;
+    u->hash_alg = c->hash_alg;
+    u->out_fd = -1;
+    u->started = metrics_now();
+
+    c->session = u;
+    return STEP_OK;
+}
+
+void upload_free(conn_t *c) {
+    upload_t *u = c->session;
+    if (!u) return;
+    recv_pipe_free(u->recv);
+    if (u->out_fd >= 0) close(u->out_fd);
+    if (u->staging[0]) unlink(u->staging);
+    free(u->sigs);
+    free(u->hints);
+    free(u->tree);
+    free(u->want);
+    free(u->nodes);
+    free(u->leaves);
+    free(u);
+    c->session = NULL;
+}
+
+int upload_start(conn_t *c, const char *line) {
+    char fname[MAX_PATH_LEN];
+    size_t fsize;
+    int nblocks;
+    if (sscanf(line, "FILE_HDR %1023s %zu %d", fname, &fsize, &nblocks) != 3) {
+        log_warn("Bad FILE_HDR from client");
+        return STEP_CLOSE;
+    }
+    if (upload_init(c, fname, fsize, nblocks, BLOCK_SIZE, 0) != STEP_OK) return STEP_CLOSE;
+    c->state = ST_SIGS;
+    return STEP_OK;
+}
+
+int send_frame(int fd, uint8_t type, uint16_t flags, const void *payload, uint32_t len) {
+    unsigned char hdr[FRAME_HDR_LEN];
+    frame_encode_hdr(hdr, type, flags, len);
+    if (write_n(fd, hdr, sizeof(hdr)) != (ssize_t)sizeof(hdr)) return -1;
+    if (len > 0 && write_n(fd, payload, len) != (ssize_t)len) return -1;
+    return 0;
+}
+
+int send_block_req_frame(int fd, const int *req, int req_count) {
+    unsigned char *buf = malloc(ranges_encode_bound(req_count));
+    if (!buf) return -1;
+    size_t len = ranges_encode(req, req_count, buf);
+    int rc = len <= FRAME_MAX_LEN ? send_frame(fd, FT_BLOCK_REQ, 0, buf, (uint32_t)len) : -1;
+    free(buf);
+    return rc;
+}
+
+/* One entry per requested block, in request order: varint length of the
+ * old block (0 = no hint) followed by its strong hash. */
+int send_block_hints(int fd, const chunk_sig_t *hints, const int *req, int req_count) {
+    size_t cap = (size_t)req_count * (VARINT_MAX_LEN + 16);
+    if (cap > FRAME_MAX_LEN) return send_frame(fd, FT_BLOCK_HINTS, 0, NULL, 0);
+    unsigned char *buf = malloc(cap ? cap : 1);
+    if (!buf) return -1;
+    size_t pos = 0;
+    for (int k = 0; k < req_count; k++) {
+        const chunk_sig_t *h = &hints[req[k]];
+        pos += varint_encode(h->len, buf + pos);
+        if (h->len) {
+            memcpy(buf + pos, h->strong, 16);
+            pos += 16;
+        }
+    }
+    int rc = send_frame(fd, FT_BLOCK_HINTS, 0, buf, (uint32_t)pos);
+    free(buf);
+    return rc;
+}
+
+int upload_open_staging(upload_t *u) {
+    staging_path(u->staging, sizeof(u->staging), u->basename);
+    u->out_fd = open(u->staging, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (u->out_fd < 0) {
+        log_error("open staging file: %s", strerror(errno));
+        u->staging[0] = '\0';
+        return -1;
+    }
+    if (ftruncate(u->out_fd, (off_t)u->fsize) != 0) {
+        /* Not fatal; continue */
+    }
+    return 0;
+}
+
+/* Signatures of a stored version in blocks of block_size, read back from
+ * its file, for an upload that chose another block size or whose stored
+ * version was chunked */
+static int stored_version_rehash(stored_version_t *v, size_t block_size, int hash_alg) {
+    int n = (int)((v->filesize + block_size - 1) / block_size);
+    block_sig_t *sigs = malloc(sizeof(block_sig_t) * (size_t)(n ? n : 1));
+    int fd = dup(v->fd);
+    FILE *f = fd >= 0 ? fdopen(fd, "rb") : NULL;
+    if (!f && fd >= 0) close(fd);
+    int rc = sigs && f ? compute_sigs_for_file(f, sigs, n, block_size, v->filesize, hash_alg) : -1;
+    if (f) fclose(f);
+    if (rc != 0) {
+        free(sigs);
+        return -1;
+    }
+    free(v->sigs);
+    free(v->lens);
+    v->sigs = sigs;
+    v->lens = NULL;
+    v->nblocks = n;
+    v->block_size = (uint32_t)block_size;
+    v->chunk_avg = 0;
+    v->hash_alg = hash_alg;
+    return 0;
+}
+
+/* All signatures are in: decide which blocks to request and send
+ * BLOCK_REQ. The new version is assembled in a staging file from the
+ * blocks it shares with the stored one, blocks the chunk store already
+ * holds and the requested ones; if every block matches, the stored file
+ * is kept as it is. */
+int upload_negotiate(conn_t *c) {
+    upload_t *u = c->session;
+    int nblocks = u->nblocks;
+    block_sig_t *sigs = u->sigs;
+
+    log_debug("Server: file hdr: %s size=%zu nblocks=%d", u->basename, u->fsize, nblocks);
+    double t0 = metrics_now();
+    metrics_observe(MET_SIG_RECV, t0 - u->started);
+
+    size_t bs = u->block_size;
+    int *req = malloc(sizeof(int) * (size_t)(nblocks ? nblocks : 1));
+    unsigned char *matched = calloc((size_t)(nblocks ? nblocks : 1), 1);
+    unsigned char *blockbuf = buf_get(bs);
+    if (!req || !matched || !blockbuf) {
+        free(req);
+        free(matched);
+        buf_put(blockbuf);
+        return STEP_CLOSE;
+    }
+
+    stored_version_t v;
+    stored_version_open(&v, u->basename, u->path);
+    int fixed = v.indexed;
+    /* A version stored in chunks or in other blocks is rehashed in the
+     * client's, which costs a read of it but spares sending every block
+     * again */
+    if (fixed && (v.chunk_avg != 0 || v.block_size != bs)) {
+        if (v.chunk_avg) log_debug("Rehashing chunked %s in %zu byte blocks", u->basename, bs);
+        else log_debug("Rehashing %s from %u to %zu byte blocks", u->basename, v.block_size, bs);
+        if (stored_version_rehash(&v, bs, u->hash_alg) != 0) fixed = 0;
+    }
+    int same_hash = v.indexed && v.hash_alg == u->hash_alg;
+    int all_matched = 1;
+    for (int i = 0; i < nblocks; i++) {
+        if (fixed && i < v.nblocks && v.sigs[i].weak == sigs[i].weak &&
+            fixed_block_len(u->fsize, bs, i) == fixed_block_len(v.filesize, bs, i)) {
+            if (same_hash) {
+                matched[i] = memcmp(v.sigs[i].strong, sigs[i].strong, 16) == 0;
+            } else {
+                /* Under another strong hash, blocks whose weak sums agree
+                 * are read back and hashed the way the client did */
+                unsigned char strong[16];
+                uint32_t blen = fixed_block_len(u->fsize, bs, i);
+                if (pread(v.fd, blockbuf, blen, (off_t)i * bs) == (ssize_t)blen) {
+                    strong_hash(u->hash_alg, blockbuf, blen, strong);
+                    matched[i] = memcmp(strong, sigs[i].strong, 16) == 0;
+                }
+            }
+        }
+        if (!matched[i]) all_matched = 0;
+    }
+
+    struct stat st;
+    int keep = all_matched && v.fd >= 0 && fstat(v.fd, &st) == 0 && (size_t)st.st_size == u->fsize;
+    if (keep) {
+        u->base = st;
+    } else if (upload_open_staging(u) != 0) {
+        stored_version_close(&v);
+        free(req);
+        free(matched);
+        buf_put(blockbuf);
+        return STEP_CLOSE;
+    }
+
+    /* Blocks missing from this file's index may still be known elsewhere
+     * on the server; those are filled from the chunk store right away so
+     * that a chunk collected meanwhile is simply requested instead. */
+    int req_count = 0, stored_count = 0;
+    for (int i = 0; i < nblocks && !keep; i++) {
+        if (matched[i]) continue;
+        uint32_t blen = fixed_block_len(u->fsize, bs, i);
+        if (chunk_store_read(chunks, u->hash_alg, sigs[i].strong, blen, blockbuf) == 0 &&
+            pwrite(u->out_fd, blockbuf, blen, (off_t)i * bs) == (ssize_t)blen) {
+            stored_count++;
             continue;
         }
+        req[req_count++] = i;
 
-        if (outf) {
-            if (fseek(outf, (long)idx * BLOCK_SIZE, SEEK_SET) != 0) {
-                perror("fseek");
+        /* The block this one replaces is the best dictionary for it */
+        if (u->hints && same_hash && fixed && i < v.nblocks) {
+            uint32_t old_len = fixed_block_len(v.filesize, bs, i);
+            if (chunk_store_has(chunks, u->hash_alg, v.sigs[i].strong, old_len)) {
+                u->hints[i].len = old_len;
+                u->hints[i].weak = v.sigs[i].weak;
+                memcpy(u->hints[i].strong, v.sigs[i].strong, 16);
             }
-            fwrite(blockbuf, 1, (size_t)dec_len, outf);
+        }
+    }
+
+    int rc = u->binary ? send_block_req_frame(c->fd, req, req_count)
+                       : send_block_req(c->fd, req, req_count);
+    if (rc == 0 && u->hints) rc = send_block_hints(c->fd, u->hints, req, req_count);
+    free(req);
+    buf_put(blockbuf);
+
+    /* Unchanged blocks are copied over while the client sends the rest */
+    int copied = 0;
+    for (int i = 0; rc == 0 && !keep && i < nblocks;) {
+        if (!matched[i]) {
+            i++;
+            continue;
+        }
+        int j = i;
+        size_t len = 0;
+        while (j < nblocks && matched[j]) len += fixed_block_len(u->fsize, bs, j++);
+        if (copy_range(v.fd, (off_t)i * bs, u->out_fd, (off_t)i * bs, len) != 0) {
+            log_error("Copying unchanged blocks of %s failed", u->basename);
+            u->failed = 1;
+            break;
+        }
+        copied += j - i;
+        i = j;
+    }
+    stored_version_close(&v);
+    free(matched);
+    if (rc != 0) return STEP_CLOSE;
+
+    if (keep)
+        log_debug("No blocks requested; file up-to-date.");
+    else if (stored_count > 0)
+        log_debug("Filled %d blocks of %s from the chunk store", stored_count, u->basename);
+    if (copied > 0)
+        log_debug("Staged %d unchanged blocks of %s", copied, u->basename);
+
+    metrics_add(MET_BLOCKS_REQUESTED, (uint64_t)req_count);
+    u->started = metrics_now();
+    metrics_observe(MET_DIFF, u->started - t0);
+    u->negotiated = 1;
+    if (!u->binary) c->state = ST_BLOCK_HDR;
+    return STEP_OK;
+}
+
+/* Replies to the upload; inside a sync session the connection goes back
+ * to reading commands, otherwise it is closed. */
+int upload_done(conn_t *c, int rc, uint16_t ok_flags) {
+    upload_t *u = c->session;
+    metrics_add(rc == 0 ? MET_UPLOADS : MET_UPLOADS_FAILED, 1);
+    if (ok_flags & FF_UP_TO_DATE) metrics_add(MET_UP_TO_DATE, 1);
+    if (u->binary)
+        send_frame(c->fd, rc == 0 ? FT_FILE_OK : FT_FILE_ERR, rc == 0 ? ok_flags : 0, NULL, 0);
+    else if (rc == 0)
+        write_n(c->fd, MSG_FILE_OK "\n", strlen(MSG_FILE_OK) + 1);
+    else
+        write_n(c->fd, MSG_FILE_ERR "\n", strlen(MSG_FILE_ERR) + 1);
+
+    if (!c->in_sync) {
+        log_debug("Connection closed for %s", u->basename);
+        return STEP_CLOSE;
+    }
+    if (rc == 0) c->sync_files++;
+    upload_free(c);
+    c->state = ST_CMD;
+    return STEP_OK;
+}
+
+/* True if the index already describes this exact version: same size,
+ * blocks and block hash, and the same digest over the signatures. */
+int upload_up_to_date(const upload_t *u, const unsigned char *digest) {
+    pthread_mutex_lock(&index_lock);
+    const file_index_t *e = index_db_find(index_db, u->basename);
+    int same = e && e->chunk_avg == 0 && e->block_size == u->block_size && e->hash_alg == u->hash_alg &&
+               e->filesize == u->fsize && e->nblocks == u->nblocks && memcmp(e->digest, digest, 16) == 0;
+    pthread_mutex_unlock(&index_lock);
+
+    struct stat st;
+    return same && stat(u->path, &st) == 0 && (size_t)st.st_size == u->fsize;
+}
+
+/* Merkle descent: starting below the root, the client is asked for the
+ * children of every node whose hash differs from the stored tree, level
+ * by level, and finally for the signatures of the leaves that differ.
+ * Every other signature is taken from the stored version. */
+int merkle_request(conn_t *c) {
+    upload_t *u = c->session;
+    unsigned char *buf = malloc(VARINT_MAX_LEN + ranges_encode_bound(u->nwant));
+    unsigned char *nodes = realloc(u->nodes, (size_t)(u->nwant ? u->nwant : 1) * MERKLE_NODE_LEN);
+    if (!buf || !nodes) {
+        free(buf);
+        return -1;
+    }
+    u->nodes = nodes;
+    u->nodes_have = 0;
+    size_t len = varint_encode((uint64_t)u->level, buf);
+    len += ranges_encode(u->want, u->nwant, buf + len);
+    int rc = len <= FRAME_MAX_LEN ? send_frame(c->fd, FT_MERKLE_REQ, 0, buf, (uint32_t)len) : -1;
+    free(buf);
+    return rc;
+}
+
+/* Every signature is known: the new tree's leaves are the stored ones
+ * except where signatures were sent */
+int merkle_finish(conn_t *c) {
+    upload_t *u = c->session;
+    size_t n = merkle_level_size(u->nblocks, 0);
+    if (!(u->leaves = malloc(n * MERKLE_NODE_LEN))) return STEP_CLOSE;
+    int k = 0;
+    for (size_t g = 0; g < n; g++) {
+        if (k < u->nwant && (size_t)u->want[k] == g) {
+            merkle_leaf(u->hash_alg, u->sigs, u->nblocks, g, u->leaves + g * MERKLE_NODE_LEN);
+            k++;
         } else {
-            fprintf(stderr, "Warning: received data but outf==NULL (idx=%d). Ignoring write.\n", idx);
+            memcpy(u->leaves + g * MERKLE_NODE_LEN, u->tree + g * MERKLE_NODE_LEN, MERKLE_NODE_LEN);
         }
-        free(blockbuf);
-        printf("Received block %d (%d bytes compressed)\n", idx, c_len);
     }
+    log_debug("Merkle descent for %s: signatures of %d of %zu groups sent", u->basename, u->nwant, n);
+    free(u->tree);
+    free(u->want);
+    u->tree = NULL;
+    u->want = NULL;
+    u->nwant = 0;
+    return upload_negotiate(c);
+}
 
-    if (outf) {
-        fflush(outf);
-        fclose(outf);
-        outf = NULL;
+int merkle_send_groups(conn_t *c) {
+    upload_t *u = c->session;
+    unsigned char *buf = malloc(ranges_encode_bound(u->nwant));
+    if (!buf) return STEP_CLOSE;
+    size_t len = ranges_encode(u->want, u->nwant, buf);
+    int rc = len <= FRAME_MAX_LEN ? send_frame(c->fd, FT_SEND_SIGS, FF_MERKLE, buf, (uint32_t)len) : -1;
+    free(buf);
+    if (rc != 0) return STEP_CLOSE;
+
+    u->level = -1;
+    u->sig_have = 0;
+    u->sig_want = 0;
+    for (int k = 0; k < u->nwant; k++) {
+        size_t first = (size_t)u->want[k] * MERKLE_FANOUT;
+        size_t cnt = (size_t)u->nblocks - first < MERKLE_FANOUT ? (size_t)u->nblocks - first : MERKLE_FANOUT;
+        u->sig_want += cnt * sizeof(block_sig_t);
     }
+    return u->sig_want == 0 ? merkle_finish(c) : STEP_OK;
+}
 
-    file_index_t newidx;
-    memset(&newidx, 0, sizeof(newidx));
-    strncpy(newidx.filename, basename, MAX_PATH_LEN - 1);
-    newidx.filename[MAX_PATH_LEN - 1] = '\0';
-    newidx.filesize = fsize;
-    newidx.nblocks = nblocks;
-    newidx.sigs = sigs;
+/* All node hashes of the current level are in */
+int merkle_descend(conn_t *c) {
+    upload_t *u = c->session;
+    int level = u->level;
+    size_t below = level > 0 ? merkle_level_size(u->nblocks, level - 1) : (size_t)u->nwant;
+    size_t stored = merkle_level_size(u->tree_nblocks, level);
+    const unsigned char *mine = u->tree + merkle_level_offset(u->tree_nblocks, level) * MERKLE_NODE_LEN;
+    int *next = malloc(sizeof(int) * (below ? below : 1));
+    if (!next) return STEP_CLOSE;
 
+    int nnext = 0;
+    for (int k = 0; k < u->nwant; k++) {
+        size_t idx = (size_t)u->want[k];
+        if (idx < stored && memcmp(mine + idx * MERKLE_NODE_LEN, u->nodes + (size_t)k * MERKLE_NODE_LEN,
+                                   MERKLE_NODE_LEN) == 0)
+            continue;
+        if (level == 0) {
+            next[nnext++] = (int)idx;
+            continue;
+        }
+        for (size_t j = idx * MERKLE_FANOUT; j < below && j < (idx + 1) * MERKLE_FANOUT; j++)
+            next[nnext++] = (int)j;
+    }
+    free(u->want);
+    u->want = next;
+    u->nwant = nnext;
+    if (level == 0 || nnext == 0) return merkle_send_groups(c);
+    u->level = level - 1;
+    return merkle_request(c) == 0 ? STEP_OK : STEP_CLOSE;
+}
+
+/* Signatures of the wanted leaf groups arrive back to back */
+int merkle_take_sigs(conn_t *c, const unsigned char *p, size_t len) {
+    upload_t *u = c->session;
+    const size_t group = MERKLE_FANOUT * sizeof(block_sig_t);
+    if (u->level != -1 || len > u->sig_want - u->sig_have) return STEP_CLOSE;
+    while (len > 0) {
+        size_t k = u->sig_have / group, off = u->sig_have % group;
+        size_t n = group - off < len ? group - off : len;
+        memcpy((unsigned char *)u->sigs + (size_t)u->want[k] * group + off, p, n);
+        u->sig_have += n;
+        p += n;
+        len -= n;
+    }
+    return u->sig_have == u->sig_want ? merkle_finish(c) : STEP_OK;
+}
+
+/* Compares the client's Merkle root with the stored tree and starts a
+ * descent into it; without a comparable tree (another block size or
+ * hash) every signature is asked for. */
+int merkle_start(conn_t *c, const unsigned char *root) {
+    upload_t *u = c->session;
+    int same = 0;
     pthread_mutex_lock(&index_lock);
-    if (replace_or_add_index(&indices, &indices_count, &newidx) != 0) {
-        fprintf(stderr, "Failed to update index in memory\n");
+    const file_index_t *e = index_db_find(index_db, u->basename);
+    if (e && e->tree && e->block_size == u->block_size && e->hash_alg == u->hash_alg && u->nblocks > 0) {
+        same = e->nblocks == u->nblocks && e->filesize == u->fsize &&
+               memcmp(merkle_root(e->tree, e->nblocks), root, MERKLE_NODE_LEN) == 0;
+        size_t tlen = merkle_nodes(e->nblocks) * MERKLE_NODE_LEN;
+        if (!same && (u->tree = malloc(tlen)) != NULL) {
+            memcpy(u->tree, e->tree, tlen);
+            u->tree_nblocks = e->nblocks;
+            int n = e->nblocks < u->nblocks ? e->nblocks : u->nblocks;
+            memcpy(u->sigs, e->sigs, sizeof(block_sig_t) * (size_t)n);
+        }
     }
-    if (save_all_indices(INDEX_FILE, indices, indices_count) != 0) {
-        fprintf(stderr, "Failed to save index to %s\n", INDEX_FILE);
+    pthread_mutex_unlock(&index_lock);
+
+    struct stat st;
+    if (same && stat(u->path, &st) == 0 && (size_t)st.st_size == u->fsize) {
+        log_info("%s is already up to date", u->basename);
+        return upload_done(c, 0, FF_UP_TO_DATE);
+    }
+    if (!u->tree) {
+        if (send_frame(c->fd, FT_SEND_SIGS, 0, NULL, 0) != 0) return STEP_CLOSE;
+        return u->nblocks == 0 ? upload_negotiate(c) : STEP_OK;
+    }
+
+    /* The roots differ, so every child of the root is wanted */
+    int top = merkle_levels(u->nblocks) - 1;
+    size_t n = top > 0 ? merkle_level_size(u->nblocks, top - 1) : 1;
+    if (!(u->want = malloc(sizeof(int) * n))) return STEP_CLOSE;
+    for (size_t i = 0; i < n; i++) u->want[i] = (int)i;
+    u->nwant = (int)n;
+    if (top == 0) return merkle_send_groups(c);
+    u->level = top - 1;
+    return merkle_request(c) == 0 ? STEP_OK : STEP_CLOSE;
+}
+
+static double mb_per_sec(size_t bytes, double sec) {
+    return sec > 0 ? (double)bytes / sec / 1e6 : 0;
+}
+
+int upload_finish(conn_t *c) {
+    upload_t *u = c->session;
+    log_debug("All blocks received for %s", u->basename);
+    metrics_observe(MET_BLOCK_RECV, metrics_now() - u->started);
+
+    recv_stats_t st;
+    if (u->recv && recv_pipe_finish(u->recv, &st) == 0) {
+        metrics_observe(MET_DECODE, st.decode_sec);
+        metrics_observe(MET_DISK_WRITE, st.write_sec);
+        metrics_add(MET_BLOCKS_RECEIVED, (uint64_t)st.blocks);
+        metrics_add(MET_BYTES_RECEIVED, st.in_bytes);
+        log_info("Received %d blocks of %s (%zu bytes on the wire) at %.1f MB/s: decoded at %.1f MB/s "
+                 "per thread, written at %.1f MB/s in %d writes",
+                 st.blocks, u->basename, st.in_bytes, mb_per_sec(st.out_bytes, st.recv_sec),
+                 mb_per_sec(st.out_bytes, st.decode_sec), mb_per_sec(st.out_bytes, st.write_sec),
+                 st.writes);
+    } else if (u->recv) {
+        u->failed = 1;
+        if (st.bad_blocks)
+            log_warn("%d of %d blocks of %s could not be decoded", st.bad_blocks, st.blocks, u->basename);
+    }
+    if (u->ignored)
+        log_warn("Ignored %d blocks of %s with no staging file or out of range", u->ignored, u->basename);
+
+    int rc = -1;
+    if (u->out_fd >= 0) {
+        close(u->out_fd);
+        u->out_fd = -1;
+    }
+    if (u->failed) {
+        unlink(u->staging);
     } else {
-        printf("Index saved to %s\n", INDEX_FILE);
+        rc = commit_file(u->basename, u->path, u->staging[0] ? u->staging : NULL,
+                         u->staging[0] ? NULL : &u->base, u->fsize, u->nblocks, u->sigs,
+                         (uint32_t)u->block_size, 0, NULL, u->hash_alg, u->leaves);
+        u->sigs = NULL;
     }
-    pthread_mutex_unlock(&index_lock);
+    u->staging[0] = '\0';
+    return upload_done(c, rc, 0);
+}
 
-    write_n(client_fd, "FILE_OK\n", 8);
-    close(client_fd);
-    printf("Connection closed for %s\n", basename);
+int step_sigs(conn_t *c) {
+    upload_t *u = c->session;
+    size_t total = sizeof(block_sig_t) * (size_t)u->nblocks;
+    u->sig_have += nb_take(&c->in, (char *)u->sigs + u->sig_have, total - u->sig_have);
+    if (u->sig_have < total) return STEP_WAIT;
+    return upload_negotiate(c);
 }
 
-void *thread_main(void *arg) {
-    int client_fd = (intptr_t)arg;
-    handle_client(client_fd);
-    return NULL;
+int step_block_hdr(conn_t *c) {
+    upload_t *u = c->session;
+    char hdr[256];
+    ssize_t n = nb_take_line(&c->in, hdr, sizeof(hdr));
+    if (n == 0) return STEP_WAIT;
+    if (n < 0) return STEP_CLOSE;
+
+    if (strncmp(hdr, "BLOCK_END", 9) == 0)
+        return upload_finish(c);
+
+    if (sscanf(hdr, "BLOCK_DATA %d %d %d", &u->idx, &u->c_len, &u->orig_len) != 3 ||
+        u->c_len <= 0 || u->c_len > MAX_LITERAL_LEN || u->orig_len <= 0 || u->orig_len > BLOCK_SIZE) {
+        log_warn("Invalid block header: %s", hdr);
+        return STEP_CLOSE;
+    }
+    c->state = ST_BLOCK_PAYLOAD;
+    c->want = (size_t)u->c_len;
+    return STEP_OK;
 }
 
-int main() {
+/* Runs on a decoder thread of the receive pipeline */
+static int decode_block(void *arg, dict_ctx_t **dict, const recv_block_t *b,
+                        const unsigned char *in, unsigned char *out) {
+    const upload_t *u = arg;
+    if (b->flags & FF_RAW) {
+        if (b->c_len != b->orig_len) {
+            log_debug("Raw block %d has wrong length", b->idx);
+            return -1;
+        }
+        memcpy(out, in, b->c_len);
+    } else if (b->flags & FF_DICT) {
+        const chunk_sig_t *h = u->hints ? &u->hints[b->idx] : NULL;
+        unsigned char *dictbuf = h && h->len ? buf_get(h->len) : NULL;
+        int rc = dictbuf && chunk_store_fetch(chunks, u->hash_alg, h->strong, h->len, dictbuf) == 0 &&
+                 (*dict || (*dict = dict_ctx_new())) &&
+                 dict_decompress(*dict, in, b->c_len, dictbuf, h->len, out, b->orig_len) >= 0 ? 0 : -1;
+        buf_put(dictbuf);
+        if (rc != 0) {
+            log_debug("Dictionary decompression failed for block %d", b->idx);
+            return -1;
+        }
+    } else if (codec_decompress(u->codec, in, b->c_len, out, b->orig_len) < 0) {
+        log_debug("Decompression failed for block %d", b->idx);
+        return -1;
+    }
+    return 0;
+}
+
+/* Queues one received block; a block that fails to decode or write fails
+ * the upload */
+void upload_write_block(upload_t *u, int idx, const unsigned char *data, size_t c_len,
+                        size_t orig_len, int flags) {
+    if (u->out_fd < 0 || idx < 0 || idx >= u->nblocks) {
+        log_debug("Received block %d of %s but no staging file or block; ignoring it", idx, u->basename);
+        u->ignored++;
+        return;
+    }
+    if (u->failed) return;
+    if (!u->recv && !(u->recv = recv_pipe_new(u->out_fd, u->block_size, decode_block, u))) {
+        u->failed = 1;
+        return;
+    }
+    if (recv_pipe_add(u->recv, idx, flags, data, c_len, orig_len) != 0) u->failed = 1;
+}
+
+/* Payloads are copied out of the connection buffer into the pipeline */
+int step_block_payload(conn_t *c) {
+    upload_t *u = c->session;
+    if (nb_avail(&c->in) < (size_t)u->c_len) return STEP_WAIT;
+
+    upload_write_block(u, u->idx, (const unsigned char *)nb_data(&c->in), (size_t)u->c_len,
+                       (size_t)u->orig_len, 0);
+    nb_consume(&c->in, (size_t)u->c_len);
+    c->state = ST_BLOCK_HDR;
+    c->want = 0;
+    return STEP_OK;
+}
+
+int handle_frame(conn_t *c, const frame_hdr_t *h, const unsigned char *p) {
+    upload_t *u = c->session;
+    uint64_t a, b, n;
+    int k, pos = 0;
+
+    switch (h->type) {
+    case FT_FILE_HDR: {
+        if ((k = varint_decode(p, h->len, &a)) < 0) return STEP_CLOSE;
+        pos += k;
+        if ((k = varint_decode(p + pos, h->len - pos, &b)) < 0) return STEP_CLOSE;
+        pos += k;
+        if ((k = varint_decode(p + pos, h->len - pos, &n)) < 0) return STEP_CLOSE;
+        pos += k;
+        if (n == 0 || n >= MAX_PATH_LEN || n > h->len - pos || b > INT32_MAX) return STEP_CLOSE;
+        size_t digest_len = (h->flags & (FF_DIGEST | FF_MERKLE)) ? 16 : 0;
+        if (h->len - pos - n < digest_len) return STEP_CLOSE;
+        uint64_t bs = BLOCK_SIZE;
+        if ((h->flags & FF_BLOCK_SIZE) &&
+            varint_decode(p + pos + n + digest_len, h->len - pos - n - digest_len, &bs) < 0)
+            return STEP_CLOSE;
+        char fname[MAX_PATH_LEN];
+        memcpy(fname, p + pos, n);
+        fname[n] = '\0';
+        if (strchr(fname, ' ') || strchr(fname, '\n') || bs > BLOCK_SIZE_MAX) return STEP_CLOSE;
+        if (upload_init(c, fname, (size_t)a, (int)b, (size_t)bs, 1) != STEP_OK) return STEP_CLOSE;
+        u = c->session;
+        if ((h->flags & FF_WANT_HINTS) &&
+            !(u->hints = calloc((size_t)(u->nblocks ? u->nblocks : 1), sizeof(chunk_sig_t))))
+            return STEP_CLOSE;
+        /* With a digest or Merkle root the signatures only follow if the
+         * server asks */
+        if (h->flags & FF_MERKLE) return merkle_start(c, p + pos + n);
+        if (h->flags & FF_DIGEST) {
+            if (upload_up_to_date(u, p + pos + n)) {
+                log_info("%s is already up to date", u->basename);
+                return upload_done(c, 0, FF_UP_TO_DATE);
+            }
+            if (send_frame(c->fd, FT_SEND_SIGS, 0, NULL, 0) != 0) return STEP_CLOSE;
+        }
+        return u->nblocks == 0 ? upload_negotiate(c) : STEP_OK;
+    }
+    case FT_SIGS: {
+        if (!u || !u->binary || u->negotiated) return STEP_CLOSE;
+        if (u->tree) return merkle_take_sigs(c, p, h->len);
+        size_t total = sizeof(block_sig_t) * (size_t)u->nblocks;
+        if (h->len > total - u->sig_have) return STEP_CLOSE;
+        memcpy((char *)u->sigs + u->sig_have, p, h->len);
+        u->sig_have += h->len;
+        return u->sig_have == total ? upload_negotiate(c) : STEP_OK;
+    }
+    case FT_MERKLE_NODES: {
+        if (!u || !u->tree || u->level < 0) return STEP_CLOSE;
+        size_t total = (size_t)u->nwant * MERKLE_NODE_LEN;
+        if (h->len > total - u->nodes_have) return STEP_CLOSE;
+        memcpy(u->nodes + u->nodes_have, p, h->len);
+        u->nodes_have += h->len;
+        return u->nodes_have == total ? merkle_descend(c) : STEP_OK;
+    }
+    case FT_BLOCK_DATA:
+        if (!u || !u->binary || !u->negotiated) return STEP_CLOSE;
+        if ((k = varint_decode(p, h->len, &a)) < 0) return STEP_CLOSE;
+        pos += k;
+        if ((k = varint_decode(p + pos, h->len - pos, &b)) < 0) return STEP_CLOSE;
+        pos += k;
+        if (a >= (uint64_t)u->nblocks || b == 0 || b > u->block_size) return STEP_CLOSE;
+        upload_write_block(u, (int)a, p + pos, h->len - pos, (size_t)b, h->flags);
+        return STEP_OK;
+    case FT_BLOCK_END:
+        if (!u || !u->binary || !u->negotiated) return STEP_CLOSE;
+        return upload_finish(c);
+    default:
+        log_warn("Unexpected frame type %d", h->type);
+        return STEP_CLOSE;
+    }
+}
+
+/* A frame is only handled once header and payload are fully buffered */
+int step_frame(conn_t *c) {
+    if (nb_avail(&c->in) < FRAME_HDR_LEN) {
+        c->want = FRAME_HDR_LEN;
+        return STEP_WAIT;
+    }
+    frame_hdr_t h;
+    if (frame_decode_hdr((const unsigned char *)nb_data(&c->in), &h) != 0) {
+        log_warn("Bad frame header");
+        return STEP_CLOSE;
+    }
+    size_t total = FRAME_HDR_LEN + (size_t)h.len;
+    if (nb_avail(&c->in) < total) {
+        c->want = total;
+        return STEP_WAIT;
+    }
+    int rc = handle_frame(c, &h, (const unsigned char *)nb_data(&c->in) + FRAME_HDR_LEN);
+    nb_consume(&c->in, total);
+    c->want = 0;
+    return rc;
+}
+
+int step_command(conn_t *c) {
+    if (c->proto >= PROTO_BINARY && nb_avail(&c->in) > 0 &&
+        (unsigned char)nb_data(&c->in)[0] == FRAME_MAGIC)
+        return step_frame(c);
+
+    char line[4096];
+    ssize_t n = nb_take_line(&c->in, line, sizeof(line));
+    if (n == 0) return STEP_WAIT;
+    if (n < 0) return STEP_CLOSE;
+
+    if (strncmp(line, MSG_FILE_HDR, strlen(MSG_FILE_HDR)) == 0)
+        return upload_start(c, line);
+
+    /* SYNC_START opens a session of many FILE_HDR uploads that keep their
+     * relative paths; SYNC_END reports how many were committed. */
+    if (strncmp(line, MSG_SYNC_START, strlen(MSG_SYNC_START)) == 0) {
+        c->in_sync = 1;
+        c->sync_files = 0;
+        return write_n(c->fd, MSG_SYNC_START "\n", strlen(MSG_SYNC_START) + 1) > 0 ? STEP_OK
+                                                                                  : STEP_CLOSE;
+    }
+    if (strncmp(line, MSG_SYNC_END, strlen(MSG_SYNC_END)) == 0 && c->in_sync && !c->session) {
+        char reply[64];
+        int len = snprintf(reply, sizeof(reply), MSG_SYNC_END " %d\n", c->sync_files);
+        log_info("Sync session ended: %d files committed", c->sync_files);
+        write_n(c->fd, reply, (size_t)len);
+        return STEP_CLOSE;
+    }
+
+    if (strncmp(line, MSG_HELLO, strlen(MSG_HELLO)) == 0) {
+        /* HELLO <version> [codec,...] [hash,...] in the client's preference
+         * order; clients that name no hashes keep md5 */
+        int version = PROTO_TEXT;
+        char prefs[128] = "", hashes[128] = "md5";
+        sscanf(line, "HELLO %d %127s %127s", &version, prefs, hashes);
+        c->proto = version >= PROTO_BINARY ? PROTO_BINARY : PROTO_TEXT;
+        /* Answer with the highest version both sides speak */
+        if (version > PROTO_VERSION) version = PROTO_VERSION;
+        c->codec = codec_pick(prefs);
+        c->hash_alg = strong_hash_pick(hashes);
+        char reply[96];
+        int len = snprintf(reply, sizeof(reply), MSG_HELLO " %d %s %s\n",
+                           c->proto == PROTO_BINARY ? version : PROTO_TEXT,
+                           codec_name(c->codec), strong_hash_name(c->hash_alg));
+        return write_n(c->fd, reply, (size_t)len) == len ? STEP_OK : STEP_CLOSE;
+    }
+
+    /* STATS [prometheus]: the report, then the connection is closed */
+    if (strncmp(line, MSG_STATS, strlen(MSG_STATS)) == 0) {
+        size_t len = 0;
+        char *report = metrics_render(strstr(line, "prometheus") != NULL, &len);
+        if (report) write_n(c->fd, report, len);
+        free(report);
+        return STEP_CLOSE;
+    }
+
+    /* The remaining commands are served start to finish on this worker,
+     * reading through the connection buffer with blocking semantics. */
+    double t0 = metrics_now();
+    int phase = -1;
+    if (strncmp(line, MSG_FILE_GET, strlen(MSG_FILE_GET)) == 0) {
+        handle_file_get(c, line);
+        phase = MET_FILE_GET;
+    } else if (strncmp(line, MSG_DELTA_GET, strlen(MSG_DELTA_GET)) == 0) {
+        handle_delta_get(c, line);
+        phase = MET_DELTA_GET;
+    } else if (strncmp(line, MSG_DELTA_HDR, strlen(MSG_DELTA_HDR)) == 0) {
+        handle_delta_upload(c, line);
+        phase = MET_DELTA_UPLOAD;
+    } else if (strncmp(line, MSG_CHUNK_HDR, strlen(MSG_CHUNK_HDR)) == 0) {
+        handle_chunk_upload(c, line);
+        phase = MET_CHUNK_UPLOAD;
+    }
+    if (phase >= 0) metrics_observe(phase, metrics_now() - t0);
+    return STEP_CLOSE;
+}
+
+int conn_step(conn_t *c) {
+    for (;;) {
+        int rc;
+        switch (c->state) {
+        case ST_CMD:           rc = step_command(c); break;
+        case ST_SIGS:          rc = step_sigs(c); break;
+        case ST_BLOCK_HDR:     rc = step_block_hdr(c); break;
+        case ST_BLOCK_PAYLOAD: rc = step_block_payload(c); break;
+        default:               rc = STEP_CLOSE; break;
+        }
+        if (rc == STEP_WAIT) return CONN_WANT_READ;
+        if (rc == STEP_CLOSE) return CONN_CLOSE;
+    }
+}
+
+void conn_cleanup(conn_t *c) {
+    upload_free(c);
+}
+
+int main(int argc, char *argv[]) {
+    int nworkers = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    int opt;
+    while ((opt = getopt(argc, argv, "w:l:")) != -1) {
+        if (opt == 'w') {
+            nworkers = atoi(optarg);
+        } else if (opt == 'l' && log_level_from_name(optarg) >= 0) {
+            log_level = log_level_from_name(optarg);
+        } else {
+            fprintf(stderr, "usage: %s [-w workers] [-l debug|info|warn|error]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (nworkers < 1) nworkers = 1;
+    int ndecoders = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    log_start();
+
+    signal(SIGPIPE, SIG_IGN);
     ensure_folder(SYNC_FOLDER);
+    remove_stale_staging();
 
-    indices = load_all_indices(INDEX_FILE, &indices_count);
-    if (indices)
-        printf("Loaded %d existing indices.\n", indices_count);
-    else
-        indices_count = 0;
+    index_db = index_db_open(INDEX_FILE);
+    if (!index_db) return 1;
+    log_info("Loaded %d existing indices.", index_db_count(index_db));
+
+    chunks = chunk_store_open(CHUNK_PACK, CHUNK_INDEX);
+    if (!chunks) return 1;
+    /* References are not persisted: rebuild them from the manifests, which
+     * also backfills files synced before the chunk store existed. */
+    for (int i = 0; i < index_db_count(index_db); i++) {
+        const file_index_t *e = index_db_entry(index_db, i);
+        char path[MAX_PATH_LEN + 64];
+        snprintf(path, sizeof(path), "%s/%s", SYNC_FOLDER, e->filename);
+        chunk_store_add_file(chunks, path, e->sigs, e->chunk_avg ? e->lens : NULL, e->block_size,
+                             e->nblocks, e->filesize, e->hash_alg);
+    }
+    if (chunk_store_should_gc(chunks))
+        chunk_store_gc(chunks);
+    chunk_store_save(chunks);
+    print_chunk_stats();
 
     int sockfd = socket(AF_INET, SOCK_STREAM, 0);
-    if (sockfd < 0) { perror("socket"); return 1; }
-    int opt = 1;
+    if (sockfd < 0) { log_error("socket: %s", strerror(errno)); return 1; }
+    opt = 1;
     setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
 
     struct sockaddr_in addr;
@@ -326,27 +1913,18 @@ int main() {
     addr.sin_addr.s_addr = INADDR_ANY;
 
     if (bind(sockfd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
-        perror("bind");
+        log_error("bind: %s", strerror(errno));
         close(sockfd);
         return 1;
     }
     if (listen(sockfd, BACKLOG) < 0) {
-        perror("listen");
+        log_error("listen: %s", strerror(errno));
         close(sockfd);
         return 1;
     }
-    printf("Server listening on port %d\n", PORT);
+    fcntl(sockfd, F_SETFL, fcntl(sockfd, F_GETFL, 0) | O_NONBLOCK);
+    recv_pool_start(ndecoders);
+    log_info("Server listening on port %d (%d workers, %d decoder threads)", PORT, nworkers, ndecoders);
 
-    while (1) {
-        int c = accept(sockfd, NULL, NULL);
-        if (c < 0) {
-            if (errno == EINTR) continue;
-            perror("accept");
-            continue;
-        }
-        pthread_t tid;
-        pthread_create(&tid, NULL, thread_main, (void *)(intptr_t)c);
-        pthread_detach(tid);
-    }
-    return 0;
+    return event_loop_run(sockfd, nworkers, conn_step, conn_cleanup) == 0 ? 0 : 1;
 }